@@ -37,6 +37,7 @@
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "cell.h"
 #include "cell-utils.h"
@@ -1367,6 +1368,93 @@ static int centering_equivalent(char cen1, char cen2)
 }
 
 
+/* 'tols' is in frac (not %) and radians */
+static int parameters_within_tolerance(double a1, double b1, double c1,
+                                       double al1, double be1, double ga1,
+                                       double a2, double b2, double c2,
+                                       double al2, double be2, double ga2,
+                                       const double *tols)
+{
+	/* within_tolerance() takes a percentage */
+	if ( !within_tolerance(a1, a2, tols[0]*100.0) ) return 0;
+	if ( !within_tolerance(b1, b2, tols[1]*100.0) ) return 0;
+	if ( !within_tolerance(c1, c2, tols[2]*100.0) ) return 0;
+	if ( fabs(al1-al2) > tols[3] ) return 0;
+	if ( fabs(be1-be2) > tols[4] ) return 0;
+	if ( fabs(ga1-ga2) > tols[5] ) return 0;
+	return 1;
+}
+
+
+/* All 3x3 matrices with elements -1, 0 or +1 and determinant +1 or -1, in the
+ * same order as the nested loops which used to generate them on the fly.
+ * There are 3480 of each determinant. */
+#define N_UNIMODULAR (6960)
+
+struct unimodular
+{
+	signed char m[9];  /* Row-major */
+	signed char det;
+};
+
+static struct unimodular unimodular_table[N_UNIMODULAR];
+static pthread_once_t unimodular_once = PTHREAD_ONCE_INIT;
+
+
+static void make_unimodular_table(void)
+{
+	int n = 0;
+	int t;
+
+	for ( t=0; t<19683; t++ ) {  /* 3^9 */
+
+		signed char m[9];
+		int det;
+		int j;
+		int r = t;
+
+		/* Last element varies fastest */
+		for ( j=8; j>=0; j-- ) {
+			m[j] = (r % 3) - 1;
+			r /= 3;
+		}
+
+		det = m[0]*(m[4]*m[8] - m[5]*m[7])
+		    - m[1]*(m[3]*m[8] - m[5]*m[6])
+		    + m[2]*(m[3]*m[7] - m[4]*m[6]);
+		if ( (det != +1) && (det != -1) ) continue;
+
+		assert(n < N_UNIMODULAR);
+		memcpy(unimodular_table[n].m, m, 9);
+		unimodular_table[n].det = det;
+		n++;
+
+	}
+
+	assert(n == N_UNIMODULAR);
+}
+
+
+static const struct unimodular *get_unimodular_table(void)
+{
+	pthread_once(&unimodular_once, make_unimodular_table);
+	return unimodular_table;
+}
+
+
+static IntegerMatrix *unimodular_to_intmat(const struct unimodular *u)
+{
+	IntegerMatrix *m;
+	int j;
+
+	m = intmat_new(3, 3);
+	if ( m == NULL ) return NULL;
+
+	for ( j=0; j<9; j++ ) intmat_set(m, j/3, j%3, u->m[j]);
+	return m;
+}
+
+
 /**
  * \param cell: A UnitCell
  * \param reference: Another UnitCell
@@ -1397,15 +1485,8 @@ int compare_cell_parameters(UnitCell *cell, UnitCell *reference,
 	cell_get_parameters(cell, &a1, &b1, &c1, &al1, &be1, &ga1);
 	cell_get_parameters(reference, &a2, &b2, &c2, &al2, &be2, &ga2);
 
-	/* within_tolerance() takes a percentage */
-	if ( !within_tolerance(a1, a2, tols[0]*100.0) ) return 0;
-	if ( !within_tolerance(b1, b2, tols[1]*100.0) ) return 0;
-	if ( !within_tolerance(c1, c2, tols[2]*100.0) ) return 0;
-	if ( fabs(al1-al2) > tols[3] ) return 0;
-	if ( fabs(be1-be2) > tols[4] ) return 0;
-	if ( fabs(ga1-ga2) > tols[5] ) return 0;
-
-	return 1;
+	return parameters_within_tolerance(a1, b1, c1, al1, be1, ga1,
+	                                   a2, b2, c2, al2, be2, ga2, tols);
 }
 
 
@@ -1505,58 +1586,90 @@ int compare_permuted_cell_parameters_and_orientation(UnitCell *cell,
                                                      const double *tols,
                                                      IntegerMatrix **pmb)
 {
-	IntegerMatrix *m;
-	int i[9];
+	const struct unimodular *table;
+	double cv[3][3];
+	double rv[3][3];
+	double comb[27][3];
+	unsigned int ok[3];
+	char ref_cen;
+	int t, c, k;
+
+	ref_cen = cell_get_centering(reference);
+	if ( cell_get_centering(cell) != ref_cen ) return 0;
+
+	cell_get_cartesian(cell, &cv[0][0], &cv[0][1], &cv[0][2],
+	                         &cv[1][0], &cv[1][1], &cv[1][2],
+	                         &cv[2][0], &cv[2][1], &cv[2][2]);
+
+	cell_get_cartesian(reference, &rv[0][0], &rv[0][1], &rv[0][2],
+	                              &rv[1][0], &rv[1][1], &rv[1][2],
+	                              &rv[2][0], &rv[2][1], &rv[2][2]);
+
+	/* Each column of a matrix in the table picks one of the 27 sums of
+	 * -1, 0 or +1 times each old axis.  Check each sum against each
+	 * reference axis once, instead of once per matrix. */
+	for ( k=0; k<3; k++ ) ok[k] = 0;
+	for ( c=0; c<27; c++ ) {
+
+		const int c0 = c/9 - 1;
+		const int c1 = (c/3)%3 - 1;
+		const int c2 = c%3 - 1;
+		int j;
 
-	if ( cell_get_centering(cell) != cell_get_centering(reference) ) return 0;
+		for ( j=0; j<3; j++ ) {
+			comb[c][j] = c0*cv[0][j] + c1*cv[1][j] + c2*cv[2][j];
+		}
 
-	m = intmat_new(3, 3);
+		for ( k=0; k<3; k++ ) {
+			if ( angle_between(comb[c][0], comb[c][1], comb[c][2],
+			                   rv[k][0], rv[k][1], rv[k][2])
+			     > tols[3+k] ) continue;
+			if ( moduli_check(comb[c][0], comb[c][1], comb[c][2],
+			                  rv[k][0], rv[k][1], rv[k][2])
+			     > tols[k] ) continue;
+			ok[k] |= 1u << c;
+		}
 
-	for ( i[0]=-1; i[0]<=+1; i[0]++ ) {
-	for ( i[1]=-1; i[1]<=+1; i[1]++ ) {
-	for ( i[2]=-1; i[2]<=+1; i[2]++ ) {
-	for ( i[3]=-1; i[3]<=+1; i[3]++ ) {
-	for ( i[4]=-1; i[4]<=+1; i[4]++ ) {
-	for ( i[5]=-1; i[5]<=+1; i[5]++ ) {
-	for ( i[6]=-1; i[6]<=+1; i[6]++ ) {
-	for ( i[7]=-1; i[7]<=+1; i[7]++ ) {
-	for ( i[8]=-1; i[8]<=+1; i[8]++ ) {
+	}
 
-		UnitCell *nc;
-		int j, k;
-		int l = 0;
-		signed int det;
+	/* No possible match for one of the axes? */
+	if ( (ok[0] == 0) || (ok[1] == 0) || (ok[2] == 0) ) return 0;
 
-		for ( j=0; j<3; j++ )
-			for ( k=0; k<3; k++ )
-				intmat_set(m, j, k, i[l++]);
+	table = get_unimodular_table();
+	for ( t=0; t<N_UNIMODULAR; t++ ) {
 
-		det = intmat_det(m);
-		if ( (det != +1) && (det != -1) ) continue;
+		const signed char *m = table[t].m;
+		IntegerMatrix *im;
+		UnitCell *nc;
+		char cen;
+
+		/* New axis k is sum over j of m[j][k] times old axis j */
+		for ( k=0; k<3; k++ ) {
+			c = (m[k]+1)*9 + (m[3+k]+1)*3 + (m[6+k]+1);
+			if ( !(ok[k] & (1u << c)) ) break;
+		}
+		if ( k < 3 ) continue;
 
-		nc = cell_transform_intmat(cell, m);
+		/* The axes match.  Only now is it worth the expense of working
+		 * out the centering of the transformed cell. */
+		im = unimodular_to_intmat(&table[t]);
+		nc = cell_transform_intmat(cell, im);
+		cen = cell_get_centering(nc);
+		cell_free(nc);
 
-		if ( compare_cell_parameters_and_orientation(nc, reference,
-		                                             tols) )
-		{
-			if ( pmb != NULL ) *pmb = m;
-			cell_free(nc);
+		if ( cen == ref_cen ) {
+			if ( pmb != NULL ) {
+				*pmb = im;
+			} else {
+				intmat_free(im);
+			}
 			return 1;
 		}
 
-		cell_free(nc);
+		intmat_free(im);
 
 	}
-	}
-	}
-	}
-	}
-	}
-	}
-	}
-	}
 
-	intmat_free(m);
 	return 0;
 }
 
@@ -2191,101 +2304,161 @@ static int random_int(int max)
 }
 
 
+/* Metric tensor (matrix of scalar products of the real-space axes) */
+static void cell_metric_tensor(UnitCell *cell, double G[3][3])
+{
+	double v[3][3];
+	int j, k;
+
+	cell_get_cartesian(cell, &v[0][0], &v[0][1], &v[0][2],
+	                         &v[1][0], &v[1][1], &v[1][2],
+	                         &v[2][0], &v[2][1], &v[2][2]);
+
+	for ( j=0; j<3; j++ ) {
+		for ( k=0; k<3; k++ ) {
+			G[j][k] = v[j][0]*v[k][0] + v[j][1]*v[k][1]
+			        + v[j][2]*v[k][2];
+		}
+	}
+}
+
+
+/* Same as angle_between(), but from the metric tensor */
+static double metric_angle(double gjk, double gjj, double gkk)
+{
+	double cosine = gjk / sqrt(gjj*gkk);
+	if ( cosine > 1.0 ) cosine = 1.0;
+	if ( cosine < -1.0 ) cosine = -1.0;
+	return acos(cosine);
+}
+
+
 static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *reference,
                                          RationalMatrix *CiARA, IntegerMatrix *RiBCB,
                                          const double *tols)
 {
-	IntegerMatrix *m;
-	int i[9];
+	const struct unimodular *table;
 	double a, b, c, al, be, ga;
 	double best_diff = +INFINITY;
-	int s, sel;
-	IntegerMatrix *best_m[24];
+	int sel;
+	int best_t[24];
 	int n_best = 0;
+	double G[3][3];
+	double R[3][3];
+	struct g6 g6ref;
+	IntegerMatrix *m;
+	UnitCell *tmp;
+	UnitCell *nc;
+	char cen;
+	int t, j, k;
+
+	/* P is unimodular, so the centering of the cell transformed by P and
+	 * then RiBCB is the same for all P.  Work it out just once. */
+	m = intmat_identity(3);
+	tmp = cell_transform_intmat(cell_reduced, m);
+	nc = cell_transform_intmat(tmp, RiBCB);
+	cen = cell_get_centering(nc);
+	intmat_free(m);
+	cell_free(tmp);
+	cell_free(nc);
+	if ( !centering_equivalent(cen, cell_get_centering(reference)) ) {
+		return NULL;
+	}
 
-	m = intmat_new(3, 3);
 	cell_get_parameters(reference, &a, &b, &c, &al, &be, &ga);
+	g6ref = cell_get_G6(reference);
+	cell_metric_tensor(cell_reduced, G);
+	for ( j=0; j<3; j++ ) {
+		for ( k=0; k<3; k++ ) {
+			R[j][k] = intmat_get(RiBCB, j, k);
+		}
+	}
 
-	for ( i[0]=-1; i[0]<=+1; i[0]++ ) {
-	for ( i[1]=-1; i[1]<=+1; i[1]++ ) {
-	for ( i[2]=-1; i[2]<=+1; i[2]++ ) {
-	for ( i[3]=-1; i[3]<=+1; i[3]++ ) {
-	for ( i[4]=-1; i[4]<=+1; i[4]++ ) {
-	for ( i[5]=-1; i[5]<=+1; i[5]++ ) {
-	for ( i[6]=-1; i[6]<=+1; i[6]++ ) {
-	for ( i[7]=-1; i[7]<=+1; i[7]++ ) {
-	for ( i[8]=-1; i[8]<=+1; i[8]++ ) {
-
-		UnitCell *nc;
-		int j, k;
-		int l = 0;
-		signed int det;
-		UnitCell *tmp;
-
-		for ( j=0; j<3; j++ )
-			for ( k=0; k<3; k++ )
-				intmat_set(m, j, k, i[l++]);
-
-		det = intmat_det(m);
-		if ( det != +1 ) continue;
-
-		tmp = cell_transform_intmat(cell_reduced, m);
-		nc = cell_transform_intmat(tmp, RiBCB);
-		cell_free(tmp);
-
-		if ( compare_cell_parameters(nc, reference, tols) ) {
-
-			double diff = g6_distance(nc, reference);
-			if ( diff < 0.999*best_diff ) {
+	table = get_unimodular_table();
+	for ( t=0; t<N_UNIMODULAR; t++ ) {
 
-				/* New solution is significantly better,
-				 * dump all the previous ones */
-				for ( s=0; s<n_best; s++ ) {
-					intmat_free(best_m[s]);
-				}
-				best_diff = diff;
-				n_best = 0;
+		const signed char *p = table[t].m;
+		double M[3][3];
+		double GM[3][3];
+		double Gn[3][3];
+		double na, nb, nc_len, nal, nbe, nga;
+		double diff;
+		int l;
 
-				best_m[n_best++] = intmat_copy(m);
+		if ( table[t].det != +1 ) continue;
 
-			} else if ( diff < 1.001*best_diff ) {
+		/* Combined transformation M = P.RiBCB, and the metric tensor
+		 * of the transformed cell, Gn = M^T.G.M */
+		for ( j=0; j<3; j++ ) {
+			for ( k=0; k<3; k++ ) {
+				M[j][k] = p[3*j]*R[0][k] + p[3*j+1]*R[1][k]
+				        + p[3*j+2]*R[2][k];
+			}
+		}
+		for ( j=0; j<3; j++ ) {
+			for ( k=0; k<3; k++ ) {
+				GM[j][k] = G[j][0]*M[0][k] + G[j][1]*M[1][k]
+				         + G[j][2]*M[2][k];
+			}
+		}
+		for ( j=0; j<3; j++ ) {
+			for ( k=j; k<3; k++ ) {
+				Gn[j][k] = 0.0;
+				for ( l=0; l<3; l++ ) Gn[j][k] += M[l][j]*GM[l][k];
+			}
+		}
 
-				/* If the new solution is the same as the
-				 * previous one, add it to the list */
-				if ( n_best == 24 ) {
-					ERROR("WARNING: Too many equivalent "
-					      "reindexed lattices\n");
-				} else {
-					best_m[n_best++] = intmat_copy(m);
-				}
+		na = sqrt(Gn[0][0]);
+		nb = sqrt(Gn[1][1]);
+		nc_len = sqrt(Gn[2][2]);
+		nal = metric_angle(Gn[1][2], Gn[1][1], Gn[2][2]);
+		nbe = metric_angle(Gn[0][2], Gn[0][0], Gn[2][2]);
+		nga = metric_angle(Gn[0][1], Gn[0][0], Gn[1][1]);
 
-			} /* else worse, so ignore */
+		if ( !parameters_within_tolerance(na, nb, nc_len, nal, nbe, nga,
+		                                  a, b, c, al, be, ga, tols) )
+		{
+			continue;
 		}
 
-		cell_free(nc);
+		/* Distance in G6 */
+		diff = 0.0;
+		diff += (Gn[0][0]-g6ref.A)*(Gn[0][0]-g6ref.A);
+		diff += (Gn[1][1]-g6ref.B)*(Gn[1][1]-g6ref.B);
+		diff += (Gn[2][2]-g6ref.C)*(Gn[2][2]-g6ref.C);
+		diff += (2.0*Gn[1][2]-g6ref.D)*(2.0*Gn[1][2]-g6ref.D);
+		diff += (2.0*Gn[0][2]-g6ref.E)*(2.0*Gn[0][2]-g6ref.E);
+		diff += (2.0*Gn[0][1]-g6ref.F)*(2.0*Gn[0][1]-g6ref.F);
+		diff = sqrt(diff);
+
+		if ( diff < 0.999*best_diff ) {
+
+			/* New solution is significantly better,
+			 * dump all the previous ones */
+			best_diff = diff;
+			n_best = 0;
+			best_t[n_best++] = t;
+
+		} else if ( diff < 1.001*best_diff ) {
+
+			/* If the new solution is the same as the
+			 * previous one, add it to the list */
+			if ( n_best == 24 ) {
+				ERROR("WARNING: Too many equivalent "
+				      "reindexed lattices\n");
+			} else {
+				best_t[n_best++] = t;
+			}
 
-	}
-	}
-	}
-	}
-	}
-	}
-	}
-	}
-	}
+		} /* else worse, so ignore */
 
-	intmat_free(m);
+	}
 
 	if ( n_best == 0 ) return NULL;
 
-	/* Select a transformation at random from the equivalent versions,
-	 * and then free all the others */
+	/* Select a transformation at random from the equivalent versions */
 	sel = random_int(n_best);
-	for ( s=0; s<n_best; s++ ) {
-		if ( s != sel ) intmat_free(best_m[s]);
-	}
-
-	return best_m[sel];
+	return unimodular_to_intmat(&table[best_t[sel]]);
 }
 
 
@@ -241,3 +241,40 @@ void colscale_lookup(double val, double max, int scale,
 		break;
 	}
 }
+
+
+/**
+ * \param max The value which should map to the top of the colour scale
+ * \param scale The colour scale, e.g. SCALE_COLOUR
+ * \param lut Array of 3*(2*n_half+1) bytes for the 8-bit RGB triplets
+ * \param n_half Number of table entries between zero and \p max
+ *
+ * Fills \p lut with the colours for \p val evenly spaced from -\p max to
+ * +\p max, such that entry number \p n_half corresponds to zero and entry
+ * number 2*\p n_half corresponds to \p max.  Values outside this range should
+ * be clamped to the first or last entry.
+ *
+ * Looking up the table is much faster than calling \ref colscale_lookup for
+ * every pixel, and the results are the same to within the quantisation of
+ * the values.
+ */
+void colscale_make_lut(double max, int scale, unsigned char *lut, int n_half)
+{
+	int i;
+
+	for ( i=0; i<=2*n_half; i++ ) {
+
+		double r, g, b;
+		double val = max * (double)(i-n_half) / n_half;
+
+		colscale_lookup(val, max, scale, &r, &g, &b);
+
+		if ( r > 1.0 ) r = 1.0;
+		if ( g > 1.0 ) g = 1.0;
+		if ( b > 1.0 ) b = 1.0;
+		lut[3*i+0] = 255*r;
+		lut[3*i+1] = 255*g;
+		lut[3*i+2] = 255*b;
+
+	}
+}
@@ -50,6 +50,10 @@ extern "C" {
 extern void colscale_lookup(double val, double max, int scale,
                             double *rp, double *gp, double *bp);
 
+/* Precomputed 8-bit colour scale lookup table */
+extern void colscale_make_lut(double max, int scale,
+                              unsigned char *lut, int n_half);
+
 
 #ifdef __cplusplus
 }
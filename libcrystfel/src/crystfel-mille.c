@@ -29,13 +29,25 @@
 #include <libcrystfel-config.h>
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
+#include <gsl/gsl_linalg.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "image.h"
 #include "geometry.h"
 #include "cell-utils.h"
 #include "predict-refine.h"
 #include "profile.h"
+#include "thread-pool.h"
+#include "utils.h"
+#include "crystfel-mille.h"
 
 int mille_label(int group_serial, enum gparam param)
 {
@@ -77,15 +89,54 @@ struct mille
 	int n_local;
 
 	FILE *fh;
+	int framed;
+	int compress;
+
+	/* Finished records waiting to be written */
+	char *buf;
+	size_t buf_len;
+	size_t buf_max;
+	time_t last_flush;
+
+	/* Compressed copy of buf */
+	unsigned char *zbuf;
+	size_t zbuf_max;
 };
 
+
+/* Finished records are collected in memory, and written out in batches of
+ * about this size */
+#define MILLE_WRITE_BATCH (4*1024*1024)
+
+/* However, a worker process can die at any moment, taking its unwritten
+ * records with it.  To limit the loss, the records are also written out at
+ * the end of a frame if there are more than this many bytes of them... */
+#define MILLE_FRAME_FLUSH (64*1024)
+
+/* ... and whenever this many seconds have passed since the last write */
+#define MILLE_FLUSH_INTERVAL (10)
+
 typedef struct mille Mille;
 
 
-static void mille_add_measurement(Mille *m,
-                                  int NLC, float *derLc,
-                                  int NGL, float *derGl, int *labels,
-                                  float rMeas, float sigma)
+/**
+ * \param m A \ref Mille
+ * \param NLC The number of local parameters
+ * \param derLc The gradients with respect to the local parameters
+ * \param NGL The number of global parameters
+ * \param derGl The gradients with respect to the global parameters
+ * \param labels The labels of the global parameters
+ * \param rMeas The measured value
+ * \param sigma The uncertainty of the measurement
+ *
+ * Adds a measurement to the current record, which will be written by
+ * \ref crystfel_mille_write_record.  Gradients of zero are left out, as are
+ * global parameters with labels of zero or less.
+ */
+void crystfel_mille_add_measurement(Mille *m,
+                                    int NLC, float *derLc,
+                                    int NGL, float *derGl, int *labels,
+                                    float rMeas, float sigma)
 {
 	int space_required;
 	int i;
@@ -265,20 +316,23 @@ void write_mille(Mille *mille, int n, UnitCell *cell,
 		}
 
 		/* Add fs measurement */
-		mille_add_measurement(mille,
-		                      nl, local_gradients_fs,
-		                      j, global_gradients_fs, labels,
-		                      fs_dev(&rps[i], image->detgeom), 0.3);
+		crystfel_mille_add_measurement(mille,
+		                               nl, local_gradients_fs,
+		                               j, global_gradients_fs, labels,
+		                               fs_dev(&rps[i], image->detgeom),
+		                               0.3);
 
 		/* Add ss measurement */
-		mille_add_measurement(mille,
-		                      nl, local_gradients_ss,
-		                      j, global_gradients_ss, labels,
-		                      ss_dev(&rps[i], image->detgeom), 0.3);
+		crystfel_mille_add_measurement(mille,
+		                               nl, local_gradients_ss,
+		                               j, global_gradients_ss, labels,
+		                               ss_dev(&rps[i], image->detgeom),
+		                               0.3);
 
 		/* Add excitation error "measurement" (local-only) */
-		mille_add_measurement(mille, nl, local_gradients_r,
-		                      0, NULL, NULL, r_dev(&rps[i]), 0.2);
+		crystfel_mille_add_measurement(mille, nl, local_gradients_r,
+		                               0, NULL, NULL, r_dev(&rps[i]),
+		                               0.2);
 	}
 }
 
@@ -296,6 +350,14 @@ static Mille *mille_new()
 	m->int_arr = NULL;
 	m->have_local = NULL;
 	m->n_local = 0;
+	m->framed = 0;
+	m->compress = 0;
+	m->buf = NULL;
+	m->buf_len = 0;
+	m->buf_max = 0;
+	m->zbuf = NULL;
+	m->zbuf_max = 0;
+	m->last_flush = time(NULL);
 
 	return m;
 }
@@ -329,20 +391,168 @@ Mille *crystfel_mille_new_fd(int fd)
 		return NULL;
 	}
 
+	/* Compressed blocks need to be marked, so that the indexamajig sandbox
+	 * can pass them on in one piece */
+	m->framed = 1;
+
 	return m;
 }
 
 
+/**
+ * \param m A \ref Mille
+ * \param compress Non-zero to compress the records
+ *
+ * Sets whether the records should be compressed.  Compressed records are
+ * written in gzip format, in blocks of a few megabytes.  Millepede-II can read
+ * such files directly if the filename ends in ".gz", and the built-in solver
+ * reads them regardless of the filename.
+ *
+ * \returns zero on success, or non-zero if compression is not available.
+ */
+int crystfel_mille_set_compression(Mille *m, int compress)
+{
+#ifdef HAVE_ZLIB
+	m->compress = compress;
+	return 0;
+#else
+	if ( compress ) {
+		ERROR("Compressed Mille output needs zlib.\n");
+		return 1;
+	}
+	return 0;
+#endif
+}
+
+
+#ifdef HAVE_ZLIB
+static int write_compressed(Mille *m)
+{
+	z_stream zs;
+	size_t max_len;
+	int r;
+
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+
+	/* 16 extra window bits means gzip format */
+	if ( deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15+16, 8,
+	                  Z_DEFAULT_STRATEGY) != Z_OK )
+	{
+		ERROR("Failed to initialise compression for Mille data\n");
+		return 1;
+	}
+
+	max_len = deflateBound(&zs, m->buf_len);
+	if ( max_len > m->zbuf_max ) {
+		unsigned char *zbuf_new = cfrealloc(m->zbuf, max_len);
+		if ( zbuf_new == NULL ) {
+			deflateEnd(&zs);
+			return 1;
+		}
+		m->zbuf = zbuf_new;
+		m->zbuf_max = max_len;
+	}
+
+	zs.next_in = (unsigned char *)m->buf;
+	zs.avail_in = m->buf_len;
+	zs.next_out = m->zbuf;
+	zs.avail_out = m->zbuf_max;
+	r = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if ( r != Z_STREAM_END ) {
+		ERROR("Failed to compress Mille data\n");
+		return 1;
+	}
+
+	if ( m->framed ) {
+		int hdr[2];
+		hdr[0] = CRYSTFEL_MILLE_BLOCK_MARKER;
+		hdr[1] = zs.total_out;
+		fwrite(hdr, sizeof(int), 2, m->fh);
+	}
+
+	if ( fwrite(m->zbuf, 1, zs.total_out, m->fh) != zs.total_out ) {
+		return 1;
+	}
+
+	return 0;
+}
+#endif
+
+
+static int mille_flush(Mille *m)
+{
+	int r = 0;
+
+	if ( m->buf_len == 0 ) return 0;
+
+#ifdef HAVE_ZLIB
+	if ( m->compress ) {
+		r = write_compressed(m);
+	} else
+#endif
+	if ( fwrite(m->buf, 1, m->buf_len, m->fh) != m->buf_len ) {
+		r = 1;
+	}
+
+	if ( r ) ERROR("Failed to write Mille data\n");
+	fflush(m->fh);
+
+	m->buf_len = 0;
+	m->last_flush = time(NULL);
+	return r;
+}
+
+
+/* The clock could also have gone backwards */
+static int flush_overdue(Mille *m)
+{
+	time_t now = time(NULL);
+	return (now < m->last_flush)
+	    || (now - m->last_flush >= MILLE_FLUSH_INTERVAL);
+}
+
+
+/**
+ * \param m A \ref Mille
+ *
+ * Tells \p m that the current frame is finished.  The finished records are
+ * written out if there are more than a few of them, or if they have been
+ * waiting for a while.  Call this after each frame, so that not much data is
+ * lost if the process dies.
+ */
+void crystfel_mille_end_frame(Mille *m)
+{
+	if ( m == NULL ) return;
+	if ( m->buf_len == 0 ) return;
+	if ( (m->buf_len >= MILLE_FRAME_FLUSH) || flush_overdue(m) ) {
+		mille_flush(m);
+	}
+}
+
+
 void crystfel_mille_free(Mille *m)
 {
 	if ( m == NULL ) return;
+	mille_flush(m);
 	fclose(m->fh);
 	cffree(m->float_arr);
 	cffree(m->int_arr);
+	cffree(m->buf);
+	cffree(m->zbuf);
 	cffree(m);
 }
 
 
+static void append(Mille *m, const void *data, size_t len)
+{
+	memcpy(m->buf+m->buf_len, data, len);
+	m->buf_len += len;
+}
+
+
 void crystfel_mille_delete_last_record(Mille *m)
 {
 	m->n = 0;
@@ -358,6 +568,7 @@ void crystfel_mille_write_record(Mille *m)
 	float nf = 0.0;
 	int ni = 0;
 	int nw = (m->n * 2)+2;
+	size_t reclen;
 
 	/* Don't write empty records */
 	if ( m->n == 0 ) return;
@@ -370,12 +581,1104 @@ void crystfel_mille_write_record(Mille *m)
 		}
 	}
 
-	fwrite(&nw, sizeof(int), 1, m->fh);
-
-	fwrite(&nf, sizeof(float), 1, m->fh);
-	fwrite(m->float_arr, sizeof(float), m->n, m->fh);
+	reclen = (2+m->n)*sizeof(int) + (1+m->n)*sizeof(float);
+	if ( m->buf_len + reclen > m->buf_max ) {
+		size_t new_max = m->buf_len + reclen;
+		char *buf_new;
+		if ( new_max < MILLE_WRITE_BATCH ) new_max = MILLE_WRITE_BATCH;
+		buf_new = cfrealloc(m->buf, new_max);
+		if ( buf_new == NULL ) {
+			ERROR("Failed to allocate Mille buffer\n");
+			m->n = 0;
+			return;
+		}
+		m->buf = buf_new;
+		m->buf_max = new_max;
+	}
 
-	fwrite(&ni, sizeof(int), 1, m->fh);
-	fwrite(m->int_arr, sizeof(int), m->n, m->fh);
+	append(m, &nw, sizeof(int));
+	append(m, &nf, sizeof(float));
+	append(m, m->float_arr, m->n*sizeof(float));
+	append(m, &ni, sizeof(int));
+	append(m, m->int_arr, m->n*sizeof(int));
 	m->n = 0;
+
+	if ( (m->buf_len >= MILLE_WRITE_BATCH) || flush_overdue(m) ) {
+		mille_flush(m);
+	}
+}
+
+
+/**
+ * \param buf Data from the other end of \ref crystfel_mille_new_fd
+ * \param len The number of bytes in \p buf
+ * \param fh Where to write the records
+ *
+ * Writes the complete records at the start of \p buf to \p fh, or a complete
+ * block of compressed records without its header.  The file then consists of
+ * uncompressed records or concatenated gzip members, either of which can be
+ * read by \ref crystfel_mille_reader_open.
+ *
+ * \returns the number of bytes used from the start of \p buf.  The remaining
+ * bytes should be given again, followed by more data, on the next call.
+ */
+size_t crystfel_mille_pump(const void *buf, size_t len, FILE *fh)
+{
+	const char *data = buf;
+	size_t pos = 0;
+
+	/* A block of compressed records goes to the file in one piece */
+	if ( (len >= 2*sizeof(int))
+	  && (*(int *)data == CRYSTFEL_MILLE_BLOCK_MARKER) )
+	{
+		const int *hdr = buf;
+		size_t blocklen = hdr[1];
+		if ( len < 2*sizeof(int)+blocklen ) return 0;
+		fwrite(data+2*sizeof(int), 1, blocklen, fh);
+		fflush(fh);
+		return 2*sizeof(int)+blocklen;
+	}
+
+	/* Otherwise, write all the complete records in one go */
+	while ( len-pos >= sizeof(int) ) {
+
+		int n;
+		int ni;
+		size_t reclen;
+
+		ni = *(int *)(data+pos);
+		if ( ni == CRYSTFEL_MILLE_BLOCK_MARKER ) break;
+		n = (ni-2)/2;
+
+		reclen = (2+n)*sizeof(int) + (1+n)*sizeof(float);
+		if ( len-pos < reclen ) break;
+		pos += reclen;
+
+	}
+
+	if ( pos > 0 ) {
+		fwrite(data, 1, pos, fh);
+		fflush(fh);
+	}
+
+	return pos;
+}
+
+
+/* ------------------------------ Reading records ---------------------------- */
+
+struct mille_reader
+{
+#ifdef HAVE_ZLIB
+	gzFile fh;
+#else
+	FILE *fh;
+#endif
+	float *float_arr;
+	int *int_arr;
+	int max_entries;
+};
+
+
+/**
+ * \param filename Filename of a Mille file
+ *
+ * Opens a file written by \ref crystfel_mille_write_record for reading.  The
+ * file may be compressed (see \ref crystfel_mille_set_compression) or not.
+ *
+ * \returns a new \ref MilleReader, or NULL on error.
+ */
+MilleReader *crystfel_mille_reader_open(const char *filename)
+{
+	MilleReader *r;
+
+	r = cfmalloc(sizeof(struct mille_reader));
+	if ( r == NULL ) return NULL;
+
+#ifdef HAVE_ZLIB
+	/* Reads uncompressed files as well */
+	r->fh = gzopen(filename, "rb");
+#else
+	r->fh = fopen(filename, "rb");
+#endif
+	if ( r->fh == NULL ) {
+		ERROR("Failed to open Mille file '%s'\n", filename);
+		cffree(r);
+		return NULL;
+	}
+
+#ifdef HAVE_GZBUFFER
+	gzbuffer(r->fh, 1024*1024);
+#endif
+
+	r->float_arr = NULL;
+	r->int_arr = NULL;
+	r->max_entries = 0;
+	return r;
+}
+
+
+void crystfel_mille_reader_close(MilleReader *r)
+{
+	if ( r == NULL ) return;
+#ifdef HAVE_ZLIB
+	gzclose(r->fh);
+#else
+	fclose(r->fh);
+#endif
+	cffree(r->float_arr);
+	cffree(r->int_arr);
+	cffree(r);
+}
+
+
+/* Returns 1 if all of 'len' bytes were read, 0 if the end of the file came
+ * first, or -1 on error */
+static int read_bytes(MilleReader *r, void *buf, size_t len)
+{
+#ifdef HAVE_ZLIB
+	int n = gzread(r->fh, buf, len);
+	if ( n < 0 ) return -1;
+	if ( n == len ) return 1;
+	if ( n == 0 ) return 0;
+	return -1;
+#else
+	size_t n = fread(buf, 1, len, r->fh);
+	if ( n == len ) return 1;
+	if ( (n == 0) && feof(r->fh) ) return 0;
+	return -1;
+#endif
+}
+
+
+/**
+ * \param r A \ref MilleReader
+ * \param plen Location to store the number of entries in the record
+ * \param pfloats Location to store a pointer to the values
+ * \param plabels Location to store a pointer to the labels
+ *
+ * Reads the next record.  The arrays are as given to Millepede-II, but
+ * without the leading zero of each one.  They are valid until the next call
+ * to this function.
+ *
+ * \returns 1 if a record was read, 0 at the end of the file, or -1 on error.
+ */
+int crystfel_mille_reader_next(MilleReader *r, int *plen, float **pfloats,
+                               int **plabels)
+{
+	int nw, n;
+	float nf;
+	int ni;
+	int rr;
+
+	rr = read_bytes(r, &nw, sizeof(int));
+	if ( rr == 0 ) return 0;
+	if ( rr < 0 ) {
+		ERROR("Failed to read Mille record header\n");
+		return -1;
+	}
+
+	if ( (nw < 2) || (nw % 2) ) {
+		ERROR("Invalid Mille record length %i\n", nw);
+		return -1;
+	}
+	n = (nw-2)/2;
+
+	if ( n > r->max_entries ) {
+		float *new_float_arr;
+		int *new_int_arr;
+		new_float_arr = cfrealloc(r->float_arr, n*sizeof(float));
+		new_int_arr = cfrealloc(r->int_arr, n*sizeof(int));
+		if ( new_float_arr != NULL ) r->float_arr = new_float_arr;
+		if ( new_int_arr != NULL ) r->int_arr = new_int_arr;
+		if ( (new_float_arr == NULL) || (new_int_arr == NULL) ) {
+			return -1;
+		}
+		r->max_entries = n;
+	}
+
+	if ( (read_bytes(r, &nf, sizeof(float)) != 1)
+	  || ((n > 0) && (read_bytes(r, r->float_arr, n*sizeof(float)) != 1))
+	  || (read_bytes(r, &ni, sizeof(int)) != 1)
+	  || ((n > 0) && (read_bytes(r, r->int_arr, n*sizeof(int)) != 1)) )
+	{
+		ERROR("Truncated Mille record\n");
+		return -1;
+	}
+
+	*plen = n;
+	*pfloats = r->float_arr;
+	*plabels = r->int_arr;
+	return 1;
+}
+
+
+/* ------------------------------ Built-in solver ---------------------------- */
+
+/* The same least-squares problem as solved by Millepede-II.  Each record
+ * contains the measurements for one crystal, which depend on the crystal's
+ * own ("local") parameters as well as the global detector parameters.  The
+ * local parameters are eliminated record by record, leaving a contribution
+ * to the normal equations for the global parameters only.  Constraints are
+ * added using Lagrange multipliers. */
+
+struct mille_solver
+{
+	int n_params;
+	int max_params;
+	int *labels;
+
+	int n_con;
+	int max_con;
+	int **con_labels;
+	int *con_n;
+
+	int n_files;
+	int max_files;
+	char **files;
+
+	double *shifts;
+	int *determined;
+	int n_records;
+	int n_rejected;
+};
+
+
+/* Number of records handed to a worker thread at once */
+#define MILLE_BATCH (256)
+
+
+/**
+ * Creates a new solver for the global parameters, to be used instead of the
+ * external Millepede program.
+ *
+ * Add the free parameters with \ref mille_solver_add_parameter, constraints
+ * with \ref mille_solver_add_constraint and the files containing the data
+ * with \ref mille_solver_add_file, then call \ref mille_solver_solve.
+ *
+ * \returns a new \ref MilleSolver, or NULL on error.
+ */
+MilleSolver *mille_solver_new(void)
+{
+	MilleSolver *s;
+
+	s = cfcalloc(1, sizeof(MilleSolver));
+	if ( s == NULL ) return NULL;
+
+	return s;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ *
+ * Frees \p s and everything in it.
+ */
+void mille_solver_free(MilleSolver *s)
+{
+	int i;
+
+	if ( s == NULL ) return;
+
+	for ( i=0; i<s->n_con; i++ ) cffree(s->con_labels[i]);
+	for ( i=0; i<s->n_files; i++ ) cffree(s->files[i]);
+	cffree(s->labels);
+	cffree(s->con_labels);
+	cffree(s->con_n);
+	cffree(s->files);
+	cffree(s->shifts);
+	cffree(s->determined);
+	cffree(s);
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param label: The Millepede label of the parameter, from \ref mille_label
+ *
+ * Adds a free parameter.  Any parameters found in the data which have not been
+ * added will be held fixed.
+ *
+ * \returns zero on success.
+ */
+int mille_solver_add_parameter(MilleSolver *s, int label)
+{
+	if ( s->n_params == s->max_params ) {
+		int new_max = (s->max_params == 0) ? 64 : 2*s->max_params;
+		int *new_labels = cfrealloc(s->labels, new_max*sizeof(int));
+		if ( new_labels == NULL ) return 1;
+		s->labels = new_labels;
+		s->max_params = new_max;
+	}
+
+	s->labels[s->n_params++] = label;
+	return 0;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param labels: Labels of the parameters in the constraint
+ * \param n: Number of labels
+ *
+ * Adds a constraint that the corrections to the parameters in \p labels must
+ * sum to zero.  Labels of fixed parameters are ignored.
+ *
+ * \returns zero on success.
+ */
+int mille_solver_add_constraint(MilleSolver *s, const int *labels, int n)
+{
+	int *copy;
+
+	if ( s->n_con == s->max_con ) {
+		int new_max = (s->max_con == 0) ? 32 : 2*s->max_con;
+		int **new_labels = cfrealloc(s->con_labels, new_max*sizeof(int *));
+		int *new_n;
+		if ( new_labels == NULL ) return 1;
+		s->con_labels = new_labels;
+		new_n = cfrealloc(s->con_n, new_max*sizeof(int));
+		if ( new_n == NULL ) return 1;
+		s->con_n = new_n;
+		s->max_con = new_max;
+	}
+
+	copy = cfmalloc(n*sizeof(int));
+	if ( copy == NULL ) return 1;
+	memcpy(copy, labels, n*sizeof(int));
+
+	s->con_labels[s->n_con] = copy;
+	s->con_n[s->n_con] = n;
+	s->n_con++;
+	return 0;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param filename: Name of a file written via \ref crystfel_mille_new or
+ *   \ref crystfel_mille_new_fd
+ *
+ * Adds a file of data to be read by \ref mille_solver_solve.
+ *
+ * \returns zero on success.
+ */
+int mille_solver_add_file(MilleSolver *s, const char *filename)
+{
+	char *copy;
+
+	if ( s->n_files == s->max_files ) {
+		int new_max = (s->max_files == 0) ? 32 : 2*s->max_files;
+		char **new_files = cfrealloc(s->files, new_max*sizeof(char *));
+		if ( new_files == NULL ) return 1;
+		s->files = new_files;
+		s->max_files = new_max;
+	}
+
+	copy = cfstrdup(filename);
+	if ( copy == NULL ) return 1;
+	s->files[s->n_files++] = copy;
+	return 0;
+}
+
+
+static int cmpint(const void *av, const void *bv)
+{
+	const int *a = av;
+	const int *b = bv;
+	if ( *a < *b ) return -1;
+	if ( *a > *b ) return +1;
+	return 0;
+}
+
+
+static int param_index(MilleSolver *s, int label)
+{
+	int *p = bsearch(&label, s->labels, s->n_params, sizeof(int), cmpint);
+	if ( p == NULL ) return -1;
+	return p - s->labels;
+}
+
+
+/* Normal equations for the global parameters, one set per thread, plus
+ * workspace for eliminating the local parameters of one record */
+struct mille_accum
+{
+	double *C;     /* n_params*n_params */
+	double *b;     /* n_params */
+
+	int max_nl;
+	double *gam;   /* max_nl*max_nl: local normal matrix */
+	double *beta;  /* max_nl */
+
+	int max_ng;
+	int *gidx;     /* max_ng: global parameter index for each slot */
+	double *G;     /* max_ng*max_nl: mixed global/local terms */
+	double *X;     /* max_ng*max_nl: G times inverse of local matrix */
+
+	int max_len;
+	int *slot;     /* max_len: record entry -> global slot, or -1 */
+};
+
+
+struct mille_batch
+{
+	struct mille_queue_args *qargs;
+	int n;
+	int start[MILLE_BATCH];
+	int len[MILLE_BATCH];
+
+	int n_entries;
+	int max_entries;
+	float *float_arr;
+	int *int_arr;
+
+	int n_used;
+	int n_rejected;
+};
+
+
+struct mille_queue_args
+{
+	MilleSolver *s;
+	struct mille_accum *acc;
+	int next_file;
+	MilleReader *reader;
+	int failed;
+};
+
+
+static int resize_accum(struct mille_accum *a, int nl, int ng, int len)
+{
+	if ( nl > a->max_nl ) {
+		cffree(a->gam);
+		cffree(a->beta);
+		a->gam = cfmalloc(nl*nl*sizeof(double));
+		a->beta = cfmalloc(nl*sizeof(double));
+		a->max_nl = nl;
+		a->max_ng = 0;  /* G and X depend on nl */
+		if ( (a->gam == NULL) || (a->beta == NULL) ) {
+			a->max_nl = 0;
+			return 1;
+		}
+	}
+
+	if ( ng > a->max_ng ) {
+		cffree(a->gidx);
+		cffree(a->G);
+		cffree(a->X);
+		a->gidx = cfmalloc(ng*sizeof(int));
+		a->G = cfmalloc(ng*a->max_nl*sizeof(double));
+		a->X = cfmalloc(ng*a->max_nl*sizeof(double));
+		a->max_ng = ng;
+		if ( (a->gidx == NULL) || (a->G == NULL) || (a->X == NULL) ) {
+			a->max_ng = 0;
+			return 1;
+		}
+	}
+
+	if ( len > a->max_len ) {
+		cffree(a->slot);
+		a->slot = cfmalloc(len*sizeof(int));
+		a->max_len = len;
+		if ( a->slot == NULL ) {
+			a->max_len = 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* In-place Cholesky decomposition of the symmetric matrix a (n*n, row-major),
+ * leaving L in the lower triangle.  Returns non-zero if the matrix is not
+ * (numerically) positive definite. */
+static int cholesky_decomp(double *a, int n)
+{
+	int i, j, k;
+
+	for ( j=0; j<n; j++ ) {
+
+		double d = a[j*n+j];
+		double s = d;
+
+		for ( k=0; k<j; k++ ) s -= a[j*n+k]*a[j*n+k];
+		if ( !(s > 1e-12*d) ) return 1;
+		a[j*n+j] = sqrt(s);
+
+		for ( i=j+1; i<n; i++ ) {
+			double t = a[i*n+j];
+			for ( k=0; k<j; k++ ) t -= a[i*n+k]*a[j*n+k];
+			a[i*n+j] = t / a[j*n+j];
+		}
+
+	}
+
+	return 0;
+}
+
+
+/* Solves L L^T x = x in place, after cholesky_decomp() */
+static void cholesky_solve(const double *a, int n, double *x)
+{
+	int i, k;
+
+	for ( i=0; i<n; i++ ) {
+		double t = x[i];
+		for ( k=0; k<i; k++ ) t -= a[i*n+k]*x[k];
+		x[i] = t / a[i*n+i];
+	}
+
+	for ( i=n-1; i>=0; i-- ) {
+		double t = x[i];
+		for ( k=i+1; k<n; k++ ) t -= a[k*n+i]*x[k];
+		x[i] = t / a[i*n+i];
+	}
+}
+
+
+/* Finds the next measurement in a record, starting at 'pos'.  Each one is:
+ * measurement, local derivatives, sigma, global derivatives.
+ * Returns the position of the following measurement, or -1 if the record is
+ * malformed. */
+static int next_measurement(const float *f, const int *lbl, int len, int pos,
+                            int *pl, int *psig, int *pg, int *pend)
+{
+	if ( lbl[pos] != 0 ) return -1;
+	pos++;
+
+	*pl = pos;
+	while ( (pos < len) && (lbl[pos] != 0) ) pos++;
+	if ( pos == len ) return -1;
+
+	*psig = pos;
+	pos++;
+
+	*pg = pos;
+	while ( (pos < len) && (lbl[pos] != 0) ) pos++;
+	*pend = pos;
+
+	if ( !(f[*psig] > 0.0) ) return -1;
+
+	return pos;
+}
+
+
+/* Adds the contribution of one record to the normal equations.
+ * Returns non-zero if the record has to be rejected. */
+static int add_record(MilleSolver *s, struct mille_accum *a,
+                      const float *f, const int *lbl, int len)
+{
+	const int n = s->n_params;
+	int nl = 0;
+	int ng = 0;
+	int pos, i, j, k;
+
+	/* Check the structure, and find the number of local parameters */
+	pos = 0;
+	while ( pos < len ) {
+
+		int l0, sig, g0, end;
+
+		pos = next_measurement(f, lbl, len, pos, &l0, &sig, &g0, &end);
+		if ( pos < 0 ) return 1;
+
+		for ( i=l0; i<sig; i++ ) {
+			if ( (lbl[i] < 1) || (lbl[i] > len) ) return 1;
+			if ( lbl[i] > nl ) nl = lbl[i];
+		}
+
+	}
+
+	/* There can't be more different global parameters than entries */
+	if ( resize_accum(a, (nl > 0) ? nl : 1, len, len) ) return 1;
+
+	/* Give each different free global parameter a slot */
+	pos = 0;
+	while ( pos < len ) {
+
+		int l0, sig, g0, end;
+
+		pos = next_measurement(f, lbl, len, pos, &l0, &sig, &g0, &end);
+
+		for ( i=g0; i<end; i++ ) {
+			int p = param_index(s, lbl[i]);
+			if ( p < 0 ) {
+				a->slot[i] = -1;  /* Fixed parameter */
+				continue;
+			}
+			for ( j=0; j<ng; j++ ) {
+				if ( a->gidx[j] == p ) break;
+			}
+			if ( j == ng ) a->gidx[ng++] = p;
+			a->slot[i] = j;
+		}
+
+	}
+
+	/* Local normal equations, and the mixed terms */
+	for ( i=0; i<nl*nl; i++ ) a->gam[i] = 0.0;
+	for ( i=0; i<nl; i++ ) a->beta[i] = 0.0;
+	for ( i=0; i<ng*nl; i++ ) a->G[i] = 0.0;
+
+	pos = 0;
+	while ( pos < len ) {
+
+		int l0, sig, g0, end;
+		double r, w;
+
+		pos = next_measurement(f, lbl, len, pos, &l0, &sig, &g0, &end);
+		r = f[l0-1];
+		w = 1.0 / ((double)f[sig]*f[sig]);
+
+		for ( i=l0; i<sig; i++ ) {
+			const int li = lbl[i]-1;
+			const double wd = w*f[i];
+			for ( j=l0; j<sig; j++ ) {
+				a->gam[li*nl+lbl[j]-1] += wd*f[j];
+			}
+			a->beta[li] += wd*r;
+			for ( j=g0; j<end; j++ ) {
+				if ( a->slot[j] < 0 ) continue;
+				a->G[a->slot[j]*nl+li] += wd*f[j];
+			}
+		}
+
+	}
+
+	/* Local fit impossible? */
+	if ( cholesky_decomp(a->gam, nl) ) return 1;
+
+	/* Direct contributions to the global normal equations */
+	pos = 0;
+	while ( pos < len ) {
+
+		int l0, sig, g0, end;
+		double r, w;
+
+		pos = next_measurement(f, lbl, len, pos, &l0, &sig, &g0, &end);
+		r = f[l0-1];
+		w = 1.0 / ((double)f[sig]*f[sig]);
+
+		for ( i=g0; i<end; i++ ) {
+			int pi;
+			double wd;
+			if ( a->slot[i] < 0 ) continue;
+			pi = a->gidx[a->slot[i]];
+			wd = w*f[i];
+			for ( j=g0; j<end; j++ ) {
+				if ( a->slot[j] < 0 ) continue;
+				a->C[pi*n+a->gidx[a->slot[j]]] += wd*f[j];
+			}
+			a->b[pi] += wd*r;
+		}
+
+	}
+
+	/* Subtract the part taken up by the local parameters */
+	cholesky_solve(a->gam, nl, a->beta);
+	for ( i=0; i<ng; i++ ) {
+		memcpy(&a->X[i*nl], &a->G[i*nl], nl*sizeof(double));
+		cholesky_solve(a->gam, nl, &a->X[i*nl]);
+	}
+	for ( i=0; i<ng; i++ ) {
+
+		const int pi = a->gidx[i];
+		double t = 0.0;
+
+		for ( j=0; j<ng; j++ ) {
+			double u = 0.0;
+			for ( k=0; k<nl; k++ ) u += a->G[i*nl+k]*a->X[j*nl+k];
+			a->C[pi*n+a->gidx[j]] -= u;
+		}
+
+		for ( k=0; k<nl; k++ ) t += a->G[i*nl+k]*a->beta[k];
+		a->b[pi] -= t;
+
+	}
+
+	return 0;
+}
+
+
+static int add_to_batch(struct mille_batch *batch, const float *floats,
+                        const int *labels, int len)
+{
+	if ( batch->n_entries + len > batch->max_entries ) {
+
+		int new_max = 2*batch->max_entries;
+		float *new_float_arr;
+		int *new_int_arr;
+
+		if ( new_max < batch->n_entries + len ) {
+			new_max = batch->n_entries + len;
+		}
+
+		new_float_arr = cfrealloc(batch->float_arr, new_max*sizeof(float));
+		if ( new_float_arr == NULL ) return 1;
+		batch->float_arr = new_float_arr;
+
+		new_int_arr = cfrealloc(batch->int_arr, new_max*sizeof(int));
+		if ( new_int_arr == NULL ) return 1;
+		batch->int_arr = new_int_arr;
+
+		batch->max_entries = new_max;
+	}
+
+	memcpy(batch->float_arr+batch->n_entries, floats, len*sizeof(float));
+	memcpy(batch->int_arr+batch->n_entries, labels, len*sizeof(int));
+	batch->start[batch->n] = batch->n_entries;
+	batch->len[batch->n] = len;
+	batch->n_entries += len;
+	batch->n++;
+	return 0;
+}
+
+
+static void free_batch(struct mille_batch *batch)
+{
+	cffree(batch->float_arr);
+	cffree(batch->int_arr);
+	cffree(batch);
+}
+
+
+static void *mille_get_task(void *vp)
+{
+	struct mille_queue_args *qargs = vp;
+	struct mille_batch *batch;
+
+	if ( qargs->failed ) return NULL;
+
+	batch = cfcalloc(1, sizeof(struct mille_batch));
+	if ( batch == NULL ) {
+		qargs->failed = 1;
+		return NULL;
+	}
+	batch->qargs = qargs;
+
+	while ( batch->n < MILLE_BATCH ) {
+
+		int r, len;
+		float *floats;
+		int *labels;
+
+		if ( qargs->reader == NULL ) {
+			const char *filename;
+			if ( qargs->next_file == qargs->s->n_files ) break;
+			filename = qargs->s->files[qargs->next_file++];
+			qargs->reader = crystfel_mille_reader_open(filename);
+			if ( qargs->reader == NULL ) {
+				qargs->failed = 1;
+				break;
+			}
+		}
+
+		r = crystfel_mille_reader_next(qargs->reader, &len, &floats,
+		                               &labels);
+		if ( r == 0 ) {
+			crystfel_mille_reader_close(qargs->reader);
+			qargs->reader = NULL;
+			continue;
+		}
+		if ( (r < 0) || add_to_batch(batch, floats, labels, len) ) {
+			qargs->failed = 1;
+			break;
+		}
+
+	}
+
+	if ( qargs->failed || (batch->n == 0) ) {
+		free_batch(batch);
+		return NULL;
+	}
+
+	return batch;
+}
+
+
+static void mille_work(void *vp, int cookie)
+{
+	struct mille_batch *batch = vp;
+	MilleSolver *s = batch->qargs->s;
+	struct mille_accum *a = &batch->qargs->acc[cookie];
+	int i;
+
+	for ( i=0; i<batch->n; i++ ) {
+		const int st = batch->start[i];
+		if ( add_record(s, a, batch->float_arr+st, batch->int_arr+st,
+		                batch->len[i]) )
+		{
+			batch->n_rejected++;
+		} else {
+			batch->n_used++;
+		}
+	}
+}
+
+
+static void mille_final(void *vp, void *vb)
+{
+	struct mille_queue_args *qargs = vp;
+	struct mille_batch *batch = vb;
+
+	qargs->s->n_records += batch->n_used;
+	qargs->s->n_rejected += batch->n_rejected;
+	free_batch(batch);
+}
+
+
+static void free_accums(struct mille_accum *acc, int n)
+{
+	int i;
+
+	if ( acc == NULL ) return;
+
+	for ( i=0; i<n; i++ ) {
+		cffree(acc[i].C);
+		cffree(acc[i].b);
+		cffree(acc[i].gam);
+		cffree(acc[i].beta);
+		cffree(acc[i].gidx);
+		cffree(acc[i].G);
+		cffree(acc[i].X);
+		cffree(acc[i].slot);
+	}
+	cffree(acc);
+}
+
+
+/* Solves the global normal equations in acc, with the constraints.
+ * Parameters without any data are left at zero. */
+static int solve_global(MilleSolver *s, struct mille_accum *acc)
+{
+	const int n = s->n_params;
+	int *idx;
+	int *con_ok;
+	int na = 0;
+	int nc = 0;
+	int i, j, k, sgn;
+	gsl_matrix *M;
+	gsl_vector *v;
+	gsl_vector *x;
+	gsl_permutation *perm;
+	double max_pivot = 0.0;
+
+	/* Active parameters */
+	idx = cfmalloc(n*sizeof(int));
+	con_ok = cfmalloc(s->n_con*sizeof(int));
+	if ( (idx == NULL) || ((s->n_con > 0) && (con_ok == NULL)) ) return 1;
+	for ( i=0; i<n; i++ ) {
+		s->determined[i] = (acc->C[i*n+i] > 0.0);
+		s->shifts[i] = 0.0;
+		idx[i] = s->determined[i] ? na++ : -1;
+		if ( !s->determined[i] ) {
+			ERROR("No data for parameter %i - it will not be "
+			      "refined.\n", s->labels[i]);
+		}
+	}
+
+	/* Constraints which involve at least one active parameter */
+	for ( i=0; i<s->n_con; i++ ) {
+		con_ok[i] = 0;
+		for ( j=0; j<s->con_n[i]; j++ ) {
+			int p = param_index(s, s->con_labels[i][j]);
+			if ( (p >= 0) && (idx[p] >= 0) ) con_ok[i] = 1;
+		}
+		if ( con_ok[i] ) nc++;
+	}
+
+	if ( na == 0 ) {
+		cffree(idx);
+		cffree(con_ok);
+		return 0;
+	}
+
+	M = gsl_matrix_calloc(na+nc, na+nc);
+	v = gsl_vector_calloc(na+nc);
+	x = gsl_vector_alloc(na+nc);
+	perm = gsl_permutation_alloc(na+nc);
+	if ( (M == NULL) || (v == NULL) || (x == NULL) || (perm == NULL) ) {
+		cffree(idx);
+		cffree(con_ok);
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		if ( idx[i] < 0 ) continue;
+		gsl_vector_set(v, idx[i], acc->b[i]);
+		for ( j=0; j<n; j++ ) {
+			if ( idx[j] < 0 ) continue;
+			gsl_matrix_set(M, idx[i], idx[j], acc->C[i*n+j]);
+		}
+	}
+
+	/* Lagrange multipliers */
+	k = na;
+	for ( i=0; i<s->n_con; i++ ) {
+		if ( !con_ok[i] ) continue;
+		for ( j=0; j<s->con_n[i]; j++ ) {
+			int p = param_index(s, s->con_labels[i][j]);
+			if ( (p < 0) || (idx[p] < 0) ) continue;
+			gsl_matrix_set(M, k, idx[p], 1.0);
+			gsl_matrix_set(M, idx[p], k, 1.0);
+		}
+		k++;
+	}
+
+	gsl_linalg_LU_decomp(M, perm, &sgn);
+	for ( i=0; i<na+nc; i++ ) {
+		double d = fabs(gsl_matrix_get(M, i, i));
+		if ( d > max_pivot ) max_pivot = d;
+	}
+	for ( i=0; i<na+nc; i++ ) {
+		if ( !(fabs(gsl_matrix_get(M, i, i)) > 1e-14*max_pivot) ) break;
+	}
+	if ( i < na+nc ) {
+		ERROR("The alignment problem is singular.  Check the "
+		      "constraints, or refine fewer parameters.\n");
+		gsl_matrix_free(M);
+		gsl_vector_free(v);
+		gsl_vector_free(x);
+		gsl_permutation_free(perm);
+		cffree(idx);
+		cffree(con_ok);
+		return 1;
+	}
+
+	gsl_linalg_LU_solve(M, perm, v, x);
+	for ( i=0; i<n; i++ ) {
+		if ( idx[i] < 0 ) continue;
+		s->shifts[i] = gsl_vector_get(x, idx[i]);
+	}
+
+	gsl_matrix_free(M);
+	gsl_vector_free(v);
+	gsl_vector_free(x);
+	gsl_permutation_free(perm);
+	cffree(idx);
+	cffree(con_ok);
+	return 0;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param n_threads: Number of threads to use for building the equations
+ *
+ * Reads all the files, and solves for the free parameters.  The data is read
+ * in a single pass, with the local parameters of each record being eliminated
+ * straight away.  Records for which the local parameters can't be determined
+ * are rejected, as they are by Millepede.
+ *
+ * \returns zero on success.
+ */
+int mille_solver_solve(MilleSolver *s, int n_threads)
+{
+	struct mille_queue_args qargs;
+	const int n = s->n_params;
+	int i, j;
+	int r;
+
+	if ( n_threads < 1 ) n_threads = 1;
+
+	qsort(s->labels, n, sizeof(int), cmpint);
+	for ( i=1; i<n; i++ ) {
+		if ( s->labels[i] == s->labels[i-1] ) {
+			ERROR("Parameter %i added more than once\n", s->labels[i]);
+			return 1;
+		}
+	}
+
+	cffree(s->shifts);
+	cffree(s->determined);
+	s->shifts = cfmalloc(n*sizeof(double));
+	s->determined = cfmalloc(n*sizeof(int));
+	if ( (n > 0) && ((s->shifts == NULL) || (s->determined == NULL)) ) {
+		return 1;
+	}
+	s->n_records = 0;
+	s->n_rejected = 0;
+
+	qargs.s = s;
+	qargs.next_file = 0;
+	qargs.reader = NULL;
+	qargs.failed = 0;
+	qargs.acc = cfcalloc(n_threads, sizeof(struct mille_accum));
+	if ( qargs.acc == NULL ) return 1;
+	for ( i=0; i<n_threads; i++ ) {
+		qargs.acc[i].C = cfcalloc(n*n, sizeof(double));
+		qargs.acc[i].b = cfcalloc(n, sizeof(double));
+		if ( (n > 0)
+		  && ((qargs.acc[i].C == NULL) || (qargs.acc[i].b == NULL)) )
+		{
+			free_accums(qargs.acc, n_threads);
+			return 1;
+		}
+	}
+
+	run_threads(n_threads, mille_work, mille_get_task, mille_final,
+	            &qargs, 0, 0, 0, 0);
+
+	if ( qargs.reader != NULL ) crystfel_mille_reader_close(qargs.reader);
+	if ( qargs.failed ) {
+		free_accums(qargs.acc, n_threads);
+		return 1;
+	}
+
+	for ( i=1; i<n_threads; i++ ) {
+		for ( j=0; j<n*n; j++ ) qargs.acc[0].C[j] += qargs.acc[i].C[j];
+		for ( j=0; j<n; j++ ) qargs.acc[0].b[j] += qargs.acc[i].b[j];
+	}
+
+	r = solve_global(s, &qargs.acc[0]);
+	free_accums(qargs.acc, n_threads);
+	return r;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ *
+ * \returns the number of free parameters.
+ */
+int mille_solver_num_parameters(MilleSolver *s)
+{
+	return s->n_params;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param n_used: Place to store the number of records used
+ * \param n_rejected: Place to store the number of records rejected
+ *
+ * Gets the number of records used and rejected by \ref mille_solver_solve.
+ */
+void mille_solver_num_records(MilleSolver *s, int *n_used, int *n_rejected)
+{
+	*n_used = s->n_records;
+	*n_rejected = s->n_rejected;
+}
+
+
+/**
+ * \param s: A \ref MilleSolver
+ * \param i: Index of the parameter, from 0 to
+ *   \ref mille_solver_num_parameters minus 1
+ * \param label: Place to store the label of the parameter
+ * \param shift: Place to store the correction to the parameter
+ *
+ * Gets the result for one parameter after \ref mille_solver_solve.  The
+ * parameters are in order of increasing label.  The correction has the same
+ * meaning as the one written by Millepede to its result file.
+ *
+ * \returns non-zero if the parameter was determined, or zero if there was no
+ * data for it (in which case the correction is zero).
+ */
+int mille_solver_get_result(MilleSolver *s, int i, int *label, double *shift)
+{
+	*label = s->labels[i];
+	*shift = s->shifts[i];
+	return s->determined[i];
 }
@@ -29,10 +29,21 @@
 #ifndef CRYSTFEL_MILLE_H
 #define CRYSTFEL_MILLE_H
 
+#include <stdio.h>
 #include <gsl/gsl_matrix.h>
 
 typedef struct mille Mille;
 
+/**
+ * Opaque type for reading Mille files.
+ */
+typedef struct mille_reader MilleReader;
+
+/**
+ * Opaque type for the built-in solver for the global parameters.
+ */
+typedef struct mille_solver MilleSolver;
+
 #include "cell.h"
 #include "image.h"
 #include "predict-refine.h"
@@ -44,6 +55,7 @@ typedef struct mille Mille;
 
 extern Mille *crystfel_mille_new(const char *outFileName);
 extern Mille *crystfel_mille_new_fd(int fd);
+extern int crystfel_mille_set_compression(Mille *m, int compress);
 
 extern void crystfel_mille_free(Mille *m);
 
@@ -55,8 +67,40 @@ extern void write_mille(Mille *mille, int n, UnitCell *cell,
                         struct reflpeak *rps, struct image *image,
                         int max_level, gsl_matrix **Minvs);
 
+extern void crystfel_mille_add_measurement(Mille *m,
+                                           int NLC, float *derLc,
+                                           int NGL, float *derGl, int *labels,
+                                           float rMeas, float sigma);
+
 extern void crystfel_mille_delete_last_record(Mille *m);
 
 extern void crystfel_mille_write_record(Mille *m);
 
+extern void crystfel_mille_end_frame(Mille *m);
+
+/* Marks a block of compressed records in the data from
+ * crystfel_mille_new_fd(), followed by the length of the block.  Cannot be
+ * mistaken for the length of an uncompressed record. */
+#define CRYSTFEL_MILLE_BLOCK_MARKER (-1)
+
+extern size_t crystfel_mille_pump(const void *buf, size_t len, FILE *fh);
+
+extern MilleReader *crystfel_mille_reader_open(const char *filename);
+extern int crystfel_mille_reader_next(MilleReader *r, int *plen,
+                                      float **pfloats, int **plabels);
+extern void crystfel_mille_reader_close(MilleReader *r);
+
+extern MilleSolver *mille_solver_new(void);
+extern void mille_solver_free(MilleSolver *s);
+extern int mille_solver_add_parameter(MilleSolver *s, int label);
+extern int mille_solver_add_constraint(MilleSolver *s, const int *labels,
+                                       int n);
+extern int mille_solver_add_file(MilleSolver *s, const char *filename);
+extern int mille_solver_solve(MilleSolver *s, int n_threads);
+extern int mille_solver_num_parameters(MilleSolver *s);
+extern void mille_solver_num_records(MilleSolver *s, int *n_used,
+                                     int *n_rejected);
+extern int mille_solver_get_result(MilleSolver *s, int i, int *label,
+                                   double *shift);
+
 #endif	/* CRYSTFEL_MILLE_H */
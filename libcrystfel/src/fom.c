@@ -32,7 +32,11 @@
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_statistics.h>
 #include <gsl/gsl_fit.h>
+#include <gsl/gsl_rng.h>
 #include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "utils.h"
 #include "fom.h"
@@ -40,6 +44,7 @@
 #include "cell-utils.h"
 #include "reflist.h"
 #include "reflist-utils.h"
+#include "thread-pool.h"
 
 /**
  * \file fom.h
@@ -796,66 +801,419 @@ static int wilson_scale(RefList *list1, RefList *list2, UnitCell *cell)
 }
 
 
-static int calculate_possible(struct fom_context *fctx,
-                              struct fom_shells *shells,
-                              UnitCell *cell,
-                              const SymOpList *sym)
+/* Limit on the size of the bitmap used to visit each group of symmetry
+ * equivalents only once.  Beyond this, each index is checked separately. */
+#define MAX_POSSIBLE_VISITED (256*1024*1024)
+
+/* Number of sets of possible reflection counts to remember */
+#define POSSIBLE_CACHE_SIZE 8
+
+struct possible_cache_entry
+{
+	double rvecs[9];
+	char cen;
+	int nequiv;
+	signed int *ops;
+	int nshells;
+	double *rmins;
+	double *rmaxs;
+	long int *possible;
+};
+
+static struct possible_cache_entry possible_cache[POSSIBLE_CACHE_SIZE];
+static int possible_cache_next = 0;
+static pthread_mutex_t possible_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* The symmetry operations, as the images of the three unit indices */
+static signed int *get_symop_images(const SymOpList *sym, int *pnequiv)
+{
+	int nequiv = num_equivs(sym, NULL);
+	signed int *ops;
+	int p;
+
+	ops = cfmalloc(nequiv*9*sizeof(signed int));
+	if ( ops == NULL ) return NULL;
+
+	for ( p=0; p<nequiv; p++ ) {
+		signed int *o = &ops[9*p];
+		get_equiv(sym, NULL, p, 1, 0, 0, &o[0], &o[1], &o[2]);
+		get_equiv(sym, NULL, p, 0, 1, 0, &o[3], &o[4], &o[5]);
+		get_equiv(sym, NULL, p, 0, 0, 1, &o[6], &o[7], &o[8]);
+	}
+
+	*pnequiv = nequiv;
+	return ops;
+}
+
+
+static int possible_cache_match(struct possible_cache_entry *e,
+                                const double *rvecs, char cen,
+                                const signed int *ops, int nequiv,
+                                struct fom_shells *shells)
+{
+	int i;
+
+	if ( e->possible == NULL ) return 0;
+	if ( e->cen != cen ) return 0;
+	if ( e->nequiv != nequiv ) return 0;
+	if ( e->nshells != shells->nshells ) return 0;
+	for ( i=0; i<9; i++ ) {
+		if ( e->rvecs[i] != rvecs[i] ) return 0;
+	}
+	for ( i=0; i<9*nequiv; i++ ) {
+		if ( e->ops[i] != ops[i] ) return 0;
+	}
+	for ( i=0; i<shells->nshells; i++ ) {
+		if ( e->rmins[i] != shells->rmins[i] ) return 0;
+		if ( e->rmaxs[i] != shells->rmaxs[i] ) return 0;
+	}
+	return 1;
+}
+
+
+static int possible_cache_lookup(const double *rvecs, char cen,
+                                 const signed int *ops, int nequiv,
+                                 struct fom_shells *shells, long int *possible)
+{
+	int i;
+	int found = 0;
+
+	pthread_mutex_lock(&possible_cache_lock);
+	for ( i=0; i<POSSIBLE_CACHE_SIZE; i++ ) {
+		struct possible_cache_entry *e = &possible_cache[i];
+		if ( !possible_cache_match(e, rvecs, cen, ops, nequiv, shells) ) {
+			continue;
+		}
+		memcpy(possible, e->possible, shells->nshells*sizeof(long int));
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&possible_cache_lock);
+
+	return found;
+}
+
+
+static void possible_cache_store(const double *rvecs, char cen,
+                                 const signed int *ops, int nequiv,
+                                 struct fom_shells *shells,
+                                 const long int *possible)
 {
-	RefList *counted;
+	struct possible_cache_entry *e;
+	int nshells = shells->nshells;
+	signed int *ops_copy;
+	double *rmins, *rmaxs;
+	long int *possible_copy;
+
+	ops_copy = cfmalloc(9*nequiv*sizeof(signed int));
+	rmins = cfmalloc(nshells*sizeof(double));
+	rmaxs = cfmalloc(nshells*sizeof(double));
+	possible_copy = cfmalloc(nshells*sizeof(long int));
+	if ( (ops_copy == NULL) || (rmins == NULL) || (rmaxs == NULL)
+	  || (possible_copy == NULL) )
+	{
+		cffree(ops_copy);
+		cffree(rmins);
+		cffree(rmaxs);
+		cffree(possible_copy);
+		return;
+	}
+	memcpy(ops_copy, ops, 9*nequiv*sizeof(signed int));
+	memcpy(rmins, shells->rmins, nshells*sizeof(double));
+	memcpy(rmaxs, shells->rmaxs, nshells*sizeof(double));
+	memcpy(possible_copy, possible, nshells*sizeof(long int));
+
+	pthread_mutex_lock(&possible_cache_lock);
+	e = &possible_cache[possible_cache_next];
+	possible_cache_next = (possible_cache_next+1) % POSSIBLE_CACHE_SIZE;
+	cffree(e->ops);
+	cffree(e->rmins);
+	cffree(e->rmaxs);
+	cffree(e->possible);
+	memcpy(e->rvecs, rvecs, 9*sizeof(double));
+	e->cen = cen;
+	e->nequiv = nequiv;
+	e->ops = ops_copy;
+	e->nshells = nshells;
+	e->rmins = rmins;
+	e->rmaxs = rmaxs;
+	e->possible = possible_copy;
+	pthread_mutex_unlock(&possible_cache_lock);
+}
+
+
+/* Same as the loop in get_bin(), but by bisection if the shells are in order */
+static int find_shell(struct fom_shells *shells, int sorted, double d)
+{
+	int i;
+	int lo, hi;
+
+	if ( !sorted ) {
+		for ( i=0; i<shells->nshells; i++ ) {
+			if ( (d>shells->rmins[i]) && (d<=shells->rmaxs[i]) ) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	/* First shell with d <= rmax */
+	lo = 0;
+	hi = shells->nshells;
+	while ( lo < hi ) {
+		int mid = (lo+hi)/2;
+		if ( d <= shells->rmaxs[mid] ) {
+			hi = mid;
+		} else {
+			lo = mid+1;
+		}
+	}
+	if ( lo == shells->nshells ) return -1;
+	if ( d <= shells->rmins[lo] ) return -1;
+	return lo;
+}
+
+
+static int shells_sorted(struct fom_shells *shells)
+{
+	int i;
+
+	for ( i=0; i<shells->nshells; i++ ) {
+		if ( shells->rmaxs[i] < shells->rmins[i] ) return 0;
+		if ( (i > 0) && (shells->rmins[i] < shells->rmaxs[i-1]) ) return 0;
+	}
+	return 1;
+}
+
+
+/* Range of l for which |h*a* + k*b* + l*c*| lies between rin and rout.
+ * If the range is split in two by the inner sphere, the upper part is returned
+ * in l3 and l4.  The limits include a small margin, so that the exact
+ * resolution check can be made later. */
+static int l_ranges(const double *rv, signed int h, signed int k,
+                    double rin, double rout, signed int lmax,
+                    signed int *l1, signed int *l2,
+                    signed int *l3, signed int *l4)
+{
+	double px, py, pz;
+	double a, b, c, disc, sq;
+	double lo, hi;
+
+	px = h*rv[0] + k*rv[3];
+	py = h*rv[1] + k*rv[4];
+	pz = h*rv[2] + k*rv[5];
+
+	/* |p + l*c*|^2 = a*l^2 + 2*b*l + c */
+	a = rv[6]*rv[6] + rv[7]*rv[7] + rv[8]*rv[8];
+	b = px*rv[6] + py*rv[7] + pz*rv[8];
+	c = px*px + py*py + pz*pz;
+
+	disc = b*b - a*(c - rout*rout);
+	if ( disc < 0.0 ) return 0;
+	sq = sqrt(disc);
+	lo = floor((-b - sq)/a) - 1;
+	hi = ceil((-b + sq)/a) + 1;
+	if ( lo < -lmax ) lo = -lmax;
+	if ( hi > lmax ) hi = lmax;
+	if ( lo > hi ) return 0;
+
+	*l1 = lo;
+	*l2 = hi;
+	*l3 = 1;
+	*l4 = 0;
+
+	disc = b*b - a*(c - rin*rin);
+	if ( (rin > 0.0) && (disc > 0.0) ) {
+		double ilo, ihi;
+		sq = sqrt(disc);
+		ilo = ceil((-b - sq)/a) + 1;
+		ihi = floor((-b + sq)/a) - 1;
+		if ( ilo <= ihi ) {
+			if ( ihi+1 <= hi ) {
+				*l3 = ihi+1;
+				*l4 = hi;
+			}
+			*l2 = (ilo-1 < hi) ? ilo-1 : hi;
+		}
+	}
+
+	return 1;
+}
+
+
+struct possible_count
+{
+	UnitCell *cell;
+	const SymOpList *sym;
+	int nequiv;
+	struct fom_shells *shells;
+	int sorted;
+	const double *rv;
 	int hmax, kmax, lmax;
+	unsigned char *visited;
+	long int *possible;
+};
+
+
+static size_t visited_idx(struct possible_count *pc,
+                          signed int h, signed int k, signed int l)
+{
+	size_t nk = 2*pc->kmax+1;
+	size_t nl = 2*pc->lmax+1;
+	return ((h+pc->hmax)*nk + (k+pc->kmax))*nl + (l+pc->lmax);
+}
+
+
+static void count_index(struct possible_count *pc,
+                        signed int h, signed int k, signed int l)
+{
+	double d;
+	signed int hs, ks, ls;
+	int bin;
+	int p;
+	int allowed;
+	const double *rv = pc->rv;
+
+	if ( pc->visited != NULL ) {
+		size_t idx = visited_idx(pc, h, k, l);
+		if ( pc->visited[idx/8] & (1<<(idx%8)) ) return;
+	}
+
+	get_asymm(pc->sym, h, k, l, &hs, &ks, &ls);
+
+	/* Without the bitmap, count only at the asymmetric index itself */
+	if ( (pc->visited == NULL)
+	  && ((hs != h) || (ks != k) || (ls != l)) ) return;
+
+	/* Mark all the equivalents as visited, and check if any of them is
+	 * allowed by the centering */
+	allowed = !forbidden_reflection(pc->cell, h, k, l);
+	for ( p=0; p<pc->nequiv; p++ ) {
+
+		signed int he, ke, le;
+
+		if ( allowed && (pc->visited == NULL) ) break;
+
+		get_equiv(pc->sym, NULL, p, h, k, l, &he, &ke, &le);
+		if ( (abs(he) > pc->hmax) || (abs(ke) > pc->kmax)
+		  || (abs(le) > pc->lmax) ) continue;
+
+		if ( !forbidden_reflection(pc->cell, he, ke, le) ) allowed = 1;
+
+		if ( pc->visited != NULL ) {
+			size_t idx = visited_idx(pc, he, ke, le);
+			pc->visited[idx/8] |= 1<<(idx%8);
+		}
+
+	}
+	if ( !allowed ) return;
+
+	/* Same as 2.0 * resolution(cell, hs, ks, ls) */
+	d = modulus(hs*rv[0] + ks*rv[3] + ls*rv[6],
+	            hs*rv[1] + ks*rv[4] + ls*rv[7],
+	            hs*rv[2] + ks*rv[5] + ls*rv[8]);
+
+	bin = find_shell(pc->shells, pc->sorted, d);
+	if ( bin == -1 ) return;
+
+	pc->possible[bin]++;
+}
+
+
+/* Counts the unique reflections in each resolution shell.  A reflection is
+ * counted if any of its equivalents is allowed by the lattice centering. */
+static void count_possible(long int *possible, struct fom_shells *shells,
+                           UnitCell *cell, const SymOpList *sym,
+                           const double *rv)
+{
+	struct possible_count pc;
 	double ax, ay, az;
 	double bx, by, bz;
 	double cx, cy, cz;
+	double rin, rout;
+	double nbox;
 	signed int h, k, l;
 
-	fctx->possible = cfcalloc(fctx->nshells, sizeof(long int));
-	if ( fctx->possible == NULL ) return 1;
-
-	counted = reflist_new();
-	if ( counted == NULL ) {
-		cffree(fctx->possible);
-		return 1;
-	}
-
 	cell_get_cartesian(cell, &ax, &ay, &az,
 	                         &bx, &by, &bz,
 	                         &cx, &cy, &cz);
-	hmax = shells->rmaxs[fctx->nshells-1] * modulus(ax, ay, az);
-	kmax = shells->rmaxs[fctx->nshells-1] * modulus(bx, by, bz);
-	lmax = shells->rmaxs[fctx->nshells-1] * modulus(cx, cy, cz);
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
-
-		double d;
-		signed int hs, ks, ls;
-		int bin;
-		int i;
-
-		get_asymm(sym, h, k, l, &hs, &ks, &ls);
-		d = 2.0 * resolution(cell, hs, ks, ls);
+	pc.hmax = shells->rmaxs[shells->nshells-1] * modulus(ax, ay, az);
+	pc.kmax = shells->rmaxs[shells->nshells-1] * modulus(bx, by, bz);
+	pc.lmax = shells->rmaxs[shells->nshells-1] * modulus(cx, cy, cz);
+
+	pc.cell = cell;
+	pc.sym = sym;
+	pc.nequiv = num_equivs(sym, NULL);
+	pc.shells = shells;
+	pc.sorted = shells_sorted(shells);
+	pc.rv = rv;
+	pc.possible = possible;
+
+	/* Only reflections within the outer shell, and outside the inner one,
+	 * need to be visited */
+	rout = shells->rmaxs[shells->nshells-1];
+	rin = pc.sorted ? shells->rmins[0] : 0.0;
+
+	nbox = (2.0*pc.hmax+1) * (2.0*pc.kmax+1) * (2.0*pc.lmax+1);
+	if ( nbox <= MAX_POSSIBLE_VISITED ) {
+		pc.visited = cfcalloc(((size_t)nbox+7)/8, 1);
+	} else {
+		pc.visited = NULL;
+	}
 
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
+	for ( h=-pc.hmax; h<=pc.hmax; h++ ) {
+	for ( k=-pc.kmax; k<=pc.kmax; k++ ) {
 
-		bin = -1;
-		for ( i=0; i<fctx->nshells; i++ ) {
-			if ( (d>shells->rmins[i]) && (d<=shells->rmaxs[i]) ) {
-				bin = i;
-				break;
-			}
-		}
-		if ( bin == -1 ) continue;
+		signed int l1, l2, l3, l4;
 
-		if ( find_refl(counted, hs, ks, ls) != NULL ) continue;
-		add_refl(counted, hs, ks, ls);
+		if ( !l_ranges(rv, h, k, rin, rout, pc.lmax,
+		               &l1, &l2, &l3, &l4) ) continue;
 
-		fctx->possible[bin]++;
+		for ( l=l1; l<=l2; l++ ) count_index(&pc, h, k, l);
+		for ( l=l3; l<=l4; l++ ) count_index(&pc, h, k, l);
 
 	}
 	}
+
+	cffree(pc.visited);
+}
+
+
+static int calculate_possible(struct fom_context *fctx,
+                              struct fom_shells *shells,
+                              UnitCell *cell,
+                              const SymOpList *sym)
+{
+	double rv[9];
+	signed int *ops;
+	int nequiv;
+	char cen;
+
+	fctx->possible = cfcalloc(fctx->nshells, sizeof(long int));
+	if ( fctx->possible == NULL ) return 1;
+
+	cell_get_reciprocal(cell, &rv[0], &rv[1], &rv[2],
+	                          &rv[3], &rv[4], &rv[5],
+	                          &rv[6], &rv[7], &rv[8]);
+	cen = cell_get_centering(cell);
+
+	ops = get_symop_images(sym, &nequiv);
+	if ( ops == NULL ) {
+		cffree(fctx->possible);
+		fctx->possible = NULL;
+		return 1;
 	}
-	reflist_free(counted);
 
+	if ( !possible_cache_lookup(rv, cen, ops, nequiv, shells,
+	                            fctx->possible) )
+	{
+		count_possible(fctx->possible, shells, cell, sym, rv);
+		possible_cache_store(rv, cen, ops, nequiv, shells,
+		                     fctx->possible);
+	}
+
+	cffree(ops);
 	return 0;
 }
 
@@ -953,51 +1311,50 @@ static int is_single_list(enum fom_type fom)
 }
 
 
-/**
- * \param list1: A %RefList
- * \param list2: A %RefList
- * \param cell: A %UnitCell
- * \param shells: A %fom_shells structure
- * \param fom: The figure of merit to calculate
- * \param noscale: Non-zero to disable scaline of reflection lists
- * \param sym: The symmetry of \p list1 and \p list2.
- *
- * Calculates the specified figure of merit, comparing the two reflection lists.
- *
- * The \p cell and \p sym must match both reflection lists.  You should also have
- * called fom_select_reflection_pairs() to pre-process the lists.
- *
- * If the figure of merit does not involve comparison (e.g. %FOM_SNR),
- * then \p list1 will be used.  In this case, \p list2 and \p noscale will be
- * ignored.  Use fom_select_reflections() instead of fom_select_reflection_pairs()
- * in this case.
- *
- * \returns a %fom_context structure.  Use fom_shell_value() et al., to
- *  extract the actual figure of merit values.
- */
-struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell,
-                                  struct fom_shells *shells, enum fom_type fom,
-                                  int noscale, const SymOpList *sym)
+/* A pair of reflections which will contribute to the figures of merit */
+struct fom_pair
 {
 	Reflection *refl1;
-	RefListIterator *iter;
-	struct fom_context *fctx;
-	long int n_out = 0;
-	long int n_rej = 0;
+	Reflection *refl2;
+	Reflection *refl1_bij;
+	Reflection *refl2_bij;
+	int bin;
+
+	/* Non-zero if this reflection was already counted as the Bijvoet
+	 * partner of an earlier one, and so should not contribute to the
+	 * anomalous figures of merit */
+	int bij_counted;
+};
 
-	fctx = init_fom(fom, num_reflections(list1), shells->nshells);
 
-	if ( fctx == NULL ) {
-		ERROR("Couldn't allocate memory for resolution shells.\n");
-		return NULL;
+static int any_anomalous(const enum fom_type *foms, int n_foms)
+{
+	int i;
+	for ( i=0; i<n_foms; i++ ) {
+		if ( fom_is_anomalous(foms[i]) ) return 1;
 	}
+	return 0;
+}
 
-	if ( !is_single_list(fom) ) {
-		if ( !noscale && wilson_scale(list1, list2, cell) ) {
-			ERROR("Error with scaling.\n");
-			return NULL;
-		}
 
+/* Pairs up the reflections in the two lists, and works out which shell each
+ * pair belongs to.  For single-list figures of merit, list2 is not used. */
+static struct fom_pair *collect_pairs(RefList *list1, RefList *list2,
+                                      UnitCell *cell,
+                                      struct fom_shells *shells,
+                                      int single, int anom,
+                                      const SymOpList *sym, long int *pn)
+{
+	Reflection *refl1;
+	RefListIterator *iter;
+	struct fom_pair *pairs;
+	long int n = 0;
+	long int n_out = 0;
+
+	pairs = cfmalloc(num_reflections(list1)*sizeof(struct fom_pair));
+	if ( pairs == NULL ) return NULL;
+
+	if ( !single ) {
 		for ( refl1 = first_refl(list1, &iter);
 		      refl1 != NULL;
 		      refl1 = next_refl(refl1, iter) )
@@ -1021,10 +1378,11 @@ struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell
 		Reflection *refl2;
 		Reflection *refl1_bij = NULL;
 		Reflection *refl2_bij = NULL;
+		int bij_counted = 0;
 
 		get_indices(refl1, &h, &k, &l);
 
-		if ( is_single_list(fom) ) {
+		if ( single ) {
 			refl2 = NULL;
 		} else {
 			refl2 = find_refl(list2, h, k, l);
@@ -1037,7 +1395,7 @@ struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell
 			continue;
 		}
 
-		if ( fom_is_anomalous(fom) ) {
+		if ( anom ) {
 
 			signed int hb, kb, lb;
 
@@ -1055,42 +1413,703 @@ struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell
 
 			/* Each reflection must only be counted once, whether
 			 * we are visiting it now as "normal" or "bij" */
-			if ( get_flag(refl1) ) continue;
-			assert(!get_flag(refl2));
-			set_flag(refl1, 1);
-			set_flag(refl1_bij, 1);
-			set_flag(refl2, 1);
-			set_flag(refl2_bij, 1);
-
-			assert(refl1_bij != NULL);
-			assert(refl2_bij != NULL);
+			if ( get_flag(refl1) ) {
+				bij_counted = 1;
+			} else {
+				assert(!get_flag(refl2));
+				set_flag(refl1, 1);
+				set_flag(refl1_bij, 1);
+				set_flag(refl2, 1);
+				set_flag(refl2_bij, 1);
+
+				assert(refl1_bij != NULL);
+				assert(refl2_bij != NULL);
+			}
 
 		}
 
-		n_rej += add_to_fom(fctx, refl1, refl2, refl1_bij, refl2_bij, bin);
+		pairs[n].refl1 = refl1;
+		pairs[n].refl2 = refl2;
+		pairs[n].refl1_bij = refl1_bij;
+		pairs[n].refl2_bij = refl2_bij;
+		pairs[n].bin = bin;
+		pairs[n].bij_counted = bij_counted;
+		n++;
 
 	}
 	if ( n_out )  {
-		ERROR("WARNING: %i reflection pairs outside range.\n", n_out);
+		ERROR("WARNING: %li reflection pairs outside range.\n", n_out);
 	}
-	if ( n_rej ) {
-		if ( fom == FOM_SNR ) {
-			ERROR("WARNING: %li reflections had infinite or "
-			      "invalid values of I/sigma(I).\n", n_rej);
-		} else {
-			ERROR("WARNING: %li reflections rejected by add_to_fom\n",
-			      n_rej);
+
+	*pn = n;
+	return pairs;
+}
+
+
+static int add_pair_to_fom(struct fom_context *fctx, struct fom_pair *p)
+{
+	if ( fom_is_anomalous(fctx->fom) ) {
+		if ( p->bij_counted ) return 0;
+		return add_to_fom(fctx, p->refl1, p->refl2,
+		                  p->refl1_bij, p->refl2_bij, p->bin);
+	}
+	return add_to_fom(fctx, p->refl1, p->refl2, NULL, NULL, p->bin);
+}
+
+
+/**
+ * \param fctx: A %fom_context structure
+ *
+ * Frees a %fom_context structure returned by fom_calculate() or
+ * fom_calculate_multi().
+ */
+void fom_context_free(struct fom_context *fctx)
+{
+	int i;
+
+	if ( fctx == NULL ) return;
+
+	cffree(fctx->cts);
+	cffree(fctx->num2);
+	cffree(fctx->den2);
+	cffree(fctx->num);
+	cffree(fctx->den);
+	cffree(fctx->n_meas);
+	if ( fctx->vec1 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			cffree(fctx->vec1[i]);
+		}
+		cffree(fctx->vec1);
+	}
+	if ( fctx->vec2 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			cffree(fctx->vec2[i]);
+		}
+		cffree(fctx->vec2);
+	}
+	cffree(fctx->n);
+	cffree(fctx->n_within);
+	cffree(fctx->possible);
+	cffree(fctx);
+}
+
+
+/**
+ * \param list1: A %RefList
+ * \param list2: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param foms: The figures of merit to calculate
+ * \param n_foms: The number of figures of merit in \p foms
+ * \param noscale: Non-zero to disable scaling of reflection lists
+ * \param sym: The symmetry of \p list1 and \p list2.
+ * \param fctxs: Array of \p n_foms locations for the results
+ *
+ * Calculates several figures of merit at once, using a single pass over the
+ * reflections.  The results are the same as calling fom_calculate() for each
+ * figure of merit in turn, except that the lists will be scaled only once.
+ *
+ * The figures of merit must either all involve a comparison, or none of them.
+ * Note that the reflection lists for anomalous figures of merit should be
+ * selected differently (see fom_select_reflection_pairs()).
+ *
+ * \returns zero on success.  On error, none of the contexts will be returned.
+ */
+int fom_calculate_multi(RefList *list1, RefList *list2, UnitCell *cell,
+                        struct fom_shells *shells,
+                        const enum fom_type *foms, int n_foms,
+                        int noscale, const SymOpList *sym,
+                        struct fom_context **fctxs)
+{
+	struct fom_pair *pairs;
+	long int n_pairs;
+	long int i;
+	int j;
+	int single;
+
+	if ( n_foms < 1 ) return 1;
+
+	single = is_single_list(foms[0]);
+	for ( j=1; j<n_foms; j++ ) {
+		if ( is_single_list(foms[j]) != single ) {
+			ERROR("Can't mix comparative and single-list figures "
+			      "of merit in one calculation.\n");
+			return 1;
 		}
 	}
 
-	if ( fom == FOM_COMPLETENESS ) {
-		calculate_possible(fctx, shells, cell, sym);
+	for ( j=0; j<n_foms; j++ ) {
+		fctxs[j] = init_fom(foms[j], num_reflections(list1),
+		                    shells->nshells);
+		if ( fctxs[j] == NULL ) {
+			ERROR("Couldn't allocate memory for resolution "
+			      "shells.\n");
+			while ( j-- > 0 ) fom_context_free(fctxs[j]);
+			return 1;
+		}
 	}
 
+	if ( !single && !noscale && wilson_scale(list1, list2, cell) ) {
+		ERROR("Error with scaling.\n");
+		for ( j=0; j<n_foms; j++ ) fom_context_free(fctxs[j]);
+		return 1;
+	}
+
+	pairs = collect_pairs(list1, list2, cell, shells, single,
+	                      any_anomalous(foms, n_foms), sym, &n_pairs);
+	if ( pairs == NULL ) {
+		for ( j=0; j<n_foms; j++ ) fom_context_free(fctxs[j]);
+		return 1;
+	}
+
+	for ( j=0; j<n_foms; j++ ) {
+
+		long int n_rej = 0;
+
+		for ( i=0; i<n_pairs; i++ ) {
+			n_rej += add_pair_to_fom(fctxs[j], &pairs[i]);
+		}
+
+		if ( n_rej ) {
+			if ( foms[j] == FOM_SNR ) {
+				ERROR("WARNING: %li reflections had infinite "
+				      "or invalid values of I/sigma(I).\n",
+				      n_rej);
+			} else {
+				ERROR("WARNING: %li reflections rejected by "
+				      "add_to_fom\n", n_rej);
+			}
+		}
+
+		if ( foms[j] == FOM_COMPLETENESS ) {
+			calculate_possible(fctxs[j], shells, cell, sym);
+		}
+
+	}
+
+	cffree(pairs);
+	return 0;
+}
+
+
+/**
+ * \param list1: A %RefList
+ * \param list2: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param fom: The figure of merit to calculate
+ * \param noscale: Non-zero to disable scaline of reflection lists
+ * \param sym: The symmetry of \p list1 and \p list2.
+ *
+ * Calculates the specified figure of merit, comparing the two reflection lists.
+ *
+ * The \p cell and \p sym must match both reflection lists.  You should also have
+ * called fom_select_reflection_pairs() to pre-process the lists.
+ *
+ * If the figure of merit does not involve comparison (e.g. %FOM_SNR),
+ * then \p list1 will be used.  In this case, \p list2 and \p noscale will be
+ * ignored.  Use fom_select_reflections() instead of fom_select_reflection_pairs()
+ * in this case.
+ *
+ * \returns a %fom_context structure.  Use fom_shell_value() et al., to
+ *  extract the actual figure of merit values.
+ */
+struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell,
+                                  struct fom_shells *shells, enum fom_type fom,
+                                  int noscale, const SymOpList *sym)
+{
+	struct fom_context *fctx;
+
+	if ( fom_calculate_multi(list1, list2, cell, shells, &fom, 1,
+	                         noscale, sym, &fctx) ) return NULL;
+
 	return fctx;
 }
 
 
+static void reset_fom(struct fom_context *fctx)
+{
+	int i;
+
+	for ( i=0; i<fctx->nshells; i++ ) {
+		fctx->cts[i] = 0;
+		if ( fctx->num != NULL ) fctx->num[i] = 0.0;
+		if ( fctx->den != NULL ) fctx->den[i] = 0.0;
+		if ( fctx->num2 != NULL ) fctx->num2[i] = 0.0;
+		if ( fctx->den2 != NULL ) fctx->den2[i] = 0.0;
+		if ( fctx->n != NULL ) fctx->n[i] = 0;
+		if ( fctx->n_within != NULL ) fctx->n_within[i] = 0;
+		if ( fctx->n_meas != NULL ) fctx->n_meas[i] = 0;
+	}
+}
+
+
+struct fom_bootstrap
+{
+	int n_foms;
+	int nshells;
+	int n_samples;
+
+	/* Sorted values for each figure of merit, for each shell followed by
+	 * the overall value.  NaNs are left out. */
+	double **vals;
+	int *n_vals;
+};
+
+
+struct bootstrap_args
+{
+	const enum fom_type *foms;
+	int n_foms;
+	struct fom_shells *shells;
+	UnitCell *cell;
+	const SymOpList *sym;
+	long int nmax;
+
+	/* Indices of the pairs in each shell, for the normal and anomalous
+	 * figures of merit */
+	struct fom_pair *pairs;
+	long int *shell_start;
+	long int *shell_idx;
+	long int *anom_start;
+	long int *anom_idx;
+
+	unsigned long int seed;
+	int n_samples;
+	int next_sample;
+
+	/* One set of contexts and one random number generator per thread */
+	struct fom_context ***thread_fctxs;
+	gsl_rng **thread_rngs;
+
+	/* Results, [(fom*(nshells+1) + shell)*n_samples + sample] */
+	double *results;
+	int failed;
+};
+
+
+struct bootstrap_task
+{
+	struct bootstrap_args *args;
+	int sample;
+	int failed;
+};
+
+
+static void *bootstrap_get_task(void *vp)
+{
+	struct bootstrap_args *args = vp;
+	struct bootstrap_task *task;
+
+	if ( args->next_sample == args->n_samples ) return NULL;
+
+	task = cfmalloc(sizeof(struct bootstrap_task));
+	if ( task == NULL ) return NULL;
+
+	task->args = args;
+	task->sample = args->next_sample++;
+	task->failed = 0;
+	return task;
+}
+
+
+static int bootstrap_thread_setup(struct bootstrap_args *args, int cookie)
+{
+	struct fom_context **fctxs;
+	gsl_rng *rng;
+	int j;
+
+	fctxs = cfcalloc(args->n_foms, sizeof(struct fom_context *));
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	if ( (fctxs == NULL) || (rng == NULL) ) goto fail;
+
+	for ( j=0; j<args->n_foms; j++ ) {
+		fctxs[j] = init_fom(args->foms[j], args->nmax,
+		                    args->shells->nshells);
+		if ( fctxs[j] == NULL ) goto fail;
+		if ( (args->foms[j] == FOM_COMPLETENESS)
+		  && calculate_possible(fctxs[j], args->shells,
+		                        args->cell, args->sym) ) goto fail;
+	}
+
+	args->thread_fctxs[cookie] = fctxs;
+	args->thread_rngs[cookie] = rng;
+	return 0;
+
+fail:
+	if ( fctxs != NULL ) {
+		for ( j=0; j<args->n_foms; j++ ) fom_context_free(fctxs[j]);
+		cffree(fctxs);
+	}
+	if ( rng != NULL ) gsl_rng_free(rng);
+	return 1;
+}
+
+
+/* Draws each pair in the shell with replacement, as many times as there are
+ * pairs in the shell, and adds them to the figures of merit of one kind */
+static void resample_shell(struct bootstrap_args *args,
+                           struct fom_context **fctxs, gsl_rng *rng,
+                           const long int *start, const long int *idx,
+                           int shell, int anom)
+{
+	long int n = start[shell+1] - start[shell];
+	long int i;
+	int j;
+
+	for ( i=0; i<n; i++ ) {
+
+		struct fom_pair *p;
+
+		p = &args->pairs[idx[start[shell] + gsl_rng_uniform_int(rng, n)]];
+
+		for ( j=0; j<args->n_foms; j++ ) {
+			if ( fom_is_anomalous(args->foms[j]) != anom ) continue;
+			add_pair_to_fom(fctxs[j], p);
+		}
+	}
+}
+
+
+static void bootstrap_work(void *vp, int cookie)
+{
+	struct bootstrap_task *task = vp;
+	struct bootstrap_args *args = task->args;
+	struct fom_context **fctxs;
+	int nshells = args->shells->nshells;
+	int have_anom = any_anomalous(args->foms, args->n_foms);
+	int have_normal = 0;
+	gsl_rng *rng;
+	int i, j;
+
+	if ( args->thread_fctxs[cookie] == NULL ) {
+		if ( bootstrap_thread_setup(args, cookie) ) {
+			task->failed = 1;
+			return;
+		}
+	}
+	fctxs = args->thread_fctxs[cookie];
+
+	/* Each sample has its own seed, so that the results don't depend on
+	 * how the samples were shared out between the threads */
+	rng = args->thread_rngs[cookie];
+	gsl_rng_set(rng, args->seed + task->sample);
+
+	for ( j=0; j<args->n_foms; j++ ) {
+		reset_fom(fctxs[j]);
+		if ( !fom_is_anomalous(args->foms[j]) ) have_normal = 1;
+	}
+
+	for ( i=0; i<nshells; i++ ) {
+		if ( have_normal ) {
+			resample_shell(args, fctxs, rng, args->shell_start,
+			               args->shell_idx, i, 0);
+		}
+		if ( have_anom ) {
+			resample_shell(args, fctxs, rng, args->anom_start,
+			               args->anom_idx, i, 1);
+		}
+	}
+
+	for ( j=0; j<args->n_foms; j++ ) {
+		double *res = &args->results[j*(nshells+1)*args->n_samples];
+		for ( i=0; i<nshells; i++ ) {
+			res[i*args->n_samples + task->sample]
+			           = fom_shell_value(fctxs[j], i);
+		}
+		res[nshells*args->n_samples + task->sample]
+		           = fom_overall_value(fctxs[j]);
+	}
+}
+
+
+static void bootstrap_final(void *qargs, void *vp)
+{
+	struct bootstrap_args *args = qargs;
+	struct bootstrap_task *task = vp;
+
+	if ( task->failed ) args->failed = 1;
+	cffree(task);
+}
+
+
+/* Counting sort of the pairs by shell.  For the anomalous version, pairs
+ * which were already counted as Bijvoet partners are left out. */
+static int sort_pairs_by_shell(struct fom_pair *pairs, long int n_pairs,
+                               int nshells, int anom,
+                               long int **pstart, long int **pidx)
+{
+	long int *start;
+	long int *idx;
+	long int *pos;
+	long int i;
+	int s;
+
+	start = cfcalloc(nshells+1, sizeof(long int));
+	idx = cfmalloc((n_pairs+1)*sizeof(long int));
+	pos = cfmalloc(nshells*sizeof(long int));
+	if ( (start == NULL) || (idx == NULL) || (pos == NULL) ) {
+		cffree(start);
+		cffree(idx);
+		cffree(pos);
+		return 1;
+	}
+
+	for ( i=0; i<n_pairs; i++ ) {
+		if ( anom && pairs[i].bij_counted ) continue;
+		start[pairs[i].bin+1]++;
+	}
+	for ( s=0; s<nshells; s++ ) {
+		start[s+1] += start[s];
+		pos[s] = start[s];
+	}
+	for ( i=0; i<n_pairs; i++ ) {
+		if ( anom && pairs[i].bij_counted ) continue;
+		idx[pos[pairs[i].bin]++] = i;
+	}
+
+	cffree(pos);
+	*pstart = start;
+	*pidx = idx;
+	return 0;
+}
+
+
+static int compare_doubles(const void *av, const void *bv)
+{
+	double a = *(double *)av;
+	double b = *(double *)bv;
+	if ( a < b ) return -1;
+	if ( a > b ) return 1;
+	return 0;
+}
+
+
+/**
+ * \param list1: A %RefList
+ * \param list2: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param foms: The figures of merit to calculate
+ * \param n_foms: The number of figures of merit in \p foms
+ * \param sym: The symmetry of \p list1 and \p list2.
+ * \param n_samples: The number of bootstrap samples
+ * \param seed: Seed for the random number generator
+ * \param n_threads: The number of threads to use
+ *
+ * Estimates the spread of the figures of merit by resampling the reflections.
+ * Each sample draws the same number of reflections (or pairs of reflections)
+ * in each resolution shell as the original, with replacement, and calculates
+ * the figures of merit for that.  Use fom_bootstrap_shell_quantile() and
+ * fom_bootstrap_overall_quantile() to get confidence limits from the result.
+ *
+ * The lists should be prepared in the same way as for fom_calculate_multi().
+ * They will not be re-scaled, so you probably want to call this after
+ * fom_calculate_multi(), which scales the second list in place.
+ *
+ * For the same \p seed, the results do not depend on \p n_threads.
+ *
+ * \returns a %fom_bootstrap structure, or NULL on error.
+ */
+struct fom_bootstrap *fom_bootstrap(RefList *list1, RefList *list2,
+                                    UnitCell *cell, struct fom_shells *shells,
+                                    const enum fom_type *foms, int n_foms,
+                                    const SymOpList *sym, int n_samples,
+                                    unsigned long int seed, int n_threads)
+{
+	struct bootstrap_args args;
+	struct fom_bootstrap *b;
+	long int n_pairs;
+	int nshells = shells->nshells;
+	int single;
+	int i, j;
+
+	if ( (n_foms < 1) || (n_samples < 1) || (n_threads < 1) ) return NULL;
+
+	single = is_single_list(foms[0]);
+	for ( j=1; j<n_foms; j++ ) {
+		if ( is_single_list(foms[j]) != single ) {
+			ERROR("Can't mix comparative and single-list figures "
+			      "of merit in one calculation.\n");
+			return NULL;
+		}
+	}
+
+	args.foms = foms;
+	args.n_foms = n_foms;
+	args.shells = shells;
+	args.cell = cell;
+	args.sym = sym;
+	args.nmax = num_reflections(list1);
+	args.seed = seed;
+	args.n_samples = n_samples;
+	args.next_sample = 0;
+	args.failed = 0;
+	args.shell_start = NULL;
+	args.shell_idx = NULL;
+	args.anom_start = NULL;
+	args.anom_idx = NULL;
+
+	args.pairs = collect_pairs(list1, list2, cell, shells, single,
+	                           any_anomalous(foms, n_foms), sym, &n_pairs);
+	if ( args.pairs == NULL ) return NULL;
+
+	if ( sort_pairs_by_shell(args.pairs, n_pairs, nshells, 0,
+	                         &args.shell_start, &args.shell_idx)
+	  || sort_pairs_by_shell(args.pairs, n_pairs, nshells, 1,
+	                         &args.anom_start, &args.anom_idx) )
+	{
+		args.failed = 1;
+	}
+
+	args.thread_fctxs = cfcalloc(n_threads, sizeof(struct fom_context **));
+	args.thread_rngs = cfcalloc(n_threads, sizeof(gsl_rng *));
+	args.results = cfmalloc(n_foms*(nshells+1)*n_samples*sizeof(double));
+	if ( (args.thread_fctxs == NULL) || (args.thread_rngs == NULL)
+	  || (args.results == NULL) ) args.failed = 1;
+
+	if ( !args.failed ) {
+		run_threads(n_threads, bootstrap_work, bootstrap_get_task,
+		            bootstrap_final, &args, 0, 0, 0, 0);
+	}
+
+	for ( i=0; i<n_threads; i++ ) {
+		if ( (args.thread_fctxs != NULL)
+		  && (args.thread_fctxs[i] != NULL) )
+		{
+			for ( j=0; j<n_foms; j++ ) {
+				fom_context_free(args.thread_fctxs[i][j]);
+			}
+			cffree(args.thread_fctxs[i]);
+		}
+		if ( (args.thread_rngs != NULL)
+		  && (args.thread_rngs[i] != NULL) )
+		{
+			gsl_rng_free(args.thread_rngs[i]);
+		}
+	}
+	cffree(args.thread_fctxs);
+	cffree(args.thread_rngs);
+	cffree(args.pairs);
+	cffree(args.shell_start);
+	cffree(args.shell_idx);
+	cffree(args.anom_start);
+	cffree(args.anom_idx);
+
+	if ( args.failed ) {
+		ERROR("Bootstrap calculation failed.\n");
+		cffree(args.results);
+		return NULL;
+	}
+
+	b = cfmalloc(sizeof(struct fom_bootstrap));
+	if ( b == NULL ) {
+		cffree(args.results);
+		return NULL;
+	}
+	b->n_foms = n_foms;
+	b->nshells = nshells;
+	b->n_samples = n_samples;
+	b->vals = cfcalloc(n_foms*(nshells+1), sizeof(double *));
+	b->n_vals = cfcalloc(n_foms*(nshells+1), sizeof(int));
+	if ( (b->vals == NULL) || (b->n_vals == NULL) ) {
+		cffree(b->vals);
+		cffree(b->n_vals);
+		cffree(b);
+		cffree(args.results);
+		return NULL;
+	}
+
+	for ( i=0; i<n_foms*(nshells+1); i++ ) {
+
+		double *res = &args.results[i*n_samples];
+		int n = 0;
+		int k;
+
+		for ( k=0; k<n_samples; k++ ) {
+			if ( isnan(res[k]) ) continue;
+			res[n++] = res[k];
+		}
+		qsort(res, n, sizeof(double), compare_doubles);
+
+		b->vals[i] = cfmalloc((n+1)*sizeof(double));
+		if ( b->vals[i] == NULL ) {
+			fom_bootstrap_free(b);
+			cffree(args.results);
+			return NULL;
+		}
+		memcpy(b->vals[i], res, n*sizeof(double));
+		b->n_vals[i] = n;
+
+	}
+
+	cffree(args.results);
+	return b;
+}
+
+
+static double bootstrap_quantile(struct fom_bootstrap *b, int i, double q)
+{
+	if ( b->n_vals[i] == 0 ) return NAN;
+	return gsl_stats_quantile_from_sorted_data(b->vals[i], 1,
+	                                           b->n_vals[i], q);
+}
+
+
+/**
+ * \param b: A %fom_bootstrap structure
+ * \param fom: Index of the figure of merit, in the list given to fom_bootstrap()
+ * \param shell: The shell number
+ * \param q: The quantile, between 0 and 1
+ *
+ * For example, a 95% confidence interval is given by the quantiles 0.025
+ * and 0.975.  Samples for which the figure of merit could not be calculated
+ * are ignored.
+ *
+ * \returns the quantile of the bootstrap distribution of the figure of merit
+ * in the shell, or NaN if there were no valid samples.
+ */
+double fom_bootstrap_shell_quantile(struct fom_bootstrap *b, int fom, int shell,
+                                    double q)
+{
+	return bootstrap_quantile(b, fom*(b->nshells+1) + shell, q);
+}
+
+
+/**
+ * \param b: A %fom_bootstrap structure
+ * \param fom: Index of the figure of merit, in the list given to fom_bootstrap()
+ * \param q: The quantile, between 0 and 1
+ *
+ * \returns the quantile of the bootstrap distribution of the overall figure of
+ * merit, or NaN if there were no valid samples.
+ */
+double fom_bootstrap_overall_quantile(struct fom_bootstrap *b, int fom, double q)
+{
+	return bootstrap_quantile(b, fom*(b->nshells+1) + b->nshells, q);
+}
+
+
+/**
+ * \param b: A %fom_bootstrap structure
+ *
+ * Frees a %fom_bootstrap structure returned by fom_bootstrap().
+ */
+void fom_bootstrap_free(struct fom_bootstrap *b)
+{
+	int i;
+
+	if ( b == NULL ) return;
+
+	for ( i=0; i<b->n_foms*(b->nshells+1); i++ ) {
+		cffree(b->vals[i]);
+	}
+	cffree(b->vals);
+	cffree(b->n_vals);
+	cffree(b);
+}
+
+
 /**
  * \param list1: The first input %RefList
  * \param list2: The second input %RefList
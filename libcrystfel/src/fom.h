@@ -86,6 +86,7 @@ struct fom_shells
 };
 
 struct fom_context;
+struct fom_bootstrap;
 
 extern struct fom_rejections fom_select_reflection_pairs(RefList *list1,
                                                          RefList *list2,
@@ -119,6 +120,14 @@ extern struct fom_context *fom_calculate(RefList *list1, RefList *list2,
                                          enum fom_type fom, int noscale,
                                          const SymOpList *sym);
 
+extern int fom_calculate_multi(RefList *list1, RefList *list2, UnitCell *cell,
+                               struct fom_shells *shells,
+                               const enum fom_type *foms, int n_foms,
+                               int noscale, const SymOpList *sym,
+                               struct fom_context **fctxs);
+
+extern void fom_context_free(struct fom_context *fctx);
+
 extern struct fom_shells *fom_make_resolution_shells(double rmin, double rmax,
                                                      int nshells);
 
@@ -133,6 +142,20 @@ extern int fom_shell_num_reflections(struct fom_context *fctx, int i);
 extern int fom_overall_num_possible(struct fom_context *fctx);
 extern int fom_shell_num_possible(struct fom_context *fctx, int i);
 
+extern struct fom_bootstrap *fom_bootstrap(RefList *list1, RefList *list2,
+                                           UnitCell *cell,
+                                           struct fom_shells *shells,
+                                           const enum fom_type *foms,
+                                           int n_foms, const SymOpList *sym,
+                                           int n_samples,
+                                           unsigned long int seed,
+                                           int n_threads);
+extern double fom_bootstrap_shell_quantile(struct fom_bootstrap *b, int fom,
+                                           int shell, double q);
+extern double fom_bootstrap_overall_quantile(struct fom_bootstrap *b, int fom,
+                                             double q);
+extern void fom_bootstrap_free(struct fom_bootstrap *b);
+
 extern int fom_is_anomalous(enum fom_type f);
 extern int fom_is_comparison(enum fom_type f);
 
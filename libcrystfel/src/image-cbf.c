@@ -32,6 +32,8 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifdef HAVE_ZLIB
@@ -45,66 +47,143 @@
 #include "datatemplate.h"
 #include "datatemplate_priv.h"
 
-static void add_out(float val, float *data_out, int nmemb_out,
-                    int *outpos, int *nrej)
+/* Byte offset decompression state, carried across chunks of input when the
+ * data is being decoded as it arrives */
+struct byte_offset_state
 {
-	if ( *outpos < nmemb_out ) {
-		data_out[(*outpos)++] = val;
-	} else {
-		(*nrej)++;
-	}
+	int64_t val;
+	long int outpos;
+	long int nrej;
+};
+
+
+static int64_t read_le16(const int8_t *p)
+{
+	const uint8_t *u = (const uint8_t *)p;
+	return (int16_t)(u[0] | (u[1] << 8));
 }
 
 
-/* Reverses byte offset compression and converts to single precision float.
- * Note that this compression scheme specifies the data format of the input
- * data, therefore the X-Binary-Element-Type is completely ignored. */
-static void decode_cbf_byte_offset(float *data_out, int nmemb_out,
-                                   const int8_t *data_in, const size_t n)
+static int64_t read_le32(const int8_t *p)
 {
-	int inpos = 0;
-	int outpos = 0;
-	int nrej = 0;
-	float val = 0.0;
+	const uint8_t *u = (const uint8_t *)p;
+	return (int32_t)((uint32_t)u[0] | ((uint32_t)u[1] << 8)
+	               | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24));
+}
 
-	while ( inpos < n ) {
 
-		int64_t delta = data_in[inpos++];
+static int64_t read_le64(const int8_t *p)
+{
+	const uint8_t *u = (const uint8_t *)p;
+	uint64_t v = 0;
+	int i;
+	for ( i=7; i>=0; i-- ) v = (v << 8) | u[i];
+	return (int64_t)v;
+}
 
-		if ( (delta >= -127) && (delta <= 127) ) {
-			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
-			continue;
-		}
 
-		delta = *(int16_t *)(data_in+inpos);
-		inpos += 2;
+/* Decodes one (possibly escaped) delta from the start of 'data_in'.
+ * Returns the number of bytes used, or zero if the element is not complete
+ * within the 'n' bytes available. */
+static int decode_one_delta(const int8_t *data_in, size_t n, int64_t *delta)
+{
+	if ( n < 1 ) return 0;
+	if ( data_in[0] != -128 ) {
+		*delta = data_in[0];
+		return 1;
+	}
 
-		if ( (delta >= -32767) && (delta <= 32767) ) {
-			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
-			continue;
-		}
+	if ( n < 3 ) return 0;
+	*delta = read_le16(data_in+1);
+	if ( *delta != INT16_MIN ) return 3;
+
+	if ( n < 7 ) return 0;
+	*delta = read_le32(data_in+3);
+	if ( *delta != INT32_MIN ) return 7;
+
+	if ( n < 15 ) return 0;
+	*delta = read_le64(data_in+7);
+	return 15;
+}
+
+
+/* Non-zero if any of the eight bytes in 'w' is the escape value 0x80 */
+static int has_escape(uint64_t w)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t x = w ^ highs;  /* Escape bytes become zero */
+	return ((x - ones) & ~x & highs) != 0;
+}
 
-		delta = *(int32_t *)(data_in+inpos);
-		inpos += 4;
 
-		if ( (delta >= -2147483647) && (delta <= 2147483647) ) {
-			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
+/* Reverses byte offset compression and converts to single precision float.
+ * Note that this compression scheme specifies the data format of the input
+ * data, therefore the X-Binary-Element-Type is completely ignored.
+ *
+ * Returns the number of bytes of input used.  This will be less than 'n' if
+ * the last element is cut off, in which case the remaining bytes should be
+ * passed again, followed by the rest of the data. */
+static size_t decode_cbf_byte_offset(struct byte_offset_state *st,
+                                     float *data_out, long int nmemb_out,
+                                     const int8_t *data_in, const size_t n)
+{
+	size_t inpos = 0;
+	long int outpos = st->outpos;
+	int64_t val = st->val;
+
+	/* Fast path: almost all deltas fit in one byte, so look at eight
+	 * bytes at once and only drop to the general case if any of them
+	 * is an escape */
+	while ( (inpos+8 <= n) && (outpos+8 <= nmemb_out) ) {
+
+		uint64_t w;
+		int64_t delta;
+		int k;
+
+		memcpy(&w, data_in+inpos, 8);
+		if ( !has_escape(w) ) {
+			const int8_t *in = data_in+inpos;
+			float *out = data_out+outpos;
+			for ( k=0; k<8; k++ ) {
+				val += in[k];
+				out[k] = val;
+			}
+			inpos += 8;
+			outpos += 8;
 			continue;
 		}
 
-		delta = *(int64_t *)(data_in+inpos);
-		inpos += 8;
+		k = decode_one_delta(data_in+inpos, n-inpos, &delta);
+		if ( k == 0 ) break;
+		inpos += k;
 		val += delta;
-		add_out(val, data_out, nmemb_out, &outpos, &nrej);
+		data_out[outpos++] = val;
 
 	}
 
-	if ( nrej > 0 ) {
-		STATUS("%i elements rejected\n", nrej);
+	/* Remainder, one element at a time */
+	while ( inpos < n ) {
+
+		int64_t delta;
+		int k;
+
+		k = decode_one_delta(data_in+inpos, n-inpos, &delta);
+		if ( k == 0 ) break;
+		inpos += k;
+		val += delta;
+
+		if ( outpos < nmemb_out ) {
+			data_out[outpos++] = val;
+		} else {
+			st->nrej++;
+		}
+
 	}
+
+	st->outpos = outpos;
+	st->val = val;
+	return inpos;
 }
 
 
@@ -263,77 +342,216 @@ static int convert_type(float *data_out, long nmemb_exp,
 }
 
 
-static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
+#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
+#define CBF_USE_ZLIB
+#endif
+
+/* Size of chunks in which byte offset data is read and decoded */
+#define CBF_CHUNK_SIZE (256*1024)
+
+
+/* A CBF file, either plain or gzipped.  The gzipped file is inflated as it is
+ * read, rather than all at once up front. */
+struct cbf_source
 {
 	FILE *fh;
-	char *buf = NULL;
-	char *rval;
-	size_t data_compressed_len = 0;
-	float *data_out = NULL;
-	enum cbf_data_conversion data_conversion = CBF_NO_CONVERSION;
-	enum cbf_data_type data_type = CBF_ELEMENT_U32;  /* ITG (2006) 2.3.3.3 */
-	int in_binary_section = 0;
+#ifdef CBF_USE_ZLIB
+	gzFile gzfh;
+#endif
+};
 
-	*w = 0;
-	*h = 0;
 
-	if ( !gz ) {
+static int cbf_source_open(struct cbf_source *src, const char *filename,
+                           int gz)
+{
+	src->fh = NULL;
+#ifdef CBF_USE_ZLIB
+	src->gzfh = NULL;
+#endif
 
-		fh = fopen(filename, "rb");
-		if ( fh == NULL ) {
+	if ( !gz ) {
+		src->fh = fopen(filename, "rb");
+		if ( src->fh == NULL ) {
 			ERROR("Failed to open '%s'\n", filename);
-			return NULL;
+			return 1;
 		}
+		return 0;
+	}
 
-	} else {
+#ifdef CBF_USE_ZLIB
+	src->gzfh = gzopen(filename, "rb");
+	if ( src->gzfh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+	#ifdef HAVE_GZBUFFER
+	/* Set larger buffer size for hopefully faster uncompression */
+	gzbuffer(src->gzfh, 128*1024);
+	#endif
+	return 0;
+#else
+	ERROR("Can't read gzipped CBF without zlib\n");
+	return 1;
+#endif
+}
 
-		#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
-		gzFile gzfh;
-		int len_read;
-		size_t len;
-		const size_t bufinc = 8*1024*1024;  /* Allocate buffer in 8Mb chunks */
-		size_t bufsz = bufinc;
 
-		gzfh = gzopen(filename, "rb");
-		if ( gzfh == NULL ) return NULL;
+static void cbf_source_close(struct cbf_source *src)
+{
+	if ( src->fh != NULL ) fclose(src->fh);
+#ifdef CBF_USE_ZLIB
+	if ( src->gzfh != NULL ) gzclose(src->gzfh);
+#endif
+}
 
-		#ifdef HAVE_GZBUFFER
-		/* Set larger buffer size for hopefully faster uncompression */
-		gzbuffer(gzfh, 128*1024);
-		#endif
 
-		buf = cfmalloc(bufsz);
-		if ( buf == NULL ) return NULL;
+static char *cbf_source_gets(struct cbf_source *src, char *line, int len)
+{
+#ifdef CBF_USE_ZLIB
+	if ( src->gzfh != NULL ) return gzgets(src->gzfh, line, len);
+#endif
+	return fgets(line, len, src->fh);
+}
 
-		len = 0;
-		do {
 
-			len_read = gzread(gzfh, buf+len, bufinc);
-			if ( len_read == -1 ) return NULL;
-			len += len_read;
+static long cbf_source_tell(struct cbf_source *src)
+{
+#ifdef CBF_USE_ZLIB
+	if ( src->gzfh != NULL ) return gztell(src->gzfh);
+#endif
+	return ftell(src->fh);
+}
 
-			if ( len_read == bufinc ) {
-				bufsz += bufinc;
-				buf = srealloc(buf, bufsz);
-				if ( buf == NULL ) return NULL;
-			}
 
-		} while ( len_read == bufinc );
+static int cbf_source_seek(struct cbf_source *src, long pos)
+{
+#ifdef CBF_USE_ZLIB
+	/* Seeking backwards makes zlib start again from the beginning, but
+	 * this is only ever used to step back over the last header line. */
+	if ( src->gzfh != NULL ) {
+		return gzseek(src->gzfh, pos, SEEK_SET) != pos;
+	}
+#endif
+	return fseek(src->fh, pos, SEEK_SET);
+}
+
 
-		fh = fmemopen(buf, len, "rb");
-		if ( fh == NULL ) {
-			cffree(buf);
-			return NULL;
+static size_t cbf_source_read(struct cbf_source *src, void *buf, size_t len)
+{
+#ifdef CBF_USE_ZLIB
+	if ( src->gzfh != NULL ) {
+		int r = gzread(src->gzfh, buf, len);
+		if ( r < 0 ) return 0;
+		return r;
+	}
+#endif
+	return fread(buf, 1, len, src->fh);
+}
+
+
+/* Reads and decodes byte offset data in chunks, so that each part of the data
+ * is decoded while it is still in cache, straight after being read (and
+ * inflated, if the file is gzipped). */
+static int read_byte_offset(struct cbf_source *src, size_t data_compressed_len,
+                            float *data_out, long int nmemb_out)
+{
+	struct byte_offset_state st;
+	int8_t *chunk;
+	size_t remaining = data_compressed_len;
+	size_t n_have = 0;
+
+	chunk = cfmalloc(CBF_CHUNK_SIZE);
+	if ( chunk == NULL ) {
+		ERROR("Failed to allocate memory for CBF data\n");
+		return 1;
+	}
+
+	st.val = 0;
+	st.outpos = 0;
+	st.nrej = 0;
+
+	while ( remaining > 0 ) {
+
+		size_t to_read, len_read, used;
+
+		/* n_have is at most one incomplete element (<15 bytes) */
+		to_read = CBF_CHUNK_SIZE - n_have;
+		if ( to_read > remaining ) to_read = remaining;
+
+		len_read = cbf_source_read(src, chunk+n_have, to_read);
+		if ( len_read < to_read ) {
+			ERROR("Couldn't read entire CBF data\n");
+			cffree(chunk);
+			return 1;
 		}
+		remaining -= len_read;
+		n_have += len_read;
+
+		used = decode_cbf_byte_offset(&st, data_out, nmemb_out,
+		                              chunk, n_have);
+		memmove(chunk, chunk+used, n_have-used);
+		n_have -= used;
 
-		gzclose(gzfh);
+	}
+
+	cffree(chunk);
 
-		#else
-		return NULL;
-		#endif
+	if ( n_have > 0 ) {
+		STATUS("CBF byte offset data ends part-way through an "
+		       "element\n");
+	}
 
+	if ( st.nrej > 0 ) {
+		STATUS("%li elements rejected\n", st.nrej);
 	}
 
+	return 0;
+}
+
+
+static int read_uncompressed(struct cbf_source *src,
+                             size_t data_compressed_len,
+                             enum cbf_data_type data_type,
+                             float *data_out, int nmemb_out)
+{
+	void *data_compressed;
+	size_t len_read;
+	int r;
+
+	data_compressed = cfmalloc(data_compressed_len);
+	if ( data_compressed == NULL ) {
+		ERROR("Failed to allocate memory for CBF data\n");
+		return 1;
+	}
+
+	len_read = cbf_source_read(src, data_compressed, data_compressed_len);
+	if ( len_read < data_compressed_len ) {
+		ERROR("Couldn't read entire CBF data\n");
+		cffree(data_compressed);
+		return 1;
+	}
+
+	r = convert_type(data_out, nmemb_out, data_type,
+	                 data_compressed, data_compressed_len);
+	cffree(data_compressed);
+	return r;
+}
+
+
+static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
+{
+	struct cbf_source src;
+	char *rval;
+	size_t data_compressed_len = 0;
+	enum cbf_data_conversion data_conversion = CBF_NO_CONVERSION;
+	enum cbf_data_type data_type = CBF_ELEMENT_U32;  /* ITG (2006) 2.3.3.3 */
+	int in_binary_section = 0;
+
+	*w = 0;
+	*h = 0;
+
+	if ( cbf_source_open(&src, filename, gz) ) return NULL;
+
 	/* This is really horrible, but there are at least three different types
 	 * of header mingled together (CIF, MIME, DECTRIS), so a real parser
 	 * would be very complicated and much more likely to have weird bugs. */
@@ -342,8 +560,8 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 		char line[1024];
 		long line_start;
 
-		line_start = ftell(fh);
-		rval = fgets(line, 1023, fh);
+		line_start = cbf_source_tell(&src);
+		rval = cbf_source_gets(&src, line, 1023);
 		if ( rval == NULL ) break;
 		chomp(line);
 
@@ -365,8 +583,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				const char *elbo = line+29;
 				if ( strcmp(elbo, "LITTLE_ENDIAN") != 0 ) {
 					ERROR("Unsupported endianness: %s\n", elbo);
-					cffree(buf);
-					fclose(fh);
+					cbf_source_close(&src);
 					return NULL;
 				}
 			}
@@ -380,8 +597,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				data_conversion = CBF_PACKED;
 			} else if ( strstr(line, "conversions=") != NULL ) {
 				ERROR("Unrecognised CBF content conversion: %s\n", line);
-				cffree(buf);
-				fclose(fh);
+				cbf_source_close(&src);
 				return NULL;
 			}
 
@@ -393,8 +609,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				if ( data_type == CBF_NO_TYPE ) {
 					ERROR("Unrecognised element type: %s\n",
 					      eltype);
-					cffree(buf);
-					fclose(fh);
+					cbf_source_close(&src);
 					return NULL;
 				}
 			}
@@ -411,47 +626,31 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 
 		if ( in_binary_section && binary_start(line) ) {
 
-			size_t len_read;
 			int nmemb_exp;
-			void *data_compressed;
+			float *data_out;
 			int r = 0;
 
 			if ( data_compressed_len == 0 ) {
 				ERROR("Found CBF data before X-Binary-Size!\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_source_close(&src);
 				return NULL;
 			}
 
 			if ( (*w == 0) || (*h == 0) ) {
 				ERROR("Found CBF data before dimensions!\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_source_close(&src);
 				return NULL;
 			}
 
 			if ( data_compressed_len > 100*1024*1024 ) {
 				ERROR("Stated CBF data size too big\n");
-				cffree(buf);
-				fclose(fh);
-				return NULL;
-			}
-
-			data_compressed = cfmalloc(data_compressed_len);
-			if ( data_compressed == NULL ) {
-				ERROR("Failed to allocate memory for CBF data\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_source_close(&src);
 				return NULL;
 			}
 
-			fseek(fh, line_start+4, SEEK_SET);
-			len_read = fread(data_compressed, 1, data_compressed_len, fh);
-			if ( len_read < data_compressed_len ) {
-				ERROR("Couldn't read entire CBF data\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
+			if ( cbf_source_seek(&src, line_start+4) ) {
+				ERROR("Failed to find start of CBF data\n");
+				cbf_source_close(&src);
 				return NULL;
 			}
 
@@ -459,48 +658,39 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 			data_out = cfmalloc(nmemb_exp*sizeof(float));
 			if ( data_out == NULL ) {
 				ERROR("Failed to allocate memory for CBF data\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
+				cbf_source_close(&src);
 				return NULL;
 			}
 
 			switch ( data_conversion ) {
 
 				case CBF_NO_CONVERSION:
-				r = convert_type(data_out, nmemb_exp, data_type,
-				                 data_compressed,
-				                 data_compressed_len);
+				r = read_uncompressed(&src, data_compressed_len,
+				                      data_type, data_out,
+				                      nmemb_exp);
 				break;
 
 				case CBF_BYTE_OFFSET:
-				decode_cbf_byte_offset(data_out, nmemb_exp,
-				                       data_compressed,
-				                       data_compressed_len);
+				r = read_byte_offset(&src, data_compressed_len,
+				                     data_out, nmemb_exp);
 				break;
 
 				case CBF_PACKED:
 				case CBF_CANONICAL:
 				ERROR("Don't yet know how to decompress "
 				      "CBF_PACKED or CBF_CANONICAL\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
-				return NULL;
+				r = 1;
+				break;
 
 			}
 
-			cffree(data_compressed);
+			cbf_source_close(&src);
 
 			if ( r ) {
-				cffree(buf);
 				cffree(data_out);
-				fclose(fh);
 				return NULL;
 			}
 
-			cffree(buf);
-			fclose(fh);
 			return data_out;
 
 		}
@@ -508,7 +698,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 	} while ( rval != NULL );
 
 	ERROR("Reached end of CBF file before finding data.\n");
-	cffree(buf);  /* might be NULL */
+	cbf_source_close(&src);
 	return NULL;
 }
 
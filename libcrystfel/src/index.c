@@ -41,6 +41,8 @@
 #include <assert.h>
 #include <fenv.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "image.h"
 #include "utils.h"
@@ -80,6 +82,11 @@ struct _indexingprivate
 	int n_methods;
 	IndexingMethod *methods;
 	void **engine_private;
+
+	/* Number of threads for running the methods concurrently ("racing"),
+	 * or 1 to try them one after the other */
+	int race_threads;
+	double race_deadline;
 };
 
 
@@ -431,6 +438,8 @@ IndexingPrivate *setup_indexing(const char *method_list,
 	ipriv->wavelength_estimate = wavelength_estimate;
 	ipriv->clen_estimate = clen_estimate;
 	ipriv->n_threads = n_threads;
+	ipriv->race_threads = 1;
+	ipriv->race_deadline = -1.0;
 
 	if ( cell != NULL ) {
 		ipriv->target_cell = cell_new_from_cell(cell);
@@ -467,6 +476,50 @@ void print_indexing_info(IndexingPrivate *ipriv)
 	       onoff(ipriv->flags & INDEXING_MULTI));
 	STATUS("                              Retry indexing: %s\n",
 	       onoff(ipriv->flags & INDEXING_RETRY));
+	if ( ipriv->race_threads > 1 ) {
+		if ( ipriv->race_deadline < 0.0 ) {
+			STATUS("                       Race indexing methods: "
+			       "%i threads\n", ipriv->race_threads);
+		} else {
+			STATUS("                       Race indexing methods: "
+			       "%i threads, deadline %.3f s\n",
+			       ipriv->race_threads, ipriv->race_deadline);
+		}
+	} else {
+		STATUS("                       Race indexing methods: off\n");
+	}
+}
+
+
+/**
+ * \param ipriv An \ref IndexingPrivate structure
+ * \param n_threads Maximum number of threads to use for each frame
+ * \param deadline Maximum time to wait for higher-priority methods, in seconds
+ *
+ * Sets up "racing" of the indexing methods: instead of trying each method in
+ * turn, up to \p n_threads of them are run at the same time for each frame.
+ * The methods are started in priority order, and the result from the
+ * highest-priority method which succeeds is kept.  Lower-priority methods are
+ * cancelled as soon as a higher-priority one succeeds.
+ *
+ * If \p deadline is negative, the methods with higher priority than a
+ * successful one are always allowed to finish, so the results are the same
+ * as when trying the methods in turn.  Otherwise, they are cancelled once
+ * \p deadline seconds have passed since the first success, and the best result
+ * so far is kept.  A deadline of zero keeps the first successful result.
+ *
+ * Cancellation happens between indexing attempts, so a method which is already
+ * running carries on until its current attempt is finished.
+ *
+ * Racing is not used when writing Millepede data, or when the first method is
+ * "file".  The indexing engines must not be used from any other thread while
+ * a frame is being indexed.
+ */
+void indexing_set_race(IndexingPrivate *ipriv, int n_threads, double deadline)
+{
+	if ( n_threads < 1 ) n_threads = 1;
+	ipriv->race_threads = n_threads;
+	ipriv->race_deadline = deadline;
 }
 
 
@@ -954,43 +1007,14 @@ void index_pattern_3(struct image *image, IndexingPrivate *ipriv, int *ping,
 }
 
 
-void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
-                     char *last_task, Mille *mille, int max_mille_level)
+/* Try each method in turn, stopping at the first one which works.  Returns
+ * the index of the successful method, or n_methods if none worked */
+static int try_methods_in_turn(struct image *image, IndexingPrivate *ipriv,
+                               Mille *mille, int max_mille_level)
 {
 	int n = 0;
 	ImageFeatureList *orig;
 
-	if ( ipriv == NULL ) return;
-
-	free_all_crystals(image);
-
-	/* No peaks? */
-	if ( image->features == NULL ) return;
-	if ( image_feature_count(image->features) == 0 ) return;
-
-	if ( !isnan(ipriv->wavelength_estimate) ) {
-		if ( !within_tolerance(image->lambda,
-		                          ipriv->wavelength_estimate,
-		                          10.0) )
-		{
-			   ERROR("WARNING: Wavelength for %s %s (%e) differs by "
-			         "more than 10%% from estimated value (%e)\n",
-			         image->filename, image->ev,
-			         image->lambda, ipriv->wavelength_estimate);
-		}
-	}
-
-	if ( !isnan(ipriv->clen_estimate) ) {
-		double mean_clen = detgeom_mean_camera_length(image->detgeom);
-		if ( !within_tolerance(mean_clen, ipriv->clen_estimate, 10.0) )
-		{
-			   ERROR("WARNING: Camera length for %s %s (%e) differs by "
-			         "more than 10%% from estimated value (%e)\n",
-			         image->filename, image->ev,
-			         mean_clen, ipriv->clen_estimate);
-		}
-	}
-
 	orig = image->features;
 
 	for ( n=0; n<ipriv->n_methods; n++ ) {
@@ -1032,13 +1056,264 @@ void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
 
 	}
 
+	image->features = orig;
+
+	return n;
+}
+
+
+struct race_entry
+{
+	/* Shallow copy of the image, with its own peak list and crystals */
+	struct image image;
+	int success;
+	int ntry;
+};
+
+
+struct race
+{
+	IndexingPrivate *ipriv;
+	ImageFeatureList *orig;
+	struct race_entry *entries;
+
+	pthread_mutex_t lock;
+	int next;              /* Next method to start */
+	int best;              /* Best successful method so far, or n_methods */
+	double first_success;  /* Time of first success */
+};
+
+
+static double race_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+/* Called with lock held.  Returns true if method n should give up */
+static int race_cancelled(struct race *race, int n)
+{
+	IndexingPrivate *ipriv = race->ipriv;
+
+	/* Once a method has succeeded, it gets to finish (e.g. to look for
+	 * more crystals) */
+	if ( race->entries[n].success ) return 0;
+
+	/* Beaten by a higher-priority method? */
+	if ( race->best < n ) return 1;
+
+	/* Out of time waiting for this method to beat the one which worked? */
+	if ( (race->best < ipriv->n_methods)
+	  && (ipriv->race_deadline >= 0.0)
+	  && (race_time() - race->first_success > ipriv->race_deadline) )
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static void race_method(struct race *race, int n)
+{
+	IndexingPrivate *ipriv = race->ipriv;
+	struct race_entry *e = &race->entries[n];
+	int done = 0;
+
+	e->image.features = sort_peaks(race->orig);
+
+	do {
+
+		int r;
+		int cancelled;
+
+		pthread_mutex_lock(&race->lock);
+		cancelled = race_cancelled(race, n);
+		pthread_mutex_unlock(&race->lock);
+		if ( cancelled ) break;
+
+		/* Never any Millepede data here, see index_pattern_4() */
+		r = try_indexer(&e->image, ipriv->methods[n],
+		                ipriv, ipriv->engine_private[n], NULL, 0);
+		e->ntry++;
+
+		if ( r && !e->success ) {
+			pthread_mutex_lock(&race->lock);
+			if ( race->best == ipriv->n_methods ) {
+				race->first_success = race_time();
+			}
+			if ( n < race->best ) race->best = n;
+			pthread_mutex_unlock(&race->lock);
+		}
+		e->success += r;
+
+		done = finished_retry(ipriv->methods[n], ipriv->flags,
+		                      r, &e->image);
+		if ( e->ntry > 5 ) done = 1;
+		if ( notify_alive() ) done = 1;
+
+	} while ( !done );
+
+	image_feature_list_free(e->image.features);
+	e->image.features = NULL;
+}
+
+
+static void *race_thread(void *vp)
+{
+	struct race *race = vp;
+
+	while ( 1 ) {
+
+		int n;
+
+		pthread_mutex_lock(&race->lock);
+		n = race->next;
+
+		/* The methods are started in priority order, so if this one
+		 * can't win, none of the remaining ones can either */
+		if ( (n >= race->ipriv->n_methods) || (race->best < n) ) {
+			pthread_mutex_unlock(&race->lock);
+			break;
+		}
+		race->next++;
+		pthread_mutex_unlock(&race->lock);
+
+		race_method(race, n);
+
+	}
+
+	return NULL;
+}
+
+
+/* Run the methods concurrently, see indexing_set_race().  Returns the index
+ * of the method whose results were kept, or n_methods if none worked */
+static int race_methods(struct image *image, IndexingPrivate *ipriv)
+{
+	struct race race;
+	pthread_t *threads;
+	int n_threads;
+	int i, n;
+
+	race.entries = cfmalloc(ipriv->n_methods*sizeof(struct race_entry));
+	if ( race.entries == NULL ) return try_methods_in_turn(image, ipriv,
+	                                                       NULL, 0);
+
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+		race.entries[i].image = *image;
+		race.entries[i].image.crystals = NULL;
+		race.entries[i].image.n_crystals = 0;
+		race.entries[i].image.features = NULL;
+		race.entries[i].success = 0;
+		race.entries[i].ntry = 0;
+	}
+
+	race.ipriv = ipriv;
+	race.orig = image->features;
+	race.next = 0;
+	race.best = ipriv->n_methods;
+	race.first_success = 0.0;
+	pthread_mutex_init(&race.lock, NULL);
+
+	n_threads = ipriv->race_threads;
+	if ( n_threads > ipriv->n_methods ) n_threads = ipriv->n_methods;
+
+	/* This thread takes part as well */
+	threads = cfmalloc(n_threads*sizeof(pthread_t));
+	if ( threads == NULL ) {
+		pthread_mutex_destroy(&race.lock);
+		cffree(race.entries);
+		return try_methods_in_turn(image, ipriv, NULL, 0);
+	}
+	for ( i=1; i<n_threads; i++ ) {
+		if ( pthread_create(&threads[i], NULL, race_thread, &race) ) {
+			ERROR("Failed to start indexing thread\n");
+			n_threads = i;
+			break;
+		}
+	}
+	race_thread(&race);
+	for ( i=1; i<n_threads; i++ ) {
+		pthread_join(threads[i], NULL);
+	}
+	cffree(threads);
+	pthread_mutex_destroy(&race.lock);
+
+	/* Keep the crystals from the winner, throw away the rest */
+	n = race.best;
+	if ( n < ipriv->n_methods ) {
+		image->crystals = race.entries[n].image.crystals;
+		image->n_crystals = race.entries[n].image.n_crystals;
+		image->n_indexing_tries = race.entries[n].ntry;
+		race.entries[n].image.crystals = NULL;
+		race.entries[n].image.n_crystals = 0;
+	}
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+		free_all_crystals(&race.entries[i].image);
+	}
+	cffree(race.entries);
+
+	return n;
+}
+
+
+void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
+                     char *last_task, Mille *mille, int max_mille_level)
+{
+	int n;
+
+	if ( ipriv == NULL ) return;
+
+	free_all_crystals(image);
+
+	/* No peaks? */
+	if ( image->features == NULL ) return;
+	if ( image_feature_count(image->features) == 0 ) return;
+
+	if ( !isnan(ipriv->wavelength_estimate) ) {
+		if ( !within_tolerance(image->lambda,
+		                          ipriv->wavelength_estimate,
+		                          10.0) )
+		{
+			   ERROR("WARNING: Wavelength for %s %s (%e) differs by "
+			         "more than 10%% from estimated value (%e)\n",
+			         image->filename, image->ev,
+			         image->lambda, ipriv->wavelength_estimate);
+		}
+	}
+
+	if ( !isnan(ipriv->clen_estimate) ) {
+		double mean_clen = detgeom_mean_camera_length(image->detgeom);
+		if ( !within_tolerance(mean_clen, ipriv->clen_estimate, 10.0) )
+		{
+			   ERROR("WARNING: Camera length for %s %s (%e) differs by "
+			         "more than 10%% from estimated value (%e)\n",
+			         image->filename, image->ev,
+			         mean_clen, ipriv->clen_estimate);
+		}
+	}
+
+	/* Millepede records are written as soon as a crystal passes the
+	 * checks, which would include ones from methods which later lose the
+	 * race.  The "file" method works on the original peak list. */
+	if ( (ipriv->race_threads > 1)
+	  && (ipriv->n_methods > 1)
+	  && (mille == NULL)
+	  && (ipriv->methods[0] != INDEXING_FILE) )
+	{
+		n = race_methods(image, ipriv);
+	} else {
+		n = try_methods_in_turn(image, ipriv, mille, max_mille_level);
+	}
+
 	if ( n < ipriv->n_methods ) {
 		image->indexed_by = ipriv->methods[n];
 	} else {
 		image->indexed_by = INDEXING_NONE;
 	}
-
-	image->features = orig;
 }
 
 
@@ -144,6 +144,7 @@ typedef enum {
 
 struct asdf_options {
 	int fast_execution;
+	int n_threads;
 };
 
 
@@ -273,6 +274,9 @@ extern IndexingPrivate *setup_indexing(const char *methods,
 
 extern void print_indexing_info(IndexingPrivate *ipriv);
 
+extern void indexing_set_race(IndexingPrivate *ipriv, int n_threads,
+                              double deadline);
+
 extern const IndexingMethod *indexing_methods(IndexingPrivate *p, int *n);
 
 extern char *detect_indexing_methods(UnitCell *cell);
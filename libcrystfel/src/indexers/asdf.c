@@ -42,6 +42,7 @@
 #include <gsl/gsl_fit.h>
 #include <profile.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "index.h"
 #include "image.h"
@@ -64,18 +65,29 @@
 
 #include <fftw3.h>
 
-struct fftw_vars {
-	int N;
-	fftw_plan p;
-	double *in;
-	fftw_complex *out;
+/* Number of points in each FFT */
+#define ASDF_FFT_N (1024)
+
+/* Number of triplets whose projections are Fourier transformed together */
+#define ASDF_BATCH (16)
+
+
+/* Working space for one thread of the triplet search */
+struct asdf_scratch {
+	double *in;             /* ASDF_BATCH * ASDF_FFT_N */
+	fftw_complex *out;      /* ASDF_BATCH * (ASDF_FFT_N/2+1) */
+	double *projections;    /* ASDF_BATCH * n_alloc */
+	int *fits;              /* n_alloc */
+	int n_alloc;
 };
 
 
 struct asdf_private {
 	IndexingMethod          indm;
 	UnitCell                *template;
-	struct fftw_vars        fftw;
+	fftw_plan               plan;
+	int                     n_threads;
+	struct asdf_scratch     *scratch;
 	int                     fast_execution;
 };
 
@@ -88,25 +100,45 @@ struct tvector {
 };
 
 
-struct fftw_vars fftw_vars_new()
+static int asdf_scratch_init(struct asdf_scratch *s)
 {
-	struct fftw_vars fftw;
-	int N = 1024;
+	s->in = fftw_alloc_real(ASDF_BATCH*ASDF_FFT_N);
+	s->out = fftw_alloc_complex(ASDF_BATCH*(ASDF_FFT_N/2+1));
+	s->projections = NULL;
+	s->fits = NULL;
+	s->n_alloc = 0;
+	if ( (s->in == NULL) || (s->out == NULL) ) return 1;
+	return 0;
+}
 
-	fftw.N = N;
-	fftw.in = fftw_alloc_real(N);
-	fftw.out = fftw_alloc_complex(N);
-	fftw.p = fftw_plan_dft_r2c_1d(N, fftw.in, fftw.out, FFTW_MEASURE);
 
-	return fftw;
+static void asdf_scratch_free(struct asdf_scratch *s)
+{
+	fftw_free(s->in);
+	fftw_free(s->out);
+	cffree(s->projections);
+	cffree(s->fits);
 }
 
 
-static void fftw_vars_free(struct fftw_vars fftw)
+/* Make sure there is space for 'n' projections per triplet */
+static int asdf_scratch_reserve(struct asdf_scratch *s, int n)
 {
-	fftw_free(fftw.in);
-	fftw_free(fftw.out);
-	fftw_destroy_plan(fftw.p);
+	double *proj;
+	int *fits;
+
+	if ( n <= s->n_alloc ) return 0;
+
+	proj = cfrealloc(s->projections, ASDF_BATCH*n*sizeof(double));
+	if ( proj == NULL ) return 1;
+	s->projections = proj;
+
+	fits = cfrealloc(s->fits, n*sizeof(int));
+	if ( fits == NULL ) return 1;
+	s->fits = fits;
+
+	s->n_alloc = n;
+	return 0;
 }
 
 
@@ -305,15 +337,6 @@ static void force_right_handed(struct asdf_cell *cl)
 }
 
 
-static int compare_doubles(const void *a, const void *b)
-{
-	const double *da = (const double *) a;
-	const double *db = (const double *) b;
-
-	return (*da > *db) - (*da < *db);
-}
-
-
 static double max(double a, double b, double c)
 {
      double m = a;
@@ -338,98 +361,6 @@ static int compare_tvectors(const void *a, const void *b)
 }
 
 
-/* Calculates normal to a triplet c1, c2, c3. Returns 0 if reflections are on
- * the same line */
-static int calc_normal(gsl_vector *c1, gsl_vector *c2, gsl_vector *c3,
-                       gsl_vector *normal)
-{
-	gsl_vector *c12 = gsl_vector_alloc(3);
-	gsl_vector *c23 = gsl_vector_alloc(3);
-	gsl_vector *c31 = gsl_vector_alloc(3);
-	gsl_vector *res = gsl_vector_alloc(3);
-
-	cross_product(c1, c2, &c12);
-	cross_product(c2, c3, &c23);
-	cross_product(c3, c1, &c31);
-
-	int i;
-	for ( i = 0; i < 3; i++ ) {
-		gsl_vector_set(res, i, gsl_vector_get(c12, i) +
-		                       gsl_vector_get(c23, i) +
-		                       gsl_vector_get(c31, i));
-	}
-
-	gsl_vector_free(c12);
-	gsl_vector_free(c23);
-	gsl_vector_free(c31);
-
-	double norm = gsl_blas_dnrm2(res);
-	if ( norm < 0.0001 ) {
-		gsl_vector_free(res);
-		return 0;
-	} else {
-		gsl_vector_scale(res, 1/norm);
-		gsl_vector_memcpy(normal, res);
-		gsl_vector_free(res);
-	}
-
-	return 1;
-}
-
-
-static float find_ds_fft(double *projections, int N_projections, double d_max,
-                         struct fftw_vars fftw)
-{
-	int n = N_projections;
-	double projections_sorted[n];
-	memcpy(projections_sorted, projections, sizeof(double) * n);
-	qsort(projections_sorted, n, sizeof(double), compare_doubles);
-
-	int i;
-
-	int N = fftw.N; // number of points in fft calculation
-
-	for ( i=0; i<N; i++ ) {
-		fftw.in[i] = 0;
-	}
-
-	for ( i=0; i<n; i++ ) {
-		int k;
-		k = (int)((projections_sorted[i] - projections_sorted[0]) /
-		          (projections_sorted[n - 1] - projections_sorted[0]) *
-		          (N - 1));
-		if ( (k>=N) || (k<0) ) {
-			ERROR("Bad k value in find_ds_fft() (k=%i, N=%i)\n",
-			      k, N);
-			return -1.0;
-		}
-		fftw.in[k]++;
-	}
-
-	fftw_execute(fftw.p);
-
-	int i_max = (int)(d_max * (projections_sorted[n - 1] -
-	                           projections_sorted[0]));
-
-	if ( i_max > N / 2 ) i_max = N / 2;
-
-	int d = 1;
-	double maxval = 0;
-	for ( i=1; i<=i_max; i++ ) {
-		double a;
-		a = sqrt(fftw.out[i][0] * fftw.out[i][0] + fftw.out[i][1] * fftw.out[i][1]);
-		if (a > maxval) {
-			maxval = a;
-			d = i;
-		}
-	}
-
-	double ds = (projections_sorted[n - 1] - projections_sorted[0]) / d;
-
-	return ds;
-}
-
-
 /* Returns number of reflections fitting ds.
  * A projected reflection fits a one-dimensional lattice with elementary
  * lattice vector d* if its absolute distance to the nearest lattice
@@ -968,22 +899,32 @@ static int **generate_triplets(int N_reflections, int N_triplets_max, int *N)
 		}
 	} else {
 		// Random selection from the whole set:
-		int *tidx = (int *)cfmalloc(N_triplets * sizeof(int));
+		// Indices already chosen are kept in a hash set
+		// (open addressing, -1 for empty)
+		int hash_size = 1;
+		while ( hash_size < 2*N_triplets ) hash_size *= 2;
+		int *tidx = (int *)cfmalloc(hash_size * sizeof(int));
 		if ( tidx == NULL ) {
 			ERROR("Failed to allocate tidx in generate_triplets_2!\n");
 			cffree(triplets);
 			return NULL;
 		}
+		for ( i = 0; i < hash_size; i++ ) tidx[i] = -1;
 		while ( n < N_triplets ) {
 			int already_in_triplets = 1;
 			while ( already_in_triplets ) {
 				ri = rand() % N_triplets_tot;
 				already_in_triplets = 0;
-				for ( i = 0; i < n; i++ ) {
-					if (tidx[i] == ri) already_in_triplets = 1;
+				i = ri & (hash_size-1);
+				while ( tidx[i] != -1 ) {
+					if ( tidx[i] == ri ) {
+						already_in_triplets = 1;
+						break;
+					}
+					i = (i+1) & (hash_size-1);
 				}
 			}
-			tidx[n] = ri;
+			tidx[i] = ri;
 			triplets[n] = (int *)cfmalloc(3 * sizeof(int));
 			if ( triplets[n] == NULL ) {
 				ERROR("Failed to allocate triplet in generate_triplets!\n");
@@ -998,10 +939,228 @@ static int **generate_triplets(int N_reflections, int N_triplets_max, int *N)
 }
 
 
+/* Calculates normal to a triplet of reflections.  Returns 0 if the
+ * reflections are on the same line */
+static int triplet_normal(double (*refl)[3], const int *triplet,
+                          double *normal)
+{
+	const double *c1 = refl[triplet[0]];
+	const double *c2 = refl[triplet[1]];
+	const double *c3 = refl[triplet[2]];
+	double res[3];
+	double norm;
+
+	res[0] = (c1[1]*c2[2] - c1[2]*c2[1])
+	       + (c2[1]*c3[2] - c2[2]*c3[1])
+	       + (c3[1]*c1[2] - c3[2]*c1[1]);
+	res[1] = (- c1[0]*c2[2] + c1[2]*c2[0])
+	       + (- c2[0]*c3[2] + c2[2]*c3[0])
+	       + (- c3[0]*c1[2] + c3[2]*c1[0]);
+	res[2] = (c1[0]*c2[1] - c1[1]*c2[0])
+	       + (c2[0]*c3[1] - c2[1]*c3[0])
+	       + (c3[0]*c1[1] - c3[1]*c1[0]);
+
+	norm = sqrt(res[0]*res[0] + res[1]*res[1] + res[2]*res[2]);
+	if ( norm < 0.0001 ) return 0;
+
+	normal[0] = res[0] * (1/norm);
+	normal[1] = res[1] * (1/norm);
+	normal[2] = res[2] * (1/norm);
+	return 1;
+}
+
+
+/* The triplet search, split into segments between the points at which
+ * find_cell() is run.  The triplets in a segment are shared out between the
+ * threads in batches of ASDF_BATCH, and the results put back in triplet order
+ * afterwards, so that the outcome does not depend on the number of threads. */
+struct triplet_search {
+	double (*refl)[3];
+	int N_refl;
+	int **triplets;
+	double d_max;
+	double LevelFit;
+	fftw_plan plan;
+
+	int seg_start;
+	int seg_end;             /* exclusive */
+	int next;                /* next triplet to be handed out */
+	pthread_mutex_t lock;
+
+	struct tvector *results; /* one per triplet in segment, t=NULL if none */
+};
+
+
+struct triplet_thread {
+	struct triplet_search *ts;
+	struct asdf_scratch *scratch;
+};
+
+
+/* Projects all the reflections onto the normals of several triplets, Fourier
+ * transforms all of the projections in one go, and turns each into a possible
+ * direct vector */
+static void eval_triplet_batch(struct triplet_search *ts,
+                               struct asdf_scratch *s,
+                               int first, int n_batch)
+{
+	const int N = ASDF_FFT_N;
+	const int NC = ASDF_FFT_N/2+1;
+	const int nr = ts->N_refl;
+	double normals[ASDF_BATCH][3];
+	double pmin[ASDF_BATCH];
+	double pmax[ASDF_BATCH];
+	int valid[ASDF_BATCH];
+	int b, k;
+
+	memset(s->in, 0, ASDF_BATCH*N*sizeof(double));
+
+	for ( b=0; b<n_batch; b++ ) {
+
+		double *proj = s->projections + b*nr;
+		double *in = s->in + b*N;
+
+		valid[b] = triplet_normal(ts->refl, ts->triplets[first+b],
+		                          normals[b]);
+		if ( !valid[b] ) continue;
+
+		/* Calculate projections of reflections to normal */
+		pmin[b] = +INFINITY;
+		pmax[b] = -INFINITY;
+		for ( k=0; k<nr; k++ ) {
+			proj[k] = normals[b][0]*ts->refl[k][0]
+			        + normals[b][1]*ts->refl[k][1]
+			        + normals[b][2]*ts->refl[k][2];
+			if ( proj[k] < pmin[b] ) pmin[b] = proj[k];
+			if ( proj[k] > pmax[b] ) pmax[b] = proj[k];
+		}
+
+		for ( k=0; k<nr; k++ ) {
+			int j;
+			j = (int)((proj[k] - pmin[b]) / (pmax[b] - pmin[b])
+			          * (N - 1));
+			if ( (j>=N) || (j<0) ) {
+				ERROR("Bad k value in find_ds_fft() "
+				      "(k=%i, N=%i)\n", j, N);
+				ERROR("find_ds_fft() failed.\n");
+				valid[b] = 0;
+				break;
+			}
+			in[j]++;
+		}
+
+	}
+
+	fftw_execute_dft_r2c(ts->plan, s->in, s->out);
+
+	for ( b=0; b<n_batch; b++ ) {
+
+		double *proj = s->projections + b*nr;
+		fftw_complex *out = s->out + b*NC;
+		struct tvector *t = &ts->results[first+b-ts->seg_start];
+		int i_max, i, d, n;
+		double maxval;
+		double ds;
+
+		t->t = NULL;
+		if ( !valid[b] ) continue;
+
+		/* Find ds - period in 1d lattice of projections */
+		i_max = (int)(ts->d_max * (pmax[b] - pmin[b]));
+		if ( i_max > N / 2 ) i_max = N / 2;
+
+		d = 1;
+		maxval = 0;
+		for ( i=1; i<=i_max; i++ ) {
+			double a;
+			a = sqrt(out[i][0] * out[i][0] + out[i][1] * out[i][1]);
+			if ( a > maxval ) {
+				maxval = a;
+				d = i;
+			}
+		}
+		ds = (float)((pmax[b] - pmin[b]) / d);
+
+		/* Refine ds, write 1 to fits[i] if reflections[i]
+		 * fits ds */
+		ds = refine_ds(proj, nr, ds, ts->LevelFit, s->fits);
+
+		/* n - number of reflections fitting ds */
+		n = check_refl_fitting_ds(proj, nr, ds, ts->LevelFit);
+
+		if ( n > nr / 3 && n > 6 ) {
+
+			/* normal/ds - possible direct vector */
+			*t = tvector_new(nr);
+			for ( k=0; k<3; k++ ) {
+				gsl_vector_set(t->t, k, normals[b][k] * (1/ds));
+			}
+			memcpy(t->fits, s->fits, nr * sizeof(int));
+			t->n = n;
+		}
+	}
+}
+
+
+static void *triplet_search_thread(void *vp)
+{
+	struct triplet_thread *tt = vp;
+	struct triplet_search *ts = tt->ts;
+
+	do {
+
+		int first, n;
+
+		pthread_mutex_lock(&ts->lock);
+		first = ts->next;
+		n = ts->seg_end - first;
+		if ( n > ASDF_BATCH ) n = ASDF_BATCH;
+		if ( n > 0 ) ts->next += n;
+		pthread_mutex_unlock(&ts->lock);
+
+		if ( n <= 0 ) break;
+
+		eval_triplet_batch(ts, tt->scratch, first, n);
+
+	} while ( 1 );
+
+	return NULL;
+}
+
+
+static void search_segment(struct triplet_search *ts, struct asdf_private *dp)
+{
+	struct triplet_thread tt[dp->n_threads];
+	pthread_t threads[dp->n_threads];
+	int n_started = 0;
+	int i;
+
+	ts->next = ts->seg_start;
+
+	for ( i=0; i<dp->n_threads; i++ ) {
+		tt[i].ts = ts;
+		tt[i].scratch = &dp->scratch[i];
+	}
+
+	/* The calling thread does its share, as thread 0 */
+	for ( i=1; i<dp->n_threads; i++ ) {
+		if ( pthread_create(&threads[i], NULL,
+		                    triplet_search_thread, &tt[i]) ) break;
+		n_started++;
+	}
+
+	triplet_search_thread(&tt[0]);
+
+	for ( i=1; i<=n_started; i++ ) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+
 static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_max,
                        double d_max, double volume_min, double volume_max,
                        double LevelFit, double IndexFit, int N_triplets_max,
-                       struct asdf_cell *c, struct fftw_vars fftw)
+                       struct asdf_cell *c, struct asdf_private *dp)
 {
 
 	int i, k, n;
@@ -1035,108 +1194,98 @@ static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_m
 
 	if ( N_triplets == 0 ) return 0;
 
-	gsl_vector *normal = gsl_vector_alloc(3);
-
-	double projections[N_refl_max];
-	double ds;
-
-	int *fits = cfmalloc(N_refl_max * sizeof(int));
-	if ( fits == NULL ) {
-		ERROR("Failed to allocate fits in index_refls!\n");
-		if ( N_reflections > N_refl_max ) cffree(refl_sample);
-		return 0;
+	for ( i=0; i<dp->n_threads; i++ ) {
+		if ( asdf_scratch_reserve(&dp->scratch[i], N_refl_max) ) {
+			ERROR("Failed to allocate projections in index_refls!\n");
+			if ( N_reflections > N_refl_max ) cffree(refl_sample);
+			return 0;
+		}
 	}
 
+	double (*refl)[3] = cfmalloc(N_refl_max * sizeof(*refl));
 	struct tvector *tvectors = cfmalloc(N_triplets * sizeof(struct tvector));
-	if ( tvectors == NULL ) {
+	struct tvector *results = cfmalloc(N_triplets * sizeof(struct tvector));
+	if ( (refl == NULL) || (tvectors == NULL) || (results == NULL) ) {
 		ERROR("Failed to allocate tvectors in index_refls!\n");
 		if ( N_reflections > N_refl_max ) cffree(refl_sample);
-		cffree(fits);
+		cffree(refl);
+		cffree(tvectors);
+		cffree(results);
 		return 0;
 	}
 
+	for ( i = 0; i < N_refl_max; i++ ) {
+		for ( k = 0; k < 3; k++ ) {
+			refl[i][k] = gsl_vector_get(refl_sample[i], k);
+		}
+	}
+
+	struct triplet_search ts;
+	ts.refl = refl;
+	ts.N_refl = N_refl_max;
+	ts.triplets = triplets;
+	ts.d_max = d_max;
+	ts.LevelFit = LevelFit;
+	ts.plan = dp->plan;
+	ts.results = results;
+	pthread_mutex_init(&ts.lock, NULL);
+
 	int N_tvectors = 0;
 
 	int n_max = 0; // maximum number of reflections fitting one of tvectors
 	profile_start("asdf-search");
-	for ( i = 0; i < N_triplets; i++ ) {
-		if ( calc_normal(refl_sample[triplets[i][0]],
-				 refl_sample[triplets[i][1]],
-				 refl_sample[triplets[i][2]],
-				 normal) )
-		{
-
-			/* Calculate projections of reflections to normal */
-			for ( k = 0; k < N_refl_max; k++ ) {
-				gsl_blas_ddot(normal, refl_sample[k], &projections[k]);
-			}
-
-			/* Find ds - period in 1d lattice of projections */
-			ds = find_ds_fft(projections, N_refl_max, d_max, fftw);
-			if ( ds < 0.0 ) {
-				ERROR("find_ds_fft() failed.\n");
-				continue;
-			}
-
-			/* Refine ds, write 1 to fits[i] if reflections[i]
-			 * fits ds */
-			ds = refine_ds(projections, N_refl_max, ds, LevelFit, fits);
-
-			/* n - number of reflections fitting ds */
-			n = check_refl_fitting_ds(projections, N_refl_max, ds, LevelFit);
-
-			/* normal/ds - possible direct vector */
-			gsl_vector_scale(normal, 1/ds);
-
-			if ( n > N_refl_max / 3 && n > 6 ) {
-
-				tvectors[N_tvectors] = tvector_new(N_refl_max);
-
-				gsl_vector_memcpy(tvectors[N_tvectors].t, normal);
-				memcpy(tvectors[N_tvectors].fits, fits,
-				       N_refl_max * sizeof(int));
-
-				tvectors[N_tvectors].n = n;
-
-				N_tvectors++;
-
-				if (n > n_max) n_max = n;
-			}
+	ts.seg_start = 0;
+	while ( ts.seg_start < N_triplets ) {
+
+		/* Cell search happens after every N_triplets_max/2 triplets,
+		 * and after the last one */
+		int seg_last = (ts.seg_start / (N_triplets_max/2) + 1)
+		             * (N_triplets_max/2);
+		if ( seg_last > N_triplets - 1 ) seg_last = N_triplets - 1;
+		ts.seg_end = seg_last + 1;
+
+		search_segment(&ts, dp);
+
+		for ( i = ts.seg_start; i < ts.seg_end; i++ ) {
+			struct tvector *t = &results[i-ts.seg_start];
+			if ( t->t == NULL ) continue;
+			tvectors[N_tvectors++] = *t;
+			if ( t->n > n_max ) n_max = t->n;
 		}
-
-		if ( (i != 0 && i % (N_triplets_max/2) == 0) || i == N_triplets - 1 ) {
-			/* Sort tvectors by length */
-			qsort(tvectors, N_tvectors, sizeof(struct tvector),
-			      compare_tvectors);
-
-			/* Three shortest independent tvectors with t.n > acl
-			 * determine the final cell. acl is selected for the
-			 * solution with the maximum number of fitting
-			 * reflections */
-			profile_start("asdf-findcell");
-			find_cell(tvectors, N_tvectors, IndexFit, volume_min,
-				  volume_max, n_max, refl_sample, N_refl_max, c);
-			profile_end("asdf-findcell");
-
-			if ( c->n > 4 * n_max / 5 ) {
-				break;
-			}
+		ts.seg_start = ts.seg_end;
+
+		/* Sort tvectors by length */
+		qsort(tvectors, N_tvectors, sizeof(struct tvector),
+		      compare_tvectors);
+
+		/* Three shortest independent tvectors with t.n > acl
+		 * determine the final cell. acl is selected for the
+		 * solution with the maximum number of fitting
+		 * reflections */
+		profile_start("asdf-findcell");
+		find_cell(tvectors, N_tvectors, IndexFit, volume_min,
+			  volume_max, n_max, refl_sample, N_refl_max, c);
+		profile_end("asdf-findcell");
+
+		if ( c->n > 4 * n_max / 5 ) {
+			break;
 		}
 	}
 	profile_end("asdf-search");
-	cffree(fits);
+	pthread_mutex_destroy(&ts.lock);
 
 	for ( i = 0; i < N_tvectors; i++ ) {
 		tvector_free(tvectors[i]);
 	}
 	cffree(tvectors);
+	cffree(results);
+	cffree(refl);
 
 	for ( i = 0; i < N_triplets; i++ ) {
 		cffree(triplets[i]);
 	}
 	cffree(triplets);
 
-	gsl_vector_free(normal);
 	if ( N_reflections > N_refl_max ) cffree(refl_sample);
 
 	if ( c->n ) return 1;
@@ -1197,6 +1346,10 @@ int run_asdf(struct image *image, void *ipriv)
 	int N_reflections = 0;
 	gsl_vector *reflections[n];
 
+	/* All the reflection vectors live in one block */
+	gsl_matrix *refl_block = gsl_matrix_alloc(n > 0 ? n : 1, 3);
+	gsl_vector_view refl_views[n];
+
 	for ( i=0; i<n; i++ ) {
 		struct imagefeature *f;
 		double r[3];
@@ -1208,7 +1361,9 @@ int run_asdf(struct image *image, void *ipriv)
 		                         f->fs, f->ss, image->lambda,
 		                         0.0, 0.0, r);
 
-		reflections[N_reflections] = gsl_vector_alloc(3);
+		refl_views[N_reflections] = gsl_matrix_row(refl_block,
+		                                           N_reflections);
+		reflections[N_reflections] = &refl_views[N_reflections].vector;
 		gsl_vector_set(reflections[N_reflections], 0, r[0]/1e10);
 		gsl_vector_set(reflections[N_reflections], 1, r[1]/1e10);
 		gsl_vector_set(reflections[N_reflections], 2, r[2]/1e10);
@@ -1218,18 +1373,19 @@ int run_asdf(struct image *image, void *ipriv)
 	struct asdf_cell *c = asdf_cell_new(N_reflections);
 	if (c == NULL) {
 		ERROR("Failed to allocate asdf_cell in run_asdf!\n");
+		gsl_matrix_free(refl_block);
 		return 0;
 	}
 
-	if ( N_reflections == 0 ) return 0;
+	if ( N_reflections == 0 ) {
+		gsl_matrix_free(refl_block);
+		return 0;
+	}
 
 	j = index_refls(reflections, N_reflections, N_refl_max, d_max, volume_min,
-	                volume_max, LevelFit, IndexFit, N_triplets_max, c,
-	                dp->fftw);
+	                volume_max, LevelFit, IndexFit, N_triplets_max, c, dp);
 
-	for ( i = 0; i < N_reflections; i++ ) {
-		gsl_vector_free(reflections[i]);
-	}
+	gsl_matrix_free(refl_block);
 
 	if ( j ) {
 
@@ -1270,6 +1426,8 @@ int run_asdf(struct image *image, void *ipriv)
 void *asdf_prepare(IndexingMethod *indm, UnitCell *cell, struct asdf_options *asdf_opts)
 {
 	struct asdf_private *dp;
+	int n_fft;
+	int i;
 
 	/* Flags that asdf knows about */
 	*indm &= INDEXING_METHOD_MASK | INDEXING_USE_CELL_PARAMETERS;
@@ -1280,7 +1438,38 @@ void *asdf_prepare(IndexingMethod *indm, UnitCell *cell, struct asdf_options *as
 	dp->template = cell;
 	dp->indm = *indm;
 	dp->fast_execution = asdf_opts->fast_execution;
-	dp->fftw = fftw_vars_new();
+	dp->n_threads = asdf_opts->n_threads;
+	if ( dp->n_threads < 1 ) dp->n_threads = 1;
+	dp->plan = NULL;
+
+	dp->scratch = cfmalloc(dp->n_threads*sizeof(struct asdf_scratch));
+	if ( dp->scratch == NULL ) {
+		cffree(dp);
+		return NULL;
+	}
+	for ( i=0; i<dp->n_threads; i++ ) {
+		if ( asdf_scratch_init(&dp->scratch[i]) ) {
+			ERROR("Failed to allocate FFT arrays for asdf\n");
+			dp->n_threads = i+1;
+			asdf_cleanup(dp);
+			return NULL;
+		}
+	}
+
+	/* One plan, for a batch of transforms, shared by all threads (each
+	 * with their own arrays) for every frame */
+	n_fft = ASDF_FFT_N;
+	dp->plan = fftw_plan_many_dft_r2c(1, &n_fft, ASDF_BATCH,
+	                                  dp->scratch[0].in, NULL,
+	                                  1, ASDF_FFT_N,
+	                                  dp->scratch[0].out, NULL,
+	                                  1, ASDF_FFT_N/2+1,
+	                                  FFTW_MEASURE);
+	if ( dp->plan == NULL ) {
+		ERROR("Failed to create FFT plan for asdf\n");
+		asdf_cleanup(dp);
+		return NULL;
+	}
 
 	return (void *)dp;
 }
@@ -1289,8 +1478,13 @@ void *asdf_prepare(IndexingMethod *indm, UnitCell *cell, struct asdf_options *as
 void asdf_cleanup(void *pp)
 {
 	struct asdf_private *p;
+	int i;
 	p = (struct asdf_private *)pp;
-	fftw_vars_free(p->fftw);
+	if ( p->plan != NULL ) fftw_destroy_plan(p->plan);
+	for ( i=0; i<p->n_threads; i++ ) {
+		asdf_scratch_free(&p->scratch[i]);
+	}
+	cffree(p->scratch);
 	cffree(p);
 }
 
@@ -1336,6 +1530,9 @@ static void asdf_show_help()
 "                           Speed up execution by limiting maximum number of peaks\n"
 "                            used for indexing and the number of unit cell search\n"
 "                            iterations\n"
+"     --asdf-threads=n\n"
+"                           Use n threads to search for the unit cell for each\n"
+"                            frame.  Default: 1\n"
 );
 }
 
@@ -1348,6 +1545,7 @@ int asdf_default_options(struct asdf_options **opts_ptr)
 	if ( opts == NULL ) return ENOMEM;
 
 	opts->fast_execution = 0;
+	opts->n_threads = 1;
 
 	*opts_ptr = opts;
 	return 0;
@@ -1375,6 +1573,17 @@ static error_t asdf_parse_arg(int key, char *arg,
 		(*opts_ptr)->fast_execution = 1;
 		break;
 
+		case 3 :
+		if ( sscanf(arg, "%d", &(*opts_ptr)->n_threads) != 1 ) {
+			ERROR("Invalid value for --asdf-threads\n");
+			return EINVAL;
+		}
+		if ( (*opts_ptr)->n_threads < 1 ) {
+			ERROR("--asdf-threads must be at least 1\n");
+			return EINVAL;
+		}
+		break;
+
 	}
 
 	return 0;
@@ -1387,6 +1596,7 @@ static struct argp_option asdf_options[] = {
 	 "Show options for asdf indexing algorithm", 99},
 
 	{"asdf-fast", 2, NULL, OPTION_HIDDEN, NULL},
+	{"asdf-threads", 3, "n", OPTION_HIDDEN, NULL},
 
 	{0}
 };
@@ -51,12 +51,16 @@
 #include "utils.h"
 #include "peaks.h"
 #include "cell-utils.h"
+#include "external.h"
 
 
 /** \file dirax.h */
 
 #define DIRAX_VERBOSE 0
 
+/* Seconds to wait for DirAx to say something */
+#define DIRAX_TIMEOUT (30)
+
 #define MAX_DIRAX_CELL_CANDIDATES (5)
 
 
@@ -68,12 +72,19 @@ typedef enum {
 } DirAxInputType;
 
 
+struct dirax_data;
+
 struct dirax_private {
 	IndexingMethod          indm;
 	UnitCell                *template;
+
+	/* Kept between frames */
+	char                    *scratch;
+	struct dirax_data       *session;
 };
 
 
+/* One running copy of DirAx, which processes many frames in turn */
 struct dirax_data {
 
 	/* DirAx auto-indexing low-level stuff */
@@ -82,8 +93,11 @@ struct dirax_data {
 	char                    *rbuffer;
 	int                     rbufpos;
 	int                     rbuflen;
+	int                     at_prompt;  /* Waiting for us at "Dirax>" */
+	int                     n_frames;
 
-	/* DirAx auto-indexing high-level stuff */
+	/* DirAx auto-indexing high-level stuff, reset for each frame.
+	 * step=0 means that no frame is in progress. */
 	int                     step;
 	int                     finished_ok;
 	int                     read_cell;
@@ -217,6 +231,7 @@ static void dirax_parseline(const char *line, struct image *image,
 		image_add_crystal(image, cr);
 		dirax->done = 1;
 		dirax->success = 1;
+		dirax->step = 0;
 
 		return;
 
@@ -305,10 +320,13 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 		if ( dirax->best_acl_nh == 0 ) {
 			/* At this point, DirAx is presenting its ACL prompt
 			 * and waiting for a single number.  Use an extra
-			 * newline to choose automatic ACL selection before
-			 * exiting. */
-			dirax_sendline("\nexit\n", dirax);
-			break;
+			 * newline to choose automatic ACL selection, which
+			 * gets back to the main prompt, and give up.  The
+			 * output of the automatic selection gets read and
+			 * ignored before the frame is finished. */
+			dirax_sendline("\n", dirax);
+			dirax->step = 0;
+			return;
 		}
 		snprintf(tmp, 31, "%i\n", dirax->best_acl);
 		dirax->acls_tried[dirax->n_acls_tried++] = dirax->best_acl;
@@ -321,7 +339,11 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 
 		case 10 :
 		if ( dirax->n_acls_tried == MAX_DIRAX_CELL_CANDIDATES ) {
-			dirax_sendline("exit\n", dirax);
+			/* Give up, leaving DirAx at its prompt for the
+			 * next frame */
+			dirax->at_prompt = 1;
+			dirax->step = 0;
+			return;
 		} else {
 			/* Go back round for another cell */
 			dirax->best_acl_nh = 0;
@@ -331,7 +353,8 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 		break;
 
 		default:
-		dirax_sendline("exit\n", dirax);
+		dirax->at_prompt = 1;
+		dirax->step = 0;
 		return;
 
 	}
@@ -407,18 +430,32 @@ static int dirax_readable(struct image *image, struct dirax_data *dirax)
 					memmove(block_buffer, block_buffer+1, i);
 				}
 
-				dirax_parseline(block_buffer, image, dirax);
+				/* Anything left over from the previous frame
+				 * gets ignored */
+				if ( dirax->step != 0 ) {
+					dirax_parseline(block_buffer, image,
+					                dirax);
+				}
 				cffree(block_buffer);
 				endbit_length = i+2;
 				break;
 
 				case DIRAX_INPUT_PROMPT :
-				dirax_send_next(image, dirax);
+				if ( dirax->step == 0 ) {
+					dirax->at_prompt = 1;
+				} else {
+					dirax_send_next(image, dirax);
+				}
 				endbit_length = i+7;
 				break;
 
 				case DIRAX_INPUT_ACL :
-				dirax_send_next(image,dirax);
+				if ( dirax->step == 0 ) {
+					/* Automatic selection */
+					dirax_sendline("\n", dirax);
+				} else {
+					dirax_send_next(image, dirax);
+				}
 				endbit_length = i+10;
 				break;
 
@@ -466,13 +503,13 @@ static int dirax_readable(struct image *image, struct dirax_data *dirax)
 }
 
 
-static void write_drx(struct image *image)
+static void write_drx(struct image *image, const char *dir)
 {
 	FILE *fh;
 	int i;
 	char filename[1024];
 
-	snprintf(filename, 1023, "xfel.drx");
+	snprintf(filename, 1023, "%s/xfel.drx", dir);
 
 	fh = fopen(filename, "w");
 	if ( !fh ) {
@@ -501,49 +538,59 @@ static void write_drx(struct image *image)
 }
 
 
-int run_dirax(struct image *image, void *ipriv)
+static struct dirax_data *dirax_start(struct dirax_private *dp)
 {
-	unsigned int opts;
-	int status;
-	int rval;
 	struct dirax_data *dirax;
-
-	write_drx(image);
+	char *argv[] = {"dirax", NULL};
 
 	dirax = cfmalloc(sizeof(struct dirax_data));
 	if ( dirax == NULL ) {
 		ERROR("Couldn't allocate memory for DirAx data.\n");
-		return 0;
+		return NULL;
 	}
 
-	dirax->pid = forkpty(&dirax->pty, NULL, NULL, NULL);
+	dirax->pid = external_spawn(&dirax->pty, dp->scratch, argv, NULL);
 	if ( dirax->pid == -1 ) {
-		ERROR("Failed to fork for DirAx: %s\n", strerror(errno));
-		return 0;
+		cffree(dirax);
+		return NULL;
 	}
-	if ( dirax->pid == 0 ) {
 
-		/* Child process: invoke DirAx */
-		struct termios t;
+	dirax->rbuffer = cfmalloc(256);
+	dirax->rbuflen = 256;
+	dirax->rbufpos = 0;
+	dirax->at_prompt = 0;
+	dirax->n_frames = 0;
+	dirax->step = 0;
+	dirax->dp = dp;
 
-		/* Turn echo off */
-		tcgetattr(STDIN_FILENO, &t);
-		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
-		tcsetattr(STDIN_FILENO, TCSANOW, &t);
+	return dirax;
+}
 
-		execlp("dirax", "dirax", (char *)NULL);
-		ERROR("Failed to invoke DirAx.\n");
-		_exit(0);
 
+static void dirax_stop(struct dirax_data *dirax, int hard)
+{
+	if ( hard ) {
+		external_kill(dirax->pid, dirax->pty);
+	} else {
+		external_stop(dirax->pid, dirax->pty, "exit\n");
 	}
+	cffree(dirax->rbuffer);
+	cffree(dirax);
+}
 
-	dirax->rbuffer = cfmalloc(256);
-	dirax->rbuflen = 256;
-	dirax->rbufpos = 0;
 
-	/* Set non-blocking */
-	opts = fcntl(dirax->pty, F_GETFL);
-	fcntl(dirax->pty, F_SETFL, opts | O_NONBLOCK);
+/* Returns -1 if the frame should be tried again with a fresh DirAx */
+static int dirax_index_frame(struct image *image, struct dirax_private *dp)
+{
+	struct dirax_data *dirax;
+	int rval;
+	int finished_ok, success;
+
+	if ( dp->session == NULL ) {
+		dp->session = dirax_start(dp);
+		if ( dp->session == NULL ) return 0;
+	}
+	dirax = dp->session;
 
 	dirax->step = 1;	/* This starts the "initialisation" procedure */
 	dirax->finished_ok = 0;
@@ -552,57 +599,72 @@ int run_dirax(struct image *image, void *ipriv)
 	dirax->best_acl_nh = 0;
 	dirax->done = 0;
 	dirax->success = 0;
-	dirax->dp = (struct dirax_private *)ipriv;
 
-	do {
+	/* If DirAx already gave us a prompt at the end of the last frame,
+	 * there won't be another one */
+	if ( dirax->at_prompt ) {
+		dirax->at_prompt = 0;
+		dirax_send_next(image, dirax);
+	}
 
-		fd_set fds;
-		struct timeval tv;
-		int sval;
+	/* Once the frame is over, keep going until DirAx is back at its
+	 * prompt, so that nothing it says about this frame gets taken as
+	 * part of the next one */
+	do {
 
-		FD_ZERO(&fds);
-		FD_SET(dirax->pty, &fds);
+		rval = external_wait(dirax->pty, DIRAX_TIMEOUT);
 
-		tv.tv_sec = 30;
-		tv.tv_usec = 0;
+		if ( rval == 1 ) {
+			rval = dirax_readable(image, dirax);
+		} else {
+			if ( rval == 0 ) ERROR("No response from DirAx..\n");
+			rval = 1;
+		}
 
-		sval = select(dirax->pty+1, &fds, NULL, NULL, &tv);
+	} while ( !rval && ((dirax->step != 0) || !dirax->at_prompt) );
 
-		if ( sval == -1 ) {
+	finished_ok = dirax->finished_ok;
+	success = dirax->success;
 
-			const int err = errno;
+	if ( rval ) {
 
-			switch ( err ) {
+		/* DirAx exited or got stuck.  If it was already running
+		 * before this frame and went away before doing any work,
+		 * this frame deserves another go. */
+		int retry = (dirax->n_frames > 0) && !finished_ok;
 
-				case EINTR:
-				STATUS("Restarting select()\n");
-				break;
+		dirax_stop(dirax, 1);
+		dp->session = NULL;
+		if ( retry ) return -1;
 
-				default:
-				ERROR("select() failed: %s\n", strerror(err));
-				rval = 1;
+	} else {
+		dirax->n_frames++;
+	}
 
-			}
+	if ( !finished_ok ) {
+		ERROR("DirAx doesn't seem to be working properly.\n");
+	}
 
-		} else if ( sval != 0 ) {
-			rval = dirax_readable(image, dirax);
-		} else {
-			ERROR("No response from DirAx..\n");
-			rval = 1;
-		}
+	return success;
+}
 
-	} while ( !rval && !dirax->success );
 
-	close(dirax->pty);
-	cffree(dirax->rbuffer);
-	waitpid(dirax->pid, &status, 0);
+int run_dirax(struct image *image, void *ipriv)
+{
+	struct dirax_private *dp = (struct dirax_private *)ipriv;
+	int rval;
 
-	if ( dirax->finished_ok == 0 ) {
-		ERROR("DirAx doesn't seem to be working properly.\n");
+	if ( dp->scratch == NULL ) {
+		dp->scratch = external_scratch_new("dirax");
+		if ( dp->scratch == NULL ) return 0;
 	}
 
-	rval = dirax->success;
-	cffree(dirax);
+	write_drx(image, dp->scratch);
+
+	rval = dirax_index_frame(image, dp);
+	if ( rval == -1 ) rval = dirax_index_frame(image, dp);
+	if ( rval == -1 ) rval = 0;
+
 	return rval;
 }
 
@@ -626,6 +688,10 @@ void *dirax_prepare(IndexingMethod *indm, UnitCell *cell)
 	dp->template = cell;
 	dp->indm = *indm;
 
+	/* DirAx itself gets started for the first frame */
+	dp->scratch = NULL;
+	dp->session = NULL;
+
 	return (IndexingPrivate *)dp;
 }
 
@@ -634,6 +700,8 @@ void dirax_cleanup(void *pp)
 {
 	struct dirax_private *p;
 	p = (struct dirax_private *)pp;
+	if ( p->session != NULL ) dirax_stop(p->session, 0);
+	external_scratch_free(p->scratch);
 	cffree(p);
 }
 
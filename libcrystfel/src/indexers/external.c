@@ -0,0 +1,363 @@
+/*
+ * external.c
+ *
+ * Helpers for running external indexing programs
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifdef HAVE_FORKPTY_PTY_H
+#include <pty.h>
+#endif
+#ifdef HAVE_FORKPTY_UTIL_H
+#include <util.h>
+#endif
+
+#include "utils.h"
+#include "external.h"
+
+
+/* Scratch files go here if possible, so that writing the input files for
+ * the indexer doesn't touch the (possibly networked) working directory */
+#define SCRATCH_LOCATION "/dev/shm"
+
+
+/**
+ * \param name: Short name for the indexer, used in the folder name
+ *
+ * Creates a private scratch folder for an indexing program.  The folder is
+ * created in RAM-backed storage if possible, otherwise in the current
+ * directory.
+ *
+ * \returns the absolute path of the new folder, or NULL on error.
+ */
+char *external_scratch_new(const char *name)
+{
+	char *dir;
+	char *cwd;
+	size_t len;
+
+	if ( access(SCRATCH_LOCATION, W_OK | X_OK) == 0 ) {
+		len = strlen(SCRATCH_LOCATION) + strlen(name) + 32;
+		dir = cfmalloc(len);
+		if ( dir == NULL ) return NULL;
+		snprintf(dir, len, "%s/crystfel-%s.XXXXXX",
+		         SCRATCH_LOCATION, name);
+		if ( mkdtemp(dir) != NULL ) return dir;
+		cffree(dir);
+	}
+
+	/* The absolute path is needed, because a long-lived indexer process
+	 * will outlast any later chdir() by the caller */
+	cwd = getcwd(NULL, 0);
+	if ( cwd == NULL ) {
+		ERROR("Failed to get current directory: %s\n", strerror(errno));
+		return NULL;
+	}
+	len = strlen(cwd) + strlen(name) + 32;
+	dir = cfmalloc(len);
+	if ( dir == NULL ) {
+		free(cwd);
+		return NULL;
+	}
+	snprintf(dir, len, "%s/%s.XXXXXX", cwd, name);
+	free(cwd);
+
+	if ( mkdtemp(dir) == NULL ) {
+		ERROR("Failed to create scratch folder for %s: %s\n",
+		      name, strerror(errno));
+		cffree(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+
+/**
+ * \param dir: A folder created by \ref external_scratch_new
+ *
+ * Deletes everything in the scratch folder, followed by the folder itself,
+ * and frees \p dir.
+ */
+void external_scratch_free(char *dir)
+{
+	DIR *d;
+	struct dirent *ent;
+
+	if ( dir == NULL ) return;
+
+	d = opendir(dir);
+	if ( d != NULL ) {
+
+		size_t len = strlen(dir) + 258;
+		char *path = cfmalloc(len);
+
+		while ( (path != NULL) && ((ent = readdir(d)) != NULL) ) {
+			if ( strcmp(ent->d_name, ".") == 0 ) continue;
+			if ( strcmp(ent->d_name, "..") == 0 ) continue;
+			snprintf(path, len, "%s/%s", dir, ent->d_name);
+			unlink(path);
+		}
+
+		cffree(path);
+		closedir(d);
+
+	}
+
+	if ( rmdir(dir) ) {
+		ERROR("Failed to delete scratch folder %s: %s\n",
+		      dir, strerror(errno));
+	}
+	cffree(dir);
+}
+
+
+/**
+ * \param pty: Location at which to store the master side of the pty
+ * \param dir: Working directory for the new process, or NULL
+ * \param argv: NULL-terminated argument list, starting with the program name
+ * \param alt_prog: Program to try if argv[0] can't be run, or NULL
+ *
+ * Starts an external program with its standard input and output connected to
+ * a new pseudo-terminal, with echo turned off.  The master side is set to
+ * non-blocking mode, and will not be inherited by other child processes.
+ *
+ * \returns the process ID, or -1 on error.
+ */
+pid_t external_spawn(int *pty, const char *dir, char *const argv[],
+                     const char *alt_prog)
+{
+	pid_t pid;
+	int opts;
+
+	pid = forkpty(pty, NULL, NULL, NULL);
+	if ( pid == -1 ) {
+		ERROR("Failed to fork for %s: %s\n", argv[0], strerror(errno));
+		return -1;
+	}
+	if ( pid == 0 ) {
+
+		/* Child process */
+		struct termios t;
+
+		/* Turn echo off */
+		tcgetattr(STDIN_FILENO, &t);
+		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
+		tcsetattr(STDIN_FILENO, TCSANOW, &t);
+
+		if ( (dir != NULL) && chdir(dir) ) {
+			ERROR("Failed to chdir to %s: %s\n",
+			      dir, strerror(errno));
+			_exit(1);
+		}
+
+		execvp(argv[0], argv);
+		if ( alt_prog != NULL ) execvp(alt_prog, argv);
+		ERROR("Failed to invoke %s: %s\n", argv[0], strerror(errno));
+		_exit(1);
+
+	}
+
+	/* Set non-blocking */
+	opts = fcntl(*pty, F_GETFL);
+	fcntl(*pty, F_SETFL, opts | O_NONBLOCK);
+
+	/* Don't leak the pty into other indexers' processes */
+	fcntl(*pty, F_SETFD, FD_CLOEXEC);
+
+	return pid;
+}
+
+
+/**
+ * \param pty: The master side of the pty
+ * \param timeout: Maximum time to wait, in seconds
+ *
+ * Waits for output from an external program.
+ *
+ * \returns 1 if there is something to read, 0 if the time ran out, or -1 on
+ * error.
+ */
+int external_wait(int pty, double timeout)
+{
+	do {
+
+		fd_set fds;
+		struct timeval tv;
+		int sval;
+
+		FD_ZERO(&fds);
+		FD_SET(pty, &fds);
+
+		tv.tv_sec = timeout;
+		tv.tv_usec = (timeout - tv.tv_sec)*1e6;
+
+		sval = select(pty+1, &fds, NULL, NULL, &tv);
+		if ( sval > 0 ) return 1;
+		if ( sval == 0 ) return 0;
+
+		if ( errno != EINTR ) {
+			ERROR("select() failed: %s\n", strerror(errno));
+			return -1;
+		}
+
+	} while ( 1 );
+}
+
+
+/**
+ * \param pid: The process ID
+ * \param pty: The master side of the pty
+ *
+ * Kills an external program, closes its pty and waits for it to go away.
+ */
+void external_kill(pid_t pid, int pty)
+{
+	int status;
+
+	kill(pid, SIGKILL);
+	close(pty);
+	waitpid(pid, &status, 0);
+}
+
+
+/**
+ * \param pid: The process ID
+ * \param pty: The master side of the pty
+ * \param quit: Command to make the program exit, or NULL
+ *
+ * Asks an external program to exit, and closes its pty.  If the program
+ * doesn't exit within a second, it will be killed.
+ */
+void external_stop(pid_t pid, int pty, const char *quit)
+{
+	int i;
+	int status;
+
+	if ( quit != NULL ) {
+		if ( write(pty, quit, strlen(quit)) == -1 ) {
+			/* Already gone, or going */
+		}
+	}
+
+	/* Closing the master side hangs up the terminal */
+	close(pty);
+
+	for ( i=0; i<20; i++ ) {
+		if ( waitpid(pid, &status, WNOHANG) != 0 ) return;
+		usleep(50000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+}
+
+
+/**
+ * \param dir: Working directory for the program, or NULL
+ * \param argv: NULL-terminated argument list, starting with the program name
+ * \param timeout: Maximum time to wait for any output, in seconds
+ * \param line_func: Function to call for each line of output, or NULL
+ * \param vp: Argument for \p line_func
+ *
+ * Runs an external program to completion, for the programs which can't be
+ * kept running between frames.  The program will be killed if it produces
+ * no output for \p timeout seconds.
+ *
+ * \returns the exit status of the program, or -1 if it did not exit normally.
+ */
+int external_run(const char *dir, char *const argv[], double timeout,
+                 void (*line_func)(const char *line, void *vp), void *vp)
+{
+	pid_t pid;
+	int pty;
+	int status;
+	char buf[4096];
+	int pos = 0;
+
+	pid = external_spawn(&pty, dir, argv, NULL);
+	if ( pid == -1 ) return -1;
+
+	do {
+
+		int r;
+		int i, start;
+
+		r = external_wait(pty, timeout);
+		if ( r <= 0 ) {
+			if ( r == 0 ) ERROR("No response from %s.\n", argv[0]);
+			external_kill(pid, pty);
+			return -1;
+		}
+
+		r = read(pty, buf+pos, sizeof(buf)-1-pos);
+		if ( (r == -1) && ((errno == EAGAIN) || (errno == EINTR)) ) {
+			continue;
+		}
+		if ( r <= 0 ) break;  /* EOF, or EIO when the program exits */
+		pos += r;
+
+		/* Hand over complete lines */
+		start = 0;
+		for ( i=0; i<pos; i++ ) {
+			if ( buf[i] != '\n' ) continue;
+			buf[i] = '\0';
+			if ( (i > start) && (buf[i-1] == '\r') ) buf[i-1] = '\0';
+			if ( line_func != NULL ) line_func(buf+start, vp);
+			start = i+1;
+		}
+		memmove(buf, buf+start, pos-start);
+		pos -= start;
+
+		/* Very long line */
+		if ( pos == sizeof(buf)-1 ) {
+			buf[pos] = '\0';
+			if ( line_func != NULL ) line_func(buf, vp);
+			pos = 0;
+		}
+
+	} while ( 1 );
+
+	if ( (pos > 0) && (line_func != NULL) ) {
+		buf[pos] = '\0';
+		line_func(buf, vp);
+	}
+
+	close(pty);
+	waitpid(pid, &status, 0);
+
+	if ( !WIFEXITED(status) ) return -1;
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,49 @@
+/*
+ * external.h
+ *
+ * Helpers for running external indexing programs
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EXTERNAL_H
+#define EXTERNAL_H
+
+#include <sys/types.h>
+
+/** \file external.h
+ * Process and scratch file handling shared by the wrappers for MOSFLM,
+ * DirAx, XDS and Felix.  Not part of the public API.
+ */
+
+extern char *external_scratch_new(const char *name);
+extern void external_scratch_free(char *dir);
+
+extern pid_t external_spawn(int *pty, const char *dir, char *const argv[],
+                            const char *alt_prog);
+extern int external_wait(int pty, double timeout);
+extern void external_stop(pid_t pid, int pty, const char *quit);
+extern void external_kill(pid_t pid, int pty);
+
+extern int external_run(const char *dir, char *const argv[], double timeout,
+                        void (*line_func)(const char *line, void *vp),
+                        void *vp);
+
+#endif	/* EXTERNAL_H */
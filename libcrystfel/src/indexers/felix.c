@@ -63,6 +63,7 @@
 #include "cell-utils.h"
 #include "felix.h"
 #include "index.h"
+#include "external.h"
 
 
 #define FELIX_VERBOSE 0
@@ -101,20 +102,8 @@ struct felix_private
 	char *readhkl_file;
 	float maxtime;
 
-};
-
-
-/* Data needed to call Felix */
-struct felix_data {
-
-	struct felix_private *gp;
-
-	/* Low-level stuff */
-	int                     pty;
-	pid_t                   pid;
-	char                    *rbuffer;
-	int                     rbufpos;
-	int                     rbuflen;
+	/* Kept between frames */
+	char *scratch;
 
 };
 
@@ -233,8 +222,7 @@ static int read_felix(struct felix_private *gp, struct image *image,
 }
 
 
-static void gs_parseline(char *line, struct image *image,
-                         struct felix_data *gs)
+static void felix_parseline(const char *line, void *vp)
 {
 	#if FELIX_VERBOSE
 	STATUS("%s\n", line);
@@ -242,95 +230,13 @@ static void gs_parseline(char *line, struct image *image,
 }
 
 
-static int felix_readable(struct image *image, struct felix_data *gs)
-{
-	int rval;
-	int no_string = 0;
-
-	rval = read(gs->pty, gs->rbuffer+gs->rbufpos, gs->rbuflen-gs->rbufpos);
-
-	if ( (rval == -1) || (rval == 0) ) return 1;
-
-	gs->rbufpos += rval;
-	assert(gs->rbufpos <= gs->rbuflen);
-
-	while ( (!no_string) && (gs->rbufpos > 0) ) {
-
-		int i;
-		int block_ready = 0;
-
-		/* See if there's a full line in the buffer yet */
-		for ( i=0; i<gs->rbufpos-1; i++ ) {
-			/* Means the last value looked at is rbufpos-2 */
-
-			if ( (gs->rbuffer[i] == '\r')
-			  && ( gs->rbuffer[i+1] == '\n' ) ) {
-				block_ready = 1;
-				break;
-			}
-
-		}
-
-		if ( block_ready ) {
-
-			unsigned int new_rbuflen;
-			unsigned int endbit_length;
-			char *block_buffer = NULL;
-
-			block_buffer = cfmalloc(i+1);
-			memcpy(block_buffer, gs->rbuffer, i);
-			block_buffer[i] = '\0';
-
-			if ( block_buffer[0] == '\r' ) {
-				memmove(block_buffer, block_buffer+1, i);
-			}
-
-			gs_parseline(block_buffer, image, gs);
-			cffree(block_buffer);
-			endbit_length = i+2;
-
-			/* Now the block's been parsed, it should be
-			 * forgotten about */
-			memmove(gs->rbuffer,
-			        gs->rbuffer + endbit_length,
-			        gs->rbuflen - endbit_length);
-
-			/* Subtract the number of bytes removed */
-			gs->rbufpos = gs->rbufpos  - endbit_length;
-			new_rbuflen = gs->rbuflen - endbit_length;
-			if ( new_rbuflen == 0 ) new_rbuflen = 256;
-			gs->rbuffer = cfrealloc(gs->rbuffer, new_rbuflen);
-			gs->rbuflen = new_rbuflen;
-
-		} else {
-
-			if ( gs->rbufpos == gs->rbuflen ) {
-
-				/* More buffer space is needed */
-				gs->rbuffer = cfrealloc(gs->rbuffer,
-				                        gs->rbuflen + 256);
-				gs->rbuflen = gs->rbuflen + 256;
-				/* The new space gets used at the next
-				 * read, shortly... */
-
-			}
-			no_string = 1;
-
-		}
-
-	}
-
-	return 0;
-}
-
-
 static void write_gve(struct image *image, struct felix_private *gp)
 {
 	FILE *fh;
 	int i;
 	char filename[1024];
 	double a, b, c, al, be, ga;
-	snprintf(filename, 1023, "xfel.gve");
+	snprintf(filename, 1023, "%s/xfel.gve", gp->scratch);
 	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", filename);
@@ -367,25 +273,24 @@ static void write_gve(struct image *image, struct felix_private *gp)
 }
 
 
-static char *write_ini(struct image *image, struct felix_private *gp)
+/* Felix runs in the scratch folder, so the filenames in the ini file are
+ * relative to that */
+static int write_ini(struct felix_private *gp)
 {
 	FILE *fh;
-	char *filename;
+	int rval = 0;
+	char filename[1024];
 	char gveFilename[1024];
 	char logFilename[1024];
 
-	filename = cfmalloc(1024);
-	if ( filename == NULL ) return NULL;
-
-	snprintf(filename, 1023, "xfel.ini");
+	snprintf(filename, 1023, "%s/xfel.ini", gp->scratch);
 	snprintf(gveFilename, 1023, "xfel.gve");
 	snprintf(logFilename, 1023, "xfel.log");
 
 	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", filename);
-		cffree(filename);
-		return NULL;
+		return 1;
 	}
 
 	fprintf(fh, "spacegroup %i\n", gp->spacegroup);
@@ -413,8 +318,7 @@ static char *write_ini(struct image *image, struct felix_private *gp)
 		fprintf(fh, "orispace octa\n");
 	} else{
 		ERROR("No felix supported orispace specified.\n");
-		cffree(filename);
-		filename = NULL;
+		rval = 1;
 	}
 
 	/* If an hkl file is not specified, generate the peak list. */
@@ -428,126 +332,44 @@ static char *write_ini(struct image *image, struct felix_private *gp)
 
 	fclose(fh);
 
-	return filename;
+	return rval;
 }
 
 
 int felix_index(struct image *image, IndexingPrivate *ipriv)
 {
-	unsigned int opts;
-	int status;
-	int rval;
-	struct felix_data *felix;
+	int r;
 	struct felix_private *gp = (struct felix_private *) ipriv;
-	char *ini_filename;
 	char gff_filename[1024];
-
-	write_gve (image, gp);
-	ini_filename = write_ini (image, gp);
-
-	if ( ini_filename == NULL ) {
-		ERROR("Failed to write ini file for Felix.\n");
-		return 0;
-	}
-
-	felix = cfmalloc(sizeof(struct felix_data));
-	if ( felix == NULL ) {
-		ERROR("Couldn't allocate memory for Felix data.\n");
-		return 0;
+	char *argv[] = {"Felix", "xfel.ini", NULL};
+
+	/* The ini file is the same for every frame */
+	if ( gp->scratch == NULL ) {
+		gp->scratch = external_scratch_new("felix");
+		if ( gp->scratch == NULL ) return 0;
+		if ( write_ini(gp) ) {
+			ERROR("Failed to write ini file for Felix.\n");
+			external_scratch_free(gp->scratch);
+			gp->scratch = NULL;
+			return 0;
+		}
 	}
 
-	felix->gp = gp;
+	write_gve(image, gp);
 
-	snprintf(gff_filename, 1023, "xfel.felix");
+	snprintf(gff_filename, 1023, "%s/xfel.felix", gp->scratch);
 	remove(gff_filename);
 
-	felix->pid = forkpty(&felix->pty, NULL, NULL, NULL);
-	if ( felix->pid == -1 ) {
-		ERROR("Failed to fork for Felix: %s\n", strerror(errno));
-		return 0;
-	}
-	if ( felix->pid == 0 ) {
-
-		/* Child process: invoke Felix */
-		struct termios t;
-
-		/* Turn echo off */
-		tcgetattr(STDIN_FILENO, &t);
-		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
-		tcsetattr(STDIN_FILENO, TCSANOW, &t);
-
-		STATUS("Running Felix '%s'\n", ini_filename);
-		execlp("Felix", "Felix", ini_filename, (char *)NULL);
-		ERROR("Failed to invoke Felix.\n");
-		_exit(0);
-
-	}
-
-	cffree(ini_filename);
-
-	felix->rbuffer = cfmalloc(256);
-	felix->rbuflen = 256;
-	felix->rbufpos = 0;
-
-	/* Set non-blocking */
-	opts = fcntl(felix->pty, F_GETFL);
-	fcntl(felix->pty, F_SETFL, opts | O_NONBLOCK);
-
-	do {
-
-		fd_set fds;
-		struct timeval tv;
-		int sval;
-
-		FD_ZERO(&fds);
-		FD_SET(felix->pty, &fds);
-
-		tv.tv_sec = gp->maxtime + 1.0;
-		tv.tv_usec = 0;
-
-		sval = select(felix->pty+1, &fds, NULL, NULL, &tv);
-
-		if ( sval == -1 ) {
-
-			const int err = errno;
-
-			switch ( err ) {
-
-				case EINTR:
-				STATUS("Restarting select()\n");
-				rval = 0;
-				break;
-
-				default:
-				ERROR("select() failed: %s\n", strerror(err));
-				rval = 1;
-
-			}
-
-		} else if ( sval != 0 ) {
-			rval = felix_readable(image, felix);
-		} else {
-			ERROR("No response from Felix..\n");
-			rval = 1;
-		}
-
-	} while ( !rval );
-
-	close(felix->pty);
-	cffree(felix->rbuffer);
-	waitpid(felix->pid, &status, 0);
-
-	if ( status != 0 ) {
+	/* Felix does one pattern per run, so there's no way to keep it
+	 * running between frames */
+	r = external_run(gp->scratch, argv, gp->maxtime + 1.0,
+	                 felix_parseline, NULL);
+	if ( r != 0 ) {
 		ERROR("Felix either timed out, or is not working properly.\n");
-		cffree(felix);
 		return 0;
 	}
 
-	rval = read_felix(gp, image, gff_filename);
-
-	cffree(felix);
-	return rval;
-
+	return read_felix(gp, image, gff_filename);
 }
 
 
@@ -710,6 +532,7 @@ void felix_cleanup(IndexingPrivate *pp)
 	struct felix_private *p;
 
 	p = (struct felix_private *) pp;
+	external_scratch_free(p->scratch);
 	cffree(p->readhkl_file);
 	cffree(p);
 }
@@ -61,12 +61,16 @@
 #include "utils.h"
 #include "peaks.h"
 #include "cell-utils.h"
+#include "external.h"
 
 /** \file mosflm.h */
 
 #define MOSFLM_VERBOSE 0
 #define FAKE_CLEN (0.1)
 
+/* Seconds to wait for MOSFLM to say something */
+#define MOSFLM_TIMEOUT (30)
+
 
 typedef enum {
 	MOSFLM_INPUT_NONE,
@@ -76,12 +80,19 @@ typedef enum {
 
 
 
+struct mosflm_data;
+
 struct mosflm_private {
 	IndexingMethod          indm;
 	UnitCell                *template;
+
+	/* Kept between frames */
+	char                    *scratch;
+	struct mosflm_data      *session;
 };
 
 
+/* One running copy of MOSFLM, which processes many frames in turn */
 struct mosflm_data {
 
 	/* MOSFLM auto-indexing low-level stuff */
@@ -90,8 +101,12 @@ struct mosflm_data {
 	char                    *rbuffer;
 	int                     rbufpos;
 	int                     rbuflen;
+	int                     at_prompt;  /* Waiting for us at "MOSFLM =>" */
+	int                     n_frames;
 
-	/* MOSFLM high-level stuff */
+	/* MOSFLM high-level stuff, reset for each frame.  The filenames are
+	 * relative to the scratch folder, where MOSFLM runs.  step=0 means
+	 * that no frame is in progress. */
 	char                    newmatfile[128];
 	char                    imagefile[128];
 	char                    sptfile[128];
@@ -573,7 +588,10 @@ static void mosflm_send_next(struct image *image, struct mosflm_data *mosflm)
 		break;
 
 		default:
-		mosflm_sendline("exit\n", mosflm);
+		/* Autoindexing has finished, and MOSFLM is waiting for
+		 * the next frame */
+		mosflm->at_prompt = 1;
+		mosflm->step = 0;
 		return;
 	}
 
@@ -643,8 +661,12 @@ static int mosflm_readable(struct image *image, struct mosflm_data *mosflm)
 				break;
 
 				case MOSFLM_INPUT_PROMPT :
-				mosflm_send_next(image, mosflm);
-				endbit_length = i+7;
+				if ( mosflm->step == 0 ) {
+					mosflm->at_prompt = 1;
+				} else {
+					mosflm_send_next(image, mosflm);
+				}
+				endbit_length = i+10;
 				break;
 
 				default :
@@ -693,120 +715,152 @@ static int mosflm_readable(struct image *image, struct mosflm_data *mosflm)
 }
 
 
-int run_mosflm(struct image *image, void *ipriv)
+static struct mosflm_data *mosflm_start(struct mosflm_private *mp)
 {
 	struct mosflm_data *mosflm;
-	unsigned int opts;
-	int status;
-	int rval;
+	char *argv[] = {"mosflm", "-n", NULL};
 
 	mosflm = cfmalloc(sizeof(struct mosflm_data));
 	if ( mosflm == NULL ) {
 		ERROR("Couldn't allocate memory for MOSFLM data.\n");
-		return 0;
+		return NULL;
 	}
 
-	snprintf(mosflm->imagefile, 127, "xfel_001.img");
-	write_img(image, mosflm->imagefile); /* Dummy image */
+	mosflm->pid = external_spawn(&mosflm->pty, mp->scratch, argv,
+	                             "ipmosflm");
+	if ( mosflm->pid == -1 ) {
+		cffree(mosflm);
+		return NULL;
+	}
 
-	snprintf(mosflm->sptfile, 127, "xfel_001.spt");
-	write_spt(image, mosflm->sptfile);
+	mosflm->rbuffer = cfmalloc(256);
+	mosflm->rbuflen = 256;
+	mosflm->rbufpos = 0;
+	mosflm->at_prompt = 0;
+	mosflm->n_frames = 0;
+	mosflm->step = 0;
+	mosflm->mp = mp;
 
+	snprintf(mosflm->imagefile, 127, "xfel_001.img");
+	snprintf(mosflm->sptfile, 127, "xfel_001.spt");
 	snprintf(mosflm->newmatfile, 127, "xfel.newmat");
-	remove(mosflm->newmatfile);
 
-	mosflm->pid = forkpty(&mosflm->pty, NULL, NULL, NULL);
+	return mosflm;
+}
 
-	if ( mosflm->pid == -1 ) {
-		ERROR("Failed to fork for MOSFLM: %s\n", strerror(errno));
-		cffree(mosflm);
-		return 0;
-	}
-	if ( mosflm->pid == 0 ) {
 
-		/* Child process: invoke MOSFLM */
-		struct termios t;
+static void mosflm_stop(struct mosflm_data *mosflm, int hard)
+{
+	if ( hard ) {
+		external_kill(mosflm->pid, mosflm->pty);
+	} else {
+		external_stop(mosflm->pid, mosflm->pty, "exit\n");
+	}
+	cffree(mosflm->rbuffer);
+	cffree(mosflm);
+}
 
-		/* Turn echo off */
-		tcgetattr(STDIN_FILENO, &t);
-		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
-		tcsetattr(STDIN_FILENO, TCSANOW, &t);
 
-		execlp("mosflm", "mosflm", "-n", (char *)NULL);
-		execlp("ipmosflm", "ipmosflm", "-n", (char *)NULL);
-		ERROR("Invocation: Failed to invoke MOSFLM: %s\n",
-		      strerror(errno));
-		_exit(0);
+/* Returns -1 if the frame should be tried again with a fresh MOSFLM */
+static int mosflm_index_frame(struct image *image, struct mosflm_private *mp)
+{
+	struct mosflm_data *mosflm;
+	char path[1024];
+	int rval;
+	int finished_ok, success;
 
+	if ( mp->session == NULL ) {
+		mp->session = mosflm_start(mp);
+		if ( mp->session == NULL ) return 0;
 	}
+	mosflm = mp->session;
 
-	mosflm->rbuffer = cfmalloc(256);
-	mosflm->rbuflen = 256;
-	mosflm->rbufpos = 0;
-
-	/* Set non-blocking */
-	opts = fcntl(mosflm->pty, F_GETFL);
-	fcntl(mosflm->pty, F_SETFL, opts | O_NONBLOCK);
+	snprintf(path, 1023, "%s/%s", mp->scratch, mosflm->newmatfile);
+	remove(path);
 
-	mosflm->step = 1;	/* This starts the "initialisation" procedure */
+	/* The detector description and symmetry only need to be given once
+	 * per session.  The rest gets repeated for every frame, because
+	 * MOSFLM might have refined it. */
+	mosflm->step = (mosflm->n_frames > 0) ? 4 : 1;
 	mosflm->finished_ok = 0;
-	mosflm->mp = (struct mosflm_private *)ipriv;
 	mosflm->done = 0;
 	mosflm->success = 0;
 
-	rval = 0;
+	/* If MOSFLM already gave us a prompt at the end of the last frame,
+	 * there won't be another one */
+	if ( mosflm->at_prompt ) {
+		mosflm->at_prompt = 0;
+		mosflm_send_next(image, mosflm);
+	}
+
 	do {
 
-		fd_set fds;
-		struct timeval tv;
-		int sval;
+		rval = external_wait(mosflm->pty, MOSFLM_TIMEOUT);
 
-		FD_ZERO(&fds);
-		FD_SET(mosflm->pty, &fds);
+		if ( rval == 1 ) {
+			rval = mosflm_readable(image, mosflm);
+		} else {
+			if ( rval == 0 ) ERROR("No response from MOSFLM..\n");
+			rval = 1;
+		}
 
-		tv.tv_sec = 30;
-		tv.tv_usec = 0;
+	} while ( !rval && (mosflm->step != 0) );
 
-		sval = select(mosflm->pty+1, &fds, NULL, NULL, &tv);
+	if ( mosflm->finished_ok ) {
+		/* Read the mosflm NEWMAT file and get cell if found */
+		read_newmat(mosflm, path, image);
+	}
 
-		if ( sval == -1 ) {
+	finished_ok = mosflm->finished_ok;
+	success = mosflm->success;
 
-			const int err = errno;
+	if ( rval ) {
 
-			switch ( err ) {
+		/* MOSFLM exited or got stuck.  If it was already running
+		 * before this frame and went away before doing any work,
+		 * this frame deserves another go. */
+		int retry = (mosflm->n_frames > 0) && !finished_ok;
 
-				case EINTR:
-				STATUS("Restarting select()\n");
-				break;
+		mosflm_stop(mosflm, 1);
+		mp->session = NULL;
+		if ( retry ) return -1;
 
-				default:
-				ERROR("select() failed: %s\n", strerror(err));
-				rval = 1;
+	} else {
+		mosflm->n_frames++;
+	}
 
-			}
+	if ( !finished_ok ) {
+		ERROR("MOSFLM doesn't seem to be working properly.\n");
+	}
 
-		} else if ( sval != 0 ) {
-			rval = mosflm_readable(image, mosflm);
-		} else {
-			ERROR("No response from MOSFLM..\n");
-			rval = 1;
-		}
+	return success;
+}
 
-	} while ( !rval );
 
-	close(mosflm->pty);
-	cffree(mosflm->rbuffer);
-	waitpid(mosflm->pid, &status, 0);
+int run_mosflm(struct image *image, void *ipriv)
+{
+	struct mosflm_private *mp = (struct mosflm_private *)ipriv;
+	char path[1024];
+	int rval;
+
+	if ( mp->scratch == NULL ) {
+
+		mp->scratch = external_scratch_new("mosflm");
+		if ( mp->scratch == NULL ) return 0;
+
+		/* The dummy image is the same for every frame */
+		snprintf(path, 1023, "%s/xfel_001.img", mp->scratch);
+		write_img(image, path);
 
-	if ( mosflm->finished_ok == 0 ) {
-		ERROR("MOSFLM doesn't seem to be working properly.\n");
-	} else {
-		/* Read the mosflm NEWMAT file and get cell if found */
-		read_newmat(mosflm, mosflm->newmatfile, image);
 	}
 
-	rval = mosflm->success;
-	cffree(mosflm);
+	snprintf(path, 1023, "%s/xfel_001.spt", mp->scratch);
+	write_spt(image, path);
+
+	rval = mosflm_index_frame(image, mp);
+	if ( rval == -1 ) rval = mosflm_index_frame(image, mp);
+	if ( rval == -1 ) rval = 0;
+
 	return rval;
 }
 
@@ -840,6 +894,10 @@ void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell)
 	mp->template = cell;
 	mp->indm = *indm;
 
+	/* MOSFLM itself gets started for the first frame */
+	mp->scratch = NULL;
+	mp->session = NULL;
+
 	return (IndexingPrivate *)mp;
 }
 
@@ -848,6 +906,8 @@ void mosflm_cleanup(void *pp)
 {
 	struct mosflm_private *p;
 	p = (struct mosflm_private *)pp;
+	if ( p->session != NULL ) mosflm_stop(p->session, 0);
+	external_scratch_free(p->scratch);
 	cffree(p);
 }
 
@@ -124,6 +124,8 @@ struct SpotVec
 	double distance;
 	struct rvec *her_rlp;
 	struct rvec *his_rlp;
+	int her_idx;
+	int his_idx;
 };
 
 /**
@@ -133,6 +135,7 @@ struct SpotVec
 struct TheoryVec
 {
 	struct rvec vec;
+	double len;
 	int asym;
 };
 
@@ -160,6 +163,7 @@ struct taketwo_private
 
 	struct TheoryVec *theory_vecs; /**< Theoretical vectors for given unit cell */
 	unsigned int vec_count; /**< Number of theoretical vectors */
+	unsigned int *len_order; /**< Indices of theory_vecs, shortest first */
 
 	gsl_matrix     **prevSols; /**< Previous solutions to be ignored */
 	unsigned int   numPrevs; /**< Previous solution count */
@@ -182,6 +186,16 @@ struct TakeTwoCell
 	int seed_count;
 	int obs_vec_count;
 
+	/** Look-up table of observed vectors by spot: the vectors involving
+	 * spot i are spot_vecs[spot_start[i]] to spot_vecs[spot_start[i+1]-1],
+	 * in ascending order */
+	int *spot_start;
+	int *spot_vecs;
+
+	/** Spots in the current network are marked with mark_gen */
+	int *spot_mark;
+	int mark_gen;
+
 	/* Options */
 	int member_thresh;
 	double len_tol;   /**< In reciprocal metres */
@@ -308,9 +322,15 @@ static void normalise_rvec(struct rvec *vec)
 }
 
 
+static double rvec_dot(struct rvec v1, struct rvec v2)
+{
+	return v1.u * v2.u + v1.v * v2.v + v1.w * v2.w;
+}
+
+
 static double rvec_cosine(struct rvec v1, struct rvec v2)
 {
-	double dot_prod = v1.u * v2.u + v1.v * v2.v + v1.w * v2.w;
+	double dot_prod = rvec_dot(v1, v2);
 	double v1_length = rvec_length(v1);
 	double v2_length = rvec_length(v2);
 
@@ -592,35 +612,29 @@ static gsl_matrix *generate_rot_mat(struct rvec obs1, struct rvec obs2,
 }
 
 
-static int obs_vecs_share_spot(struct SpotVec *her_obs, struct SpotVec *his_obs)
-{
-	if ( (her_obs->her_rlp == his_obs->her_rlp) ||
-	    (her_obs->her_rlp == his_obs->his_rlp) ||
-	    (her_obs->his_rlp == his_obs->her_rlp) ||
-	    (her_obs->his_rlp == his_obs->his_rlp) ) {
-		return 1;
-	}
-
-	return 0;
-}
-
-
-static int obs_shares_spot_w_array(struct SpotVec *obs_vecs, int test_idx,
-				   int *members, int num)
+/* Marks the spots used by the given network members, so that
+ * shares_marked_spot() can check whether a vector shares a spot with any of
+ * them without looping over the members each time */
+static void mark_network_spots(struct TakeTwoCell *cell, int *members, int num)
 {
 	int i;
 
-	struct SpotVec *her_obs = &obs_vecs[test_idx];
+	cell->mark_gen++;
 
 	for ( i=0; i<num; i++ ) {
-		struct SpotVec *his_obs = &obs_vecs[members[i]];
+		struct SpotVec *obs = &cell->obs_vecs[members[i]];
+		cell->spot_mark[obs->her_idx] = cell->mark_gen;
+		cell->spot_mark[obs->his_idx] = cell->mark_gen;
+	}
+}
 
-		int shares = obs_vecs_share_spot(her_obs, his_obs);
 
-		if ( shares ) return 1;
-	}
+static int shares_marked_spot(struct TakeTwoCell *cell, int test_idx)
+{
+	struct SpotVec *obs = &cell->obs_vecs[test_idx];
 
-	return 0;
+	return (cell->spot_mark[obs->her_idx] == cell->mark_gen)
+	    || (cell->spot_mark[obs->his_idx] == cell->mark_gen);
 }
 
 
@@ -631,30 +645,53 @@ static int obs_vecs_match_angles(int her, int his,
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	struct SpotVec *her_obs = &obs_vecs[her];
 	struct SpotVec *his_obs = &obs_vecs[his];
+	int max_seeds = 0;
 
 	*match_count = 0;
 
 	double min_angle = deg2rad(2.5);
 	double max_angle = deg2rad(187.5);
 
-	/* calculate angle between observed vectors */
+	/* The observed side of things is the same for every candidate
+	 * pair of theoretical vectors, so work it out once: the angle
+	 * between the observed vectors, and the angles they make with the
+	 * third side of the triangle */
 	double obs_angle = rvec_angle(her_obs->obsvec, his_obs->obsvec);
+	struct rvec obs_diff = diff_vec(his_obs->obsvec, her_obs->obsvec);
+	double diff_dist = rvec_length(obs_diff);
+	double her_diff_angle = rvec_angle(her_obs->obsvec, obs_diff);
+	double his_diff_angle = rvec_angle(his_obs->obsvec, obs_diff);
+
+	/* Theoretical pairs with cosines outside this range can't be within
+	 * the angle tolerance, and can be skipped without calling acos().
+	 * The range is a little wider than it needs to be, so that rounding
+	 * never rejects anything which the full check would accept. */
+	double cos_max = cos(fmax(obs_angle - cell->angle_tol, 0.0)) + 1e-9;
+	double cos_min = cos(fmin(obs_angle + cell->angle_tol, M_PI)) - 1e-9;
 
 	/* calculate angle between all potential theoretical vectors */
 
 	int i, j;
 	for ( i=0; i<her_obs->match_num; i++ ) {
+
+		struct TheoryVec *her_match = &her_obs->matches[i];
+		double her_dist = her_match->len;
+
 		for ( j=0; j<his_obs->match_num; j++ ) {
 			double score = 0;
 
-			struct rvec *her_match = &her_obs->matches[i].vec;
-			struct rvec *his_match = &his_obs->matches[j].vec;
+			struct TheoryVec *his_match = &his_obs->matches[j];
+			double his_dist = his_match->len;
 
-			double her_dist = rvec_length(*her_match);
-			double his_dist = rvec_length(*his_match);
+			double cos_theta = rvec_dot(her_match->vec,
+			                            his_match->vec);
+			cos_theta /= her_dist * his_dist;
 
-			double theory_angle = rvec_angle(*her_match,
-			                                 *his_match);
+			if ( (cos_theta > cos_max) || (cos_theta < cos_min) ) {
+				continue;
+			}
+
+			double theory_angle = acos(cos_theta);
 
 			/* is this angle a match? */
 
@@ -681,16 +718,11 @@ static int obs_vecs_match_angles(int her, int his,
 			/* check that third vector adequately completes
 			*  triangle */
 
-			struct rvec theory_diff = diff_vec(*his_match, *her_match);
-			struct rvec obs_diff = diff_vec(his_obs->obsvec,
-			                                her_obs->obsvec);
+			struct rvec theory_diff = diff_vec(his_match->vec,
+			                                   her_match->vec);
 
-			theory_angle = rvec_angle(*her_match,
-			                          theory_diff);
-			obs_angle = rvec_angle(her_obs->obsvec, obs_diff);
-			angle_diff = fabs(obs_angle - theory_angle);
-
-			double diff_dist = rvec_length(obs_diff);
+			theory_angle = rvec_angle(her_match->vec, theory_diff);
+			angle_diff = fabs(her_diff_angle - theory_angle);
 
 			if (angle_diff > ANGLE_TOLERANCE) {
 				continue;
@@ -701,11 +733,9 @@ static int obs_vecs_match_angles(int her, int his,
 				score += add * her_dist * diff_dist;
 			}
 
-			theory_angle = rvec_angle(*his_match,
-			                          theory_diff);
-			obs_angle = rvec_angle(his_obs->obsvec, obs_diff);
+			theory_angle = rvec_angle(his_match->vec, theory_diff);
 
-			if (fabs(obs_angle - theory_angle) > ANGLE_TOLERANCE) {
+			if (fabs(his_diff_angle - theory_angle) > ANGLE_TOLERANCE) {
 				continue;
 			}
 
@@ -714,31 +744,35 @@ static int obs_vecs_match_angles(int her, int his,
 				score += add * his_dist * diff_dist;
 			}
 
-			/* we add a new seed to the array */
-			size_t new_size = (*match_count + 1);
-			new_size *= sizeof(struct Seed);
+			/* we add a new seed to the array, which may need
+			 * to grow first */
+			if ( *match_count == max_seeds ) {
 
-			/* Reallocate the array to fit in another match */
-			struct Seed *tmp_seeds = cfrealloc(*seeds, new_size);
+				struct Seed *tmp_seeds;
 
-			if ( tmp_seeds == NULL ) {
-				apologise();
-			} else {
+				max_seeds = (max_seeds == 0) ? 16 : 2*max_seeds;
+				tmp_seeds = cfrealloc(*seeds, max_seeds
+				                      * sizeof(struct Seed));
+
+				if ( tmp_seeds == NULL ) {
+					apologise();
+					return (*match_count > 0);
+				}
 
 				(*seeds) = tmp_seeds;
+			}
 
-				(*seeds)[*match_count].obs1 = her;
-				(*seeds)[*match_count].obs2 = his;
-				(*seeds)[*match_count].idx1 = i;
-				(*seeds)[*match_count].idx2 = j;
-				(*seeds)[*match_count].score = score * 1000;
+			(*seeds)[*match_count].obs1 = her;
+			(*seeds)[*match_count].obs2 = his;
+			(*seeds)[*match_count].idx1 = i;
+			(*seeds)[*match_count].idx2 = j;
+			(*seeds)[*match_count].score = score * 1000;
 
-	                        (*match_count)++;
-			}
-                }
-        }
+			(*match_count)++;
+		}
+	}
 
-        return (*match_count > 0);
+	return (*match_count > 0);
 }
 
 /* ------------------------------------------------------------------------
@@ -901,6 +935,8 @@ static signed int find_next_index(gsl_matrix *rot, int *obs_members,
 
 	int i, j, k;
 
+	mark_network_spots(cell, obs_members, member_num);
+
 	for ( i=start; i<obs_vec_count; i++ ) {
 
 		/* If we've considered this vector before, ignore it */
@@ -910,10 +946,7 @@ static signed int find_next_index(gsl_matrix *rot, int *obs_members,
 		}
 
 		/* first we check for a shared spot - harshest condition */
-		int shared = obs_shares_spot_w_array(obs_vecs, i, obs_members,
-						     member_num);
-
-		if ( !shared ) continue;
+		if ( !shares_marked_spot(cell, i) ) continue;
 
 		int all_ok = 1;
 		int matched = -1;
@@ -1292,7 +1325,9 @@ static int sort_seed_by_score(const void *av, const void *bv)
 {
 	struct Seed *a = (struct Seed *)av;
 	struct Seed *b = (struct Seed *)bv;
-	return a->score > b->score;
+	if ( a->score > b->score ) return 1;
+	if ( a->score < b->score ) return -1;
+	return 0;
 }
 
 static void remove_old_solutions(struct TakeTwoCell *cell,
@@ -1339,81 +1374,124 @@ static void remove_old_solutions(struct TakeTwoCell *cell,
 //	STATUS("Removing %i duplicates due to prev solutions.\n", duplicates);
 }
 
+/* Adds the seeds for one pair of observed vectors to the full list */
+static void add_pair_seeds(struct TakeTwoCell *cell, int *max_seeds,
+                           int i, int j)
+{
+	/* cell vector index matches stored in i, j and total
+	 * number stored in int matches.
+	 */
+	int seed_num = 0;
+	struct Seed *seeds = NULL;
+	int seed_i;
+
+	/* Check to see if any angles match from the cell
+	 * vectors */
+	obs_vecs_match_angles(i, j, &seeds, &seed_num, cell);
+
+	if (seed_num == 0)
+	{
+		/* Nothing to clean up here */
+		return;
+	}
+
+	/* Weed out the duplicate seeds (from symmetric
+	 * reflection pairs) */
+	weed_duplicate_matches(&seeds, &seed_num, cell);
+
+	/* Add all the new seeds to the full list */
+	if ( cell->seed_count + seed_num > *max_seeds ) {
+
+		int new_max = 2*(*max_seeds);
+		struct Seed *tmp;
+
+		if ( new_max < cell->seed_count + seed_num ) {
+			new_max = cell->seed_count + seed_num;
+		}
+
+		tmp = cfrealloc(cell->seeds, new_max*sizeof(struct Seed));
+		if (tmp == NULL) {
+			apologise();
+			cffree(seeds);
+			return;
+		}
+
+		cell->seeds = tmp;
+		*max_seeds = new_max;
+	}
+
+	for ( seed_i = 0; seed_i < seed_num; seed_i++)
+	{
+		if (seeds[seed_i].idx1 < 0 || seeds[seed_i].idx2 < 0)
+		{
+			continue;
+		}
+
+		cell->seeds[cell->seed_count] = seeds[seed_i];
+		cell->seed_count++;
+	}
+
+	cffree(seeds);
+}
+
+
 static int find_seeds(struct TakeTwoCell *cell, struct taketwo_private *tp)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	int obs_vec_count = cell->obs_vec_count;
+	int max_seeds = 0;
 
 	/* loop round pairs of vectors to try and find a suitable
-	 * seed to start building a self-consistent network of vectors
+	 * seed to start building a self-consistent network of vectors.
+	 * Only pairs which share a spot can form a seed, so the partners for
+	 * each vector come from the look-up table by spot.  Both lists for
+	 * the spots of vector i are in ascending order, so merging them
+	 * visits the partners j<i in the same order as looping over all
+	 * pairs would.
 	 */
-	int i, j;
+	int i;
 
 	for ( i=1; i<obs_vec_count; i++ ) {
 
-		for ( j=0; j<i; j++ ) {
+		int *her_list = &cell->spot_vecs[cell->spot_start[obs_vecs[i].her_idx]];
+		int *his_list = &cell->spot_vecs[cell->spot_start[obs_vecs[i].his_idx]];
+		int her_n = cell->spot_start[obs_vecs[i].her_idx+1]
+		          - cell->spot_start[obs_vecs[i].her_idx];
+		int his_n = cell->spot_start[obs_vecs[i].his_idx+1]
+		          - cell->spot_start[obs_vecs[i].his_idx];
+		int a = 0;
+		int b = 0;
 
-			/** Only check distances which are accumulatively less
-			* than the limit if we can easily generate seeds */
-			if (obs_vecs[j].distance + obs_vecs[i].distance >
-			    MAX_RECIP_DISTANCE && cell->seed_count > 100) {
-				continue;
-			}
+		while ( 1 ) {
 
-			/** Check to see if there is a shared spot - opportunity
-			 * for optimisation by generating a look-up table
-			 * by spot instead of by vector.
-			 */
-			int shared = obs_vecs_share_spot(&obs_vecs[i],
-			                                 &obs_vecs[j]);
-			if ( !shared ) continue;
-
-			/* cell vector index matches stored in i, j and total
-			 * number stored in int matches.
-			 */
-			int seed_num = 0;
-			struct Seed *seeds = NULL;
-
-			/* Check to see if any angles match from the cell
-			 * vectors */
-			obs_vecs_match_angles(i, j, &seeds, &seed_num, cell);
-
-			if (seed_num == 0)
-			{
-				/* Nothing to clean up here */
-				continue;
-			}
-
-			/* Weed out the duplicate seeds (from symmetric
-			 * reflection pairs) */
-			weed_duplicate_matches(&seeds, &seed_num, cell);
-
-			/* Add all the new seeds to the full list */
+			int j;
 
-			size_t new_size = cell->seed_count + seed_num;
-			new_size *= sizeof(struct Seed);
-
-			struct Seed *tmp = cfrealloc(cell->seeds, new_size);
-
-			if (tmp == NULL) {
-				apologise();
+			if ( (a < her_n) && (b < his_n) ) {
+				if ( her_list[a] < his_list[b] ) {
+					j = her_list[a++];
+				} else {
+					j = his_list[b++];
+				}
+			} else if ( a < her_n ) {
+				j = her_list[a++];
+			} else if ( b < his_n ) {
+				j = his_list[b++];
+			} else {
+				break;
 			}
 
-			cell->seeds = tmp;
+			/* Only the partners before i, and never i itself
+			 * (which is in both lists) */
+			if ( j >= i ) break;
 
-			int seed_i;
-			for ( seed_i = 0; seed_i < seed_num; seed_i++)
-			{
-				if (seeds[seed_i].idx1 < 0 || seeds[seed_i].idx2 < 0)
-				{
-					continue;
-				}
-
-				cell->seeds[cell->seed_count] = seeds[seed_i];
-				cell->seed_count++;
+			/** Only check distances which are accumulatively less
+			* than the limit if we can easily generate seeds */
+			if (obs_vecs[j].distance + obs_vecs[i].distance >
+			    MAX_RECIP_DISTANCE && cell->seed_count > 100) {
+				continue;
 			}
 
-			cffree(seeds);
+			add_pair_seeds(cell, &max_seeds, i, j);
 		}
 	}
 
@@ -1580,31 +1658,77 @@ struct sortme
 {
 	struct TheoryVec v;
 	double dist;
+	unsigned int idx;
 };
 
 static int sort_theory_distances(const void *av, const void *bv)
 {
 	struct sortme *a = (struct sortme *)av;
 	struct sortme *b = (struct sortme *)bv;
-	return a->dist > b->dist;
+	if ( a->dist > b->dist ) return 1;
+	if ( a->dist < b->dist ) return -1;
+
+	/* Equally good matches stay in the order they were generated */
+	if ( a->idx > b->idx ) return 1;
+	if ( a->idx < b->idx ) return -1;
+	return 0;
+}
+
+/* Returns the position in tp->len_order of the first theoretical vector
+ * which is at least as long as min_len */
+static unsigned int first_theory_vec_longer(struct taketwo_private *tp,
+                                            double min_len)
+{
+	unsigned int lo = 0;
+	unsigned int hi = tp->vec_count;
+
+	while ( lo < hi ) {
+		unsigned int mid = lo + (hi-lo)/2;
+		if ( tp->theory_vecs[tp->len_order[mid]].len < min_len ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
 }
 
-static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_count,
+static int match_obs_to_cell_vecs(struct taketwo_private *tp,
 				  struct TakeTwoCell *cell)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	int obs_vec_count = cell->obs_vec_count;
+	struct TheoryVec *cell_vecs = tp->theory_vecs;
+	struct sortme *for_sort;
+	int max_sort = 0;
 	int i, j;
 
+	for_sort = NULL;
+
 	for ( i=0; i<obs_vec_count; i++ ) {
 
 		int count = 0;
-		struct sortme *for_sort = NULL;
+		double obs_length = obs_vecs[i].distance;
+		unsigned int k;
+
+		/* Only the theoretical vectors with about the right length
+		 * need to be looked at.  The window is slightly too wide,
+		 * and the exact tolerance check below does the rest. */
+		double slack = 1e-6*cell->len_tol;
+
+		k = first_theory_vec_longer(tp, obs_length - cell->len_tol
+		                                           - slack);
+
+		for ( ; k<tp->vec_count; k++ ) {
+
+			unsigned int idx = tp->len_order[k];
 
-		for ( j=0; j<cell_vec_count; j++ ) {
 			/* get distance for unit cell vector */
-			double cell_length = rvec_length(cell_vecs[j].vec);
-			double obs_length = obs_vecs[i].distance;
+			double cell_length = cell_vecs[idx].len;
+
+			if ( cell_length > obs_length + cell->len_tol
+			                              + slack ) break;
 
 			/* check if this matches the observed length */
 			double dist_diff = fabs(cell_length - obs_length);
@@ -1613,13 +1737,21 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 
 			/* we have a match, add to array! */
 
-			size_t new_size = (count+1)*sizeof(struct sortme);
-			for_sort = srealloc(for_sort, new_size);
-
-			if ( for_sort == NULL ) return 0;
+			if ( count == max_sort ) {
+				struct sortme *tmp;
+				max_sort = (max_sort == 0) ? 64 : 2*max_sort;
+				tmp = cfrealloc(for_sort,
+				                max_sort*sizeof(struct sortme));
+				if ( tmp == NULL ) {
+					cffree(for_sort);
+					return 0;
+				}
+				for_sort = tmp;
+			}
 
-			for_sort[count].v = cell_vecs[j];
+			for_sort[count].v = cell_vecs[idx];
 			for_sort[count].dist = dist_diff;
+			for_sort[count].idx = idx;
 			count++;
 
 		}
@@ -1632,7 +1764,8 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 		match_array = &(obs_vecs[i].matches);
 		match_count = &(obs_vecs[i].match_num);
 
-		if ( for_sort == NULL ) {
+		if ( count == 0 ) {
+			cffree(for_sort);
 			return 0;
 		}
 
@@ -1644,9 +1777,10 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 			(*match_array)[j] = for_sort[j].v;
 
 		}
-		cffree(for_sort);
 	}
 
+	cffree(for_sort);
+
 	return 1;
 }
 
@@ -1654,7 +1788,49 @@ static int compare_spot_vecs(const void *av, const void *bv)
 {
 	struct SpotVec *a = (struct SpotVec *)av;
 	struct SpotVec *b = (struct SpotVec *)bv;
-	return a->distance > b->distance;
+	if ( a->distance > b->distance ) return 1;
+	if ( a->distance < b->distance ) return -1;
+	return 0;
+}
+
+/* Builds the look-up table of observed vectors by spot, used to find the
+ * vectors which share a spot with a given one without looking at all of
+ * them */
+static int gen_spot_table(struct TakeTwoCell *cell, int rlp_count)
+{
+	int i;
+	int *fill;
+
+	cell->spot_start = cfcalloc(rlp_count+1, sizeof(int));
+	cell->spot_vecs = cfmalloc(2*cell->obs_vec_count*sizeof(int));
+	cell->spot_mark = cfcalloc(rlp_count, sizeof(int));
+	fill = cfcalloc(rlp_count, sizeof(int));
+	if ( (cell->spot_start == NULL) || (cell->spot_vecs == NULL)
+	  || (cell->spot_mark == NULL) || (fill == NULL) )
+	{
+		cffree(fill);
+		return 0;
+	}
+	cell->mark_gen = 0;
+
+	for ( i=0; i<cell->obs_vec_count; i++ ) {
+		cell->spot_start[cell->obs_vecs[i].her_idx+1]++;
+		cell->spot_start[cell->obs_vecs[i].his_idx+1]++;
+	}
+	for ( i=0; i<rlp_count; i++ ) {
+		cell->spot_start[i+1] += cell->spot_start[i];
+	}
+
+	/* Vectors are added in order, so each list is sorted */
+	for ( i=0; i<cell->obs_vec_count; i++ ) {
+		int her = cell->obs_vecs[i].her_idx;
+		int his = cell->obs_vecs[i].his_idx;
+		cell->spot_vecs[cell->spot_start[her] + fill[her]++] = i;
+		cell->spot_vecs[cell->spot_start[his] + fill[his]++] = i;
+	}
+
+	cffree(fill);
+	return 1;
 }
 
 static int gen_observed_vecs(struct rvec *rlps, int rlp_count,
@@ -1662,6 +1838,7 @@ static int gen_observed_vecs(struct rvec *rlps, int rlp_count,
 {
 	int i, j;
 	int count = 0;
+	int max_count = 0;
 
 	/* maximum distance squared for comparisons */
 	double max_sq_length = pow(MAX_RECIP_DISTANCE, 2);
@@ -1677,31 +1854,32 @@ static int gen_observed_vecs(struct rvec *rlps, int rlp_count,
 
 			if ( sqlength > max_sq_length ) continue;
 
-			count++;
-
-			struct SpotVec *temp_obs_vecs;
-			temp_obs_vecs = cfrealloc(cell->obs_vecs,
-			                          count*sizeof(struct SpotVec));
-
-			if ( temp_obs_vecs == NULL ) {
-				return 0;
-			} else {
+			if ( count == max_count ) {
+				struct SpotVec *temp_obs_vecs;
+				max_count = (max_count == 0) ? 64 : 2*max_count;
+				temp_obs_vecs = cfrealloc(cell->obs_vecs,
+				                          max_count*sizeof(struct SpotVec));
+				if ( temp_obs_vecs == NULL ) return 0;
 				cell->obs_vecs = temp_obs_vecs;
+			}
 
-				/* initialise all SpotVec struct members */
-
-				struct SpotVec spot_vec;
-				spot_vec.obsvec = diff;
-				spot_vec.distance = sqrt(sqlength);
-				spot_vec.matches = NULL;
-				spot_vec.assignment = -1;
-				spot_vec.match_num = 0;
-				spot_vec.her_rlp = &rlps[i];
-				spot_vec.his_rlp = &rlps[j];
-				spot_vec.in_network = 0;
+			count++;
 
-				cell->obs_vecs[count - 1] = spot_vec;
-			}
+			/* initialise all SpotVec struct members */
+
+			struct SpotVec spot_vec;
+			spot_vec.obsvec = diff;
+			spot_vec.distance = sqrt(sqlength);
+			spot_vec.matches = NULL;
+			spot_vec.assignment = -1;
+			spot_vec.match_num = 0;
+			spot_vec.her_rlp = &rlps[i];
+			spot_vec.his_rlp = &rlps[j];
+			spot_vec.her_idx = i;
+			spot_vec.his_idx = j;
+			spot_vec.in_network = 0;
+
+			cell->obs_vecs[count - 1] = spot_vec;
 		}
 	}
 
@@ -1715,7 +1893,7 @@ static int gen_observed_vecs(struct rvec *rlps, int rlp_count,
 
 	cell->obs_vec_count = count;
 
-	return 1;
+	return gen_spot_table(cell, rlp_count);
 }
 
 
@@ -1767,6 +1945,7 @@ static int gen_theoretical_vecs(UnitCell *cell, struct TheoryVec **cell_vecs,
 
 		struct TheoryVec theory;
 		theory.vec = cell_vec;
+		theory.len = rvec_length(cell_vec);
 		theory.asym = asymmetric;
 
 		/* add this to our array - which may require expanding */
@@ -1794,6 +1973,57 @@ static int gen_theoretical_vecs(UnitCell *cell, struct TheoryVec **cell_vecs,
 }
 
 
+struct sortlen
+{
+	double len;
+	unsigned int idx;
+};
+
+static int compare_theory_lengths(const void *av, const void *bv)
+{
+	struct sortlen *a = (struct sortlen *)av;
+	struct sortlen *b = (struct sortlen *)bv;
+	if ( a->len > b->len ) return 1;
+	if ( a->len < b->len ) return -1;
+	if ( a->idx > b->idx ) return 1;
+	if ( a->idx < b->idx ) return -1;
+	return 0;
+}
+
+/* Sorts the theoretical vectors by length, so that the ones matching an
+ * observed vector can be found by binary search */
+static unsigned int *gen_theory_len_order(struct TheoryVec *cell_vecs,
+                                          unsigned int vec_count)
+{
+	struct sortlen *for_sort;
+	unsigned int *order;
+	unsigned int i;
+
+	for_sort = cfmalloc((vec_count+1)*sizeof(struct sortlen));
+	order = cfmalloc((vec_count+1)*sizeof(unsigned int));
+	if ( (for_sort == NULL) || (order == NULL) ) {
+		cffree(for_sort);
+		cffree(order);
+		return NULL;
+	}
+
+	for ( i=0; i<vec_count; i++ ) {
+		for_sort[i].len = cell_vecs[i].len;
+		for_sort[i].idx = i;
+	}
+
+	qsort(for_sort, vec_count, sizeof(struct sortlen),
+	      compare_theory_lengths);
+
+	for ( i=0; i<vec_count; i++ ) {
+		order[i] = for_sort[i].idx;
+	}
+
+	cffree(for_sort);
+	return order;
+}
+
+
 /* ------------------------------------------------------------------------
  * cleanup functions - called from run_taketwo().
  * ------------------------------------------------------------------------*/
@@ -1821,6 +2051,9 @@ static void cleanup_taketwo_cell(struct TakeTwoCell *ttCell)
 
 	cleanup_taketwo_obs_vecs(ttCell->obs_vecs,
 	                         ttCell->obs_vec_count);
+	cffree(ttCell->spot_start);
+	cffree(ttCell->spot_vecs);
+	cffree(ttCell->spot_mark);
 
 	gsl_vector_free(ttCell->vec1Tmp);
 	gsl_vector_free(ttCell->vec2Tmp);
@@ -1862,6 +2095,10 @@ static UnitCell *run_taketwo(UnitCell *cell, const struct taketwo_options *opts,
 	ttCell.vec2Tmp = gsl_vector_calloc(3);
 	ttCell.numOps = 0;
 	ttCell.obs_vec_count = 0;
+	ttCell.spot_start = NULL;
+	ttCell.spot_vecs = NULL;
+	ttCell.spot_mark = NULL;
+	ttCell.mark_gen = 0;
 	ttCell.solution = NULL;
 	ttCell.x_ang = 0;
 	ttCell.y_ang = 0;
@@ -1903,8 +2140,7 @@ static UnitCell *run_taketwo(UnitCell *cell, const struct taketwo_options *opts,
 		ttCell.trace_tol = sqrt(4.0*(1.0-cos(opts->trace_tol)));
 	}
 
-	success = match_obs_to_cell_vecs(tp->theory_vecs, tp->vec_count,
-					 &ttCell);
+	success = match_obs_to_cell_vecs(tp, &ttCell);
 
 	if ( !success ) {
 		cleanup_taketwo_cell(&ttCell);
@@ -2112,6 +2348,12 @@ void *taketwo_prepare(IndexingMethod *indm, struct taketwo_options *opts,
 	tp->theory_vecs = NULL;
 
 	gen_theoretical_vecs(cell, &tp->theory_vecs, &tp->vec_count);
+	tp->len_order = gen_theory_len_order(tp->theory_vecs, tp->vec_count);
+	if ( tp->len_order == NULL ) {
+		cffree(tp->theory_vecs);
+		cffree(tp);
+		return NULL;
+	}
 
 	return tp;
 }
@@ -2123,6 +2365,7 @@ void taketwo_cleanup(IndexingPrivate *pp)
 
 	partial_taketwo_cleanup(tp);
 	cffree(tp->theory_vecs);
+	cffree(tp->len_order);
 
 	cffree(tp);
 }
@@ -54,6 +54,7 @@
 #include "utils.h"
 #include "peaks.h"
 #include "cell-utils.h"
+#include "external.h"
 
 /** \file xds.h */
 
@@ -61,12 +62,19 @@
 #define FAKE_PIXEL_SIZE (70e-6)
 #define FAKE_CLEN (0.1)
 
+/* Seconds to wait for XDS to say something */
+#define XDS_TIMEOUT (60)
+
 
 /* Global private data, prepared once */
 struct xds_private
 {
 	IndexingMethod indm;
 	UnitCell *cell;
+
+	/* Kept between frames */
+	char *scratch;
+	double inp_lambda;  /* Wavelength in current XDS.INP, or -1 */
 };
 
 
@@ -96,7 +104,7 @@ static int convert_spacegroup_number(int spg, LatticeType *lt, char *cen,
 }
 
 
-static int read_cell(struct image *image)
+static int read_cell(struct image *image, const char *dir)
 {
 	FILE * fh;
 	float ax, ay, az;
@@ -108,8 +116,10 @@ static int read_cell(struct image *image)
 	LatticeType latticetype;
 	char centering, ua;
 	Crystal *cr;
+	char filename[1024];
 
-	fh = fopen("IDXREF.LP", "r");
+	snprintf(filename, 1023, "%s/IDXREF.LP", dir);
+	fh = fopen(filename, "r");
 	if ( fh == NULL ) return 0; /* Not indexable */
 
 	do {
@@ -192,15 +202,17 @@ static int read_cell(struct image *image)
 }
 
 
-static void write_spot(struct image *image)
+static void write_spot(struct image *image, const char *dir)
 {
 	FILE *fh;
 	int i;
 	int n;
+	char filename[1024];
 
-	fh = fopen("SPOT.XDS", "w");
+	snprintf(filename, 1023, "%s/SPOT.XDS", dir);
+	fh = fopen(filename, "w");
 	if ( !fh ) {
-		ERROR("Couldn't open temporary file '%s'\n", "SPOT.XDS");
+		ERROR("Couldn't open temporary file '%s'\n", filename);
 		return;
 	}
 
@@ -318,8 +330,10 @@ static const char *xds_spacegroup_for_lattice(UnitCell *cell)
 static int write_inp(struct image *image, struct xds_private *xp)
 {
 	FILE *fh;
+	char filename[1024];
 
-	fh = fopen("XDS.INP", "w");
+	snprintf(filename, 1023, "%s/XDS.INP", xp->scratch);
+	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open XDS.INP\n");
 		return 1;
@@ -383,53 +397,43 @@ static int write_inp(struct image *image, struct xds_private *xp)
 
 int run_xds(struct image *image, void *priv)
 {
-	int status;
-	int rval;
 	int n;
-	pid_t pid;
-	int pty;
+	char filename[1024];
+	char *argv[] = {"xds", NULL};
 	struct xds_private *xp = (struct xds_private *)priv;
 
-	if ( write_inp(image, xp) ) {
-		ERROR("Failed to write XDS.INP file for XDS.\n");
-		return 0;
-	}
-
 	n = image_feature_count(image->features);
 	if ( n < 25 ) return 0;
 
-	write_spot(image);
-
-	/* Delete any old indexing result which may exist */
-	remove("IDXREF.LP");
-
-	pid = forkpty(&pty, NULL, NULL, NULL);
-
-	if ( pid == -1 ) {
-		ERROR("Failed to fork for XDS\n");
-		return 0;
+	if ( xp->scratch == NULL ) {
+		xp->scratch = external_scratch_new("xds");
+		if ( xp->scratch == NULL ) return 0;
 	}
-	if ( pid == 0 ) {
 
-		/* Child process: invoke XDS */
-		struct termios t;
+	/* XDS.INP only depends on the wavelength */
+	if ( image->lambda != xp->inp_lambda ) {
+		if ( write_inp(image, xp) ) {
+			ERROR("Failed to write XDS.INP file for XDS.\n");
+			xp->inp_lambda = -1.0;
+			return 0;
+		}
+		xp->inp_lambda = image->lambda;
+	}
 
-		/* Turn echo off */
-		tcgetattr(STDIN_FILENO, &t);
-		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
-		tcsetattr(STDIN_FILENO, TCSANOW, &t);
+	write_spot(image, xp->scratch);
 
-		execlp("xds", "xds", (char *)NULL);
-		ERROR("Failed to invoke XDS.\n");
-		_exit(0);
+	/* Delete any old indexing result which may exist */
+	snprintf(filename, 1023, "%s/IDXREF.LP", xp->scratch);
+	remove(filename);
 
+	/* XDS can only do one job per run, so there's no way to keep it
+	 * running between frames */
+	if ( external_run(xp->scratch, argv, XDS_TIMEOUT, NULL, NULL) == -1 ) {
+		ERROR("XDS either timed out, or is not working properly.\n");
+		return 0;
 	}
-	waitpid(pid, &status, 0);
-
-	close(pty);
-	rval = read_cell(image);
 
-	return rval;
+	return read_cell(image, xp->scratch);
 }
 
 
@@ -477,6 +481,8 @@ void *xds_prepare(IndexingMethod *indm, UnitCell *cell)
 
 	xp->cell = cell;
 	xp->indm = *indm;
+	xp->scratch = NULL;
+	xp->inp_lambda = -1.0;
 
 	return xp;
 }
@@ -487,6 +493,7 @@ void xds_cleanup(void *pp)
 	struct xds_private *xp;
 
 	xp = (struct xds_private *)pp;
+	external_scratch_free(xp->scratch);
 	cffree(xp);
 }
 
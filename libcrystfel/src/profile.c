@@ -30,230 +30,908 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
-#include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "profile.h"
 #include "utils.h"
 
-#ifndef CLOCK_MONOTONIC_RAW
-#define CLOCK_MONOTONIC_RAW (CLOCK_MONOTONIC)
-#endif
 
-struct _profile_block
-{
-	char *name;
+/* Blocks are aggregated into a call tree for each thread.  All the storage
+ * is allocated up front, so that profile_start() and profile_end() only need
+ * to look up the block (by name) among the children of the current one. */
+#define MAX_NODES (512)
+#define MAX_DEPTH (64)
+#define MAX_NAMES (1024)
+#define MAX_EVENTS (4096)
 
-	time_t start_sec;
-	long start_nsec;
-	double total_time;
+/* Aggregated results are written at most this often, in seconds */
+#define STATS_INTERVAL (5.0)
 
-	struct _profile_block *parent;
-	struct _profile_block **children;
-	int n_children;
-	int max_children;
+
+struct profile_stats
+{
+	uint64_t count;
+	uint64_t total;  /* All times in nanoseconds */
+	uint64_t min;
+	uint64_t max;
+	uint64_t hist[PROFILE_N_BINS];
 };
 
 
-struct _profiledata
+struct profile_node
 {
-	struct _profile_block *root;
-	struct _profile_block *current;
+	int name;              /* Index into names[] */
+	const char *key;       /* Last pointer given for this name */
+	int parent;
+	int first_child;
+	int next_sibling;
+	struct profile_stats stats;
 };
 
 
-struct _profiledata *pd = NULL;
+struct profile_event
+{
+	int node;
+	uint64_t start;
+	uint64_t duration;
+};
 
 
-static struct _profile_block *start_profile_block(const char *name)
+struct profile_thread
 {
-	struct _profile_block *b;
+	/* Protects the node list, stats and events against the thread which
+	 * writes them out.  Never contended otherwise. */
+	pthread_mutex_t lock;
 
-	b = cfmalloc(sizeof(struct _profile_block));
-	if ( b == NULL ) return NULL;
+	int id;
+	int in_use;
+	struct profile_thread *next;
 
-	b->name = cfstrdup(name);
-	if ( b->name == NULL ) {
-		cffree(b);
-		return NULL;
-	}
-	b->n_children = 0;
-	b->max_children = 0;
-	b->children = NULL;
+	struct profile_node nodes[MAX_NODES];
+	int n_nodes;
+	int n_dropped;
 
-#ifdef HAVE_CLOCK_GETTIME
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	b->start_sec = tp.tv_sec;
-	b->start_nsec = tp.tv_nsec;
-#endif
+	int stack[MAX_DEPTH];
+	uint64_t start[MAX_DEPTH];
+	int depth;
+
+	struct profile_event *events;
+	int n_events;
+};
 
-	return b;
-}
 
+static int profiling = 0;
 
-static void stop_profile_block(struct _profile_block *b)
+/* Protects everything below */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *names[MAX_NAMES];
+static int n_names = 0;
+
+static struct profile_thread *threads = NULL;
+static int n_threads = 0;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static char *stats_filename = NULL;
+static FILE *trace_fh = NULL;
+static int trace_pid = 0;
+static uint64_t last_stats_write = 0;
+
+
+static uint64_t now_ns()
 {
 #ifdef HAVE_CLOCK_GETTIME
+	/* Not CLOCK_MONOTONIC_RAW, because the trace timestamps need to be
+	 * comparable between processes */
 	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	time_t sec = tp.tv_sec - b->start_sec;
-	long nsec = tp.tv_nsec - b->start_nsec;
-	b->total_time = sec + nsec*1e-9;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000000000 + tp.tv_nsec;
 #else
-	b->total_time = 0.0;
+	return 0;
 #endif
 }
 
 
-void profile_init()
+static int histogram_bin(uint64_t ns)
 {
-	if ( pd != NULL ) {
-		fprintf(stderr, "Attempted to initialise profiling twice!\n");
-		fflush(stderr);
-		abort();
-	}
+	uint64_t us = ns / 1000;
+	int bin = 0;
 
-	if ( pd == NULL ) {
-		pd = cfmalloc(sizeof(struct _profiledata));
-		if ( pd == NULL ) return;
+	while ( (us > 0) && (bin < PROFILE_N_BINS-1) ) {
+		us >>= 1;
+		bin++;
 	}
 
-	pd->root = start_profile_block("root");
-	pd->current = pd->root;
-	pd->root->parent = NULL;
+	return bin;
+}
 
-#ifndef HAVE_CLOCK_GETTIME
-	printf("Profiling disabled because clock_gettime is not available\n");
-#endif
+
+static void add_sample(struct profile_stats *st, uint64_t ns)
+{
+	if ( (st->count == 0) || (ns < st->min) ) st->min = ns;
+	if ( ns > st->max ) st->max = ns;
+	st->count++;
+	st->total += ns;
+	st->hist[histogram_bin(ns)]++;
 }
 
 
-static char *format_profile_block(struct _profile_block *b)
+static void add_stats(struct profile_stats *st, const struct profile_stats *a)
 {
 	int i;
-	size_t total_len = 0;
-	char **subbufs;
-	char *full_buf;
 
-	subbufs = cfmalloc(b->n_children * sizeof(char *));
-	if ( subbufs == NULL ) return NULL;
+	if ( a->count == 0 ) return;
+	if ( (st->count == 0) || (a->min < st->min) ) st->min = a->min;
+	if ( a->max > st->max ) st->max = a->max;
+	st->count += a->count;
+	st->total += a->total;
+	for ( i=0; i<PROFILE_N_BINS; i++ ) st->hist[i] += a->hist[i];
+}
+
 
-	total_len = 32 + strlen(b->name);
-	for ( i=0; i<b->n_children; i++ ) {
-		subbufs[i] = format_profile_block(b->children[i]);
-		if ( subbufs[i] == NULL ) return NULL;
-		total_len += 1 + strlen(subbufs[i]);
+static void write_json_string(FILE *fh, const char *str)
+{
+	fputc('"', fh);
+	for ( ; *str!='\0'; str++ ) {
+		if ( (*str == '"') || (*str == '\\') ) {
+			fprintf(fh, "\\%c", *str);
+		} else if ( (unsigned char)*str < 0x20 ) {
+			fprintf(fh, "\\u%04x", *str);
+		} else {
+			fputc(*str, fh);
+		}
 	}
+	fputc('"', fh);
+}
+
+
+/* Called with profile_lock held */
+static int intern_name(const char *name)
+{
+	int i;
+
+	for ( i=0; i<n_names; i++ ) {
+		if ( strcmp(names[i], name) == 0 ) return i;
+	}
+
+	if ( n_names == MAX_NAMES ) return -1;
+	names[n_names] = cfstrdup(name);
+	if ( names[n_names] == NULL ) return -1;
+	return n_names++;
+}
+
+
+static void release_thread(void *vp)
+{
+	struct profile_thread *t = vp;
+
+	/* The results are kept, and the record will be reused by the next
+	 * new thread.  This keeps the numbers bounded when threads are
+	 * created for each frame. */
+	pthread_mutex_lock(&profile_lock);
+	t->depth = 0;
+	t->in_use = 0;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+static void make_thread_key()
+{
+	pthread_key_create(&thread_key, release_thread);
+}
+
+
+/* Called with profile_lock held */
+static void reset_thread(struct profile_thread *t)
+{
+	/* Node 0 is the root */
+	t->nodes[0].name = -1;
+	t->nodes[0].parent = -1;
+	t->nodes[0].first_child = -1;
+	t->nodes[0].next_sibling = -1;
+	t->n_nodes = 1;
+	t->n_dropped = 0;
+	t->n_events = 0;
+
+	if ( (trace_fh != NULL) && (t->events == NULL) ) {
+		t->events = cfmalloc(MAX_EVENTS*sizeof(struct profile_event));
+	} else if ( trace_fh == NULL ) {
+		cffree(t->events);
+		t->events = NULL;
+	}
+}
+
+
+static struct profile_thread *new_thread()
+{
+	struct profile_thread *t;
+
+	pthread_mutex_lock(&profile_lock);
+
+	for ( t=threads; t!=NULL; t=t->next ) {
+		if ( !t->in_use ) break;
+	}
+
+	if ( t == NULL ) {
+
+		t = cfcalloc(1, sizeof(struct profile_thread));
+		if ( t == NULL ) {
+			pthread_mutex_unlock(&profile_lock);
+			return NULL;
+		}
+		pthread_mutex_init(&t->lock, NULL);
+		t->id = n_threads++;
+		reset_thread(t);
+
+		/* The first thread (usually the main one) comes first in the
+		 * output */
+		if ( threads == NULL ) {
+			threads = t;
+		} else {
+			struct profile_thread *last = threads;
+			while ( last->next != NULL ) last = last->next;
+			last->next = t;
+		}
 
-	full_buf = cfmalloc(total_len);
-	snprintf(full_buf, 32, "(%s %.3f", b->name, b->total_time);
-	for ( i=0; i<b->n_children; i++ ) {
-		strcat(full_buf, " ");
-		strcat(full_buf, subbufs[i]);
-		cffree(subbufs[i]);
 	}
-	strcat(full_buf, ")");
 
-	cffree(subbufs);
+	t->in_use = 1;
+	t->depth = 0;
 
-	return full_buf;
+	pthread_mutex_unlock(&profile_lock);
+
+	pthread_setspecific(thread_key, t);
+	return t;
 }
 
 
-static void free_profile_block(struct _profile_block *b)
+/* Called with profile_lock and t->lock held */
+static void write_events(struct profile_thread *t)
 {
 	int i;
-	for ( i=0; i<b->n_children; i++ ) {
-		free_profile_block(b->children[i]);
+
+	if ( trace_fh != NULL ) {
+		for ( i=0; i<t->n_events; i++ ) {
+			struct profile_event *ev = &t->events[i];
+			fprintf(trace_fh, "{\"name\":");
+			write_json_string(trace_fh,
+			                  names[t->nodes[ev->node].name]);
+			fprintf(trace_fh, ",\"ph\":\"X\",\"pid\":%i,\"tid\":%i,"
+			        "\"ts\":%.3f,\"dur\":%.3f},\n",
+			        trace_pid, t->id,
+			        ev->start/1e3, ev->duration/1e3);
+		}
 	}
-	cffree(b->children);
-	cffree(b->name);
-	cffree(b);
+
+	t->n_events = 0;
 }
 
 
-void profile_print_and_reset(int worker_id)
+/* Called with profile_lock and t->lock held */
+static void write_node(FILE *fh, struct profile_thread *t, int node,
+                       char *path, size_t path_len)
 {
-	char *buf;
-	char *buf2;
+	size_t len = strlen(path);
+	int c;
+
+	if ( node != 0 ) {
+		struct profile_stats *st = &t->nodes[node].stats;
+		int i;
+		fprintf(fh, "%llu %llu %llu %llu",
+		        (unsigned long long)st->count,
+		        (unsigned long long)st->total,
+		        (unsigned long long)st->min,
+		        (unsigned long long)st->max);
+		for ( i=0; i<PROFILE_N_BINS; i++ ) {
+			fprintf(fh, " %llu", (unsigned long long)st->hist[i]);
+		}
+		fprintf(fh, " %s\n", path);
+	}
 
-	if ( pd == NULL ) {
-		fprintf(stderr, "Profiling not initialised yet!\n");
-		fflush(stderr);
-		abort();
+	for ( c=t->nodes[node].first_child; c!=-1; c=t->nodes[c].next_sibling ) {
+		snprintf(path+len, path_len-len, "%s%s",
+		         (node == 0) ? "" : "/", names[t->nodes[c].name]);
+		write_node(fh, t, c, path, path_len);
+		path[len] = '\0';
+	}
+}
+
+
+/* Called with profile_lock held */
+static void write_stats()
+{
+	FILE *fh;
+	char *tmp;
+	size_t len;
+	struct profile_thread *t;
+
+	if ( stats_filename == NULL ) return;
+
+	/* Written to a new file and renamed, so that a reader (or a crash)
+	 * never sees a partial file */
+	len = strlen(stats_filename)+8;
+	tmp = cfmalloc(len);
+	if ( tmp == NULL ) return;
+	snprintf(tmp, len, "%s.tmp", stats_filename);
+
+	fh = fopen(tmp, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to write profiling results to %s\n", tmp);
+		cffree(tmp);
+		return;
 	}
 
-	if ( pd->current != pd->root ) {
-		fprintf(stderr, "Attempted to finalise profiling while not "
-		        "on root block (%s)\n", pd->current->name);
+	fprintf(fh, "CrystFEL profile 1 %i\n", PROFILE_N_BINS);
+	for ( t=threads; t!=NULL; t=t->next ) {
+		char path[4096];
+		path[0] = '\0';
+		pthread_mutex_lock(&t->lock);
+		write_node(fh, t, 0, path, sizeof(path));
+		pthread_mutex_unlock(&t->lock);
+	}
+
+	fclose(fh);
+	rename(tmp, stats_filename);
+	cffree(tmp);
+
+	last_stats_write = now_ns();
+}
+
+
+/**
+ * \param stats_filename: Filename for aggregated results, or NULL
+ * \param trace_filename: Filename for trace events, or NULL
+ * \param process_id: Process number to use in the trace events
+ *
+ * Switches on profiling for this process.  The aggregated results are written
+ * periodically by \ref profile_flush, in a simple text format which can be
+ * merged with results from other processes using \ref profile_summary_add_file.
+ *
+ * If \p trace_filename is not NULL, a record of every block will be written in
+ * Chrome's trace event format (without the enclosing brackets, see
+ * \ref profile_merge_traces).
+ */
+void profile_init(const char *stats_fn, const char *trace_fn, int process_id)
+{
+	struct profile_thread *t;
+
+	if ( profiling ) {
+		fprintf(stderr, "Attempted to initialise profiling twice!\n");
 		fflush(stderr);
 		abort();
 	}
 
-	stop_profile_block(pd->root);
+#ifndef HAVE_CLOCK_GETTIME
+	printf("Profiling disabled because clock_gettime is not available\n");
+	return;
+#endif
+
+	pthread_once(&thread_key_once, make_thread_key);
+
+	if ( stats_fn != NULL ) {
+		stats_filename = cfstrdup(stats_fn);
+	}
+
+	if ( trace_fn != NULL ) {
+		/* Appending, in case this process is a replacement for one
+		 * which crashed */
+		trace_fh = fopen(trace_fn, "a");
+		if ( trace_fh == NULL ) {
+			ERROR("Failed to open %s\n", trace_fn);
+		}
+	}
+	trace_pid = process_id;
+	last_stats_write = now_ns();
 
-	buf = format_profile_block(pd->root);
-	buf2 = cfmalloc(8+strlen(buf));
-	size_t len = 8+strlen(buf);
-	snprintf(buf2, len, "%i %s\n", worker_id, buf);
-	write(STDOUT_FILENO, buf2, strlen(buf2));
-	cffree(buf);
-	cffree(buf2);
+	pthread_mutex_lock(&profile_lock);
+	for ( t=threads; t!=NULL; t=t->next ) {
+		reset_thread(t);
+	}
+	pthread_mutex_unlock(&profile_lock);
 
-	free_profile_block(pd->root);
-	pd->root = start_profile_block("root");
-	pd->current = pd->root;
-	pd->root->parent = NULL;
+	profiling = 1;
 }
 
 
-void profile_start(const char *name)
+/**
+ * Writes out the trace events recorded so far, and the aggregated results if
+ * they haven't been written for a few seconds.  Call this between units of
+ * work, e.g. after each frame.
+ */
+void profile_flush()
 {
-	struct _profile_block *b;
+	struct profile_thread *t;
+
+	if ( !profiling ) return;
+
+	pthread_mutex_lock(&profile_lock);
+	for ( t=threads; t!=NULL; t=t->next ) {
+		pthread_mutex_lock(&t->lock);
+		write_events(t);
+		pthread_mutex_unlock(&t->lock);
+	}
+	if ( trace_fh != NULL ) fflush(trace_fh);
+	if ( now_ns() - last_stats_write > STATS_INTERVAL*1e9 ) {
+		write_stats();
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+/**
+ * Writes out all results, and switches off profiling.  No other thread may
+ * be inside a profiling block when this is called.
+ */
+void profile_finish()
+{
+	struct profile_thread *t;
+
+	if ( !profiling ) return;
+	profiling = 0;
 
-	if ( pd == NULL ) return;
+	pthread_mutex_lock(&profile_lock);
 
-	if ( pd->current->n_children >= pd->current->max_children ) {
-		struct _profile_block **nblock;
-		int nmax = pd->current->n_children + 64;
-		nblock = cfrealloc(pd->current->children, nmax*sizeof(struct _profile_block *));
-		if ( nblock == NULL ) {
-			fprintf(stderr, "Failed to allocate profiling record. "
-			                "Try again without --profile.\n");
-			abort();
+	for ( t=threads; t!=NULL; t=t->next ) {
+		if ( t->n_dropped > 0 ) {
+			ERROR("Profiling: %i blocks not recorded because "
+			      "there were too many different ones.\n",
+			      t->n_dropped);
 		}
-		pd->current->children = nblock;
-		pd->current->max_children = nmax;
+		pthread_mutex_lock(&t->lock);
+		write_events(t);
+		pthread_mutex_unlock(&t->lock);
 	}
+	write_stats();
 
-	b = start_profile_block(name);
-	b->parent = pd->current;
-	pd->current->children[pd->current->n_children++] = b;
-	pd->current = b;
+	if ( trace_fh != NULL ) fclose(trace_fh);
+	trace_fh = NULL;
+	cffree(stats_filename);
+	stats_filename = NULL;
+
+	/* The per-thread records are not freed, because other threads might
+	 * still refer to them.  They will be reused if profiling starts
+	 * again. */
+
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+static int find_child(struct profile_thread *t, int parent, const char *name)
+{
+	int c;
+	int n;
+	int name_idx;
+
+	for ( c=t->nodes[parent].first_child; c!=-1; c=t->nodes[c].next_sibling ) {
+
+		/* Almost always a string literal, so this usually matches */
+		if ( t->nodes[c].key == name ) return c;
+
+		if ( strcmp(names[t->nodes[c].name], name) == 0 ) {
+			t->nodes[c].key = name;
+			return c;
+		}
+
+	}
+
+	if ( t->n_nodes == MAX_NODES ) return -1;
+
+	pthread_mutex_lock(&profile_lock);
+	name_idx = intern_name(name);
+	pthread_mutex_unlock(&profile_lock);
+	if ( name_idx == -1 ) return -1;
+
+	pthread_mutex_lock(&t->lock);
+	n = t->n_nodes++;
+	t->nodes[n].name = name_idx;
+	t->nodes[n].key = name;
+	t->nodes[n].parent = parent;
+	t->nodes[n].first_child = -1;
+	t->nodes[n].next_sibling = -1;
+	memset(&t->nodes[n].stats, 0, sizeof(struct profile_stats));
+
+	/* Added at the end, so that the output is in order of appearance */
+	if ( t->nodes[parent].first_child == -1 ) {
+		t->nodes[parent].first_child = n;
+	} else {
+		c = t->nodes[parent].first_child;
+		while ( t->nodes[c].next_sibling != -1 ) c = t->nodes[c].next_sibling;
+		t->nodes[c].next_sibling = n;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return n;
 }
 
 
+/**
+ * \param name: Name of the block
+ *
+ * Starts a profiling block.  Blocks can be nested, and each thread has its
+ * own set of blocks.  Blocks with the same name and in the same place in the
+ * hierarchy are aggregated together.
+ *
+ * This does nothing unless \ref profile_init has been called.
+ */
+void profile_start(const char *name)
+{
+	struct profile_thread *t;
+	int node;
+
+	if ( !profiling ) return;
+
+	t = pthread_getspecific(thread_key);
+	if ( t == NULL ) {
+		t = new_thread();
+		if ( t == NULL ) return;
+	}
+
+	if ( t->depth >= MAX_DEPTH ) {
+		/* Still counted, so that profile_end() stays in step */
+		t->depth++;
+		t->n_dropped++;
+		return;
+	}
+
+	if ( (t->depth > 0) && (t->stack[t->depth-1] == -1) ) {
+		/* Parent block wasn't recorded */
+		node = -1;
+	} else {
+		node = find_child(t, (t->depth>0) ? t->stack[t->depth-1] : 0,
+		                  name);
+	}
+	if ( node == -1 ) t->n_dropped++;
+
+	t->stack[t->depth] = node;
+	t->start[t->depth] = now_ns();
+	t->depth++;
+}
+
+
+/**
+ * \param name: Name of the block
+ *
+ * Ends the current profiling block, which must have the given name.
+ */
 void profile_end(const char *name)
 {
-	if ( pd == NULL ) return;
+	struct profile_thread *t;
+	uint64_t end;
+	uint64_t duration;
+	int node;
 
-	if ( pd->current == NULL ) {
+	if ( !profiling ) return;
+
+	end = now_ns();
+
+	t = pthread_getspecific(thread_key);
+	if ( (t == NULL) || (t->depth == 0) ) {
 		fprintf(stderr, "No current profile block!\n");
 		fflush(stderr);
 		abort();
 	}
 
-	if ( strcmp(name, pd->current->name) != 0 ) {
+	t->depth--;
+	if ( t->depth >= MAX_DEPTH ) return;
+
+	node = t->stack[t->depth];
+	if ( node == -1 ) return;
+
+	if ( strcmp(name, names[t->nodes[node].name]) != 0 ) {
 		fprintf(stderr, "Attempt to close wrong profile block (%s) "
-		        "current block is %s\n", name, pd->current->name);
+		        "current block is %s\n", name,
+		        names[t->nodes[node].name]);
 		fflush(stderr);
 		abort();
 	}
 
-	stop_profile_block(pd->current);
+	duration = end - t->start[t->depth];
+
+	pthread_mutex_lock(&t->lock);
+	add_sample(&t->nodes[node].stats, duration);
+	if ( t->events != NULL ) {
+		struct profile_event *ev = &t->events[t->n_events++];
+		ev->node = node;
+		ev->start = t->start[t->depth];
+		ev->duration = duration;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if ( (t->events != NULL) && (t->n_events == MAX_EVENTS) ) {
+		/* Lock order is always global then thread */
+		pthread_mutex_lock(&profile_lock);
+		pthread_mutex_lock(&t->lock);
+		write_events(t);
+		pthread_mutex_unlock(&t->lock);
+		pthread_mutex_unlock(&profile_lock);
+	}
+}
+
+
+/* ---------------------- Merging results from processes -------------------- */
+
+struct summary_node
+{
+	char *name;
+	struct profile_stats stats;
+	struct summary_node **children;
+	int n_children;
+	int max_children;
+};
+
+
+struct _profile_summary
+{
+	struct summary_node root;
+	int n_files;
+};
+
+
+/**
+ * \returns a new, empty, set of merged profiling results.
+ */
+ProfileSummary *profile_summary_new()
+{
+	return cfcalloc(1, sizeof(struct _profile_summary));
+}
+
+
+static struct summary_node *summary_child(struct summary_node *n,
+                                          const char *name)
+{
+	int i;
+	struct summary_node *c;
+
+	for ( i=0; i<n->n_children; i++ ) {
+		if ( strcmp(n->children[i]->name, name) == 0 ) {
+			return n->children[i];
+		}
+	}
+
+	if ( n->n_children == n->max_children ) {
+		struct summary_node **nc;
+		int nmax = n->max_children + 16;
+		nc = cfrealloc(n->children, nmax*sizeof(struct summary_node *));
+		if ( nc == NULL ) return NULL;
+		n->children = nc;
+		n->max_children = nmax;
+	}
+
+	c = cfcalloc(1, sizeof(struct summary_node));
+	if ( c == NULL ) return NULL;
+	c->name = cfstrdup(name);
+	if ( c->name == NULL ) {
+		cffree(c);
+		return NULL;
+	}
+	n->children[n->n_children++] = c;
+	return c;
+}
+
+
+static int read_stats_line(char *line, struct profile_stats *st, char **path)
+{
+	char *pos = line;
+	char *end;
+	uint64_t vals[4+PROFILE_N_BINS];
+	int i;
+
+	for ( i=0; i<4+PROFILE_N_BINS; i++ ) {
+		vals[i] = strtoull(pos, &end, 10);
+		if ( (end == pos) || (*end != ' ') ) return 1;
+		pos = end+1;
+	}
+
+	st->count = vals[0];
+	st->total = vals[1];
+	st->min = vals[2];
+	st->max = vals[3];
+	for ( i=0; i<PROFILE_N_BINS; i++ ) st->hist[i] = vals[4+i];
+
+	chomp(pos);
+	*path = pos;
+	return 0;
+}
+
+
+/**
+ * \param ps: A \ref ProfileSummary
+ * \param filename: Aggregated results written by a process with profiling
+ *
+ * Adds the results in \p filename to \p ps.
+ *
+ * \returns zero on success.
+ */
+int profile_summary_add_file(ProfileSummary *ps, const char *filename)
+{
+	FILE *fh;
+	char line[8192];
+	int nbins;
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return 1;
+
+	if ( (fgets(line, sizeof(line), fh) == NULL)
+	  || (sscanf(line, "CrystFEL profile 1 %i", &nbins) != 1)
+	  || (nbins != PROFILE_N_BINS) )
+	{
+		ERROR("%s is not a profiling results file\n", filename);
+		fclose(fh);
+		return 1;
+	}
+
+	while ( fgets(line, sizeof(line), fh) != NULL ) {
+
+		struct profile_stats st;
+		struct summary_node *n = &ps->root;
+		char *path;
+		char *name;
+		char *saveptr;
+
+		if ( read_stats_line(line, &st, &path) ) {
+			ERROR("Bad line in %s: %s\n", filename, line);
+			continue;
+		}
+
+		name = strtok_r(path, "/", &saveptr);
+		while ( (name != NULL) && (n != NULL) ) {
+			n = summary_child(n, name);
+			name = strtok_r(NULL, "/", &saveptr);
+		}
+		if ( n == NULL ) {
+			fclose(fh);
+			return 1;
+		}
+
+		add_stats(&n->stats, &st);
+
+	}
+
+	fclose(fh);
+	ps->n_files++;
+	return 0;
+}
+
+
+static void write_summary_node(FILE *fh, struct summary_node *n, int indent)
+{
+	int i;
+	struct profile_stats *st = &n->stats;
+
+	fprintf(fh, "%*s{\"name\": ", indent, "");
+	write_json_string(fh, n->name);
+	fprintf(fh, ", \"count\": %llu, \"total_s\": %.6f, "
+	        "\"mean_s\": %.9f, \"min_s\": %.9f, \"max_s\": %.9f,\n",
+	        (unsigned long long)st->count, st->total/1e9,
+	        (st->count > 0) ? st->total/1e9/st->count : 0.0,
+	        st->min/1e9, st->max/1e9);
+
+	fprintf(fh, "%*s \"histogram\": [", indent, "");
+	for ( i=0; i<PROFILE_N_BINS; i++ ) {
+		fprintf(fh, "%s%llu", (i>0) ? ", " : "",
+		        (unsigned long long)st->hist[i]);
+	}
+	fprintf(fh, "],\n");
+
+	fprintf(fh, "%*s \"children\": [", indent, "");
+	for ( i=0; i<n->n_children; i++ ) {
+		fprintf(fh, "%s\n", (i>0) ? "," : "");
+		write_summary_node(fh, n->children[i], indent+2);
+	}
+	fprintf(fh, "]}");
+}
+
+
+/**
+ * \param ps: A \ref ProfileSummary
+ * \param filename: Output filename
+ *
+ * Writes the merged results in JSON format.  Each block has a name, a list of
+ * child blocks, and the number of times it ran with the total, mean, minimum
+ * and maximum times in seconds.  The histogram has \ref PROFILE_N_BINS bins,
+ * as described there.
+ *
+ * \returns zero on success.
+ */
+int profile_summary_write_json(ProfileSummary *ps, const char *filename)
+{
+	FILE *fh;
+	int i;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to open %s\n", filename);
+		return 1;
+	}
+
+	fprintf(fh, "{\"n_processes\": %i,\n", ps->n_files);
+	fprintf(fh, " \"histogram_bins\": \"bin 0: <1 us, bin i: "
+	            "[2^(i-1), 2^i) us\",\n");
+	fprintf(fh, " \"blocks\": [");
+	for ( i=0; i<ps->root.n_children; i++ ) {
+		fprintf(fh, "%s\n", (i>0) ? "," : "");
+		write_summary_node(fh, ps->root.children[i], 2);
+	}
+	fprintf(fh, "]}\n");
+
+	fclose(fh);
+	return 0;
+}
+
+
+static void free_summary_node(struct summary_node *n)
+{
+	int i;
+	for ( i=0; i<n->n_children; i++ ) {
+		free_summary_node(n->children[i]);
+		cffree(n->children[i]);
+	}
+	cffree(n->children);
+	cffree(n->name);
+}
+
+
+void profile_summary_free(ProfileSummary *ps)
+{
+	if ( ps == NULL ) return;
+	free_summary_node(&ps->root);
+	cffree(ps);
+}
+
+
+/**
+ * \param filename: Output filename
+ * \param inputs: Trace event files written by profiled processes
+ * \param n_inputs: Number of entries in \p inputs
+ *
+ * Combines the trace events from several processes into one file, which can
+ * be loaded into a trace viewer such as Perfetto or chrome://tracing.
+ * Missing input files are skipped.
+ *
+ * \returns zero on success.
+ */
+int profile_merge_traces(const char *filename, char **inputs, int n_inputs)
+{
+	FILE *ofh;
+	int i;
+	int first = 1;
+
+	ofh = fopen(filename, "w");
+	if ( ofh == NULL ) {
+		ERROR("Failed to open %s\n", filename);
+		return 1;
+	}
+
+	fprintf(ofh, "[");
+	for ( i=0; i<n_inputs; i++ ) {
+
+		FILE *fh;
+		char line[1024];
+
+		fh = fopen(inputs[i], "r");
+		if ( fh == NULL ) continue;
+
+		while ( fgets(line, sizeof(line), fh) != NULL ) {
+			size_t len;
+			chomp(line);
+			len = strlen(line);
+			if ( (len > 0) && (line[len-1] == ',') ) line[len-1] = '\0';
+			if ( line[0] == '\0' ) continue;
+			fprintf(ofh, "%s\n%s", first ? "" : ",", line);
+			first = 0;
+		}
+
+		fclose(fh);
+
+	}
+	fprintf(ofh, "\n]\n");
 
-	pd->current = pd->current->parent;
+	fclose(ofh);
+	return 0;
 }
@@ -34,9 +34,27 @@
  * Simple wall-clock profiling
  */
 
-extern void profile_init();
-extern void profile_print_and_reset(int worker_id);
+/** Number of bins in the latency histogram for each block.  Bin 0 counts
+ * durations less than 1 microsecond, and bin \c i counts durations from
+ * 2^(i-1) up to 2^i microseconds.  The last bin counts everything longer. */
+#define PROFILE_N_BINS (32)
+
+/** Opaque type for merged profiling results */
+typedef struct _profile_summary ProfileSummary;
+
+extern void profile_init(const char *stats_filename,
+                         const char *trace_filename, int process_id);
+extern void profile_flush(void);
+extern void profile_finish(void);
 extern void profile_start(const char *name);
 extern void profile_end(const char *name);
 
+extern ProfileSummary *profile_summary_new(void);
+extern int profile_summary_add_file(ProfileSummary *ps, const char *filename);
+extern int profile_summary_write_json(ProfileSummary *ps, const char *filename);
+extern void profile_summary_free(ProfileSummary *ps);
+
+extern int profile_merge_traces(const char *filename,
+                                char **inputs, int n_inputs);
+
 #endif	/* PROFILE_H */
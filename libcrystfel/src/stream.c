@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "cell.h"
 #include "cell-utils.h"
@@ -904,6 +905,125 @@ struct image *stream_read_chunk(Stream *st, StreamFlags srf)
 }
 
 
+/**
+ * \param st A \ref Stream opened for reading
+ * \param plen Location at which to store the length of the text
+ *
+ * Reads the next chunk from \p st, without interpreting it.  The text can be
+ * turned into an \ref image later using \ref stream_parse_chunk, perhaps in a
+ * different thread, so that several chunks can be interpreted at once.
+ *
+ * \returns the text of the chunk, including the start and end markers, or NULL
+ * if there are no more complete chunks.  Free the text with cffree().
+ */
+char *stream_read_chunk_text(Stream *st, size_t *plen)
+{
+	char line[1024];
+	char *text;
+	size_t len, max_len;
+	int start_of_line = 1;
+
+	if ( find_start_of_chunk(st) ) return NULL;
+
+	max_len = 16384;
+	text = cfmalloc(max_len);
+	if ( text == NULL ) return NULL;
+	strcpy(text, STREAM_CHUNK_START_MARKER"\n");
+	len = strlen(text);
+
+	do {
+
+		size_t l;
+
+		if ( fgets(line, 1023, st->fh) == NULL ) {
+			if ( !feof(st->fh) ) {
+				ERROR("Error reading stream.\n");
+			}
+			cffree(text);
+			return NULL;
+		}
+
+		l = strlen(line);
+		if ( len + l + 1 > max_len ) {
+			char *text_new;
+			max_len *= 2;
+			text_new = cfrealloc(text, max_len);
+			if ( text_new == NULL ) {
+				cffree(text);
+				return NULL;
+			}
+			text = text_new;
+		}
+		memcpy(text+len, line, l+1);
+		len += l;
+
+		/* Only a whole line can be the end marker */
+		if ( start_of_line
+		  && (strncmp(line, STREAM_CHUNK_END_MARKER,
+		              strlen(STREAM_CHUNK_END_MARKER)) == 0)
+		  && ((line[strlen(STREAM_CHUNK_END_MARKER)] == '\n')
+		   || (line[strlen(STREAM_CHUNK_END_MARKER)] == '\0')) )
+		{
+			st->ln++;
+			break;
+		}
+
+		start_of_line = (l > 0) && (line[l-1] == '\n');
+		if ( start_of_line ) st->ln++;
+
+	} while ( 1 );
+
+	*plen = len;
+	return text;
+}
+
+
+static pthread_mutex_t old_indexers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * \param st The \ref Stream from which \p text was read
+ * \param text Text of a chunk, from \ref stream_read_chunk_text
+ * \param len Length of \p text
+ * \param srf A \ref StreamFlags enum saying what to read
+ *
+ * Interprets the text of a chunk, in the same way as \ref stream_read_chunk.
+ * This function can be called from several threads at once for the same
+ * \p st, including while \ref stream_read_chunk_text reads further chunks.
+ *
+ * \returns a newly allocated \ref image, or NULL on error.
+ */
+struct image *stream_parse_chunk(Stream *st, const char *text, size_t len,
+                                 StreamFlags srf)
+{
+	Stream tmp;
+	struct image *image;
+
+	/* Only the parts of the stream which don't change after opening are
+	 * shared, so that the next chunks can be read at the same time */
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.major_version = st->major_version;
+	tmp.minor_version = st->minor_version;
+	tmp.dtempl_read = st->dtempl_read;
+	tmp.fh = fmemopen((void *)text, len, "r");
+	if ( tmp.fh == NULL ) {
+		ERROR("Failed to open chunk text\n");
+		return NULL;
+	}
+
+	image = stream_read_chunk(&tmp, srf);
+	fclose(tmp.fh);
+
+	if ( tmp.old_indexers ) {
+		pthread_mutex_lock(&old_indexers_lock);
+		st->old_indexers = 1;
+		pthread_mutex_unlock(&old_indexers_lock);
+	}
+
+	return image;
+}
+
+
 char *stream_audit_info(Stream *st)
 {
 	if ( st->audit_info == NULL ) return NULL;
@@ -1084,6 +1204,29 @@ Stream *stream_open_for_read(const char *filename)
  * \returns A \ref Stream, or NULL on failure.
  */
 Stream *stream_open_fd_for_write(int fd, const DataTemplate *dtempl)
+{
+	Stream *st;
+	FILE *fh;
+
+	fh = fdopen(fd, "w");
+	if ( fh == NULL ) return NULL;
+
+	st = stream_open_fh_for_write(fh, dtempl);
+	if ( st == NULL ) fclose(fh);
+	return st;
+}
+
+
+/**
+ * \param fh An open file handle, e.g. from fopencookie()
+ * \param dtempl A DataTemplate
+ *
+ * As \ref stream_open_fd_for_write, but for a file handle.  The \ref Stream
+ * takes ownership of \p fh, which will be closed by \ref stream_close.
+ *
+ * \returns A \ref Stream, or NULL on failure.
+ */
+Stream *stream_open_fh_for_write(FILE *fh, const DataTemplate *dtempl)
 {
 	Stream *st;
 
@@ -1097,12 +1240,7 @@ Stream *stream_open_fd_for_write(int fd, const DataTemplate *dtempl)
 	st->dtempl_read = NULL;
 	st->dtempl_write = NULL;
 
-	st->fh = fdopen(fd, "w");
-	if ( st->fh == NULL ) {
-		cffree(st);
-		return NULL;
-	}
-
+	st->fh = fh;
 	st->dtempl_write = dtempl;
 	st->major_version = LATEST_MAJOR_VERSION;
 	st->minor_version = LATEST_MINOR_VERSION;
@@ -94,6 +94,8 @@ extern Stream *stream_open_for_write(const char *filename,
                                      const DataTemplate *dtempl);
 extern Stream *stream_open_fd_for_write(int fd,
                                         const DataTemplate *dtempl);
+extern Stream *stream_open_fh_for_write(FILE *fh,
+                                        const DataTemplate *dtempl);
 extern void stream_close(Stream *st);
 
 /* Writing things to stream header */
@@ -127,6 +129,9 @@ extern void stream_index_free(StreamIndex *index);
 
 /* Read/write chunks */
 extern struct image *stream_read_chunk(Stream *st, StreamFlags srf);
+extern char *stream_read_chunk_text(Stream *st, size_t *plen);
+extern struct image *stream_parse_chunk(Stream *st, const char *text,
+                                        size_t len, StreamFlags srf);
 extern int stream_write_chunk(Stream *st, const struct image *image,
                               StreamFlags srf);
 
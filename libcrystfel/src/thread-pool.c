@@ -34,6 +34,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include "utils.h"
@@ -43,30 +44,44 @@
 
 /* --------------------------- Status label stuff --------------------------- */
 
-static int use_status_labels = 0;
+/* Only set while running tasks with more than one thread */
 static pthread_key_t status_label_key;
+static pthread_once_t status_label_once = PTHREAD_ONCE_INIT;
 
-struct worker_args
+
+static void make_status_label_key()
 {
-	struct task_queue_range *tqr;
-	struct task_queue *tq;
-	int id;
-};
+	pthread_key_create(&status_label_key, NULL);
+}
 
 
 signed int get_status_label()
 {
 	int *cookie;
 
-	if ( !use_status_labels ) {
-		return -1;
-	}
-
 	cookie = pthread_getspecific(status_label_key);
+	if ( cookie == NULL ) return -1;
 	return *cookie;
 }
 
 
+/* ------------------------------- Task queue ------------------------------- */
+
+/* Maximum number of tasks claimed from get_task() in one go */
+#define MAX_CHUNK (16)
+
+
+/* Tasks claimed by one thread, but not started yet.  The owner takes tasks
+ * from the front, and other threads steal from the back. */
+struct task_deque
+{
+	pthread_mutex_t  lock;
+	void            *tasks[MAX_CHUNK];
+	int              first;
+	int              last;
+};
+
+
 struct task_queue
 {
 	pthread_mutex_t  lock;
@@ -74,67 +89,300 @@ struct task_queue
 	int              n_started;
 	int              n_completed;
 	int              max;
+	int              n_threads;
+	int              next_cookie;  /* For temporary threads */
+	int              no_more;   /* get_task() returned NULL */
 
 	void *(*get_task)(void *);
 	void (*finalise)(void *, void *);
 	void *queue_args;
 	void (*work)(void *, int);
+
+	struct task_deque *deques;  /* One per cookie */
 };
 
 
-static void *task_worker(void *pargsv)
+static void *deque_take(struct task_deque *d, int steal)
 {
-	struct worker_args *w = pargsv;
-	struct task_queue *q = w->tq;
-	int *cookie_slot;
+	void *task = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if ( d->first < d->last ) {
+		if ( steal ) {
+			task = d->tasks[--d->last];
+		} else {
+			task = d->tasks[d->first++];
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
 
-	cookie_slot = cfmalloc(sizeof(int));
-	*cookie_slot = w->id;
-	pthread_setspecific(status_label_key, cookie_slot);
+	return task;
+}
 
-	cffree(w);
 
-	do {
+static void *steal_task(struct task_queue *q, int cookie)
+{
+	int i;
+
+	for ( i=1; i<q->n_threads; i++ ) {
+		void *task;
+		task = deque_take(&q->deques[(cookie+i) % q->n_threads], 1);
+		if ( task != NULL ) return task;
+	}
+
+	return NULL;
+}
+
+
+/* Called with queue lock held.  Claims several tasks at once when there are
+ * plenty left, but only one at a time towards the end so that the threads
+ * finish together. */
+static int claim_tasks(struct task_queue *q, struct task_deque *d)
+{
+	int chunk = 1;
+	int n = 0;
+
+	if ( q->max ) {
+		chunk = (q->max - q->n_started) / (2*q->n_threads);
+		if ( chunk < 1 ) chunk = 1;
+		if ( chunk > MAX_CHUNK ) chunk = MAX_CHUNK;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	d->first = 0;
+	d->last = 0;
+	while ( (n < chunk) && !q->no_more ) {
 
 		void *task;
-		int cookie;
 
-		/* Get a task */
-		pthread_mutex_lock(&q->lock);
 		if ( (q->max) && (q->n_started >= q->max) ) {
-			pthread_mutex_unlock(&q->lock);
+			q->no_more = 1;
 			break;
 		}
-		task = q->get_task(q->queue_args);
 
-		/* No more tasks? */
+		task = q->get_task(q->queue_args);
 		if ( task == NULL ) {
-			pthread_mutex_unlock(&q->lock);
+			q->no_more = 1;
 			break;
 		}
 
+		d->tasks[d->last++] = task;
 		q->n_started++;
-		pthread_mutex_unlock(&q->lock);
+		n++;
+
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return n;
+}
 
-		cookie = *(int *)pthread_getspecific(status_label_key);
-		q->work(task, cookie);
 
-		/* Update totals etc */
-		pthread_mutex_lock(&q->lock);
+/* Called with queue lock held */
+static void finalise_tasks(struct task_queue *q, void **done, int n_done)
+{
+	int i;
+
+	for ( i=0; i<n_done; i++ ) {
 		q->n_completed++;
 		if ( q->finalise ) {
-			q->finalise(q->queue_args, task);
+			q->finalise(q->queue_args, done[i]);
+		}
+	}
+}
+
+
+static void run_tasks(struct task_queue *q, int cookie)
+{
+	struct task_deque *d = &q->deques[cookie];
+	void *done[MAX_CHUNK];
+	int n_done = 0;
+	void *old_label;
+
+	old_label = pthread_getspecific(status_label_key);
+	if ( q->n_threads > 1 ) {
+		pthread_setspecific(status_label_key, &cookie);
+	}
+
+	do {
+
+		void *task;
+
+		task = deque_take(d, 0);
+		if ( task == NULL ) task = steal_task(q, cookie);
+
+		if ( task == NULL ) {
+
+			int n;
+
+			/* Nothing left anywhere, so get some more tasks.  Hand in
+			 * the completed ones at the same time. */
+			pthread_mutex_lock(&q->lock);
+			finalise_tasks(q, done, n_done);
+			n_done = 0;
+			n = claim_tasks(q, d);
+			if ( n == 0 ) {
+				/* New tasks only get queued under the queue
+				 * lock, so this is the last chance */
+				task = steal_task(q, cookie);
+			}
+			pthread_mutex_unlock(&q->lock);
+
+			if ( n > 0 ) continue;
+			if ( task == NULL ) break;
+
+		}
+
+		q->work(task, cookie);
+
+		done[n_done++] = task;
+		if ( n_done == MAX_CHUNK ) {
+			pthread_mutex_lock(&q->lock);
+			finalise_tasks(q, done, n_done);
+			pthread_mutex_unlock(&q->lock);
+			n_done = 0;
+		}
+
+	} while ( 1 );
+
+	pthread_mutex_lock(&q->lock);
+	finalise_tasks(q, done, n_done);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_setspecific(status_label_key, old_label);
+}
+
+
+/* ----------------------------- Persistent pool ---------------------------- */
+
+/* Threads are created as needed, and then kept for the lifetime of the
+ * process.  Only one run_threads() call can use them at a time. */
+struct thread_pool
+{
+	pthread_mutex_t    lock;
+	pthread_cond_t     new_job;
+	pthread_cond_t     job_done;
+
+	int                n_threads;
+	int                busy;
+
+	unsigned int       generation;
+	struct task_queue *job;
+	int                n_wanted;   /* Threads wanted for current job */
+	int                n_running;  /* Threads still busy with it */
+};
+
+static struct thread_pool pool = { PTHREAD_MUTEX_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER,
+                                   0, 0, 0, NULL, 0, 0 };
+
+
+static void *pool_worker(void *pargsv)
+{
+	int id = (intptr_t)pargsv;
+	unsigned int seen = 0;
+
+	do {
+
+		struct task_queue *q;
+		int wanted;
+
+		pthread_mutex_lock(&pool.lock);
+		while ( pool.generation == seen ) {
+			pthread_cond_wait(&pool.new_job, &pool.lock);
 		}
-		pthread_mutex_unlock(&q->lock);
+		seen = pool.generation;
+		q = pool.job;
+		wanted = (id < pool.n_wanted);
+		pthread_mutex_unlock(&pool.lock);
+
+		if ( !wanted ) continue;
+
+		/* The calling thread is cookie 0 */
+		run_tasks(q, id+1);
+
+		pthread_mutex_lock(&pool.lock);
+		if ( --pool.n_running == 0 ) {
+			pthread_cond_signal(&pool.job_done);
+		}
+		pthread_mutex_unlock(&pool.lock);
 
 	} while ( 1 );
 
-	cffree(cookie_slot);
+	return NULL;
+}
+
+
+/* Called with pool lock held.  Returns the number of pool threads available,
+ * which might be less than requested. */
+static int grow_pool(int n)
+{
+	while ( pool.n_threads < n ) {
+
+		pthread_t t;
+		intptr_t id = pool.n_threads;
+
+		if ( pthread_create(&t, NULL, pool_worker, (void *)id) ) {
+			/* Not ERROR() here */
+			fprintf(stderr, "Couldn't start thread %i\n",
+			        pool.n_threads);
+			break;
+		}
+		pthread_detach(t);
+		pool.n_threads++;
+
+	}
+
+	return (pool.n_threads < n) ? pool.n_threads : n;
+}
+
+
+static void *temporary_worker(void *pargsv)
+{
+	struct task_queue *q = pargsv;
+	int cookie;
 
+	pthread_mutex_lock(&q->lock);
+	cookie = q->next_cookie++;
+	pthread_mutex_unlock(&q->lock);
+
+	run_tasks(q, cookie);
 	return NULL;
 }
 
 
+/* For when the pool is already in use, e.g. by a call to run_threads() from
+ * within a work function.  Works like the pool, but with new threads. */
+static void run_temporary_threads(struct task_queue *q, int n_threads)
+{
+	pthread_t *workers;
+	int i, n_started;
+
+	workers = cfmalloc(n_threads * sizeof(pthread_t));
+	if ( workers == NULL ) n_threads = 1;
+
+	/* Cookies are handed out by the threads themselves */
+	q->next_cookie = 1;
+	n_started = 0;
+	for ( i=1; i<n_threads; i++ ) {
+		if ( pthread_create(&workers[i], NULL, temporary_worker, q) ) {
+			/* Not ERROR() here */
+			fprintf(stderr, "Couldn't start thread %i\n", i);
+			break;
+		}
+		n_started++;
+	}
+
+	run_tasks(q, 0);
+
+	for ( i=1; i<=n_started; i++ ) {
+		pthread_join(workers[i], NULL);
+	}
+
+	cffree(workers);
+}
+
+
 /**
  * \param n_threads The number of threads to run in parallel
  * \param work The function to be called to do the work
@@ -160,6 +408,11 @@ static void *task_worker(void *pargsv)
  * Work will stop after \p max tasks have been processed whether get_task
  * returned NULL or not.  If \p max is zero, all tasks will be processed.
  *
+ * The threads are taken from a pool which persists between calls, and the
+ * calling thread takes part in the work as well.  Several tasks may be taken
+ * from \p get_task at once, and \p final may be called for several tasks
+ * together, some time after they were completed.
+ *
  * \returns The number of tasks completed.
  **/
 int run_threads(int n_threads, TPWorkFunc work,
@@ -167,13 +420,13 @@ int run_threads(int n_threads, TPWorkFunc work,
                 void *queue_args, int max,
                 int cpu_num, int cpu_groupsize, int cpu_offset)
 {
-	pthread_t *workers;
 	int i;
+	int use_pool;
 	struct task_queue q;
 
-	pthread_key_create(&status_label_key, NULL);
+	pthread_once(&status_label_once, make_status_label_key);
 
-	workers = cfmalloc(n_threads * sizeof(pthread_t));
+	if ( n_threads < 1 ) n_threads = 1;
 
 	pthread_mutex_init(&q.lock, NULL);
 	q.work = work;
@@ -183,38 +436,56 @@ int run_threads(int n_threads, TPWorkFunc work,
 	q.n_started = 0;
 	q.n_completed = 0;
 	q.max = max;
+	q.no_more = 0;
 
-	/* Now it's safe to start using the status labels */
-	if ( n_threads > 1 ) use_status_labels = 1;
-
-	/* Start threads */
+	q.deques = cfmalloc(n_threads * sizeof(struct task_deque));
+	if ( q.deques == NULL ) return 0;
 	for ( i=0; i<n_threads; i++ ) {
+		pthread_mutex_init(&q.deques[i].lock, NULL);
+		q.deques[i].first = 0;
+		q.deques[i].last = 0;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	use_pool = !pool.busy;
+	if ( use_pool ) {
+		pool.busy = 1;
+		n_threads = grow_pool(n_threads-1) + 1;
+	}
+	pthread_mutex_unlock(&pool.lock);
 
-		struct worker_args *w;
+	if ( use_pool ) {
 
-		w = cfmalloc(sizeof(struct worker_args));
+		q.n_threads = n_threads;
 
-		w->tq = &q;
-		w->tqr = NULL;
-		w->id = i;
+		pthread_mutex_lock(&pool.lock);
+		pool.job = &q;
+		pool.n_wanted = n_threads - 1;
+		pool.n_running = n_threads - 1;
+		pool.generation++;
+		pthread_cond_broadcast(&pool.new_job);
+		pthread_mutex_unlock(&pool.lock);
 
-		if ( pthread_create(&workers[i], NULL, task_worker, w) ) {
-			/* Not ERROR() here */
-			fprintf(stderr, "Couldn't start thread %i\n", i);
-			n_threads = i;
-			break;
+		run_tasks(&q, 0);
+
+		pthread_mutex_lock(&pool.lock);
+		while ( pool.n_running > 0 ) {
+			pthread_cond_wait(&pool.job_done, &pool.lock);
 		}
+		pool.job = NULL;
+		pool.busy = 0;
+		pthread_mutex_unlock(&pool.lock);
 
+	} else {
+		q.n_threads = n_threads;
+		run_temporary_threads(&q, n_threads);
 	}
 
-	/* Join threads */
 	for ( i=0; i<n_threads; i++ ) {
-		pthread_join(workers[i], NULL);
+		pthread_mutex_destroy(&q.deques[i].lock);
 	}
-
-	use_status_labels = 0;
-
-	cffree(workers);
+	cffree(q.deques);
+	pthread_mutex_destroy(&q.lock);
 
 	return q.n_completed;
 }
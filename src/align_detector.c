@@ -67,6 +67,8 @@ static void show_help(const char *s)
 	       "      --out-of-plane-tilts   Refine panel rotations around x and y\n"
 	       "      --camera-length        Refine overall camera length\n"
 	       "      --panel-totals         Display total panel movements\n"
+	       "  -j <n>                     Use <n> threads to read the data\n"
+	       "      --millepede            Use the external program 'pede'\n"
 	       "\n"
 	       "  -h, --help                 Display this help message\n"
 	       "      --version              Print version number and exit\n");
@@ -137,34 +139,69 @@ static int is_child(struct dg_group_info *parent, struct dg_group_info *child)
 }
 
 
-static void write_zero_sum(FILE *fh, struct dg_group_info *g,
-                           struct dg_group_info *groups, int n_groups,
-                           enum gparam p)
+/* The parameters and constraints go to the Millepede steering file 'fh', or
+ * to the built-in solver, whichever is not NULL */
+static void add_param(FILE *fh, MilleSolver *solver, int label, int presigma)
+{
+	if ( fh != NULL ) {
+		fprintf(fh, "%i 0 %i\n", label, presigma);
+	}
+
+	/* Pre-sigma -1 means the parameter is fixed */
+	if ( (solver != NULL) && (presigma == 0) ) {
+		mille_solver_add_parameter(solver, label);
+	}
+}
+
+
+static int write_zero_sum(FILE *fh, MilleSolver *solver,
+                          struct dg_group_info *g,
+                          struct dg_group_info *groups, int n_groups,
+                          enum gparam p)
 {
 	int i;
-	int found = 0;
+	int n = 0;
+	int *labels;
+
+	labels = malloc(n_groups*sizeof(int));
+	if ( labels == NULL ) {
+		ERROR("Failed to allocate constraint\n");
+		return 1;
+	}
 
 	for ( i=0; i<n_groups; i++ ) {
 		if ( is_child(g, &groups[i]) ) {
-			if ( !found ) {
-				fprintf(fh, "Constraint 0\n");
-				found = 1;
-			}
-			fprintf(fh, "%i 1\n", mille_label(groups[i].serial, p));
+			labels[n++] = mille_label(groups[i].serial, p);
 		}
 	}
 
-	if ( found ) {
+	if ( (n > 0) && (fh != NULL) ) {
+		fprintf(fh, "Constraint 0\n");
+		for ( i=0; i<n; i++ ) {
+			fprintf(fh, "%i 1\n", labels[i]);
+		}
 		fprintf(fh, "\n");
 	}
+
+	if ( (n > 0) && (solver != NULL) ) {
+		if ( mille_solver_add_constraint(solver, labels, n) ) {
+			free(labels);
+			return 1;
+		}
+	}
+
+	free(labels);
+	return 0;
 }
 
 
-static int make_zero_sum(FILE *fh, struct dg_group_info *groups, int n_groups,
+static int make_zero_sum(FILE *fh, MilleSolver *solver,
+                         struct dg_group_info *groups, int n_groups,
                          const char *group_name, int level,
                          int out_of_plane_shift, int out_of_plane_tilts)
 {
 	int i;
+	int r = 0;
 	struct dg_group_info *g = find_group(groups, n_groups, group_name);
 
 	if ( g == NULL ) {
@@ -175,23 +212,32 @@ static int make_zero_sum(FILE *fh, struct dg_group_info *groups, int n_groups,
 	/* Millepede doesn't like excessive constraints */
 	if ( g->hierarchy_level >= level ) return 0;
 
-	fprintf(fh, "! Hierarchy constraints for group %s\n", group_name);
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TX);
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TY);
+	if ( fh != NULL ) {
+		fprintf(fh, "! Hierarchy constraints for group %s\n", group_name);
+	}
+	r += write_zero_sum(fh, solver, g, groups, n_groups, GPARAM_DET_TX);
+	r += write_zero_sum(fh, solver, g, groups, n_groups, GPARAM_DET_TY);
 	if ( out_of_plane_shift ) {
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TZ);
+		r += write_zero_sum(fh, solver, g, groups, n_groups,
+		                    GPARAM_DET_TZ);
 	}
 	if ( out_of_plane_tilts ) {
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RX);
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RY);
+		r += write_zero_sum(fh, solver, g, groups, n_groups,
+		                    GPARAM_DET_RX);
+		r += write_zero_sum(fh, solver, g, groups, n_groups,
+		                    GPARAM_DET_RY);
+	}
+	r += write_zero_sum(fh, solver, g, groups, n_groups, GPARAM_DET_RZ);
+	if ( r ) return 1;
+	if ( fh != NULL ) {
+		fprintf(fh, "\n");
 	}
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RZ);
-	fprintf(fh, "\n");
 
 	for ( i=0; i<n_groups; i++ ) {
 		if ( is_child(g, &groups[i]) ) {
-			if ( make_zero_sum(fh, groups, n_groups, groups[i].name,
-			                   level, out_of_plane_shift,
+			if ( make_zero_sum(fh, solver, groups, n_groups,
+			                   groups[i].name, level,
+			                   out_of_plane_shift,
 			                   out_of_plane_tilts) ) return 1;
 		}
 	}
@@ -264,14 +310,30 @@ static int run_pede()
 }
 
 
-static void write_children(FILE *fh, const char *dir)
+static void add_file(FILE *fh, MilleSolver *solver, const char *filename)
+{
+	if ( fh != NULL ) {
+		fprintf(fh, "%s\n", filename);
+	}
+	if ( solver != NULL ) {
+		mille_solver_add_file(solver, filename);
+	}
+}
+
+
+static void write_children(FILE *fh, MilleSolver *solver, const char *dir)
 {
 	DIR *d = opendir(dir);
 	struct dirent *dent = readdir(d);
 
 	while ( dent != NULL ) {
 		if ( dent->d_name[0] == 'm' ) {
-			fprintf(fh, "%s/%s\n", dir, dent->d_name);
+			char *tmp = malloc(strlen(dir)+strlen(dent->d_name)+2);
+			if ( tmp != NULL ) {
+				sprintf(tmp, "%s/%s", dir, dent->d_name);
+				add_file(fh, solver, tmp);
+				free(tmp);
+			}
 		}
 		dent = readdir(d);
 	}
@@ -280,6 +342,186 @@ static void write_children(FILE *fh, const char *dir)
 }
 
 
+static int apply_shift(DataTemplate *dtempl, struct dg_group_info *groups,
+                       int n_groups, int code, double shift,
+                       int *last_group_serial)
+{
+	int p;
+	const char *group_name;
+	int group_serial;
+
+	p = mille_unlabel(code % 100);
+	group_serial = code - (code % 100);
+	group_name = group_serial_to_name(group_serial, groups, n_groups);
+
+	if ( *last_group_serial != group_serial ) {
+		STATUS("Group %s:\n", group_name);
+		*last_group_serial = group_serial;
+	}
+
+	switch ( p ) {
+		case GPARAM_DET_TX:
+		case GPARAM_DET_TY:
+		case GPARAM_DET_TZ:
+		STATUS("   %14s %+f mm\n", str_param(p), 1e3*shift);
+		break;
+
+		case GPARAM_DET_RX:
+		case GPARAM_DET_RY:
+		case GPARAM_DET_RZ:
+		STATUS("   %14s %+f deg\n", str_param(p), rad2deg(shift));
+		break;
+	}
+
+	if ( group_name == NULL ) {
+		ERROR("Invalid group serial number %i\n", code);
+		return 1;
+	}
+
+	switch ( p ) {
+
+		case GPARAM_DET_TX:
+		data_template_translate_group_m(dtempl, group_name,
+		                                -shift, 0, 0);
+		break;
+
+		case GPARAM_DET_TY:
+		data_template_translate_group_m(dtempl, group_name,
+		                                0, -shift, 0);
+		break;
+
+		case GPARAM_DET_TZ:
+		data_template_translate_group_m(dtempl, group_name,
+		                                0, 0, -shift);
+		break;
+
+		case GPARAM_DET_RX:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'x');
+		break;
+
+		case GPARAM_DET_RY:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'y');
+		break;
+
+		case GPARAM_DET_RZ:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'z');
+		break;
+
+		default:
+		ERROR("Invalid parameter %i\n", p);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int read_pede_results(DataTemplate *dtempl,
+                             struct dg_group_info *groups, int n_groups)
+{
+	FILE *fh;
+	char line[256];
+	char *rval;
+	int last_group_serial = -1;
+
+	fh = fopen("millepede.res", "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open millepede.res\n");
+		return 1;
+	}
+
+	if ( fgets(line, 256, fh) != line ) {
+		ERROR("Failed to read first line of millepede.res\n");
+		return 1;
+	}
+	if ( strncmp(line, " Parameter ", 11) != 0 ) {
+		ERROR("First line of millepede.res is not as expected.\n");
+		return 1;
+	}
+
+	do {
+
+		char **bits;
+		int i, n;
+
+		rval = fgets(line, 256, fh);
+		if ( rval != line ) continue;
+
+		chomp(line);
+		notrail(line);
+		n = assplode(line, " ", &bits, ASSPLODE_NONE);
+		if ( (n != 3) && (n != 5) ) {
+			ERROR("Didn't understand this line from Millepede: (%i) %s", n, line);
+			return 1;
+		}
+
+		if ( n == 5 ) {
+
+			int code;
+			double shift;
+
+			if ( convert_int(bits[0], &code) ) {
+				ERROR("Didn't understand '%s'\n", bits[0]);
+				return 1;
+			}
+			if ( convert_float(bits[1], &shift) ) {
+				ERROR("Didn't understand '%s'\n", bits[1]);
+				return 1;
+			}
+
+			if ( apply_shift(dtempl, groups, n_groups, code, shift,
+			                 &last_group_serial) ) return 1;
+
+		}
+
+		for ( i=0; i<n; i++ ) free(bits[i]);
+		free(bits);
+
+	} while ( rval == line );
+
+	fclose(fh);
+	return 0;
+}
+
+
+static int run_solver(MilleSolver *solver, int n_threads,
+                      DataTemplate *dtempl,
+                      struct dg_group_info *groups, int n_groups)
+{
+	int i;
+	int n_used, n_rejected;
+	int last_group_serial = -1;
+
+	STATUS("Solving with %i threads\n", n_threads);
+	if ( mille_solver_solve(solver, n_threads) ) {
+		ERROR("Failed to solve for the detector geometry.\n");
+		return 1;
+	}
+
+	mille_solver_num_records(solver, &n_used, &n_rejected);
+	STATUS("Used %i records, rejected %i.\n\n", n_used, n_rejected);
+
+	for ( i=0; i<mille_solver_num_parameters(solver); i++ ) {
+
+		int code;
+		double shift;
+
+		if ( !mille_solver_get_result(solver, i, &code, &shift) ) {
+			continue;
+		}
+
+		if ( apply_shift(dtempl, groups, n_groups, code, shift,
+		                 &last_group_serial) ) return 1;
+
+	}
+
+	return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -288,18 +530,20 @@ int main(int argc, char *argv[])
 	int level = 0;
 	char *rval;
 	int i;
-	FILE *fh;
+	FILE *fh = NULL;
+	MilleSolver *solver = NULL;
 	DataTemplate *dtempl;
 	struct dg_group_info *groups;
 	int n_groups;
 	int r;
-	char line[256];
 	time_t first_mtime = 0;
 	int warn_times = 0;
 	int out_of_plane_shift = 0;
 	int out_of_plane_tilts = 0;
 	int refine_clen = 0;
 	int panel_totals = 0;
+	int use_pede = 0;
+	int n_threads = 1;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -315,12 +559,13 @@ int main(int argc, char *argv[])
 		{"out-of-plane-tilts", 0, &out_of_plane_tilts, 1},
 		{"camera-length",      0, &refine_clen,        1},
 		{"panel-totals",       0, &panel_totals,       1},
+		{"millepede",          0, &use_pede,           1},
 
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hVo:g:i:l:",
+	while ((c = getopt_long(argc, argv, "hVo:g:i:l:j:",
 	                        longopts, NULL)) != -1)
 	{
 
@@ -351,6 +596,16 @@ int main(int argc, char *argv[])
 				ERROR("Invalid value for --level.\n");
 				return 1;
 			}
+			break;
+
+			case 'j' :
+			errno = 0;
+			n_threads = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_threads < 1) ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
 
 			case 0 :
 			break;
@@ -371,10 +626,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	fh = fopen("millepede.txt", "w");
-	if ( fh == NULL ) {
-		ERROR("Couldn't open Millepede steering file\n");
-		return 1;
+	if ( use_pede ) {
+		fh = fopen("millepede.txt", "w");
+		if ( fh == NULL ) {
+			ERROR("Couldn't open Millepede steering file\n");
+			return 1;
+		}
+	} else {
+		solver = mille_solver_new();
+		if ( solver == NULL ) {
+			ERROR("Couldn't create solver\n");
+			return 1;
+		}
 	}
 
 	for ( i=optind; i<argc; i++ ) {
@@ -396,9 +659,9 @@ int main(int argc, char *argv[])
 		}
 
 		if ( is_dir(argv[i]) ) {
-			write_children(fh, argv[i]);
+			write_children(fh, solver, argv[i]);
 		} else {
-			fprintf(fh, "%s\n", argv[i]);
+			add_file(fh, solver, argv[i]);
 		}
 	}
 
@@ -407,170 +670,59 @@ int main(int argc, char *argv[])
 	dtempl = data_template_new_from_file(in_geom);
 	groups = data_template_group_info(dtempl, &n_groups);
 
-	fprintf(fh, "\nParameter\n");
+	if ( fh != NULL ) fprintf(fh, "\nParameter\n");
 
 	/* Top level */
-	fprintf(fh, "%i 0 0\n", mille_label(0, GPARAM_DET_TX));
-	fprintf(fh, "%i 0 0\n", mille_label(0, GPARAM_DET_TY));
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_TZ), refine_clen ? 0 : -1);
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_RX), out_of_plane_tilts ? 0 : -1);
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_RY), out_of_plane_tilts ? 0 : -1);
-	fprintf(fh, "%i 0 -1\n", mille_label(0, GPARAM_DET_RZ));
+	add_param(fh, solver, mille_label(0, GPARAM_DET_TX), 0);
+	add_param(fh, solver, mille_label(0, GPARAM_DET_TY), 0);
+	add_param(fh, solver, mille_label(0, GPARAM_DET_TZ), refine_clen ? 0 : -1);
+	add_param(fh, solver, mille_label(0, GPARAM_DET_RX), out_of_plane_tilts ? 0 : -1);
+	add_param(fh, solver, mille_label(0, GPARAM_DET_RY), out_of_plane_tilts ? 0 : -1);
+	add_param(fh, solver, mille_label(0, GPARAM_DET_RZ), -1);
 
 	for ( i=0; i<n_groups; i++ ) {
 		int f_inplane = (groups[i].hierarchy_level > level) ? -1 : 0;
 		int f_outplane_shift = out_of_plane_shift ? f_inplane : -1;
 		int f_outplane_tilts = out_of_plane_tilts ? f_inplane : -1;
+		int serial = groups[i].serial;
 		if ( groups[i].hierarchy_level == 0 ) continue;
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TX), f_inplane);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TY), f_inplane);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TZ), f_outplane_shift);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RX), f_outplane_tilts);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RY), f_outplane_tilts);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RZ), f_inplane);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_TX), f_inplane);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_TY), f_inplane);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_TZ), f_outplane_shift);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_RX), f_outplane_tilts);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_RY), f_outplane_tilts);
+		add_param(fh, solver, mille_label(serial, GPARAM_DET_RZ), f_inplane);
 	}
-	fprintf(fh, "\n");
+	if ( fh != NULL ) fprintf(fh, "\n");
 
 	/* All corrections must sum to zero at each level of hierarchy */
-	if ( make_zero_sum(fh, groups, n_groups, "all", level,
+	if ( make_zero_sum(fh, solver, groups, n_groups, "all", level,
 	                   out_of_plane_shift, out_of_plane_tilts) ) return 1;
 
-	fprintf(fh, "method inversion 5 0.1\n");
-	fprintf(fh, "closeandreopen\n");
-	fprintf(fh, "end\n");
-	fclose(fh);
-
-	unlink("millepede.res");
+	if ( use_pede ) {
 
-	if ( run_pede() ) return 1;
-	STATUS("Millepede succeeded.\n\n");
-
-	fh = fopen("millepede.res", "r");
-	if ( fh == NULL ) {
-		ERROR("Failed to open millepede.res\n");
-		return 1;
-	}
-
-	if ( fgets(line, 256, fh) != line ) {
-		ERROR("Failed to read first line of millepede.res\n");
-		return 1;
-	}
-	if ( strncmp(line, " Parameter ", 11) != 0 ) {
-		ERROR("First line of millepede.res is not as expected.\n");
-		return 1;
-	}
+		fprintf(fh, "method inversion 5 0.1\n");
+		fprintf(fh, "closeandreopen\n");
+		fprintf(fh, "end\n");
+		fclose(fh);
 
-	data_template_reset_total_movements(dtempl);
+		unlink("millepede.res");
 
-	int last_group_serial = -1;
-	do {
+		if ( run_pede() ) return 1;
+		STATUS("Millepede succeeded.\n\n");
 
-		char **bits;
-		int i, n;
+		data_template_reset_total_movements(dtempl);
+		if ( read_pede_results(dtempl, groups, n_groups) ) return 1;
 
-		rval = fgets(line, 256, fh);
-		if ( rval != line ) continue;
+	} else {
 
-		chomp(line);
-		notrail(line);
-		n = assplode(line, " ", &bits, ASSPLODE_NONE);
-		if ( (n != 3) && (n != 5) ) {
-			ERROR("Didn't understand this line from Millepede: (%i) %s", n, line);
+		data_template_reset_total_movements(dtempl);
+		if ( run_solver(solver, n_threads, dtempl, groups, n_groups) ) {
 			return 1;
 		}
+		mille_solver_free(solver);
 
-		if ( n == 5 ) {
-
-			int code;
-			double shift;
-			int p;
-			const char *group_name;
-			int group_serial;
-
-			if ( convert_int(bits[0], &code) ) {
-				ERROR("Didn't understand '%s'\n", bits[0]);
-				return 1;
-			}
-			if ( convert_float(bits[1], &shift) ) {
-				ERROR("Didn't understand '%s'\n", bits[1]);
-				return 1;
-			}
-
-			p = mille_unlabel(code % 100);
-			group_serial = code - (code % 100);
-			group_name = group_serial_to_name(group_serial,
-			                                  groups,
-			                                  n_groups);
-
-			if ( last_group_serial != group_serial ) {
-				STATUS("Group %s:\n", group_name);
-				last_group_serial = group_serial;
-			}
-
-			switch ( p ) {
-				case GPARAM_DET_TX:
-				case GPARAM_DET_TY:
-				case GPARAM_DET_TZ:
-				STATUS("   %14s %+f mm\n", str_param(p), 1e3*shift);
-				break;
-
-				case GPARAM_DET_RX:
-				case GPARAM_DET_RY:
-				case GPARAM_DET_RZ:
-				STATUS("   %14s %+f deg\n", str_param(p), rad2deg(shift));
-				break;
-			}
-
-			if ( group_name == NULL ) {
-				ERROR("Invalid group serial number %i\n", code);
-				return 1;
-			}
-
-			switch ( p ) {
-
-				case GPARAM_DET_TX:
-				data_template_translate_group_m(dtempl, group_name,
-				                                -shift, 0, 0);
-				break;
-
-				case GPARAM_DET_TY:
-				data_template_translate_group_m(dtempl, group_name,
-				                                0, -shift, 0);
-				break;
-
-				case GPARAM_DET_TZ:
-				data_template_translate_group_m(dtempl, group_name,
-				                                0, 0, -shift);
-				break;
-
-				case GPARAM_DET_RX:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'x');
-				break;
-
-				case GPARAM_DET_RY:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'y');
-				break;
-
-				case GPARAM_DET_RZ:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'z');
-				break;
-
-				default:
-				ERROR("Invalid parameter %i\n", p);
-				return 1;
-			}
-
-		}
-
-		for ( i=0; i<n; i++ ) free(bits[i]);
-		free(bits);
-
-	} while ( rval == line );
-
-	fclose(fh);
+	}
 
 	if ( panel_totals ) {
 		data_template_print_total_movements(dtempl);
@@ -74,6 +74,18 @@ static void show_help(const char *s)
 #define CAT_R (7)
 #define CAT_EXCLUDE (8)
 
+/* For cells which don't appear in the histograms at all */
+#define CAT_HIDDEN (255)
+
+/* Columns of cell parameters */
+#define PARAM_A (0)
+#define PARAM_B (1)
+#define PARAM_C (2)
+#define PARAM_AL (3)
+#define PARAM_BE (4)
+#define PARAM_GA (5)
+#define N_PARAMS (6)
+
 
 typedef struct {
 
@@ -105,21 +117,70 @@ typedef struct {
 	double fit_c;
 
 	struct _cellwindow *parent;
+	int param;
+
+	/* Histogram bin of each cell, and the cells sorted by bin:
+	 * bin j contains bin_cells[bin_start[j]] to bin_cells[bin_start[j+1]-1] */
+	int *bin_of;
+	int *bin_start;
+	int *bin_cells;
+
+	/* The selection which the cell states currently take into account */
+	int applied_sel;
+	double applied_min;
+	double applied_max;
 
 } HistoBox;
 
 
+struct stream_loader
+{
+	const char *filename;
+
+	float *params[N_PARAMS];
+	unsigned char *cats;
+	IndexingMethod *indms;
+	int n_cells;
+	int max_cells;
+	int n_bad;
+	int old_indexers;
+
+	/* Progress, for the main thread */
+	int n_chunks_done;
+	int n_cells_done;
+};
+
+
 typedef struct _cellwindow {
 
 	GtkWidget *window;
 	GtkUIManager *ui;
 	GtkActionGroup *action_group;
 
+	GtkWidget *vbox;
 	GtkWidget *indmlist;
-
-	UnitCell **cells;
-	IndexingMethod *indms;
+	GtkWidget *progress;
+
+	/* Cell parameters (in Angstroms and degrees), stored by column.
+	 * Single precision is plenty for the histograms, and halves the
+	 * memory needed for very large runs */
+	float *params[N_PARAMS];
+	unsigned char *cats;      /* Centering category of each cell */
+	unsigned char *indm_idx;  /* Indexing method, index in unique_indms */
 	int n_cells;
+	int n_bad;
+
+	/* Cell numbers, sorted by category and by indexing method */
+	int *by_cat;
+	int cat_start[CAT_EXCLUDE+1];
+	int *by_indm;
+	int indm_start[257];
+
+	/* Category in which each cell currently appears in the histograms,
+	 * and the number of its parameters outside the selected ranges */
+	unsigned char *state;
+	unsigned char *n_out;
+	int n_selected;
 
 	IndexingMethod unique_indms[256];
 	int active_indms[256];
@@ -131,9 +192,16 @@ typedef struct _cellwindow {
 	HistoBox *hist_al;
 	HistoBox *hist_be;
 	HistoBox *hist_ga;
+	HistoBox *hists[N_PARAMS];
 
 	int cols_on[8];
 
+	struct stream_loader *loaders;
+	int n_loaders;
+	int next_loader;
+	int loaders_running;
+	int n_chunks;
+
 } CellWindow;
 
 
@@ -599,112 +667,256 @@ static gboolean keyexpose_sig(GtkWidget *da, GdkEventExpose *event,
 }
 
 
-static int check_exclude(HistoBox *h, double v)
+static void selection_range(HistoBox *h, double *min, double *max)
 {
-	double min, max;
-
-	if ( !h->show_sel ) return 0;
-
 	if ( h->sel1 > h->sel2 ) {
-		min = h->sel2;
-		max = h->sel1;
+		*min = h->sel2;
+		*max = h->sel1;
 	} else {
-		min = h->sel1;
-		max = h->sel2;
+		*min = h->sel1;
+		*max = h->sel2;
 	}
+}
 
+
+static int check_exclude(int show_sel, double min, double max, double v)
+{
+	if ( !show_sel ) return 0;
 	if ( v < min ) return 1;
 	if ( v > max ) return 1;
-
 	return 0;
 }
 
 
-static void scan_cells(CellWindow *w)
+/* Returns 0 if all values between lo and hi are inside the selection, 1 if
+ * they are all outside, or -1 if it depends on the value */
+static int check_exclude_range(int show_sel, double min, double max,
+                               double lo, double hi)
 {
-	int i;
-	UnitCell **cells = w->cells;
-	int n_cells = w->n_cells;
-	int n_excl = 0;
-
-	multihistogram_delete_all_values(w->hist_a->h);
-	multihistogram_delete_all_values(w->hist_b->h);
-	multihistogram_delete_all_values(w->hist_c->h);
-	multihistogram_delete_all_values(w->hist_al->h);
-	multihistogram_delete_all_values(w->hist_be->h);
-	multihistogram_delete_all_values(w->hist_ga->h);
-
-	multihistogram_set_num_bins(w->hist_a->h, w->hist_a->n);
-	multihistogram_set_num_bins(w->hist_b->h, w->hist_b->n);
-	multihistogram_set_num_bins(w->hist_c->h, w->hist_c->n);
-	multihistogram_set_num_bins(w->hist_al->h, w->hist_al->n);
-	multihistogram_set_num_bins(w->hist_be->h, w->hist_be->n);
-	multihistogram_set_num_bins(w->hist_ga->h, w->hist_ga->n);
-
-	for ( i=0; i<n_cells; i++ ) {
-
-		double a, b, c, al, be, ga;
-		unsigned int cat, j;
-		int ignore = 0;
-
-		for ( j=0; j<w->n_unique_indms; j++ ) {
-			if ( w->unique_indms[j] == w->indms[i] ) {
-				if ( !w->active_indms[j] ) ignore = 1;
-			}
-		}
+	if ( !show_sel ) return 0;
+	if ( (lo >= min) && (hi <= max) ) return 0;
+	if ( (hi < min) || (lo > max) ) return 1;
+	return -1;
+}
 
-		if ( ignore ) {
-			n_excl++;
-			continue;
-		}
 
-		if ( cell_get_parameters(cells[i], &a, &b, &c, &al, &be, &ga) ) {
-			n_excl++;
-			continue;
-		}
-		a *= 1e10;  b *= 1e10;  c *= 1e10;
-		al = rad2deg(al);  be = rad2deg(be);  ga = rad2deg(ga);
-
-		switch ( cell_get_centering(cells[i]) ) {
-			case 'P' : cat = CAT_P; break;
-			case 'A' : cat = CAT_A; break;
-			case 'B' : cat = CAT_B; break;
-			case 'C' : cat = CAT_C; break;
-			case 'I' : cat = CAT_I; break;
-			case 'F' : cat = CAT_F; break;
-			case 'H' : cat = CAT_H; break;
-			case 'R' : cat = CAT_R; break;
+static void show_selected(CellWindow *w)
+{
+	STATUS("Selected %i of %i cells\n", w->n_selected,
+	       w->n_cells + w->n_bad);
+}
 
-			default :
-			ERROR("Unknown centering '%c'\n",
-			      cell_get_centering(cells[i]));
-			continue;
+
+static unsigned int cell_state(CellWindow *w, int i)
+{
+	if ( !w->active_indms[w->indm_idx[i]] ) return CAT_HIDDEN;
+	if ( w->n_out[i] ) return CAT_EXCLUDE;
+	if ( w->cols_on[w->cats[i]] == 0 ) return CAT_EXCLUDE;
+	return w->cats[i];
+}
+
+
+/* Move a cell to the right category in all the histograms, if it has
+ * changed */
+static void update_cell(CellWindow *w, int i)
+{
+	unsigned int old = w->state[i];
+	unsigned int new = cell_state(w, i);
+	int p;
+
+	if ( new == old ) return;
+
+	for ( p=0; p<N_PARAMS; p++ ) {
+		HistoBox *h = w->hists[p];
+		if ( old != CAT_HIDDEN ) {
+			multihistogram_add_to_bin(h->h, h->bin_of[i], 1<<old, -1);
 		}
+		if ( new != CAT_HIDDEN ) {
+			multihistogram_add_to_bin(h->h, h->bin_of[i], 1<<new, +1);
+		}
+	}
+
+	if ( old < CAT_EXCLUDE ) w->n_selected--;
+	if ( new < CAT_EXCLUDE ) w->n_selected++;
+	w->state[i] = new;
+}
+
+
+static void update_category(CellWindow *w, int cat)
+{
+	int k;
+	for ( k=w->cat_start[cat]; k<w->cat_start[cat+1]; k++ ) {
+		update_cell(w, w->by_cat[k]);
+	}
+}
+
+
+static void update_method(CellWindow *w, int j)
+{
+	int k;
+	for ( k=w->indm_start[j]; k<w->indm_start[j+1]; k++ ) {
+		update_cell(w, w->by_indm[k]);
+	}
+}
+
+
+/* Bring the cell states up to date with the selection in one histogram.
+ * Only the bins which straddle the old or new selection limits, or which lie
+ * between them, need to be looked at */
+static void update_selection(CellWindow *w, HistoBox *h)
+{
+	double min, max;
+	double width;
+	float *vals = w->params[h->param];
+	int j;
+
+	selection_range(h, &min, &max);
+
+	if ( !h->show_sel && !h->applied_sel ) return;
+	if ( h->show_sel && h->applied_sel
+	  && (min == h->applied_min) && (max == h->applied_max) ) return;
+
+	width = (h->max - h->min)/h->n;
+
+	for ( j=0; j<h->n; j++ ) {
+
+		double lo, hi;
+		int old, new;
+		int k;
+
+		/* Allow for rounding in the binning.  The end bins also
+		 * contain anything which fell off the ends */
+		lo = (j == 0) ? -INFINITY : h->min + (j-0.01)*width;
+		hi = (j == h->n-1) ? +INFINITY : h->min + (j+1.01)*width;
+
+		old = check_exclude_range(h->applied_sel, h->applied_min,
+		                          h->applied_max, lo, hi);
+		new = check_exclude_range(h->show_sel, min, max, lo, hi);
+		if ( (old != -1) && (old == new) ) continue;
+
+		for ( k=h->bin_start[j]; k<h->bin_start[j+1]; k++ ) {
+
+			int i = h->bin_cells[k];
+
+			old = check_exclude(h->applied_sel, h->applied_min,
+			                    h->applied_max, vals[i]);
+			new = check_exclude(h->show_sel, min, max, vals[i]);
+			if ( old == new ) continue;
+
+			if ( new ) {
+				w->n_out[i]++;
+			} else {
+				w->n_out[i]--;
+			}
+			update_cell(w, i);
 
-		if ( check_exclude(w->hist_a, a) ||
-		     check_exclude(w->hist_b, b) ||
-		     check_exclude(w->hist_c, c) ||
-		     check_exclude(w->hist_al, al) ||
-		     check_exclude(w->hist_be, be) ||
-		     check_exclude(w->hist_ga, ga) )
-		{
-			cat = CAT_EXCLUDE;
-			n_excl++;
-		} else if ( w->cols_on[cat] == 0 ) {
-			cat = CAT_EXCLUDE;
-			n_excl++;
 		}
+	}
+
+	h->applied_sel = h->show_sel;
+	h->applied_min = min;
+	h->applied_max = max;
+}
+
 
-		multihistogram_add_value(w->hist_a->h, a, 1<<cat);
-		multihistogram_add_value(w->hist_b->h, b, 1<<cat);
-		multihistogram_add_value(w->hist_c->h, c, 1<<cat);
-		multihistogram_add_value(w->hist_al->h, al, 1<<cat);
-		multihistogram_add_value(w->hist_be->h, be, 1<<cat);
-		multihistogram_add_value(w->hist_ga->h, ga, 1<<cat);
+/* Sort the cells into the bins of one histogram.  This only needs to be done
+ * again when the number of bins changes */
+static void bin_cells(CellWindow *w, HistoBox *h)
+{
+	int i;
+	int *pos;
+	float *vals = w->params[h->param];
+
+	multihistogram_set_num_bins(h->h, h->n);
+
+	free(h->bin_start);
+	h->bin_start = calloc(h->n+1, sizeof(int));
+	pos = malloc(h->n*sizeof(int));
+	if ( (h->bin_start == NULL) || (pos == NULL) ) {
+		ERROR("Failed to allocate histogram bins\n");
+		exit(1);
+	}
 
+	for ( i=0; i<w->n_cells; i++ ) {
+		h->bin_of[i] = multihistogram_get_bin(h->h, vals[i]);
+		h->bin_start[h->bin_of[i]+1]++;
+	}
+	for ( i=0; i<h->n; i++ ) {
+		h->bin_start[i+1] += h->bin_start[i];
+		pos[i] = h->bin_start[i];
+	}
+	for ( i=0; i<w->n_cells; i++ ) {
+		h->bin_cells[pos[h->bin_of[i]]++] = i;
 	}
+	free(pos);
 
-	STATUS("Selected %i of %i cells\n", n_cells-n_excl, n_cells);
+	for ( i=0; i<w->n_cells; i++ ) {
+		if ( w->state[i] == CAT_HIDDEN ) continue;
+		multihistogram_add_to_bin(h->h, h->bin_of[i], 1<<w->state[i], 1);
+	}
+}
+
+
+/* Counting sort of cell numbers by a small key */
+static int *sort_cells(unsigned char *keys, int n_cells, int *start, int n_keys)
+{
+	int *sorted;
+	int *pos;
+	int i;
+
+	sorted = malloc(n_cells*sizeof(int));
+	pos = calloc(n_keys, sizeof(int));
+	if ( (sorted == NULL) || (pos == NULL) ) {
+		ERROR("Failed to allocate cell lists\n");
+		exit(1);
+	}
+
+	for ( i=0; i<=n_keys; i++ ) start[i] = 0;
+	for ( i=0; i<n_cells; i++ ) start[keys[i]+1]++;
+	for ( i=0; i<n_keys; i++ ) {
+		start[i+1] += start[i];
+		pos[i] = start[i];
+	}
+	for ( i=0; i<n_cells; i++ ) sorted[pos[keys[i]]++] = i;
+
+	free(pos);
+	return sorted;
+}
+
+
+static void setup_cells(CellWindow *w)
+{
+	int i, p;
+	size_t n = w->n_cells;
+
+	w->state = malloc(n);
+	w->n_out = calloc(n, 1);
+	if ( (w->state == NULL) || (w->n_out == NULL) ) {
+		ERROR("Failed to allocate cell states\n");
+		exit(1);
+	}
+	for ( i=0; i<w->n_cells; i++ ) w->state[i] = CAT_HIDDEN;
+	w->n_selected = 0;
+
+	w->by_cat = sort_cells(w->cats, w->n_cells, w->cat_start, CAT_EXCLUDE);
+	w->by_indm = sort_cells(w->indm_idx, w->n_cells, w->indm_start, 256);
+
+	for ( p=0; p<N_PARAMS; p++ ) {
+		HistoBox *h = w->hists[p];
+		h->bin_of = malloc(n*sizeof(int));
+		h->bin_cells = malloc(n*sizeof(int));
+		if ( (h->bin_of == NULL) || (h->bin_cells == NULL) ) {
+			ERROR("Failed to allocate histogram bins\n");
+			exit(1);
+		}
+		bin_cells(w, h);
+		h->applied_sel = 0;
+	}
+
+	for ( i=0; i<w->n_cells; i++ ) update_cell(w, i);
+	for ( p=0; p<N_PARAMS; p++ ) update_selection(w, w->hists[p]);
+
+	show_selected(w);
 }
 
 
@@ -721,6 +933,7 @@ static gint keyclick_sig(GtkWidget *widget, GdkEventButton *event,
 	width = alloc.width;
 
 	cat = 8*event->x / width;
+	if ( cat > 7 ) cat = 7;
 
 	if ( cat == 0 ) {
 		/* Special handling for P so that it doesn't go
@@ -730,7 +943,8 @@ static gint keyclick_sig(GtkWidget *widget, GdkEventButton *event,
 		w->cols_on[cat] = (w->cols_on[cat]+1) % 3;
 	}
 
-	scan_cells(w);
+	update_category(w, cat);
+	show_selected(w);
 	redraw_all(w);
 
 	gtk_widget_queue_draw(widget);
@@ -765,44 +979,13 @@ static void set_minmax(HistoBox *h)
 
 static void scan_minmax(CellWindow *w)
 {
-	int i;
-
-	for ( i=0; i<w->n_cells; i++ ) {
+	int i, p;
 
-		double a, b, c, al, be, ga;
-		int j;
-		int found = 0;
-
-		if ( cell_get_parameters(w->cells[i], &a, &b, &c, &al, &be, &ga) ) {
-			ERROR("Cell %i is bad\n", i);
-			continue;
-		}
-		a *= 1e10;  b *= 1e10;  c *= 1e10;
-		al = rad2deg(al);  be = rad2deg(be);  ga = rad2deg(ga);
-
-		check_minmax(w->hist_a, a);
-		check_minmax(w->hist_b, b);
-		check_minmax(w->hist_c, c);
-		check_minmax(w->hist_al, al);
-		check_minmax(w->hist_be, be);
-		check_minmax(w->hist_ga, ga);
-
-		for ( j=0; j<w->n_unique_indms; j++ ) {
-			if ( w->indms[i] == w->unique_indms[j] ) {
-				found = 1;
-				break;
-			}
-		}
-		if ( !found ) {
-			if ( w->n_unique_indms > 255 ) {
-				fprintf(stderr, "Too many indexing methods\n");
-			} else {
-				IndexingMethod m = w->indms[i];
-				w->unique_indms[w->n_unique_indms] = m;
-				w->active_indms[w->n_unique_indms++] = 1;
-			}
+	for ( p=0; p<N_PARAMS; p++ ) {
+		HistoBox *h = w->hists[p];
+		for ( i=0; i<w->n_cells; i++ ) {
+			check_minmax(h, w->params[p][i]);
 		}
-
 	}
 
 	ensure_minimum_width(w->hist_al, 1.1);
@@ -1014,6 +1197,13 @@ static gint clear_sig(GtkWidget *widget, CellWindow *w)
 	w->hist_al->sel = 1;
 	w->hist_be->sel = 1;
 	w->hist_ga->sel = 1;
+	update_selection(w, w->hist_a);
+	update_selection(w, w->hist_b);
+	update_selection(w, w->hist_c);
+	update_selection(w, w->hist_al);
+	update_selection(w, w->hist_be);
+	update_selection(w, w->hist_ga);
+	show_selected(w);
 	redraw_all(w);
 	return TRUE;
 }
@@ -1754,7 +1944,8 @@ static gint press_sig(GtkWidget *widget, GdkEventButton *event, HistoBox *h)
 static gint release_sig(GtkWidget *widget, GdkEventButton *event, HistoBox *h)
 {
 	if ( h->sel ) {
-		scan_cells(h->parent);
+		update_selection(h->parent, h);
+		show_selected(h->parent);
 		redraw_all(h->parent);
 	}
 	return TRUE;
@@ -1845,14 +2036,14 @@ static gint keypress_sig(GtkWidget *widget, GdkEventKey *event, HistoBox *h)
 	if ( (event->keyval == GDK_plus) || (event->keyval == GDK_equal) ) {
 		if ( h->n < 100000 ) {
 			h->n *= 2;
-			scan_cells(h->parent);
+			bin_cells(h->parent, h);
 			gtk_widget_queue_draw(h->da);
 		}
 	}
 
 	if ( (event->keyval == GDK_minus) && (h->n > 1) ) {
 		h->n /= 2;
-		scan_cells(h->parent);
+		bin_cells(h->parent, h);
 		gtk_widget_queue_draw(h->da);
 	}
 
@@ -1860,7 +2051,8 @@ static gint keypress_sig(GtkWidget *widget, GdkEventKey *event, HistoBox *h)
 }
 
 
-static HistoBox *histobox_new(CellWindow *w, const char *units, const char *n)
+static HistoBox *histobox_new(CellWindow *w, int param, const char *units,
+                              const char *n)
 {
 	HistoBox *h;
 
@@ -1870,6 +2062,7 @@ static HistoBox *histobox_new(CellWindow *w, const char *units, const char *n)
 	h->show_sel = 0;
 	h->units = units;
 	h->parent = w;
+	h->param = param;
 	h->min = +INFINITY;
 	h->max = -INFINITY;
 	h->n = 99;  /* Number of bins */
@@ -1915,16 +2108,20 @@ static HistoBox *histobox_new(CellWindow *w, const char *units, const char *n)
 
 struct toggle_method
 {
-	int *active;
+	int indm;
 	CellWindow *w;
 };
 
 
 static gint indm_toggle_sig(GtkWidget *widget, struct toggle_method *tm)
 {
-	*tm->active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
-	scan_cells(tm->w);
-	redraw_all(tm->w);
+	CellWindow *w = tm->w;
+	GtkToggleButton *button = GTK_TOGGLE_BUTTON(widget);
+
+	w->active_indms[tm->indm] = gtk_toggle_button_get_active(button);
+	update_method(w, tm->indm);
+	show_selected(w);
+	redraw_all(w);
 	return FALSE;
 }
 
@@ -1978,7 +2175,7 @@ static void indexing_method_list(CellWindow *w, GtkWidget *vbox)
 		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), TRUE);
 
 		tm->w = w;
-		tm->active = &w->active_indms[j];
+		tm->indm = j;
 		g_signal_connect(G_OBJECT(button), "toggled",
 		                 G_CALLBACK(indm_toggle_sig), tm);
 
@@ -1990,22 +2187,90 @@ static void indexing_method_list(CellWindow *w, GtkWidget *vbox)
 }
 
 
-static int add_stream(CellWindow *w, const char *stream_filename,
-                      int *pmax_cells, int *pn_total_chunks)
+static int centering_category(char cen)
 {
-	Stream *st;
-	int n_chunks = 0;
-	int n_cells = 0;
-	int max_cells = *pmax_cells;
+	switch ( cen ) {
+		case 'P' : return CAT_P;
+		case 'A' : return CAT_A;
+		case 'B' : return CAT_B;
+		case 'C' : return CAT_C;
+		case 'I' : return CAT_I;
+		case 'F' : return CAT_F;
+		case 'H' : return CAT_H;
+		case 'R' : return CAT_R;
+		default : return -1;
+	}
+}
 
-	fprintf(stderr, "%s\r", stream_filename);
 
-	st = stream_open_for_read(stream_filename);
-	if ( st == NULL ) {
-		fprintf(stderr, "Failed to open '%s' (skipping)\n",
-		        stream_filename);
+static int loader_add_cell(struct stream_loader *ld, UnitCell *cell,
+                           IndexingMethod indm)
+{
+	double a, b, c, al, be, ga;
+	int cat;
+	int n = ld->n_cells;
+	int p;
+
+	if ( cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga) ) {
+		ERROR("Cell %i in %s is bad\n", n, ld->filename);
+		ld->n_bad++;
 		return 0;
 	}
+
+	cat = centering_category(cell_get_centering(cell));
+	if ( cat < 0 ) {
+		ERROR("Unknown centering '%c'\n", cell_get_centering(cell));
+		ld->n_bad++;
+		return 0;
+	}
+
+	if ( !right_handed(cell) ) {
+		ERROR("WARNING: Left-handed cell encountered\n");
+	}
+
+	if ( n == ld->max_cells ) {
+
+		int max_cells = (n == 0) ? 1024 : 2*n;
+
+		for ( p=0; p<N_PARAMS; p++ ) {
+			float *params_new;
+			params_new = realloc(ld->params[p],
+			                     max_cells*sizeof(float));
+			if ( params_new == NULL ) return 1;
+			ld->params[p] = params_new;
+		}
+		ld->cats = realloc(ld->cats, max_cells);
+		ld->indms = realloc(ld->indms, max_cells*sizeof(IndexingMethod));
+		if ( (ld->cats == NULL) || (ld->indms == NULL) ) return 1;
+
+		ld->max_cells = max_cells;
+
+	}
+
+	ld->params[PARAM_A][n] = a*1e10;
+	ld->params[PARAM_B][n] = b*1e10;
+	ld->params[PARAM_C][n] = c*1e10;
+	ld->params[PARAM_AL][n] = rad2deg(al);
+	ld->params[PARAM_BE][n] = rad2deg(be);
+	ld->params[PARAM_GA][n] = rad2deg(ga);
+	ld->cats[n] = cat;
+	ld->indms[n] = indm;
+	ld->n_cells++;
+
+	return 0;
+}
+
+
+static void load_stream(struct stream_loader *ld)
+{
+	Stream *st;
+
+	st = stream_open_for_read(ld->filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open '%s' (skipping)\n", ld->filename);
+		return;
+	}
+
 	do {
 
 		struct image *image;
@@ -2015,61 +2280,155 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 		if ( image == NULL ) break;
 
 		for ( i=0; i<image->n_crystals; i++ ) {
+			UnitCell *cell = crystal_get_cell(image->crystals[i].cr);
+			if ( loader_add_cell(ld, cell, image->indexed_by) ) {
+				ERROR("Failed to allocate memory for cells.\n");
+				break;
+			}
+		}
 
-			Crystal *cr = image->crystals[i].cr;
+		image_free(image);
 
-			if ( w->n_cells == max_cells ) {
+		g_atomic_int_inc(&ld->n_chunks_done);
+		g_atomic_int_set(&ld->n_cells_done, ld->n_cells);
 
-				UnitCell **cells_new;
-				IndexingMethod *indms_new;
-				size_t nsz;
+	} while ( 1 );
 
-				nsz = (max_cells+1024)*sizeof(UnitCell *);
-				cells_new = realloc(w->cells, nsz);
-				if ( cells_new == NULL ) {
-					fprintf(stderr, "Failed to allocate "
-					        "memory for cells.\n");
-					break;
-				}
+	ld->old_indexers = stream_has_old_indexers(st);
+	stream_close(st);
+}
 
-				nsz = (max_cells+1024)*sizeof(IndexingMethod);
-				indms_new = realloc(w->indms, nsz);
-				if ( indms_new == NULL ) {
-					fprintf(stderr, "Failed to allocate "
-					        "memory for methods.\n");
-					break;
-				}
 
-				max_cells += 1024;
-				*pmax_cells = max_cells;
-				w->cells = cells_new;
-				w->indms = indms_new;
+/* Each thread loads whole streams, taking the next one which hasn't been
+ * started yet */
+static gpointer load_thread(gpointer data)
+{
+	CellWindow *w = data;
 
-			}
+	do {
+		int i = g_atomic_int_add(&w->next_loader, 1);
+		if ( i >= w->n_loaders ) break;
+		load_stream(&w->loaders[i]);
+	} while ( 1 );
 
-			w->cells[w->n_cells] = cell_new_from_cell(crystal_get_cell(cr));
-			if ( !right_handed(w->cells[w->n_cells]) ) {
-				ERROR("WARNING: Left-handed cell encountered\n");
-			}
-			w->indms[w->n_cells] = image->indexed_by;
-			w->n_cells++;
-			n_cells++;
+	g_atomic_int_add(&w->loaders_running, -1);
+	return NULL;
+}
+
+
+static void start_loading(CellWindow *w, char **filenames, int n_files)
+{
+	int i;
+	int n_threads;
+
+	w->loaders = calloc(n_files, sizeof(struct stream_loader));
+	if ( w->loaders == NULL ) {
+		ERROR("Failed to allocate stream loaders\n");
+		exit(1);
+	}
+	for ( i=0; i<n_files; i++ ) {
+		w->loaders[i].filename = filenames[i];
+	}
+	w->n_loaders = n_files;
+	w->next_loader = 0;
+
+	n_threads = g_get_num_processors();
+	if ( n_threads > n_files ) n_threads = n_files;
+	w->loaders_running = n_threads;
+	for ( i=0; i<n_threads; i++ ) {
+		g_thread_unref(g_thread_new("load-stream", load_thread, w));
+	}
+}
+
+
+static int find_indm(CellWindow *w, IndexingMethod m)
+{
+	int j;
+
+	for ( j=0; j<w->n_unique_indms; j++ ) {
+		if ( w->unique_indms[j] == m ) return j;
+	}
+
+	if ( w->n_unique_indms > 255 ) {
+		ERROR("Too many indexing methods\n");
+		return 0;
+	}
+
+	w->unique_indms[w->n_unique_indms] = m;
+	w->active_indms[w->n_unique_indms] = 1;
+	return w->n_unique_indms++;
+}
+
+
+/* Join the results from all the streams together, in order */
+static void collect_cells(CellWindow *w)
+{
+	int i, p;
+	int n = 0;
+	int old_indexers = 0;
+
+	w->n_cells = 0;
+	w->n_bad = 0;
+	w->n_chunks = 0;
+	for ( i=0; i<w->n_loaders; i++ ) {
+		w->n_cells += w->loaders[i].n_cells;
+		w->n_bad += w->loaders[i].n_bad;
+		w->n_chunks += w->loaders[i].n_chunks_done;
+	}
 
+	for ( p=0; p<N_PARAMS; p++ ) {
+		w->params[p] = malloc(w->n_cells*sizeof(float));
+		if ( w->params[p] == NULL ) {
+			ERROR("Failed to allocate memory for cells.\n");
+			exit(1);
 		}
+	}
+	w->cats = malloc(w->n_cells);
+	w->indm_idx = malloc(w->n_cells);
+	if ( (w->cats == NULL) || (w->indm_idx == NULL) ) {
+		ERROR("Failed to allocate memory for cells.\n");
+		exit(1);
+	}
+
+	w->n_unique_indms = 0;
+	for ( i=0; i<w->n_loaders; i++ ) {
+
+		struct stream_loader *ld = &w->loaders[i];
+		IndexingMethod last = 0;
+		int last_idx = -1;
+		int k;
 
-		n_chunks++;
-		if ( n_chunks % 1000 == 0 ) {
-			fprintf(stderr, "%s: Loaded %i cells from %i chunks\r",
-			        stream_filename, n_cells, n_chunks);
+		for ( p=0; p<N_PARAMS; p++ ) {
+			memcpy(w->params[p]+n, ld->params[p],
+			       ld->n_cells*sizeof(float));
+			free(ld->params[p]);
 		}
+		memcpy(w->cats+n, ld->cats, ld->n_cells);
 
-		image_free(image);
+		/* Almost always the same as the previous cell */
+		for ( k=0; k<ld->n_cells; k++ ) {
+			if ( (last_idx < 0) || (ld->indms[k] != last) ) {
+				last = ld->indms[k];
+				last_idx = find_indm(w, last);
+			}
+			w->indm_idx[n+k] = last_idx;
+		}
 
-	} while ( 1 );
+		n += ld->n_cells;
+		if ( ld->old_indexers ) old_indexers = 1;
+		free(ld->cats);
+		free(ld->indms);
 
-	fprintf(stderr, "\n");
+	}
+
+	free(w->loaders);
+	w->loaders = NULL;
+	w->n_loaders = 0;
+
+	fprintf(stderr, "Loaded %i cells from %i total chunks\n",
+	        w->n_cells, w->n_chunks);
 
-	if ( stream_has_old_indexers(st) ) {
+	if ( old_indexers ) {
 		ERROR("----- Notice -----\n");
 		ERROR("This stream contains indexing methods specified in an old way.\n");
 		ERROR("The full indexing method names will not be shown by cell_explorer, \n");
@@ -2080,20 +2439,103 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 		ERROR("To simplify matters, it's best to re-run indexamajig.\n");
 		ERROR("------------------\n");
 	}
+}
 
-	stream_close(st);
 
-	*pn_total_chunks += n_chunks;
-	return 0;
+static void set_actions_sensitive(CellWindow *w, gboolean val)
+{
+	const char *actions[] = { "SaveCellAction", "SaveDataAction",
+	                          "FitCellAction", "ClearAction" };
+	int i;
+
+	for ( i=0; i<4; i++ ) {
+		GtkAction *a = gtk_action_group_get_action(w->action_group,
+		                                           actions[i]);
+		gtk_action_set_sensitive(a, val);
+	}
+}
+
+
+static void add_histograms(CellWindow *w)
+{
+	GtkWidget *box;
+
+	box = gtk_hbox_new(FALSE, 0.0);
+	gtk_box_pack_start(GTK_BOX(w->vbox), box, TRUE, TRUE, 5.0);
+
+	gtk_box_pack_start(GTK_BOX(box), w->hist_a->da, TRUE, TRUE, 5.0);
+	gtk_box_pack_start(GTK_BOX(box), w->hist_b->da, TRUE, TRUE, 5.0);
+	gtk_box_pack_start(GTK_BOX(box), w->hist_c->da, TRUE, TRUE, 5.0);
+
+	box = gtk_hbox_new(FALSE, 0.0);
+	gtk_box_pack_start(GTK_BOX(w->vbox), box, TRUE, TRUE, 5.0);
+
+	gtk_box_pack_start(GTK_BOX(box), w->hist_al->da, TRUE, TRUE, 5.0);
+	gtk_box_pack_start(GTK_BOX(box), w->hist_be->da, TRUE, TRUE, 5.0);
+	gtk_box_pack_start(GTK_BOX(box), w->hist_ga->da, TRUE, TRUE, 5.0);
+}
+
+
+static void finish_loading(CellWindow *w)
+{
+	collect_cells(w);
+
+	scan_minmax(w);
+	setup_cells(w);
+	reset_axes(w->hist_a);
+	reset_axes(w->hist_b);
+	reset_axes(w->hist_c);
+	reset_axes(w->hist_al);
+	reset_axes(w->hist_be);
+	reset_axes(w->hist_ga);
+
+	gtk_widget_destroy(w->progress);
+	w->progress = NULL;
+
+	indexing_method_list(w, w->vbox);
+	add_histograms(w);
+	set_actions_sensitive(w, TRUE);
+	gtk_widget_show_all(w->window);
+}
+
+
+static gboolean load_progress_sig(gpointer data)
+{
+	CellWindow *w = data;
+	int i;
+	int n_cells = 0;
+	int n_chunks = 0;
+	int n_started;
+	char tmp[256];
+
+	for ( i=0; i<w->n_loaders; i++ ) {
+		n_cells += g_atomic_int_get(&w->loaders[i].n_cells_done);
+		n_chunks += g_atomic_int_get(&w->loaders[i].n_chunks_done);
+	}
+	n_started = g_atomic_int_get(&w->next_loader);
+	if ( n_started > w->n_loaders ) n_started = w->n_loaders;
+
+	if ( w->n_loaders > 1 ) {
+		snprintf(tmp, 255, "Loaded %i cells from %i chunks "
+		         "(reading stream %i of %i)",
+		         n_cells, n_chunks, n_started, w->n_loaders);
+	} else {
+		snprintf(tmp, 255, "Loaded %i cells from %i chunks",
+		         n_cells, n_chunks);
+	}
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(w->progress), tmp);
+	gtk_progress_bar_pulse(GTK_PROGRESS_BAR(w->progress));
+
+	if ( g_atomic_int_get(&w->loaders_running) > 0 ) return TRUE;
+
+	finish_loading(w);
+	return FALSE;
 }
 
 
 int main(int argc, char *argv[])
 {
 	int c;
-	int max_cells = 0;
-	int n_chunks = 0;
-	GtkWidget *box, *vbox;
 	char title[1024];
 	CellWindow w;
 	int i;
@@ -2139,7 +2581,7 @@ int main(int argc, char *argv[])
 
 	gtk_init(&argc, &argv);
 
-	if ( argc < optind ) {
+	if ( argc <= optind ) {
 		fprintf(stderr, "Please provide at least one stream filename.\n");
 		return 1;
 	}
@@ -2148,41 +2590,27 @@ int main(int argc, char *argv[])
 
 	gsl_set_error_handler_off();
 
-	w.cells = NULL;
-	w.indms = NULL;
-	w.n_cells = 0;
-
-	while ( optind < argc ) {
-		if ( add_stream(&w, argv[optind++],
-		                &max_cells, &n_chunks) )
-		{
-			return 1;
-		}
-	}
-
-	fprintf(stderr, "Loaded %i cells from %i total chunks\n",
-	        w.n_cells, n_chunks);
-
 	w.cols_on[0] = 1;
 	for ( i=1; i<8; i++ ) w.cols_on[i] = 2;
 
-	w.hist_a = histobox_new(&w, " Å", "a");
-	w.hist_b = histobox_new(&w, " Å", "b");
-	w.hist_c = histobox_new(&w, " Å", "c");
-	w.hist_al = histobox_new(&w, "°", "α");
-	w.hist_be = histobox_new(&w, "°", "β");
-	w.hist_ga = histobox_new(&w, "°", "γ");
+	w.hist_a = histobox_new(&w, PARAM_A, " Å", "a");
+	w.hist_b = histobox_new(&w, PARAM_B, " Å", "b");
+	w.hist_c = histobox_new(&w, PARAM_C, " Å", "c");
+	w.hist_al = histobox_new(&w, PARAM_AL, "°", "α");
+	w.hist_be = histobox_new(&w, PARAM_BE, "°", "β");
+	w.hist_ga = histobox_new(&w, PARAM_GA, "°", "γ");
+	w.hists[PARAM_A] = w.hist_a;
+	w.hists[PARAM_B] = w.hist_b;
+	w.hists[PARAM_C] = w.hist_c;
+	w.hists[PARAM_AL] = w.hist_al;
+	w.hists[PARAM_BE] = w.hist_be;
+	w.hists[PARAM_GA] = w.hist_ga;
 
 	w.n_unique_indms = 0;
 
-	scan_minmax(&w);
-	scan_cells(&w);
-	reset_axes(w.hist_a);
-	reset_axes(w.hist_b);
-	reset_axes(w.hist_c);
-	reset_axes(w.hist_al);
-	reset_axes(w.hist_be);
-	reset_axes(w.hist_ga);
+	/* The streams are read in the background, while the window shows
+	 * the progress */
+	start_loading(&w, argv+optind, argc-optind);
 
 	w.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	snprintf(title, 1023, "%s - Unit Cell Explorer",
@@ -2191,25 +2619,18 @@ int main(int argc, char *argv[])
 	g_signal_connect(G_OBJECT(w.window), "destroy", G_CALLBACK(destroy_sig),
 	                 &w);
 
-	vbox = gtk_vbox_new(FALSE, 0.0);
-	gtk_container_add(GTK_CONTAINER(w.window), vbox);
-	add_menu_bar(&w, vbox);
-
-	indexing_method_list(&w, vbox);
-
-	box = gtk_hbox_new(FALSE, 0.0);
-	gtk_box_pack_start(GTK_BOX(vbox), box, TRUE, TRUE, 5.0);
-
-	gtk_box_pack_start(GTK_BOX(box), w.hist_a->da, TRUE, TRUE, 5.0);
-	gtk_box_pack_start(GTK_BOX(box), w.hist_b->da, TRUE, TRUE, 5.0);
-	gtk_box_pack_start(GTK_BOX(box), w.hist_c->da, TRUE, TRUE, 5.0);
-
-	box = gtk_hbox_new(FALSE, 0.0);
-	gtk_box_pack_start(GTK_BOX(vbox), box, TRUE, TRUE, 5.0);
-
-	gtk_box_pack_start(GTK_BOX(box), w.hist_al->da, TRUE, TRUE, 5.0);
-	gtk_box_pack_start(GTK_BOX(box), w.hist_be->da, TRUE, TRUE, 5.0);
-	gtk_box_pack_start(GTK_BOX(box), w.hist_ga->da, TRUE, TRUE, 5.0);
+	w.vbox = gtk_vbox_new(FALSE, 0.0);
+	gtk_container_add(GTK_CONTAINER(w.window), w.vbox);
+	add_menu_bar(&w, w.vbox);
+	set_actions_sensitive(&w, FALSE);
+
+	w.progress = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(w.progress), TRUE);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(w.progress),
+	                          "Loading streams");
+	gtk_widget_set_size_request(GTK_WIDGET(w.progress), 600, -1);
+	gtk_box_pack_start(GTK_BOX(w.vbox), w.progress, FALSE, FALSE, 20.0);
+	g_timeout_add(250, load_progress_sig, &w);
 
 	gtk_widget_show_all(w.window);
 	gtk_main();
@@ -69,33 +69,153 @@ static void show_help(const char *s)
 "      --wilson               Calculate a Wilson plot\n"
 "      --ltest                Perform an L-test (for twinning)\n"
 "      --shell-file=<file>    Write results table to <file>.\n"
+"      --wilson-file=<file>   Also write a Wilson plot to <file>.\n"
+"      --ltest-file=<file>    Also write L-test results to <file>.\n"
 "      --ignore-negs          Ignore reflections with negative intensities.\n"
 "      --zero-negs            Set negative intensities to zero.\n"
 "\n");
 }
 
 
-static int add_ltest(RefList *list, double i1, int *bins, int nbins,
+/* Everything the analyses need to know about one reflection, worked out once
+ * at the start */
+struct refl_info
+{
+	signed int h, k, l;
+	signed int ha, ka, la;   /* Indices in the asymmetric unit */
+	double s;                /* Resolution, 1/2d */
+	double intensity;
+	int epsilon;             /* Number of operations mapping h,k,l onto itself */
+};
+
+
+struct refl_table
+{
+	struct refl_info *refls;
+	int n;
+
+	/* The same reflections, sorted by asymmetric indices */
+	struct refl_info **by_asymm;
+
+	double rmin;
+	double rmax;
+};
+
+
+static int cmp_asymm(const void *av, const void *bv)
+{
+	const struct refl_info *a = *(struct refl_info **)av;
+	const struct refl_info *b = *(struct refl_info **)bv;
+
+	if ( a->ha != b->ha ) return (a->ha < b->ha) ? -1 : 1;
+	if ( a->ka != b->ka ) return (a->ka < b->ka) ? -1 : 1;
+	if ( a->la != b->la ) return (a->la < b->la) ? -1 : 1;
+	return 0;
+}
+
+
+static void free_refl_table(struct refl_table *t)
+{
+	if ( t == NULL ) return;
+	free(t->refls);
+	free(t->by_asymm);
+	free(t);
+}
+
+
+static struct refl_table *make_refl_table(RefList *list, UnitCell *cell,
+                                          const SymOpList *sym)
+{
+	struct refl_table *t;
+	Reflection *refl;
+	RefListIterator *iter;
+	SymOpMask *mask;
+	int ngen;
+	int i;
+
+	t = malloc(sizeof(struct refl_table));
+	if ( t == NULL ) return NULL;
+
+	t->n = num_reflections(list);
+	t->refls = malloc(t->n*sizeof(struct refl_info));
+	t->by_asymm = malloc(t->n*sizeof(struct refl_info *));
+	mask = new_symopmask(sym);
+	if ( (t->refls == NULL) || (t->by_asymm == NULL) || (mask == NULL) ) {
+		free_symopmask(mask);
+		free_refl_table(t);
+		return NULL;
+	}
+
+	t->rmin = INFINITY;
+	t->rmax = 0.0;
+	ngen = num_equivs(sym, NULL);
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		struct refl_info *r = &t->refls[i];
+		double res;
+
+		get_indices(refl, &r->h, &r->k, &r->l);
+		get_asymm(sym, r->h, r->k, r->l, &r->ha, &r->ka, &r->la);
+		r->s = resolution(cell, r->h, r->k, r->l);
+		r->intensity = get_intensity(refl);
+
+		special_position(sym, mask, r->h, r->k, r->l);
+		r->epsilon = ngen / num_equivs(sym, mask);
+
+		res = 2.0 * r->s;
+		if ( res > t->rmax ) t->rmax = res;
+		if ( res < t->rmin ) t->rmin = res;
+
+		t->by_asymm[i] = r;
+		i++;
+	}
+
+	free_symopmask(mask);
+
+	qsort(t->by_asymm, t->n, sizeof(struct refl_info *), cmp_asymm);
+
+	return t;
+}
+
+
+/* The reflection list contains at most one reflection from each set of
+ * equivalents, so the asymmetric indices find it whichever one it is */
+static struct refl_info *find_equiv_in_table(struct refl_table *t,
+                                             const SymOpList *sym,
+                                             signed int h, signed int k,
+                                             signed int l)
+{
+	struct refl_info key;
+	struct refl_info *keyp = &key;
+	struct refl_info **found;
+
+	get_asymm(sym, h, k, l, &key.ha, &key.ka, &key.la);
+	found = bsearch(&keyp, t->by_asymm, t->n, sizeof(struct refl_info *),
+	                cmp_asymm);
+	if ( found == NULL ) return NULL;
+	return *found;
+}
+
+
+static int add_ltest(struct refl_table *t, double i1, int *bins, int nbins,
                      double step, const SymOpList *sym, double *lt, double *l2t,
                      signed int h1, signed int k1, signed int l1,
                      signed int h2, signed int k2, signed int l2)
 {
-	Reflection *refl;
+	struct refl_info *r2;
 	double i2, L;
 	int bin;
 
 	if ( SERIAL(h1, k1, l1) > SERIAL(h2, k2, l2) ) return 0;
 
-	refl = find_refl(list, h2, k2, l2);
-	if ( refl == NULL ) {
-		signed int h, k, l;
-		if ( !find_equiv_in_list(list, h2, k2, l2, sym, &h, &k, &l) ) {
-			return 0;
-		}
-		refl = find_refl(list, h, k, l);
-	}
+	r2 = find_equiv_in_table(t, sym, h2, k2, l2);
+	if ( r2 == NULL ) return 0;
 
-	i2 = get_intensity(refl);
+	i2 = r2->intensity;
 	L = (i1-i2) / (i1+i2);
 	if ( isnan(L) ) {
 		/* This happens with --zero-negs and two negative intensities,
@@ -118,12 +238,9 @@ static int add_ltest(RefList *list, double i1, int *bins, int nbins,
 }
 
 
-static void l_test(RefList *list, UnitCell *cell, const SymOpList *sym,
-                   double rmin_fix, double rmax_fix, int nbins,
-                   const char *filename)
+static void l_test(struct refl_table *t, UnitCell *cell, const SymOpList *sym,
+                   int nbins, const char *filename)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	int *bins;
 	FILE *fh;
 	int npairs, i;
@@ -153,27 +270,24 @@ static void l_test(RefList *list, UnitCell *cell, const SymOpList *sym,
 	if ( cen == 'H' ) { hd = 3;  kd = 3;  ld = 3; }
 
 	npairs = 0;
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int h, k, l;
-		double i1;
+	for ( i=0; i<t->n; i++ ) {
 
-		get_indices(refl, &h, &k, &l);
-		i1 = get_intensity(refl);
+		signed int h = t->refls[i].h;
+		signed int k = t->refls[i].k;
+		signed int l = t->refls[i].l;
+		double i1 = t->refls[i].intensity;
 
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h-hd, k, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h+hd, k, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h, k-kd, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h, k+kd, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h, k, l-ld);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
+		npairs += add_ltest(t, i1, bins, nbins, step, sym, &lt, &l2t,
 		                    h, k, l, h, k, l+ld);
 	}
 	STATUS("%i pairs\n", npairs);
@@ -254,26 +368,20 @@ static double get_sfac(char el, double s)
 }
 
 
-static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
+static void wilson_plot(struct refl_table *t,
                         double rmin_fix, double rmax_fix, int nbins,
                         const char *filename)
 {
 	double rmin, rmax;
 	double s2min, s2max, s2step;
-	Reflection *refl;
-	RefListIterator *iter;
 	FILE *fh;
 	double *plot_i, *s2;
 	int *plot_n;
-	int i, ngen;
-	SymOpMask *mask;
-
-	resolution_limits(list, cell, &rmin, &rmax);
-	STATUS("1/d goes from %f to %f nm^-1\n", rmin/1e9, rmax/1e9);
+	int i;
 
 	/* Widen the range just a little bit */
-	rmin -= 0.001e9;
-	rmax += 0.001e9;
+	rmin = t->rmin - 0.001e9;
+	rmax = t->rmax + 0.001e9;
 
 	/* Fixed resolution shells if needed */
 	if ( rmin_fix > 0.0 ) rmin = rmin_fix;
@@ -293,28 +401,14 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 	plot_n = calloc(nbins, sizeof(int));
 	if ( plot_n == NULL ) return;
 
-	ngen = num_equivs(sym, NULL);
-	mask = new_symopmask(sym);
+	for ( i=0; i<t->n; i++ ) {
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int h, k, l;
-		double s, intensity, E;
+		double s = t->refls[i].s;
+		double E;
 		int bin;
-		int e;
-
-		get_indices(refl, &h, &k, &l);
-
-		s = resolution(cell, h, k, l);  /* This gives "s" directly */
-		intensity = get_intensity(refl);
 
 		bin = (pow(s, 2.0) - s2min)/s2step;
 
-		special_position(sym, mask, h, k, l);
-		e = ngen / num_equivs(sym, mask);
-
 		/* Average atoms per residue from Rupp BMC 1st ed p356 */
 		E  = 5.00*get_sfac('C', s);
 		E += 1.35*get_sfac('N', s);
@@ -324,13 +418,11 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 		if ( bin == nbins ) bin = nbins-1;
 		assert(bin < nbins);
 
-		plot_i[bin] += intensity / (e*E);
+		plot_i[bin] += t->refls[i].intensity / (t->refls[i].epsilon*E);
 		plot_n[bin]++;
 
 	}
 
-	free_symopmask(mask);
-
 	for ( i=0; i<nbins; i++ ) {
 		plot_i[i] = log(plot_i[i] / plot_n[i]);
 		s2[i] = s2min + (i+0.5)*s2step;
@@ -396,18 +488,23 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 
 static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
-                        double rmin_fix, double rmax_fix, int nshells,
-			const char *shell_file)
+                        double rmin, double rmax, int nshells,
+                        const char *shell_file)
 {
-	double rmin, rmax;
 	int i;
 	FILE *fh;
 	struct fom_shells *shells;
+	struct fom_context *fctxs[5];
 	struct fom_context *nmeas_ctx;
 	struct fom_context *red_ctx;
 	struct fom_context *snr_ctx;
 	struct fom_context *mean_ctx;
 	struct fom_context *compl_ctx;
+	const enum fom_type foms[5] = { FOM_NUM_MEASUREMENTS,
+	                                FOM_REDUNDANCY,
+	                                FOM_SNR,
+	                                FOM_MEAN_INTENSITY,
+	                                FOM_COMPLETENESS };
 
 	fh = fopen(shell_file, "w");
 	if ( fh == NULL ) {
@@ -415,27 +512,22 @@ static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
 		return;
 	}
 
-	resolution_limits(list, cell, &rmin, &rmax);
-	STATUS("1/d goes from %f to %f nm^-1\n", rmin/1e9, rmax/1e9);
-
-	/* Fixed resolution shells if needed */
-	if ( rmin_fix > 0.0 ) rmin = rmin_fix;
-	if ( rmax_fix > 0.0 ) rmax = rmax_fix;
-
 	shells = fom_make_resolution_shells(rmin, rmax,  nshells);
 
 	STATUS("Overall values within specified resolution range:\n");
 
-	nmeas_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_NUM_MEASUREMENTS, 0, sym);
-	red_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_REDUNDANCY, 0, sym);
-	snr_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_SNR, 0, sym);
-	mean_ctx = fom_calculate(list, NULL, cell, shells,
-	                         FOM_MEAN_INTENSITY, 0, sym);
-	compl_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_COMPLETENESS, 0, sym);
+	if ( fom_calculate_multi(list, NULL, cell, shells, foms, 5, 0, sym,
+	                         fctxs) )
+	{
+		ERROR("Failed to calculate figures of merit.\n");
+		fclose(fh);
+		return;
+	}
+	nmeas_ctx = fctxs[0];
+	red_ctx = fctxs[1];
+	snr_ctx = fctxs[2];
+	mean_ctx = fctxs[3];
+	compl_ctx = fctxs[4];
 
 	STATUS("%.0f measurements in total.\n",
 	       fom_overall_value(nmeas_ctx));
@@ -477,6 +569,8 @@ static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 	fclose(fh);
 
+	for ( i=0; i<5; i++ ) fom_context_free(fctxs[i]);
+
 	STATUS("Resolution shell information written to %s.\n", shell_file);
 }
 
@@ -520,12 +614,18 @@ int main(int argc, char *argv[])
 	int nshells = 10;
 	int have_nshells = 0;
 	char *shell_file = NULL;
+	char *wilson_file = NULL;
+	char *ltest_file = NULL;
+	int do_shells;
+	int nbins;
 	int wilson = 0;
 	int ltest = 0;
 	int ignorenegs = 0;
 	int zeronegs = 0;
 	float highres, lowres;
 	struct fom_rejections rej;
+	struct refl_table *table;
+	double rmin, rmax;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -542,6 +642,8 @@ int main(int argc, char *argv[])
 		{"shell-file",         1, NULL,                6},
 		{"highres",            1, NULL,                7},
 		{"lowres",             1, NULL,                8},
+		{"wilson-file",        1, NULL,               10},
+		{"ltest-file",         1, NULL,               11},
 
 		{"wilson",             0, &wilson,             1},
 		{"ltest",              0, &ltest,              1},
@@ -634,6 +736,16 @@ int main(int argc, char *argv[])
 			rmin_fix = 1.0 / (lowres/1e10);
 			break;
 
+			case 10 :
+			wilson_file = strdup(optarg);
+			wilson = 1;
+			break;
+
+			case 11 :
+			ltest_file = strdup(optarg);
+			ltest = 1;
+			break;
+
 			case '?' :
 			break;
 
@@ -656,6 +768,12 @@ int main(int argc, char *argv[])
 		      "set!\n");
 	}
 
+	if ( ltest && !ignorenegs && !zeronegs ) {
+		ERROR("For the L-test you must specify either"
+		       "--ignore-negs or --zero-negs.\n");
+		return 1;
+	}
+
 	file = strdup(argv[optind++]);
 
 	if ( cellfile == NULL ) {
@@ -690,6 +808,24 @@ int main(int argc, char *argv[])
 
 	if ( shell_file == NULL ) shell_file = strdup("shells.dat");
 
+	/* On their own, --wilson and --ltest write their results to the shell
+	 * file instead of the resolution shell statistics */
+	do_shells = 1;
+	if ( wilson && (wilson_file == NULL) ) {
+		wilson_file = strdup(shell_file);
+		do_shells = 0;
+	}
+	if ( ltest && (ltest_file == NULL) ) {
+		if ( !do_shells ) {
+			ERROR("Use --wilson-file or --ltest-file to write the "
+			      "Wilson plot and L-test to separate files.\n");
+			return 1;
+		}
+		ltest_file = strdup(shell_file);
+		do_shells = 0;
+	}
+	nbins = have_nshells ? nshells : 50;
+
 	/* Check that the intensities have the correct symmetry */
 	if ( check_list_symmetry(raw_list, sym) ) {
 		ERROR("The input reflection list does not appear to"
@@ -731,28 +867,36 @@ int main(int argc, char *argv[])
 		       " of I or sigma(I).\n", rej.nan_inf_value);
 	}
 
-	if ( wilson ) {
-		if ( !have_nshells ) nshells = 50;
-		wilson_plot(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		            shell_file);
-	} else if ( ltest ) {
-		if ( !have_nshells ) nshells = 50;
-		if ( !ignorenegs && !zeronegs ) {
-			ERROR("For the L-test you must specify either"
-			       "--ignore-negs or --zero-negs.\n");
-			return 1;
-		}
-		l_test(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		       shell_file);
-	} else {
-		plot_shells(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		            shell_file);
+	/* All the analyses work from the same table */
+	table = make_refl_table(list, cell, sym);
+	if ( table == NULL ) {
+		ERROR("Failed to allocate memory for reflection table.\n");
+		return 1;
+	}
+	STATUS("1/d goes from %f to %f nm^-1\n",
+	       table->rmin/1e9, table->rmax/1e9);
+
+	if ( do_shells ) {
+		rmin = (rmin_fix > 0.0) ? rmin_fix : table->rmin;
+		rmax = (rmax_fix > 0.0) ? rmax_fix : table->rmax;
+		plot_shells(list, cell, sym, rmin, rmax, nshells, shell_file);
+	}
+
+	if ( wilson_file != NULL ) {
+		wilson_plot(table, rmin_fix, rmax_fix, nbins, wilson_file);
+	}
+
+	if ( ltest_file != NULL ) {
+		l_test(table, cell, sym, nbins, ltest_file);
 	}
 
+	free_refl_table(table);
 	free_symoplist(sym);
 	reflist_free(list);
 	cell_free(cell);
 	free(shell_file);
+	free(wilson_file);
+	free(ltest_file);
 
 	return 0;
 }
@@ -49,6 +49,10 @@
 #include "version.h"
 
 
+/* There are only twelve comparative figures of merit */
+#define MAX_FOMS (16)
+
+
 static void show_help(const char *s)
 {
 	printf("Syntax: %s [options] <file1.hkl> <file2.hkl>\n\n", s);
@@ -61,9 +65,15 @@ static void show_help(const char *s)
 "                              R1I, R1F, R2, Rsplit, CC, CCstar,\n"
 "			       CCano, CRDano, Rano, Rano/Rsplit, d1sig,\n"
 "                              d2sig\n"
+"                             Give several, separated by commas, to\n"
+"                              calculate them all in one go.\n"
 "      --nshells=<n>          Use <n> resolution shells.\n"
 "  -u                         Force scale factor to 1.\n"
 "      --shell-file=<file>    Write resolution shells to <file>.\n"
+"      --bootstrap=<n>        Estimate 95%% confidence intervals using <n>\n"
+"                              bootstrap samples.\n"
+"      --seed=<n>             Random number seed for --bootstrap.\n"
+"  -j <n>                     Use <n> threads for --bootstrap.\n"
 "\n"
 "You can control which reflections are included in the calculation:\n"
 "\n"
@@ -103,28 +113,108 @@ static enum fom_type fom_type_from_string(const char *s)
 	exit(1);
 }
 
-static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
-                   double rmin, double rmax, enum fom_type fom,
-                   int config_unity, int nshells, const char *filename,
-                   SymOpList *sym)
+
+/* Adds the comma-separated figures of merit in 's' to the list */
+static void add_foms(const char *s, enum fom_type *foms, int *n_foms)
 {
-	struct fom_shells *shells;
-	struct fom_context *fctx;
-	FILE *fh;
-	int i;
-	const char *t1, *t2;
+	char *copy;
+	char *tok;
+	char *saveptr = NULL;
+
+	copy = strdup(s);
+	for ( tok = strtok_r(copy, ",", &saveptr);
+	      tok != NULL;
+	      tok = strtok_r(NULL, ",", &saveptr) )
+	{
+		enum fom_type fom = fom_type_from_string(tok);
+		int i;
 
-	/* Calculate the bins */
-	shells = fom_make_resolution_shells(rmin, rmax, nshells);
+		for ( i=0; i<*n_foms; i++ ) {
+			if ( foms[i] == fom ) break;
+		}
+		if ( i < *n_foms ) continue;
 
-	if ( shells == NULL ) {
-		ERROR("Failed to set up shells.\n");
-		return;
+		if ( *n_foms == MAX_FOMS ) {
+			ERROR("Too many figures of merit.\n");
+			exit(1);
+		}
+		foms[(*n_foms)++] = fom;
+	}
+	free(copy);
+}
+
+
+/* Name for the figure of merit in the shell file names */
+static const char *fom_file_tag(enum fom_type fom)
+{
+	switch ( fom ) {
+		case FOM_R1I : return "R1I";
+		case FOM_R1F : return "R1F";
+		case FOM_R2 : return "R2";
+		case FOM_RSPLIT : return "Rsplit";
+		case FOM_CC : return "CC";
+		case FOM_CCSTAR : return "CCstar";
+		case FOM_CCANO : return "CCano";
+		case FOM_CRDANO : return "CRDano";
+		case FOM_RANO : return "Rano";
+		case FOM_RANORSPLIT : return "RanoRsplit";
+		case FOM_D1SIG : return "d1sig";
+		case FOM_D2SIG : return "d2sig";
+		default : return "unknown";
 	}
+}
 
-	fctx = fom_calculate(list1, list2, cell, shells, fom,
-	                     config_unity, sym);
 
+/* "shells.dat" becomes "shells-CC.dat" */
+static char *shell_filename(const char *shell_file, enum fom_type fom)
+{
+	const char *ext;
+	const char *tag = fom_file_tag(fom);
+	size_t len, base_len;
+	char *fn;
+
+	ext = filename_extension(shell_file, NULL);
+	if ( (ext == NULL) || (strchr(ext, '/') != NULL) ) {
+		ext = shell_file + strlen(shell_file);
+	}
+	base_len = ext - shell_file;
+
+	len = strlen(shell_file) + strlen(tag) + 2;
+	fn = malloc(len);
+	if ( fn == NULL ) return NULL;
+	snprintf(fn, len, "%.*s-%s%s", (int)base_len, shell_file, tag, ext);
+	return fn;
+}
+
+
+/* Factor for displaying the figure of merit, e.g. as a percentage */
+static double fom_display_scale(enum fom_type fom)
+{
+	switch ( fom ) {
+
+		case FOM_R1I :
+		case FOM_R1F :
+		case FOM_R2 :
+		case FOM_RSPLIT :
+		case FOM_RANO :
+		case FOM_D1SIG :
+		case FOM_D2SIG :
+		return 100.0;
+
+		default :
+		return 1.0;
+
+	}
+}
+
+
+static int fom_display_precision(enum fom_type fom)
+{
+	return (fom_display_scale(fom) == 100.0) ? 2 : 7;
+}
+
+static void show_overall(struct fom_context *fctx, enum fom_type fom)
+{
 	switch ( fom ) {
 
 		case FOM_R1I :
@@ -182,6 +272,17 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 		break;
 
 	}
+}
+
+
+static void write_shells(struct fom_context *fctx, enum fom_type fom,
+                         struct fom_shells *shells, const char *filename,
+                         struct fom_bootstrap *boot, int boot_idx)
+{
+	FILE *fh;
+	int i;
+	const char *t1, *t2, *t3;
+	int nshells = shells->nshells;
 
 	fh = fopen(filename, "w");
 	if ( fh == NULL ) {
@@ -191,55 +292,56 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 
 	t1 = "  1/d centre";
 	t2 = "      d / A   Min 1/nm    Max 1/nm";
+	t3 = (boot != NULL) ? "  95% CI low 95% CI high" : "";
 
 	switch ( fom ) {
 
 		case FOM_R1I :
-		fprintf(fh, "%s  R1(I)/%%       nref%s\n", t1, t2);
+		fprintf(fh, "%s  R1(I)/%%       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_R1F :
-		fprintf(fh, "%s  R1(F)/%%       nref%s\n", t1, t2);
+		fprintf(fh, "%s  R1(F)/%%       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_R2 :
-		fprintf(fh, "%s     R2/%%       nref%s\n", t1, t2);
+		fprintf(fh, "%s     R2/%%       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_RSPLIT :
-		fprintf(fh, "%s Rsplit/%%       nref%s\n", t1, t2);
+		fprintf(fh, "%s Rsplit/%%       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_CC :
-		fprintf(fh, "%s       CC       nref%s\n", t1, t2);
+		fprintf(fh, "%s       CC       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_CCSTAR :
-		fprintf(fh, "%s      CC*       nref%s\n", t1, t2);
+		fprintf(fh, "%s      CC*       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_CCANO :
-		fprintf(fh, "%s    CCano       nref%s\n", t1, t2);
+		fprintf(fh, "%s    CCano       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_CRDANO :
-		fprintf(fh, "%s    CRDano       nref%s\n", t1, t2);
+		fprintf(fh, "%s    CRDano       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_RANO :
-		fprintf(fh, "%s   Rano/%%       nref%s\n", t1, t2);
+		fprintf(fh, "%s   Rano/%%       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_RANORSPLIT :
-		fprintf(fh, "%s Rano/Rsplit       nref%s\n", t1, t2);
+		fprintf(fh, "%s Rano/Rsplit       nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_D1SIG :
-		fprintf(fh, "%s D<1sigma/%%     nref%s\n", t1, t2);
+		fprintf(fh, "%s D<1sigma/%%     nref%s%s\n", t1, t2, t3);
 		break;
 
 		case FOM_D2SIG :
-		fprintf(fh, "%s D<2sigma/%%     nref%s\n", t1, t2);
+		fprintf(fh, "%s D<2sigma/%%     nref%s%s\n", t1, t2, t3);
 		break;
 
 		default :
@@ -262,7 +364,7 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 			case FOM_RSPLIT :
 			case FOM_RANO :
 			fprintf(fh, "%10.3f %10.2f %10i %10.2f "
-			        "%10.3f  %10.3f\n",
+			        "%10.3f  %10.3f",
 			        cen*1.0e-9, r*100.0,
 			        fom_shell_num_reflections(fctx, i),
 			        (1.0/cen)*1e10,
@@ -275,7 +377,7 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 			case FOM_CCANO :
 			case FOM_CRDANO :
 			fprintf(fh, "%10.3f %10.7f %10i %10.2f "
-			        "%10.3f  %10.3f\n",
+			        "%10.3f  %10.3f",
 			        cen*1.0e-9, r,
 			        fom_shell_num_reflections(fctx, i),
 			        (1.0/cen)*1e10,
@@ -285,7 +387,7 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 
 			case FOM_RANORSPLIT :
 			fprintf(fh, "%10.3f    %10.7f %10i %10.2f "
-			        "%10.3f  %10.3f\n",
+			        "%10.3f  %10.3f",
 			        cen*1.0e-9, r,
 			        fom_shell_num_reflections(fctx, i),
 			        (1.0/cen)*1e10,
@@ -296,7 +398,7 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 			case FOM_D1SIG :
 			case FOM_D2SIG :
 			fprintf(fh, "%10.3f %10.2f %10i %10.2f "
-			        "%10.3f  %10.3f\n",
+			        "%10.3f  %10.3f",
 			        cen*1.0e-9, r*100.0,
 			        fom_shell_num_reflections(fctx, i),
 			        (1.0/cen)*1e10,
@@ -309,12 +411,87 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 
 		}
 
+		if ( boot != NULL ) {
+			double sc = fom_display_scale(fom);
+			int prec = fom_display_precision(fom);
+			fprintf(fh, " %11.*f %11.*f",
+			        prec, sc*fom_bootstrap_shell_quantile(boot,
+			                                     boot_idx, i, 0.025),
+			        prec, sc*fom_bootstrap_shell_quantile(boot,
+			                                     boot_idx, i, 0.975));
+		}
+		fprintf(fh, "\n");
+
 	}
 
 	fclose(fh);
 }
 
 
+static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
+                   double rmin, double rmax, enum fom_type *foms, int n_foms,
+                   int config_unity, int nshells, const char *shell_file,
+                   int multi_files, SymOpList *sym, int n_bootstrap,
+                   unsigned long int seed, int n_threads)
+{
+	struct fom_shells *shells;
+	struct fom_context *fctxs[MAX_FOMS];
+	struct fom_bootstrap *boot = NULL;
+	int i;
+
+	/* Calculate the bins */
+	shells = fom_make_resolution_shells(rmin, rmax, nshells);
+
+	if ( shells == NULL ) {
+		ERROR("Failed to set up shells.\n");
+		return;
+	}
+
+	if ( fom_calculate_multi(list1, list2, cell, shells, foms, n_foms,
+	                         config_unity, sym, fctxs) )
+	{
+		ERROR("Failed to calculate figures of merit.\n");
+		return;
+	}
+
+	if ( n_bootstrap > 0 ) {
+		STATUS("Calculating %i bootstrap samples...\n", n_bootstrap);
+		boot = fom_bootstrap(list1, list2, cell, shells, foms, n_foms,
+		                     sym, n_bootstrap, seed, n_threads);
+	}
+
+	for ( i=0; i<n_foms; i++ ) {
+
+		char *filename;
+
+		show_overall(fctxs[i], foms[i]);
+		if ( boot != NULL ) {
+			double sc = fom_display_scale(foms[i]);
+			int prec = fom_display_precision(foms[i]);
+			STATUS("    95%% confidence interval: %.*f to %.*f%s\n",
+			       prec, sc*fom_bootstrap_overall_quantile(boot, i,
+			                                               0.025),
+			       prec, sc*fom_bootstrap_overall_quantile(boot, i,
+			                                               0.975),
+			       (sc == 100.0) ? " %" : "");
+		}
+
+		if ( multi_files ) {
+			filename = shell_filename(shell_file, foms[i]);
+		} else {
+			filename = strdup(shell_file);
+		}
+		write_shells(fctxs[i], foms[i], shells, filename, boot, i);
+		free(filename);
+
+		fom_context_free(fctxs[i]);
+
+	}
+
+	fom_bootstrap_free(boot);
+}
+
+
 static void check_highres()
 {
 	static int have = 0;
@@ -337,6 +514,95 @@ static void check_lowres()
 }
 
 
+static void compare_group(RefList *list1, RefList *list2, UnitCell *cell,
+                          SymOpList *sym, enum fom_type *foms, int n_foms,
+                          int multi_files, int anom,
+                          float rmin_fix, float rmax_fix, float sigma_cutoff,
+                          int config_ignorenegs, int config_zeronegs,
+                          int mul_cutoff, int config_unity, int nshells,
+                          const char *shell_file, int n_bootstrap,
+                          unsigned long int seed, int n_threads)
+{
+	RefList *list1_acc;
+	RefList *list2_acc;
+	double rmin, rmax;
+	struct fom_rejections rej;
+
+	rej = fom_select_reflection_pairs(list1, list2, &list1_acc, &list2_acc,
+	                                  cell, sym,
+	                                  anom, rmin_fix, rmax_fix, sigma_cutoff,
+	                                  config_ignorenegs, config_zeronegs,
+	                                  mul_cutoff);
+
+	if ( rej.low_snr > 0 ) {
+		STATUS("Discarded %i reflection pairs because either or both"
+		       " versions had I/sigma(I) < %f.\n",
+		       rej.low_snr, sigma_cutoff);
+	}
+
+	if ( rej.negative_deleted > 0 ) {
+		STATUS("Discarded %i reflection pairs because either or both"
+		       " versions had negative intensities.\n",
+		       rej.negative_deleted);
+	}
+
+	if ( rej.negative_zeroed > 0 ) {
+		STATUS("For %i reflection pairs, either or both versions had"
+		       " negative intensities which were set to zero.\n",
+		       rej.negative_zeroed);
+	}
+
+	if ( rej.few_measurements > 0 ) {
+		STATUS("%i reflection pairs rejected because either or both"
+		       " versions had too few measurements.\n",
+		       rej.few_measurements);
+	}
+
+	if ( rej.outside_resolution_range > 0 ) {
+		STATUS("%i reflection pairs rejected because either or both"
+		       " versions were outside the resolution range.\n",
+		       rej.outside_resolution_range);
+	}
+
+	if ( rej.no_bijvoet > 0 ) {
+		STATUS("%i reflection pairs rejected because either or both"
+		       " versions did not have Bijvoet partners.\n",
+		       rej.no_bijvoet);
+	}
+
+	if ( rej.centric > 0 ) {
+		STATUS("%i reflection pairs rejected because they were"
+		       " centric.\n", rej.centric);
+	}
+
+	STATUS("%i reflection pairs accepted.\n", rej.common);
+
+	resolution_limits(list1_acc, cell, &rmin, &rmax);
+	resolution_limits(list2_acc, cell, &rmin, &rmax);
+	STATUS("Accepted resolution range: %f to %f nm^-1"
+	       " (%.2f to %.2f Angstroms).\n",
+	       rmin/1e9, rmax/1e9, 1e10/rmin, 1e10/rmax);
+
+	if ( rmin_fix >= 0.0 ) {
+		rmin = rmin_fix;
+	}
+	if ( rmax_fix >= 0.0 ) {
+		rmax = rmax_fix;
+	}
+	if ( (rmin_fix>=0.0) || (rmax_fix>=0.0) ) {
+		STATUS("Fixed resolution range: %f to %f nm^-1"
+		       " (%.2f to %.2f Angstroms).\n",
+		       rmin/1e9, rmax/1e9, 1e10/rmin, 1e10/rmax);
+	}
+	do_fom(list1_acc, list2_acc, cell, rmin, rmax, foms, n_foms,
+	       config_unity, nshells, shell_file, multi_files, sym,
+	       n_bootstrap, seed, n_threads);
+
+	reflist_free(list1_acc);
+	reflist_free(list2_acc);
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -348,13 +614,12 @@ int main(int argc, char *argv[])
 	char *sym_str_fromfile1 = NULL;
 	char *sym_str_fromfile2 = NULL;
 	SymOpList *sym;
-	RefList *list1_acc;
-	RefList *list2_acc;
 	RefList *list1;
 	RefList *list2;
 	RefList *list1_raw;
 	RefList *list2_raw;
-	enum fom_type fom = FOM_R1I;
+	enum fom_type foms[MAX_FOMS];
+	int n_foms = 0;
 	char *cellfile = NULL;
 	float rmin_fix = -1.0;
 	float rmax_fix = -1.0;
@@ -368,7 +633,11 @@ int main(int argc, char *argv[])
 	float highres, lowres;
 	int mul_cutoff = 0;
 	int anom;
-	struct fom_rejections rej;
+	int have_r1f = 0;
+	int n_bootstrap = 0;
+	unsigned long int seed = 1;
+	int n_threads = 1;
+	int i;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -385,13 +654,15 @@ int main(int argc, char *argv[])
 		{"highres",            1, NULL,                8},
 		{"lowres",             1, NULL,                9},
 		{"min-measurements",   1, NULL,               11},
+		{"bootstrap",          1, NULL,               12},
+		{"seed",               1, NULL,               13},
 		{"ignore-negs",        0, &config_ignorenegs,  1},
 		{"zero-negs",          0, &config_zeronegs,    1},
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hy:p:u",
+	while ((c = getopt_long(argc, argv, "hy:p:uj:",
 	                        longopts, NULL)) != -1)
 	{
 
@@ -420,6 +691,17 @@ int main(int argc, char *argv[])
 			config_unity = 1;
 			break;
 
+			case 'j' :
+			if ( sscanf(optarg, "%i", &n_threads) != 1 ) {
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			if ( n_threads < 1 ) {
+				ERROR("Number of threads must be at least 1\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -440,7 +722,7 @@ int main(int argc, char *argv[])
 			break;
 
 			case 4 :
-			fom = fom_type_from_string(optarg);
+			add_foms(optarg, foms, &n_foms);
 			break;
 
 			case 5 :
@@ -489,6 +771,25 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+			case 12 :
+			if ( sscanf(optarg, "%i", &n_bootstrap) != 1 ) {
+				ERROR("Invalid value for --bootstrap\n");
+				return 1;
+			}
+			if ( n_bootstrap < 0 ) {
+				ERROR("Number of bootstrap samples can't be "
+				      "negative\n");
+				return 1;
+			}
+			break;
+
+			case 13 :
+			if ( sscanf(optarg, "%lu", &seed) != 1 ) {
+				ERROR("Invalid value for --seed\n");
+				return 1;
+			}
+			break;
+
 			case '?' :
 			break;
 
@@ -505,17 +806,16 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if ( !config_ignorenegs && !config_zeronegs ) {
-		switch ( fom )
+	if ( n_foms == 0 ) {
+		foms[n_foms++] = FOM_R1I;
+	}
+
+	for ( i=0; i<n_foms; i++ ) {
+		switch ( foms[i] )
 		{
 			case FOM_R1F :
-			ERROR("Your chosen figure of merit involves converting"
-			      " intensities to structure factors, but you have"
-			      " not specified how to handle negative"
-			      " intensities.\n");
-			ERROR("Please try again with --ignore-negs or"
-			      " --zero-negs.\n");
-			return 1;
+			have_r1f = 1;
+			break;
 
 			case FOM_R2 :
 			case FOM_R1I :
@@ -536,7 +836,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ( (fom != FOM_R1F) && (config_ignorenegs || config_zeronegs) ) {
+	if ( have_r1f && !config_ignorenegs && !config_zeronegs ) {
+		ERROR("Your chosen figure of merit involves converting"
+		      " intensities to structure factors, but you have"
+		      " not specified how to handle negative"
+		      " intensities.\n");
+		ERROR("Please try again with --ignore-negs or"
+		      " --zero-negs.\n");
+		return 1;
+	}
+
+	if ( !have_r1f && (config_ignorenegs || config_zeronegs) ) {
 		ERROR("WARNING: You are using --zero-negs or --ignore-negs "
 		      "even though your chosen figure of merit does not "
 		      "require it.\n");
@@ -595,8 +905,11 @@ int main(int argc, char *argv[])
 	sym = get_pointgroup(sym_str);
 	free(sym_str);
 
-	if ( is_centrosymmetric(sym) ) {
-		switch ( fom )
+	for ( i=0; i<n_foms; i++ ) {
+
+		if ( !is_centrosymmetric(sym) ) break;
+
+		switch ( foms[i] )
 		{
 			case FOM_R1F :
 			case FOM_R2 :
@@ -667,84 +980,38 @@ int main(int argc, char *argv[])
 	reflist_free(list1_raw);
 	reflist_free(list2_raw);
 
-	anom = ( (fom == FOM_CCANO) || (fom == FOM_CRDANO)
-	        || (fom == FOM_RANO) || (fom == FOM_RANORSPLIT) );
-	rej = fom_select_reflection_pairs(list1, list2, &list1_acc, &list2_acc,
-	                                  cell, sym,
-	                                  anom, rmin_fix, rmax_fix, sigma_cutoff,
-	                                  config_ignorenegs, config_zeronegs,
-	                                  mul_cutoff);
-	reflist_free(list1);
-	reflist_free(list2);
-
 	gsl_set_error_handler_off();
 
-	if ( rej.low_snr > 0 ) {
-		STATUS("Discarded %i reflection pairs because either or both"
-		       " versions had I/sigma(I) < %f.\n",
-		       rej.low_snr, sigma_cutoff);
-	}
-
-	if ( rej.negative_deleted > 0 ) {
-		STATUS("Discarded %i reflection pairs because either or both"
-		       " versions had negative intensities.\n",
-		       rej.negative_deleted);
-	}
-
-	if ( rej.negative_zeroed > 0 ) {
-		STATUS("For %i reflection pairs, either or both versions had"
-		       " negative intensities which were set to zero.\n",
-		       rej.negative_zeroed);
-	}
-
-	if ( rej.few_measurements > 0 ) {
-		STATUS("%i reflection pairs rejected because either or both"
-		       " versions had too few measurements.\n",
-		       rej.few_measurements);
-	}
-
-	if ( rej.outside_resolution_range > 0 ) {
-		STATUS("%i reflection pairs rejected because either or both"
-		       " versions were outside the resolution range.\n",
-		       rej.outside_resolution_range);
-	}
+	/* The anomalous figures of merit need a different selection of
+	 * reflections, so they are done separately */
+	for ( anom=0; anom<=1; anom++ ) {
 
-	if ( rej.no_bijvoet > 0 ) {
-		STATUS("%i reflection pairs rejected because either or both"
-		       " versions did not have Bijvoet partners.\n",
-		       rej.no_bijvoet);
-	}
+		enum fom_type group[MAX_FOMS];
+		int n_group = 0;
 
-	if ( rej.centric > 0 ) {
-		STATUS("%i reflection pairs rejected because they were"
-		       " centric.\n", rej.centric);
-	}
+		for ( i=0; i<n_foms; i++ ) {
+			if ( fom_is_anomalous(foms[i]) == anom ) {
+				group[n_group++] = foms[i];
+			}
+		}
+		if ( n_group == 0 ) continue;
 
-	STATUS("%i reflection pairs accepted.\n", rej.common);
+		if ( anom && (n_group < n_foms) ) {
+			STATUS("Selecting reflections for the anomalous "
+			       "figures of merit:\n");
+		}
 
-	resolution_limits(list1_acc, cell, &rmin, &rmax);
-	resolution_limits(list2_acc, cell, &rmin, &rmax);
-	STATUS("Accepted resolution range: %f to %f nm^-1"
-	       " (%.2f to %.2f Angstroms).\n",
-	       rmin/1e9, rmax/1e9, 1e10/rmin, 1e10/rmax);
+		compare_group(list1, list2, cell, sym, group, n_group,
+		              n_foms > 1, anom, rmin_fix, rmax_fix,
+		              sigma_cutoff, config_ignorenegs, config_zeronegs,
+		              mul_cutoff, config_unity, nshells, shell_file,
+		              n_bootstrap, seed, n_threads);
 
-	if ( rmin_fix >= 0.0 ) {
-		rmin = rmin_fix;
-	}
-	if ( rmax_fix >= 0.0 ) {
-		rmax = rmax_fix;
-	}
-	if ( (rmin_fix>=0.0) || (rmax_fix>=0.0) ) {
-		STATUS("Fixed resolution range: %f to %f nm^-1"
-		       " (%.2f to %.2f Angstroms).\n",
-		       rmin/1e9, rmax/1e9, 1e10/rmin, 1e10/rmax);
 	}
-	do_fom(list1_acc, list2_acc, cell, rmin, rmax, fom, config_unity,
-	       nshells, shell_file, sym);
 
+	reflist_free(list1);
+	reflist_free(list2);
 	free(shell_file);
-	reflist_free(list1_acc);
-	reflist_free(list2_acc);
 
 	return 0;
 }
@@ -191,6 +191,36 @@ static int should_rescan_streams(struct crystfelproject *proj)
 }
 
 
+/* Start loading the frames which will probably be wanted next, i.e. the
+ * next two in the direction of travel and the one in the other direction */
+static void prefetch_neighbours(struct crystfelproject *proj)
+{
+	const char *filenames[3];
+	const char *events[3];
+	int frames[3];
+	int dir;
+	int i, n;
+
+	dir = (proj->cur_frame < proj->last_frame) ? -1 : +1;
+	proj->last_frame = proj->cur_frame;
+
+	frames[0] = proj->cur_frame + dir;
+	frames[1] = proj->cur_frame + 2*dir;
+	frames[2] = proj->cur_frame - dir;
+
+	n = 0;
+	for ( i=0; i<3; i++ ) {
+		if ( (frames[i] < 0) || (frames[i] >= proj->n_frames) ) continue;
+		filenames[n] = proj->filenames[frames[i]];
+		events[n] = proj->events[frames[i]];
+		n++;
+	}
+
+	frame_prefetch_request(proj->prefetch, proj->dtempl,
+	                       filenames, events, n);
+}
+
+
 /* Bring the image view up to date after changing the selected image */
 void update_imageview(struct crystfelproject *proj)
 {
@@ -213,14 +243,15 @@ void update_imageview(struct crystfelproject *proj)
 	}
 
 	if ( file_exists(proj->filenames[proj->cur_frame]) ) {
-		image = image_read(proj->dtempl,
-		                   proj->filenames[proj->cur_frame],
-		                   proj->events[proj->cur_frame],
-		                   0, 0, NULL);
+		image = frame_prefetch_take(proj->prefetch,
+		                            proj->dtempl,
+		                            proj->filenames[proj->cur_frame],
+		                            proj->events[proj->cur_frame]);
 	} else {
 		STATUS("Image data file not present.\n");
 		image = NULL;
 	}
+	prefetch_neighbours(proj);
 
 	if ( proj->events[proj->cur_frame] != NULL ) {
 		ev_str = proj->events[proj->cur_frame];
@@ -1443,6 +1474,9 @@ int main(int argc, char *argv[])
 	gtk_widget_show_all(proj.window);
 	gtk_main();
 
+	frame_prefetch_free(proj.prefetch);
+	proj.prefetch = NULL;
+
 	return 0;
 }
 
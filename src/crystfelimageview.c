@@ -41,11 +41,13 @@
 #include <utils.h>
 #include <detgeom.h>
 #include <colscale.h>
+#include <thread-pool.h>
 
 #include "crystfelimageview.h"
 
 
 static int rerender_image(CrystFELImageView *iv);
+static int update_pixbufs(CrystFELImageView *iv);
 
 
 static void scroll_interface_init(GtkScrollable *iface)
@@ -77,26 +79,82 @@ static void redraw(CrystFELImageView *iv)
 }
 
 
-static void cleanup_image(CrystFELImageView *iv)
+/* Number of colour lookup table entries between scale_lo and scale_hi */
+#define LUT_HALF_SIZE (4096)
+
+/* Maximum number of mipmap levels, including the full-resolution one */
+#define MAX_LEVELS (8)
+
+struct iv_level
 {
-	if ( iv->pixbufs != NULL ) {
-		int i;
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-			if ( iv->pixbufs[i] != NULL ) {
-				gdk_pixbuf_unref(iv->pixbufs[i]);
-			}
+	int        w;
+	int        h;
+	float     *data;   /* For level zero, these point to the image data */
+	int       *bad;
+};
+
+struct iv_panel
+{
+	struct iv_level  levels[MAX_LEVELS];
+	int              n_levels;
+
+	GdkPixbuf       *pixbuf;
+	int              level;  /* Mipmap level currently in pixbuf */
+	int              want_level;
+	int              dirty;
+};
+
+
+static void free_levels(struct iv_panel *panel)
+{
+	int j;
+
+	/* Level zero belongs to the image */
+	for ( j=1; j<panel->n_levels; j++ ) {
+		free(panel->levels[j].data);
+		free(panel->levels[j].bad);
+	}
+	panel->n_levels = 0;
+}
+
+
+static void free_panels(CrystFELImageView *iv)
+{
+	int i;
+
+	if ( iv->panels == NULL ) return;
+
+	for ( i=0; i<iv->n_panels; i++ ) {
+		free_levels(&iv->panels[i]);
+		if ( iv->panels[i].pixbuf != NULL ) {
+			g_object_unref(iv->panels[i].pixbuf);
 		}
 	}
-	free(iv->pixbufs);
+	free(iv->panels);
+	iv->panels = NULL;
+	iv->n_panels = 0;
+}
+
+
+static void cleanup_image(CrystFELImageView *iv)
+{
+	int i;
+
+	/* Pixbufs are kept for the next image, but the mipmaps are not */
+	for ( i=0; i<iv->n_panels; i++ ) {
+		free_levels(&iv->panels[i]);
+	}
 
 	iv->image = NULL;
-	iv->pixbufs = NULL;
 }
 
 
 static gint destroy_sig(GtkWidget *window, CrystFELImageView *iv)
 {
 	cleanup_image(iv);
+	free_panels(iv);
+	free(iv->lut);
+	iv->lut = NULL;
 	return FALSE;
 }
 
@@ -349,6 +407,7 @@ static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
 	cairo_pattern_t *patt;
 	double xs, ys, pixel_size_on_screen;
 	int have_pixels = 1;
+	int ds;
 
 	cairo_save(cr);
 
@@ -360,11 +419,13 @@ static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
 	                      0.0, 0.0);
 	cairo_transform(cr, &m);
 
-	gdk_cairo_set_source_pixbuf(cr, iv->pixbufs[i], 0.0, 0.0);
+	gdk_cairo_set_source_pixbuf(cr, iv->panels[i].pixbuf, 0.0, 0.0);
 	patt = cairo_get_source(cr);
 
+	/* Each pixbuf pixel covers 2^level panel pixels */
+	ds = 1 << iv->panels[i].level;
 	cairo_pattern_get_matrix(patt, &m);
-	cairo_matrix_scale(&m, 1.0/p.pixel_pitch, 1.0/p.pixel_pitch);
+	cairo_matrix_scale(&m, 1.0/(ds*p.pixel_pitch), 1.0/(ds*p.pixel_pitch));
 	cairo_pattern_set_matrix(patt, &m);
 
 	cairo_pattern_set_filter(patt, CAIRO_FILTER_NEAREST);
@@ -662,6 +723,7 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 
 	if ( iv->image == NULL ) return FALSE;
 	if ( iv->need_rerender ) rerender_image(iv);
+	if ( update_pixbufs(iv) ) return FALSE;
 
 	cairo_save(cr);
 
@@ -678,9 +740,9 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 	cairo_translate(cr, -gtk_adjustment_get_value(iv->hadj),
 	                     gtk_adjustment_get_value(iv->vadj));
 
-	if ( iv->pixbufs != NULL ) {
+	if ( iv->panels != NULL ) {
 		int i;
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
+		for ( i=0; i<iv->n_panels; i++ ) {
 			cairo_save(cr);
 			draw_panel_rectangle(cr, iv, i, &m);
 			cairo_restore(cr);
@@ -900,7 +962,10 @@ GtkWidget *crystfel_image_view_new()
 	iv->show_centre = 1;
 	iv->show_peaks = 0;
 	iv->brightness = 1.0;
-	iv->pixbufs = NULL;
+	iv->panels = NULL;
+	iv->n_panels = 0;
+	iv->need_recolour = 1;
+	iv->lut = NULL;
 	iv->peak_box_size = 1.0;
 	iv->refl_box_size = 1.0;
 	iv->label_refls = 1;
@@ -990,54 +1055,310 @@ static void detgeom_pixel_extents(struct detgeom *det,
 }
 
 
-static void free_pixbuf(guchar *data, gpointer p)
+/* Make the next mipmap level from the previous one.  Each pixel takes the
+ * maximum of the (up to four) non-bad pixels it covers, so that peaks stay
+ * visible when zoomed out.  It is only bad if all of those pixels are bad. */
+static int make_level(struct iv_level *prev, struct iv_level *lvl)
+{
+	int fs, ss;
+
+	lvl->w = (prev->w+1)/2;
+	lvl->h = (prev->h+1)/2;
+	lvl->data = malloc(lvl->w*lvl->h*sizeof(float));
+	lvl->bad = malloc(lvl->w*lvl->h*sizeof(int));
+	if ( (lvl->data == NULL) || (lvl->bad == NULL) ) {
+		free(lvl->data);
+		free(lvl->bad);
+		return 1;
+	}
+
+	for ( ss=0; ss<lvl->h; ss++ ) {
+		for ( fs=0; fs<lvl->w; fs++ ) {
+
+			float max = -INFINITY;
+			int n = 0;
+			int dfs, dss;
+
+			for ( dss=0; dss<2; dss++ ) {
+				for ( dfs=0; dfs<2; dfs++ ) {
+
+					int pfs = 2*fs+dfs;
+					int pss = 2*ss+dss;
+					long int pidx;
+
+					if ( pfs >= prev->w ) continue;
+					if ( pss >= prev->h ) continue;
+					pidx = pfs + (long int)pss*prev->w;
+					if ( prev->bad[pidx] ) continue;
+					if ( prev->data[pidx] > max ) {
+						max = prev->data[pidx];
+					}
+					n++;
+
+				}
+			}
+
+			lvl->data[fs+ss*lvl->w] = max;
+			lvl->bad[fs+ss*lvl->w] = (n == 0);
+
+		}
+	}
+
+	return 0;
+}
+
+
+static void render_panel(struct iv_panel *panel, const unsigned char *lut,
+                         double scale_lo, double span)
+{
+	struct iv_level *lvl;
+	guchar *pixels;
+	int rowstride;
+	int fs, ss;
+	float lut_scale;
+	float lut_offs;
+
+	while ( panel->n_levels <= panel->want_level ) {
+		if ( make_level(&panel->levels[panel->n_levels-1],
+		                &panel->levels[panel->n_levels]) ) return;
+		panel->n_levels++;
+	}
+	lvl = &panel->levels[panel->want_level];
+
+	/* Value to lookup table index, with zero at scale_lo */
+	lut_scale = LUT_HALF_SIZE / span;
+	lut_offs = LUT_HALF_SIZE - scale_lo*lut_scale;
+
+	pixels = gdk_pixbuf_get_pixels(panel->pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(panel->pixbuf);
+
+	for ( ss=0; ss<lvl->h; ss++ ) {
+
+		const float *data = &lvl->data[(long int)ss*lvl->w];
+		const int *bad = &lvl->bad[(long int)ss*lvl->w];
+		guchar *row = &pixels[(long int)ss*rowstride];
+
+		for ( fs=0; fs<lvl->w; fs++ ) {
+
+			if ( !bad[fs] ) {
+
+				float fidx = data[fs]*lut_scale + lut_offs;
+				int idx;
+
+				/* Also catches NaN */
+				if ( !(fidx > 0.0f) ) {
+					idx = 0;
+				} else if ( fidx >= 2*LUT_HALF_SIZE ) {
+					idx = 2*LUT_HALF_SIZE;
+				} else {
+					idx = fidx;
+				}
+
+				row[3*fs+0] = lut[3*idx+0];
+				row[3*fs+1] = lut[3*idx+1];
+				row[3*fs+2] = lut[3*idx+2];
+
+			} else {
+
+				/* Bad pixel indicator colour */
+				row[3*fs+0] = 30;
+				row[3*fs+1] = 20;
+				row[3*fs+2] = 0;
+
+			}
+
+		}
+	}
+
+	panel->level = panel->want_level;
+	panel->dirty = 0;
+}
+
+
+static double scale_span(CrystFELImageView *iv)
 {
-	free(data);
+	double span = iv->scale_hi - iv->scale_lo;
+	if ( span < 1e-6 ) span = 1e-6;
+	return span;
 }
 
 
-static GdkPixbuf *render_panel(float *data, int *badmap, int w, int h,
-                               int scale_type, double scale_lo, double scale_hi)
+struct render_queue
+{
+	CrystFELImageView *iv;
+	int next_panel;
+};
 
 
+struct render_task
 {
-	guchar *pixbuf_data;
-	long int i;
+	struct iv_panel *panel;
+	const unsigned char *lut;
+	double scale_lo;
+	double span;
+};
+
 
-	/* Rendered (colourful) version */
-	pixbuf_data = malloc(3*w*h);
-	if ( pixbuf_data == NULL ) return NULL;
+static void *render_get_task(void *vp)
+{
+	struct render_queue *q = vp;
+	CrystFELImageView *iv = q->iv;
 
-	for ( i=0; i<w*h; i++ ) {
+	while ( q->next_panel < iv->n_panels ) {
 
-		double r, g, b;
+		struct iv_panel *panel = &iv->panels[q->next_panel++];
+		struct render_task *task;
 
-		if ( !badmap[i] ) {
+		if ( !panel->dirty && (panel->level == panel->want_level) ) {
+			continue;
+		}
 
-			colscale_lookup(data[i]-scale_lo, scale_hi-scale_lo,
-			                scale_type, &r, &g, &b);
+		task = malloc(sizeof(struct render_task));
+		if ( task == NULL ) return NULL;
+		task->panel = panel;
+		task->lut = iv->lut;
+		task->scale_lo = iv->scale_lo;
+		task->span = scale_span(iv);
+		return task;
 
-			pixbuf_data[3*i+0] = 255*r;
-			pixbuf_data[3*i+1] = 255*g;
-			pixbuf_data[3*i+2] = 255*b;
+	}
 
-		} else {
+	return NULL;
+}
+
+
+static void render_work(void *vp, int cookie)
+{
+	struct render_task *task = vp;
+	render_panel(task->panel, task->lut, task->scale_lo, task->span);
+}
+
+
+static void render_final(void *qp, void *vp)
+{
+	free(vp);
+}
+
+
+static int setup_panels(CrystFELImageView *iv)
+{
+	int i;
+	const struct detgeom *det = iv->image->detgeom;
+
+	/* Keep the existing pixbufs if the panel sizes are the same */
+	if ( iv->n_panels != det->n_panels ) {
+		free_panels(iv);
+		iv->panels = calloc(det->n_panels, sizeof(struct iv_panel));
+		if ( iv->panels == NULL ) return 1;
+		iv->n_panels = det->n_panels;
+	}
+
+	for ( i=0; i<det->n_panels; i++ ) {
 
-			/* Bad pixel indicator colour */
-			pixbuf_data[3*i+0] = 30;
-			pixbuf_data[3*i+1] = 20;
-			pixbuf_data[3*i+2] = 0;
+		struct iv_panel *panel = &iv->panels[i];
 
+		free_levels(panel);
+		panel->levels[0].w = det->panels[i].w;
+		panel->levels[0].h = det->panels[i].h;
+		panel->levels[0].data = iv->image->dp[i];
+		panel->levels[0].bad = iv->image->bad[i];
+		panel->n_levels = 1;
+		panel->level = -1;
+		panel->want_level = 0;
+		panel->dirty = 1;
+
+	}
+
+	return 0;
+}
+
+
+/* Recolour any panels which have changed or need a different level of
+ * detail, spreading the work over the libcrystfel thread pool.  The pool's
+ * threads are kept between calls, so this is cheap enough for every redraw. */
+static int update_pixbufs(CrystFELImageView *iv)
+{
+	int i;
+	int n_dirty = 0;
+	int n_threads;
+	struct render_queue q;
+
+	if ( iv->panels == NULL ) return 0;
+
+	if ( iv->need_recolour ) {
+
+		if ( iv->lut == NULL ) {
+			iv->lut = malloc(3*(2*LUT_HALF_SIZE+1));
+			if ( iv->lut == NULL ) return 1;
 		}
 
+		colscale_make_lut(scale_span(iv), SCALE_COLOUR,
+		                  iv->lut, LUT_HALF_SIZE);
+
+		for ( i=0; i<iv->n_panels; i++ ) {
+			iv->panels[i].dirty = 1;
+		}
+		iv->need_recolour = 0;
 	}
 
-	/* Create the pixbuf from the 8-bit display data */
-	return gdk_pixbuf_new_from_data(pixbuf_data,
-	                                GDK_COLORSPACE_RGB,
-	                                FALSE, 8, w, h, w*3,
-	                                free_pixbuf, NULL);
+	for ( i=0; i<iv->n_panels; i++ ) {
+
+		struct iv_panel *panel = &iv->panels[i];
+		struct detgeom_panel *p = &iv->image->detgeom->panels[i];
+		double pixel_size_on_screen = p->pixel_pitch*iv->zoom;
+		int w, h, level;
+
+		/* Use the lowest level of detail for which there are still at
+		 * least as many pixbuf pixels as screen pixels */
+		level = 0;
+		w = p->w;
+		h = p->h;
+		while ( (pixel_size_on_screen*2.0 <= 1.0)
+		     && (level < MAX_LEVELS-1)
+		     && (w > 1) && (h > 1) )
+		{
+			pixel_size_on_screen *= 2.0;
+			w = (w+1)/2;
+			h = (h+1)/2;
+			level++;
+		}
+		panel->want_level = level;
+
+		if ( !panel->dirty && (panel->level == level) ) continue;
 
+		/* Pixbufs have to be created in this thread */
+		if ( (panel->pixbuf == NULL)
+		  || (gdk_pixbuf_get_width(panel->pixbuf) != w)
+		  || (gdk_pixbuf_get_height(panel->pixbuf) != h) )
+		{
+			if ( panel->pixbuf != NULL ) {
+				g_object_unref(panel->pixbuf);
+			}
+			panel->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+			                               FALSE, 8, w, h);
+			if ( panel->pixbuf == NULL ) return 1;
+		}
+
+		n_dirty++;
+	}
+
+	if ( n_dirty == 0 ) return 0;
+
+	q.iv = iv;
+	q.next_panel = 0;
+
+	n_threads = g_get_num_processors();
+	if ( n_threads > n_dirty ) n_threads = n_dirty;
+
+	run_threads(n_threads, render_work, render_get_task, render_final,
+	            &q, 0, 0, 0, 0);
+
+	/* Rendering can only fail if a mipmap could not be allocated */
+	for ( i=0; i<iv->n_panels; i++ ) {
+		if ( iv->panels[i].level != iv->panels[i].want_level ) return 1;
+	}
+
+	return 0;
 }
 
 
@@ -1052,30 +1373,14 @@ static void center_adjustment(GtkAdjustment *adj)
 
 static int rerender_image(CrystFELImageView *iv)
 {
-	int i;
 	double min_x, min_y, max_x, max_y;
 
 	if ( iv->image == NULL ) return 0;
 	if ( iv->image->detgeom == NULL ) return 0;
 
-	if ( iv->pixbufs == NULL ) {
-		iv->pixbufs = calloc(iv->image->detgeom->n_panels,
-		                     sizeof(GdkPixbuf *));
-		if ( iv->pixbufs == NULL ) return 1;
-	} else {
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-			gdk_pixbuf_unref(iv->pixbufs[i]);
-		}
-	}
-
-	for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-		iv->pixbufs[i] = render_panel(iv->image->dp[i],
-		                              iv->image->bad[i],
-		                              iv->image->detgeom->panels[i].w,
-		                              iv->image->detgeom->panels[i].h,
-		                              SCALE_COLOUR,
-		                              iv->scale_lo, iv->scale_hi);
-		if ( iv->pixbufs[i] == NULL ) return 1;
+	/* New image? */
+	if ( (iv->panels == NULL) || (iv->panels[0].n_levels == 0) ) {
+		if ( setup_panels(iv) ) return 1;
 	}
 
 	detgeom_pixel_extents(iv->image->detgeom,
@@ -1108,6 +1413,7 @@ int crystfel_image_view_set_image(CrystFELImageView *iv,
 	cleanup_image(iv);
 	iv->image = image;
 	iv->need_rerender = 1;
+	iv->need_recolour = 1;
 	redraw(iv);
 	return 0;
 }
@@ -1201,6 +1507,6 @@ void crystfel_image_view_set_colour_scale(CrystFELImageView *iv,
 {
 	iv->scale_lo = lo;
 	iv->scale_hi = hi;
-	iv->need_rerender = 1;
+	iv->need_recolour = 1;
 	redraw(iv);
 }
@@ -55,6 +55,8 @@
 #define CRYSTFEL_IMAGE_VIEW_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS((obj), \
                                            CRYSTFEL_TYPE_IMAGE_VIEW, CrystFELImageView))
 
+struct iv_panel;
+
 struct _crystfelimageview
 {
 	GtkDrawingArea       parent_instance;
@@ -87,7 +89,11 @@ struct _crystfelimageview
 
 	const struct image  *image;
 
-	GdkPixbuf          **pixbufs;
+	/* Rendered panels, colour lookup table and mipmaps */
+	struct iv_panel     *panels;
+	int                  n_panels;
+	int                  need_recolour;
+	unsigned char       *lut;
 
 	double               brightness;
 	int                  show_centre;
@@ -43,6 +43,7 @@
 #include <symmetry.h>
 #include <cell.h>
 #include <cell-utils.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -60,6 +61,7 @@ static void show_help(const char *s)
 "  -y, --symmetry=<sym>       The symmetry of the input reflection list.\n"
 "  -p, --pdb=<file>           PDB file with cell parameters (needed when\n"
 "                              using a resolution cutoff)\n"
+"  -j <n>                     Use <n> threads for twinning and expansion.\n"
 "\n"
 "You can add noise to the reflections with either of:\n"
 "      --poisson              Simulate Poisson samples.\n"
@@ -162,150 +164,594 @@ static void noise_reflections(RefList *list)
 }
 
 
+/* Packs indices into one number, for sorting */
+static long long int index_key(signed int h, signed int k, signed int l)
+{
+	return ((long long int)(h+32768) << 32)
+	     | ((long long int)(k+32768) << 16)
+	     | (long long int)(l+32768);
+}
+
+
+static void key_indices(long long int key,
+                        signed int *h, signed int *k, signed int *l)
+{
+	*h = (signed int)((key >> 32) & 0xffff) - 32768;
+	*k = (signed int)((key >> 16) & 0xffff) - 32768;
+	*l = (signed int)(key & 0xffff) - 32768;
+}
+
+
+/* A reflection in a flat list, sorted by indices and then by position in the
+ * original list.  The first entry for each key is therefore the one which
+ * would have been found first when working through the list in order. */
+struct flat_refl
+{
+	long long int key;
+	int src;
+};
+
+
+static int cmp_flat(const void *av, const void *bv)
+{
+	const struct flat_refl *a = av;
+	const struct flat_refl *b = bv;
+	if ( a->key < b->key ) return -1;
+	if ( a->key > b->key ) return 1;
+	if ( a->src < b->src ) return -1;
+	if ( a->src > b->src ) return 1;
+	return 0;
+}
+
+
+/* Index of the first entry with the given key, or n if there is none */
+static int find_flat(const struct flat_refl *fl, int n, long long int key)
+{
+	int lo = 0;
+	int hi = n;
+
+	while ( lo < hi ) {
+		int mid = lo + (hi-lo)/2;
+		if ( fl[mid].key < key ) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ( (lo < n) && (fl[lo].key == key) ) return lo;
+	return n;
+}
+
+
+static Reflection **flatten_reflist(RefList *list, int *pn)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	Reflection **arr;
+	int n = 0;
+
+	arr = malloc(num_reflections(list)*sizeof(Reflection *));
+	if ( arr == NULL ) return NULL;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		arr[n++] = refl;
+	}
+
+	*pn = n;
+	return arr;
+}
+
+
+/* The images of the unit vectors under each operation, so that equivalents
+ * can be generated without going through the SymOpList */
+static signed int *get_symop_images(const SymOpList *sym, int *pnequiv)
+{
+	int nequiv = num_equivs(sym, NULL);
+	signed int *ops;
+	int p;
+
+	ops = malloc(nequiv*9*sizeof(signed int));
+	if ( ops == NULL ) return NULL;
+
+	for ( p=0; p<nequiv; p++ ) {
+		signed int *o = &ops[9*p];
+		get_equiv(sym, NULL, p, 1, 0, 0, &o[0], &o[1], &o[2]);
+		get_equiv(sym, NULL, p, 0, 1, 0, &o[3], &o[4], &o[5]);
+		get_equiv(sym, NULL, p, 0, 0, 1, &o[6], &o[7], &o[8]);
+	}
+
+	*pnequiv = nequiv;
+	return ops;
+}
+
+
+/* Puts the distinct equivalents of h,k,l into eq, in the same order as
+ * special_position() followed by get_equiv() would, and returns how many */
+static int get_equivs(const signed int *ops, int nops,
+                      signed int h, signed int k, signed int l,
+                      signed int *eq)
+{
+	int p;
+	int n = 0;
+
+	for ( p=0; p<nops; p++ ) {
+
+		const signed int *o = &ops[9*p];
+		signed int he, ke, le;
+		int j;
+		int dup = 0;
+
+		he = h*o[0] + k*o[3] + l*o[6];
+		ke = h*o[1] + k*o[4] + l*o[7];
+		le = h*o[2] + k*o[5] + l*o[8];
+
+		for ( j=0; j<n; j++ ) {
+			if ( (eq[3*j] == he) && (eq[3*j+1] == ke)
+			  && (eq[3*j+2] == le) )
+			{
+				dup = 1;
+				break;
+			}
+		}
+		if ( dup ) continue;
+
+		eq[3*n] = he;
+		eq[3*n+1] = ke;
+		eq[3*n+2] = le;
+		n++;
+
+	}
+
+	return n;
+}
+
+
+/* Runs func over the items 0..n-1 in blocks, using several threads */
+struct range_queue
+{
+	int n;
+	int next;
+	void (*func)(void *priv, int start, int end);
+	void *priv;
+};
+
+
+struct range_task
+{
+	struct range_queue *q;
+	int start;
+	int end;
+};
+
+
+#define RANGE_BLOCK (4096)
+
+static void *range_get_task(void *vp)
+{
+	struct range_queue *q = vp;
+	struct range_task *t;
+
+	if ( q->next >= q->n ) return NULL;
+
+	t = malloc(sizeof(struct range_task));
+	if ( t == NULL ) return NULL;
+
+	t->q = q;
+	t->start = q->next;
+	t->end = q->next + RANGE_BLOCK;
+	if ( t->end > q->n ) t->end = q->n;
+	q->next = t->end;
+
+	return t;
+}
+
+
+static void range_work(void *vp, int cookie)
+{
+	struct range_task *t = vp;
+	t->q->func(t->q->priv, t->start, t->end);
+}
+
+
+static void range_final(void *qp, void *vp)
+{
+	free(vp);
+}
+
+
+static void run_ranges(int n, int n_threads,
+                       void (*func)(void *priv, int start, int end),
+                       void *priv)
+{
+	struct range_queue q;
+
+	if ( n_threads == 1 ) {
+		func(priv, 0, n);
+		return;
+	}
+
+	q.n = n;
+	q.next = 0;
+	q.func = func;
+	q.priv = priv;
+	run_threads(n_threads, range_work, range_get_task, range_final, &q,
+	            0, 0, 0, 0);
+}
+
+
 static RefList *template_reflections(RefList *list, RefList *template)
 {
 	Reflection *refl;
 	RefListIterator *iter;
 	RefList *out;
+	Reflection **arr;
+	struct flat_refl *fl;
+	int i, n;
 
 	out = reflist_new();
 	copy_notes(out, list);
 
+	arr = flatten_reflist(list, &n);
+	fl = malloc(n*sizeof(struct flat_refl));
+	if ( (arr == NULL) || (fl == NULL) ) {
+		ERROR("Failed to allocate flat list\n");
+		free(arr);
+		free(fl);
+		return out;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		signed int h, k, l;
+		get_indices(arr[i], &h, &k, &l);
+		fl[i].key = index_key(h, k, l);
+		fl[i].src = i;
+	}
+	qsort(fl, n, sizeof(struct flat_refl), cmp_flat);
+
 	for ( refl = first_refl(template, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) ) {
 
 		signed int h, k, l;
 		Reflection *new;
-		Reflection *old;
+		int f;
 
 		get_indices(refl, &h, &k, &l);
 
-		old = find_refl(list, h, k, l);
-		if ( old == NULL ) continue;
+		f = find_flat(fl, n, index_key(h, k, l));
+		if ( f == n ) continue;
 
 		new = add_refl(out, h, k, l);
-		copy_data(new, old);
+		copy_data(new, arr[fl[f].src]);
 
 	}
 
+	free(arr);
+	free(fl);
 	return out;
 }
 
 
-static RefList *twin_reflections(RefList *in, int need_all_parts,
-                                 const SymOpList *holo, const SymOpList *mero)
+struct twin_args
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	RefList *out;
-	SymOpMask *m;
-	int n;
+	Reflection **arr;
+	RefList *in;
+	const SymOpList *holo;
+	const SymOpList *mero;
+	const signed int *holo_ops;
+	int n_holo_ops;
+	int need_all_parts;
+
+	/* First pass: asymmetric indices of each input reflection */
+	struct flat_refl *by_mero;
+	struct flat_refl *by_holo;
+	int n_in;
+
+	/* Second pass: one twinned reflection for each group */
+	long long int *groups;
+	struct twin_result *results;
+};
+
+
+struct twin_result
+{
+	double total;
+	double sigma;
+	int multi;
+	int skip;
+	signed int missing_h;
+	signed int missing_k;
+	signed int missing_l;
+};
 
-	out = reflist_new();
-	copy_notes(out, in);
 
-	/* No need to free and reallocate this for every reflection */
-	m = new_symopmask(holo);
+static void twin_asymm(void *vp, int start, int end)
+{
+	struct twin_args *ta = vp;
+	int i;
+
+	for ( i=start; i<end; i++ ) {
 
-	for ( refl = first_refl(in, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		double total, sigma;
-		int multi;
 		signed int h, k, l;
-		int j;
-		int skip;
+		signed int ha, ka, la;
 
-		/* Figure out where to put the twinned version, and check it's
-		 * not there already. */
-		get_indices(refl, &h, &k, &l);
-		get_asymm(holo, h, k, l, &h, &k, &l);
-		if ( find_refl(out, h, k, l) != NULL ) continue;
+		get_indices(ta->arr[i], &h, &k, &l);
+
+		get_asymm(ta->mero, h, k, l, &ha, &ka, &la);
+		ta->by_mero[i].key = index_key(ha, ka, la);
+		ta->by_mero[i].src = i;
 
-		special_position(holo, m, h, k, l);
-		n = num_equivs(holo, m);
+		get_asymm(ta->holo, h, k, l, &ha, &ka, &la);
+		ta->by_holo[i].key = index_key(ha, ka, la);
+		ta->by_holo[i].src = i;
 
-		total = 0.0;
-		sigma = 0.0;
-		multi = 0;
-		skip = 0;
+	}
+}
+
+
+static void twin_groups(void *vp, int start, int end)
+{
+	struct twin_args *ta = vp;
+	signed int *eq;
+	Reflection **used;
+	int g;
+
+	eq = malloc(3*ta->n_holo_ops*sizeof(signed int));
+	used = malloc(ta->n_holo_ops*sizeof(Reflection *));
+	if ( (eq == NULL) || (used == NULL) ) {
+		ERROR("Failed to allocate twinning workspace\n");
+		abort();
+	}
+
+	for ( g=start; g<end; g++ ) {
+
+		struct twin_result *res = &ta->results[g];
+		signed int h, k, l;
+		int j, n;
+		int n_used = 0;
+
+		key_indices(ta->groups[g], &h, &k, &l);
+		n = get_equivs(ta->holo_ops, ta->n_holo_ops, h, k, l, eq);
+
+		res->total = 0.0;
+		res->sigma = 0.0;
+		res->multi = 0;
+		res->skip = 0;
 
 		for ( j=0; j<n; j++ ) {
 
 			signed int he, ke, le;
-			signed int hu, ku, lu;
-			int r;
+			Reflection *part;
+			double i, sigi;
+			int f, u, mult;
+			int seen = 0;
+
+			get_asymm(ta->mero, eq[3*j], eq[3*j+1], eq[3*j+2],
+			          &he, &ke, &le);
+
+			/* Do we have this reflection, or any (merohedral)
+			 * equivalent of it? */
+			f = find_flat(ta->by_mero, ta->n_in,
+			              index_key(he, ke, le));
+
+			if ( f == ta->n_in ) {
+				if ( ta->need_all_parts ) {
+					res->skip = 1;
+					res->missing_h = he;
+					res->missing_k = ke;
+					res->missing_l = le;
+					break;
+				}
+				continue;
+			}
 
-			get_equiv(holo, m, j, h, k, l, &he, &ke, &le);
-			get_asymm(mero, he, ke, le, &he, &ke, &le);
+			if ( (f+1 < ta->n_in)
+			  && (ta->by_mero[f+1].key == ta->by_mero[f].key) )
+			{
+				/* More than one equivalent in the list.  Take
+				 * the same one as find_equiv_in_list() */
+				signed int hu, ku, lu;
+				find_equiv_in_list(ta->in, he, ke, le, ta->mero,
+				                   &hu, &ku, &lu);
+				part = find_refl(ta->in, hu, ku, lu);
+			} else {
+				part = ta->arr[ta->by_mero[f].src];
+			}
 
-			/* Do we have this reflection?
-			 * We might not have the particular (merohedral)
-			 * equivalent which belongs to our definition of the
-			 * asymmetric unit cell, so check them all.
-			 */
-			r = find_equiv_in_list(in, he, ke, le, mero,
-			                       &hu, &ku, &lu);
+			/* Each part only counts once, even if several of the
+			 * holohedral equivalents lead to it */
+			for ( u=0; u<n_used; u++ ) {
+				if ( used[u] == part ) {
+					seen = 1;
+					break;
+				}
+			}
+			if ( seen ) continue;
+			used[n_used++] = part;
 
-			if ( need_all_parts && !r ) {
+			i = get_intensity(part);
+			sigi = get_esd_intensity(part);
+			mult = get_redundancy(part);
 
-				ERROR("Twinning %i %i %i requires the %i %i %i "
-				      "reflection (or an equivalent in %s), "
-				      "which I don't have.\n",
-				      h, k, l, he, ke, le, symmetry_name(mero));
+			res->total += mult*i;
+			res->sigma += pow(sigi*mult, 2.0);
+			res->multi += mult;
 
-				skip = 1;
-				break;
+		}
 
-			}
+	}
 
-			if ( r ) {
+	free(eq);
+	free(used);
+}
 
-				double i, sigi;
-				int mult;
-				Reflection *part;
 
-				part = find_refl(in, hu, ku, lu);
+static RefList *twin_reflections(RefList *in, int need_all_parts,
+                                 const SymOpList *holo, const SymOpList *mero,
+                                 int n_threads)
+{
+	RefList *out;
+	struct twin_args ta;
+	int i, n_groups;
 
-				i = get_intensity(part);
-				sigi = get_esd_intensity(part);
-				mult = get_redundancy(part);
+	out = reflist_new();
+	copy_notes(out, in);
 
-				total += mult*i;
-				sigma += pow(sigi*mult, 2.0);
-				multi += mult;
+	ta.in = in;
+	ta.holo = holo;
+	ta.mero = mero;
+	ta.need_all_parts = need_all_parts;
+	ta.arr = flatten_reflist(in, &ta.n_in);
+	ta.holo_ops = get_symop_images(holo, &ta.n_holo_ops);
+	ta.by_mero = malloc(ta.n_in*sizeof(struct flat_refl));
+	ta.by_holo = malloc(ta.n_in*sizeof(struct flat_refl));
+	ta.groups = malloc(ta.n_in*sizeof(long long int));
+	ta.results = malloc(ta.n_in*sizeof(struct twin_result));
+	if ( (ta.arr == NULL) || (ta.holo_ops == NULL)
+	  || (ta.by_mero == NULL) || (ta.by_holo == NULL)
+	  || (ta.groups == NULL) || (ta.results == NULL) )
+	{
+		ERROR("Failed to allocate twinning lists\n");
+		free(ta.arr);
+		free((signed int *)ta.holo_ops);
+		free(ta.by_mero);
+		free(ta.by_holo);
+		free(ta.groups);
+		free(ta.results);
+		reflist_free(out);
+		return NULL;
+	}
 
-				set_intensity(part, 0.0);
-				set_esd_intensity(part, 0.0);
-				set_redundancy(part, 0);
-			}
+	/* Asymmetric indices of everything, in both point groups */
+	run_ranges(ta.n_in, n_threads, twin_asymm, &ta);
+	qsort(ta.by_mero, ta.n_in, sizeof(struct flat_refl), cmp_flat);
+	qsort(ta.by_holo, ta.n_in, sizeof(struct flat_refl), cmp_flat);
 
+	/* Each distinct holohedral asymmetric reflection becomes one
+	 * twinned reflection */
+	n_groups = 0;
+	for ( i=0; i<ta.n_in; i++ ) {
+		if ( (n_groups > 0) && (ta.groups[n_groups-1] == ta.by_holo[i].key) ) {
+			continue;
 		}
+		ta.groups[n_groups++] = ta.by_holo[i].key;
+	}
 
-		if ( !skip ) {
+	run_ranges(n_groups, n_threads, twin_groups, &ta);
 
-			Reflection *new = add_refl(out, h, k, l);
-			set_intensity(new, total/multi);
-			set_esd_intensity(new, sqrt(sigma)/multi);
-			set_redundancy(new, multi);
+	for ( i=0; i<n_groups; i++ ) {
 
+		struct twin_result *res = &ta.results[i];
+		signed int h, k, l;
+		Reflection *new;
+
+		key_indices(ta.groups[i], &h, &k, &l);
+
+		if ( res->skip ) {
+			ERROR("Twinning %i %i %i requires the %i %i %i "
+			      "reflection (or an equivalent in %s), "
+			      "which I don't have.\n",
+			      h, k, l, res->missing_h, res->missing_k,
+			      res->missing_l, symmetry_name(mero));
+			continue;
 		}
 
+		new = add_refl(out, h, k, l);
+		set_intensity(new, res->total/res->multi);
+		set_esd_intensity(new, sqrt(res->sigma)/res->multi);
+		set_redundancy(new, res->multi);
+
 	}
 
+	free(ta.arr);
+	free((signed int *)ta.holo_ops);
+	free(ta.by_mero);
+	free(ta.by_holo);
+	free(ta.groups);
+	free(ta.results);
+
 	return out;
 }
 
 
+struct expand_args
+{
+	Reflection **arr;
+	const SymOpList *target;
+	const signed int *ops;
+	int n_ops;
+
+	/* Up to n_ops asymmetric indices for each input reflection */
+	long long int *keys;
+	int *n_keys;
+};
+
+
+static void expand_equivs(void *vp, int start, int end)
+{
+	struct expand_args *ea = vp;
+	signed int *eq;
+	int i;
+
+	eq = malloc(3*ea->n_ops*sizeof(signed int));
+	if ( eq == NULL ) {
+		ERROR("Failed to allocate expansion workspace\n");
+		abort();
+	}
+
+	for ( i=start; i<end; i++ ) {
+
+		signed int h, k, l;
+		long long int *keys = &ea->keys[(size_t)i*ea->n_ops];
+		int j, n;
+		int nk = 0;
+
+		get_indices(ea->arr[i], &h, &k, &l);
+		n = get_equivs(ea->ops, ea->n_ops, h, k, l, eq);
+
+		/* For each equivalent in the higher symmetry group, put it
+		 * into the asymmetric unit for the target */
+		for ( j=0; j<n; j++ ) {
+
+			signed int he, ke, le;
+			long long int key;
+			int u;
+			int seen = 0;
+
+			get_asymm(ea->target, eq[3*j], eq[3*j+1], eq[3*j+2],
+			          &he, &ke, &le);
+			key = index_key(he, ke, le);
+
+			for ( u=0; u<nk; u++ ) {
+				if ( keys[u] == key ) {
+					seen = 1;
+					break;
+				}
+			}
+			if ( !seen ) keys[nk++] = key;
+
+		}
+
+		ea->n_keys[i] = nk;
+
+	}
+
+	free(eq);
+}
+
+
 static RefList *expand_reflections(RefList *in, const SymOpList *initial,
-                                                const SymOpList *target)
+                                   const SymOpList *target, int n_threads)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	RefList *out;
-	SymOpMask *m;
+	struct expand_args ea;
+	struct flat_refl *fl;
+	int n_in, i;
+	long int n_out;
 	int phase_warning = 0;
 
 	if ( !is_subgroup(initial, target) ) {
@@ -316,57 +762,89 @@ static RefList *expand_reflections(RefList *in, const SymOpList *initial,
 
 	out = reflist_new();
 	copy_notes(out, in);
-	m = new_symopmask(initial);
 
-	for ( refl = first_refl(in, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
+	ea.target = target;
+	ea.arr = flatten_reflist(in, &n_in);
+	ea.ops = get_symop_images(initial, &ea.n_ops);
+	ea.keys = malloc((size_t)n_in*ea.n_ops*sizeof(long long int));
+	ea.n_keys = malloc(n_in*sizeof(int));
+	if ( (ea.arr == NULL) || (ea.ops == NULL) || (ea.keys == NULL)
+	  || (ea.n_keys == NULL) )
+	{
+		ERROR("Failed to allocate expansion lists\n");
+		free(ea.arr);
+		free((signed int *)ea.ops);
+		free(ea.keys);
+		free(ea.n_keys);
+		reflist_free(out);
+		return NULL;
+	}
 
-		signed int h, k, l;
-		int n, j;
+	run_ranges(n_in, n_threads, expand_equivs, &ea);
+
+	n_out = 0;
+	for ( i=0; i<n_in; i++ ) n_out += ea.n_keys[i];
+	fl = malloc(n_out*sizeof(struct flat_refl));
+	if ( fl == NULL ) {
+		ERROR("Failed to allocate expansion lists\n");
+		free(ea.arr);
+		free((signed int *)ea.ops);
+		free(ea.keys);
+		free(ea.n_keys);
+		reflist_free(out);
+		return NULL;
+	}
 
-		get_indices(refl, &h, &k, &l);
+	n_out = 0;
+	for ( i=0; i<n_in; i++ ) {
+		int j;
+		for ( j=0; j<ea.n_keys[i]; j++ ) {
+			fl[n_out].key = ea.keys[(size_t)i*ea.n_ops+j];
+			fl[n_out].src = i;
+			n_out++;
+		}
+	}
+	free(ea.keys);
+	free(ea.n_keys);
 
-		special_position(initial, m, h, k, l);
-		n = num_equivs(initial, m);
+	/* If several input reflections lead to the same indices, the first
+	 * one wins */
+	qsort(fl, n_out, sizeof(struct flat_refl), cmp_flat);
 
-		/* For each equivalent in the higher symmetry group */
-		for ( j=0; j<n; j++ ) {
+	for ( i=0; i<n_out; i++ ) {
 
-			signed int he, ke, le;
-			Reflection *copy;
-			int have_phase;
-			double ph;
-
-			/* Get the equivalent */
-			get_equiv(initial, m, j, h, k, l, &he, &ke, &le);
-
-			/* Put it into the asymmetric unit for the target */
-			get_asymm(target, he, ke, le, &he, &ke, &le);
-
-			if ( find_refl(out, he, ke, le) != NULL ) continue;
-
-			/* Make sure the intensity is in the right place */
-			copy = add_refl(out, he, ke, le);
-			copy_data(copy, refl);
-
-			ph = get_phase(refl, &have_phase);
-			if ( have_phase ) {
-				set_phase(copy, ph);
-				if ( !phase_warning ) {
-					ERROR("WARNING: get_hkl can't expand "
-					      "phase values correctly when the "
-					      "structure contains glides or "
-					      "screw axes.\n");
-					phase_warning = 1;
-				}
+		signed int he, ke, le;
+		Reflection *refl;
+		Reflection *copy;
+		int have_phase;
+		double ph;
+
+		if ( (i > 0) && (fl[i].key == fl[i-1].key) ) continue;
+
+		refl = ea.arr[fl[i].src];
+		key_indices(fl[i].key, &he, &ke, &le);
+
+		/* Make sure the intensity is in the right place */
+		copy = add_refl(out, he, ke, le);
+		copy_data(copy, refl);
+
+		ph = get_phase(refl, &have_phase);
+		if ( have_phase ) {
+			set_phase(copy, ph);
+			if ( !phase_warning ) {
+				ERROR("WARNING: get_hkl can't expand "
+				      "phase values correctly when the "
+				      "structure contains glides or "
+				      "screw axes.\n");
+				phase_warning = 1;
 			}
-
 		}
 
 	}
 
-	free_symopmask(m);
+	free(fl);
+	free(ea.arr);
+	free((signed int *)ea.ops);
 
 	return out;
 }
@@ -421,10 +899,19 @@ static RefList *apply_resolution_cutoff(RefList *input, double lowres,
 	RefList *n;
 	Reflection *refl;
 	RefListIterator *iter;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
 
 	n = reflist_new();
 	copy_notes(n, input);
 
+	/* 1/d, as 2.0*resolution() but without getting the reciprocal cell
+	 * every time */
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+
 	for ( refl = first_refl(input, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
@@ -432,7 +919,9 @@ static RefList *apply_resolution_cutoff(RefList *input, double lowres,
 		signed int h, k, l;
 		double res;
 		get_indices(refl, &h, &k, &l);
-		res = 2.0 * resolution(cell, h, k, l);
+		res = modulus(h*asx + k*bsx + l*csx,
+		              h*asy + k*bsy + l*csy,
+		              h*asz + k*bsz + l*csz);
 		if ( (res < highres) && (res > lowres) ) {
 			Reflection *a;
 			a = add_refl(n, h, k, l);
@@ -477,6 +966,7 @@ int main(int argc, char *argv[])
 	UnitCell *cell = NULL;
 	char *output_format_str = NULL;
 	char *space_group_str = NULL;
+	int n_threads = 1;
 	int r;
 
 	/* Long options */
@@ -507,7 +997,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:",
+	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -551,6 +1041,14 @@ int main(int argc, char *argv[])
 			cellfile = strdup(optarg);
 			break;
 
+			case 'j' :
+			n_threads = atoi(optarg);
+			if ( n_threads < 1 ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
+
 			case 2 :
 			adu_per_photon = strtof(optarg, NULL);
 			have_adu_per_photon = 1;
@@ -729,7 +1227,9 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Twinning from %s into %s\n", symmetry_name(mero),
 		                                     symmetry_name(holo));
-		new = twin_reflections(input, config_nap, holo, mero);
+		new = twin_reflections(input, config_nap, holo, mero,
+		                       n_threads);
+		if ( new == NULL ) return 1;
 
 		/* Replace old with new */
 		reflist_free(input);
@@ -746,7 +1246,8 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Expanding from %s into %s\n", symmetry_name(mero),
 		                                      symmetry_name(expand));
-		new = expand_reflections(input, mero, expand);
+		new = expand_reflections(input, mero, expand, n_threads);
+		if ( new == NULL ) return 1;
 
 		/* Replace old with new */
 		reflist_free(input);
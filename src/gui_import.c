@@ -495,6 +495,7 @@ static void finddata_response_sig(GtkWidget *dialog, gint resp,
 			g_free(proj->geom_filename);
 			proj->geom_filename = geom_filename;
 
+			frame_prefetch_flush(proj->prefetch);
 			data_template_free(proj->dtempl);
 			proj->dtempl = data_template_new_from_file(geom_filename);
 			if ( proj->dtempl == NULL ) {
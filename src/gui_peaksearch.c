@@ -100,10 +100,12 @@ void update_peaks(struct crystfelproject *proj)
 
 		case PEAK_HDF5:
 		case PEAK_CXI:
+		frame_prefetch_io_lock();
 		peaks = image_read_peaks(proj->dtempl,
 		                         proj->cur_image->filename,
 		                         proj->cur_image->ev,
 		                         proj->peak_search_params.half_pixel_shift);
+		frame_prefetch_io_unlock();
 		if ( proj->peak_search_params.revalidate ) {
 			proj->cur_image->features = validate_peaks(proj->cur_image, peaks,
 			                                           proj->peak_search_params.min_snr,
@@ -0,0 +1,403 @@
+/*
+ * gui_prefetch.c
+ *
+ * Background loading of neighbouring frames for CrystFEL GUI
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <image.h>
+#include <utils.h>
+
+#include "gui_prefetch.h"
+
+
+/* Number of decoded frames to keep */
+#define PREFETCH_CACHE_SIZE (4)
+
+/* Maximum number of outstanding requests */
+#define PREFETCH_MAX_REQUESTS (4)
+
+
+struct prefetch_frame
+{
+	char *filename;
+	char *event;
+	struct image *image;  /* NULL for a pending request */
+	int last_used;
+};
+
+
+struct frame_prefetch
+{
+	GThread *thread;
+	GMutex lock;
+	GCond cond;
+	int quit;
+
+	/* Incremented whenever the cache is flushed or the DataTemplate
+	 * changes.  A load which finishes under a different generation to the
+	 * one it started under is stale, and the result gets thrown away. */
+	int generation;
+	const DataTemplate *dtempl;
+
+	struct prefetch_frame requests[PREFETCH_MAX_REQUESTS];
+	int n_requests;
+	int busy;   /* Worker is currently loading 'loading' */
+	struct prefetch_frame *loading;
+
+	struct prefetch_frame cache[PREFETCH_CACHE_SIZE];
+	int n_cached;
+	int use_counter;
+};
+
+
+/* HDF5 (and possibly other libraries) can't be called from more than one
+ * thread at a time, so all image loading in the GUI goes through this */
+static GMutex io_lock;
+
+void frame_prefetch_io_lock()
+{
+	g_mutex_lock(&io_lock);
+}
+
+
+void frame_prefetch_io_unlock()
+{
+	g_mutex_unlock(&io_lock);
+}
+
+
+static int same_frame(struct prefetch_frame *f, const char *filename,
+                      const char *event)
+{
+	if ( strcmp(f->filename, filename) != 0 ) return 0;
+	if ( (f->event == NULL) && (event == NULL) ) return 1;
+	if ( (f->event == NULL) || (event == NULL) ) return 0;
+	return strcmp(f->event, event) == 0;
+}
+
+
+static void free_frame(struct prefetch_frame *f)
+{
+	free(f->filename);
+	free(f->event);
+	image_free(f->image);
+	f->filename = NULL;
+	f->event = NULL;
+	f->image = NULL;
+}
+
+
+static struct prefetch_frame *find_cached(struct frame_prefetch *fp,
+                                          const char *filename,
+                                          const char *event)
+{
+	int i;
+	for ( i=0; i<fp->n_cached; i++ ) {
+		if ( same_frame(&fp->cache[i], filename, event) ) {
+			return &fp->cache[i];
+		}
+	}
+	return NULL;
+}
+
+
+/* Called with lock held */
+static void add_to_cache(struct frame_prefetch *fp, struct prefetch_frame *f)
+{
+	int slot;
+
+	if ( fp->n_cached < PREFETCH_CACHE_SIZE ) {
+		slot = fp->n_cached++;
+	} else {
+		/* Evict the least recently used frame */
+		int i;
+		slot = 0;
+		for ( i=1; i<fp->n_cached; i++ ) {
+			if ( fp->cache[i].last_used < fp->cache[slot].last_used ) {
+				slot = i;
+			}
+		}
+		free_frame(&fp->cache[slot]);
+	}
+
+	fp->cache[slot] = *f;
+	fp->cache[slot].last_used = fp->use_counter++;
+}
+
+
+/* Called with lock held */
+static void remove_from_cache(struct frame_prefetch *fp,
+                              struct prefetch_frame *f)
+{
+	int idx = f - fp->cache;
+	fp->cache[idx] = fp->cache[fp->n_cached-1];
+	fp->n_cached--;
+}
+
+
+static gpointer prefetch_thread(gpointer data)
+{
+	struct frame_prefetch *fp = data;
+
+	g_mutex_lock(&fp->lock);
+
+	while ( !fp->quit ) {
+
+		struct prefetch_frame f;
+		const DataTemplate *dtempl;
+		int gen;
+
+		if ( fp->n_requests == 0 ) {
+			g_cond_wait(&fp->cond, &fp->lock);
+			continue;
+		}
+
+		/* Take the most urgent request */
+		f = fp->requests[0];
+		memmove(&fp->requests[0], &fp->requests[1],
+		        (fp->n_requests-1)*sizeof(struct prefetch_frame));
+		fp->n_requests--;
+
+		if ( find_cached(fp, f.filename, f.event) != NULL ) {
+			free_frame(&f);
+			continue;
+		}
+
+		gen = fp->generation;
+		dtempl = fp->dtempl;
+		fp->busy = 1;
+		fp->loading = &f;
+		g_mutex_unlock(&fp->lock);
+
+		if ( file_exists(f.filename) ) {
+			frame_prefetch_io_lock();
+			f.image = image_read(dtempl, f.filename, f.event,
+			                     0, 0, NULL);
+			frame_prefetch_io_unlock();
+		}
+
+		g_mutex_lock(&fp->lock);
+
+		if ( (f.image != NULL) && (gen == fp->generation) ) {
+			add_to_cache(fp, &f);
+		} else {
+			free_frame(&f);
+		}
+
+		fp->busy = 0;
+		fp->loading = NULL;
+		g_cond_broadcast(&fp->cond);
+
+	}
+
+	g_mutex_unlock(&fp->lock);
+	return NULL;
+}
+
+
+struct frame_prefetch *frame_prefetch_new()
+{
+	struct frame_prefetch *fp;
+
+	fp = malloc(sizeof(struct frame_prefetch));
+	if ( fp == NULL ) return NULL;
+
+	g_mutex_init(&fp->lock);
+	g_cond_init(&fp->cond);
+	fp->quit = 0;
+	fp->generation = 0;
+	fp->dtempl = NULL;
+	fp->n_requests = 0;
+	fp->busy = 0;
+	fp->loading = NULL;
+	fp->n_cached = 0;
+	fp->use_counter = 0;
+
+	fp->thread = g_thread_new("frame-prefetch", prefetch_thread, fp);
+
+	return fp;
+}
+
+
+static void clear_requests(struct frame_prefetch *fp)
+{
+	int i;
+	for ( i=0; i<fp->n_requests; i++ ) {
+		free_frame(&fp->requests[i]);
+	}
+	fp->n_requests = 0;
+}
+
+
+/**
+ * Discards all cached and pending frames, and waits for any load in progress
+ * to finish.  Call this before changing or freeing the DataTemplate.
+ */
+void frame_prefetch_flush(struct frame_prefetch *fp)
+{
+	int i;
+
+	if ( fp == NULL ) return;
+
+	g_mutex_lock(&fp->lock);
+	fp->generation++;
+	clear_requests(fp);
+	while ( fp->busy ) g_cond_wait(&fp->cond, &fp->lock);
+	for ( i=0; i<fp->n_cached; i++ ) {
+		free_frame(&fp->cache[i]);
+	}
+	fp->n_cached = 0;
+	fp->dtempl = NULL;
+	g_mutex_unlock(&fp->lock);
+}
+
+
+void frame_prefetch_free(struct frame_prefetch *fp)
+{
+	if ( fp == NULL ) return;
+
+	frame_prefetch_flush(fp);
+
+	g_mutex_lock(&fp->lock);
+	fp->quit = 1;
+	g_cond_broadcast(&fp->cond);
+	g_mutex_unlock(&fp->lock);
+
+	g_thread_join(fp->thread);
+	g_mutex_clear(&fp->lock);
+	g_cond_clear(&fp->cond);
+	free(fp);
+}
+
+
+/**
+ * Returns the image for the given frame.  If it has already been loaded in
+ * the background, the caller takes ownership of the cached copy.  Otherwise,
+ * it is loaded now.
+ */
+struct image *frame_prefetch_take(struct frame_prefetch *fp,
+                                  const DataTemplate *dtempl,
+                                  const char *filename,
+                                  const char *event)
+{
+	struct image *image;
+
+	if ( fp != NULL ) {
+
+		struct prefetch_frame *f;
+
+		g_mutex_lock(&fp->lock);
+		if ( fp->dtempl == dtempl ) {
+
+			/* If it's being loaded right now, wait for it */
+			while ( fp->busy
+			     && same_frame(fp->loading, filename, event) )
+			{
+				g_cond_wait(&fp->cond, &fp->lock);
+			}
+
+			f = find_cached(fp, filename, event);
+			if ( f != NULL ) {
+				image = f->image;
+				f->image = NULL;
+				free_frame(f);
+				remove_from_cache(fp, f);
+				g_mutex_unlock(&fp->lock);
+				return image;
+			}
+		}
+		g_mutex_unlock(&fp->lock);
+
+	}
+
+	if ( !file_exists(filename) ) return NULL;
+
+	frame_prefetch_io_lock();
+	image = image_read(dtempl, filename, event, 0, 0, NULL);
+	frame_prefetch_io_unlock();
+
+	return image;
+}
+
+
+/**
+ * Replaces any pending requests with the given frames, most urgent first.
+ * Frames which are already cached are kept.
+ */
+void frame_prefetch_request(struct frame_prefetch *fp,
+                            const DataTemplate *dtempl,
+                            const char **filenames,
+                            const char **events,
+                            int n)
+{
+	int i;
+
+	if ( fp == NULL ) return;
+
+	g_mutex_lock(&fp->lock);
+
+	if ( dtempl != fp->dtempl ) {
+		/* Everything in the cache is for the old geometry */
+		for ( i=0; i<fp->n_cached; i++ ) {
+			free_frame(&fp->cache[i]);
+		}
+		fp->n_cached = 0;
+		fp->dtempl = dtempl;
+		fp->generation++;
+	}
+
+	/* Requests which have not been started yet are stale.  Anything being
+	 * loaded right now will still go into the cache. */
+	clear_requests(fp);
+
+	for ( i=0; i<n; i++ ) {
+
+		struct prefetch_frame *f;
+
+		if ( fp->n_requests == PREFETCH_MAX_REQUESTS ) break;
+
+		f = find_cached(fp, filenames[i], events[i]);
+		if ( f != NULL ) {
+			/* Keep it */
+			f->last_used = fp->use_counter++;
+			continue;
+		}
+
+		f = &fp->requests[fp->n_requests++];
+		f->filename = strdup(filenames[i]);
+		f->event = (events[i] != NULL) ? strdup(events[i]) : NULL;
+		f->image = NULL;
+		f->last_used = 0;
+
+	}
+
+	g_cond_broadcast(&fp->cond);
+	g_mutex_unlock(&fp->lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * gui_prefetch.h
+ *
+ * Background loading of neighbouring frames for CrystFEL GUI
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GUI_PREFETCH_H
+#define GUI_PREFETCH_H
+
+#include <image.h>
+#include <datatemplate.h>
+
+struct frame_prefetch;
+
+extern struct frame_prefetch *frame_prefetch_new(void);
+
+extern void frame_prefetch_free(struct frame_prefetch *fp);
+
+extern struct image *frame_prefetch_take(struct frame_prefetch *fp,
+                                         const DataTemplate *dtempl,
+                                         const char *filename,
+                                         const char *event);
+
+extern void frame_prefetch_request(struct frame_prefetch *fp,
+                                   const DataTemplate *dtempl,
+                                   const char **filenames,
+                                   const char **events,
+                                   int n);
+
+extern void frame_prefetch_flush(struct frame_prefetch *fp);
+
+extern void frame_prefetch_io_lock(void);
+extern void frame_prefetch_io_unlock(void);
+
+#endif
@@ -1248,6 +1248,8 @@ int default_project(struct crystfelproject *proj)
 	proj->data_search_pattern = 0;
 	proj->dtempl = NULL;
 	proj->cur_image = NULL;
+	proj->prefetch = frame_prefetch_new();
+	proj->last_frame = 0;
 	proj->indexing_opts = NULL;
 	proj->merging_opts = NULL;
 	proj->ambi_opts = NULL;
@@ -34,6 +34,8 @@
 #include <peaks.h>
 #include <stream.h>
 
+#include "gui_prefetch.h"
+
 #define MAX_RUNNING_TASKS (16)
 
 enum match_type_id
@@ -279,6 +281,8 @@ struct crystfelproject {
 
 	int cur_frame;
 	struct image *cur_image;
+	struct frame_prefetch *prefetch;
+	int last_frame;   /* For guessing which frame will be wanted next */
 	int random_history[N_RANDOM_HISTORY];
 	int n_random_history;
 
@@ -247,6 +247,34 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->asapo_params.use_ack = 1;
 		break;
 
+		case 227 :
+		args->profile = 1;
+		args->profile_trace = 1;
+		break;
+
+		case 228 :
+		free(args->metrics_file);
+		args->metrics_file = strdup(arg);
+		break;
+
+		case 229 :
+		if ( (sscanf(arg, "%lf", &args->metrics_interval) != 1)
+		  || (args->metrics_interval <= 0.0) )
+		{
+			ERROR("Invalid value for --metrics-interval\n");
+			return EINVAL;
+		}
+		break;
+
+		case 230 :
+		if ( (sscanf(arg, "%d", &args->stream_buffer) != 1)
+		  || (args->stream_buffer < 1) || (args->stream_buffer > 1024) )
+		{
+			ERROR("Invalid value for --stream-buffer\n");
+			return EINVAL;
+		}
+		break;
+
 		/* ---------- Peak search ---------- */
 
 		case 't' :
@@ -538,6 +566,30 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->millefile = strdup(arg);
 		break;
 
+		case 422 :
+		args->mille_compress = 1;
+		break;
+
+		case 420 :
+		if (sscanf(arg, "%d", &args->iargs.race_threads) != 1)
+		{
+			ERROR("Invalid value for --race-indexers\n");
+			return EINVAL;
+		}
+		if ( args->iargs.race_threads < 1 ) {
+			ERROR("Invalid value for --race-indexers\n");
+			return EINVAL;
+		}
+		break;
+
+		case 421 :
+		if (sscanf(arg, "%lf", &args->iargs.race_deadline) != 1)
+		{
+			ERROR("Invalid value for --race-deadline\n");
+			return EINVAL;
+		}
+		break;
+
 		/* ---------- Integration ---------- */
 
 		case 501 :
@@ -685,6 +737,10 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->queue_sem = strdup(arg);
 		break;
 
+		case 709 :
+		args->ring_name = strdup(arg);
+		break;
+
 		default :
 		return ARGP_ERR_UNKNOWN;
 
@@ -741,6 +797,10 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->if_refine = 1;
 	args->if_checkcell = 1;
 	args->profile = 0;
+	args->profile_trace = 0;
+	args->metrics_file = NULL;
+	args->metrics_interval = 5.0;
+	args->stream_buffer = 0;
 	args->no_data_timeout = 60;
 	args->copy_headers = NULL;
 	args->n_copy_headers = 0;
@@ -758,9 +818,11 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->fd_mille = 0;
 	args->milledir = strdup(".");
 	args->millefile = strdup("mille-data.bin");
+	args->mille_compress = 0;
 	args->worker_tmpdir = NULL;
 	args->queue_sem = NULL;
 	args->shm_name = NULL;
+	args->ring_name = NULL;
 
 	/* Defaults for process_image arguments */
 	args->iargs.cell = NULL;
@@ -819,6 +881,8 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->iargs.data_format = DATA_SOURCE_TYPE_UNKNOWN;
 	args->iargs.mille = 0;
 	args->iargs.max_mille_level = 99;
+	args->iargs.race_threads = 1;
+	args->iargs.race_deadline = -1.0;
 
 	argp_program_version_hook = show_version;
 
@@ -876,6 +940,14 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"asapo-consumer-timeout", 225, "ms", OPTION_NO_USAGE,
 			"ASAP::O get_next timeout for one frame (milliseconds)"},
 		{"asapo-acks", 226, NULL, OPTION_NO_USAGE, "Use ASAP::O acknowledgements"},
+		{"profile-trace", 227, NULL, OPTION_NO_USAGE, "Write a trace of all "
+		        "profiling blocks (implies --profile)"},
+		{"metrics-file", 228, "fn", OPTION_NO_USAGE, "Write processing metrics "
+		        "to this file while running"},
+		{"metrics-interval", 229, "s", OPTION_NO_USAGE, "Update the metrics file "
+		        "this often (default 5 seconds)"},
+		{"stream-buffer", 230, "MiB", OPTION_NO_USAGE, "Pass stream data from "
+		        "workers via shared memory buffers of this size"},
 
 		{NULL, 0, 0, OPTION_DOC, "Peak search options:", 3},
 		{"peaks", 301, "method", 0, "Peak search method.  Default: zaef"},
@@ -949,6 +1021,11 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"mille-dir", 417, "dirname", OPTION_HIDDEN, "Save Millepede data in folder"},
 		{"max-mille-level", 418, "n", 0, "Maximum geometry refinement level"},
 		{"mille-file", 419, "filename", 0, "Filename for Millepede data (default mille-data.bin)"},
+		{"mille-compress", 422, NULL, 0, "Compress the Millepede data"},
+		{"race-indexers", 420, "n", 0,
+		        "Run up to n indexing methods concurrently for each frame"},
+		{"race-deadline", 421, "s", 0,
+		        "Time limit for higher-priority methods after one succeeds"},
 
 		{NULL, 0, 0, OPTION_DOC, "Integration options:", 5},
 		{"integration", 501, "method", OPTION_NO_USAGE, "Integration method"},
@@ -985,6 +1062,7 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"worker-id", 706, "id", OPTION_HIDDEN, "Worker process number"},
 		{"worker-tmpdir", 707, "dir", OPTION_HIDDEN, "Worker temporary dir"},
 		{"queue-semaphore", 708, "sem", OPTION_HIDDEN, "Queue semaphore name"},
+		{"ring-shm", 709, "n", OPTION_HIDDEN, "SHM name for stream buffers"},
 
 		{NULL, 0, 0, OPTION_DOC, "More information:", 99},
 
@@ -1035,6 +1113,7 @@ void cleanup_indexamajig_args(struct indexamajig_arguments *args)
 	free(args->prefix);
 	free(args->temp_location);
 	free(args->harvest_file);
+	free(args->metrics_file);
 	free(*args->taketwo_opts_ptr);
 	free(*args->felix_opts_ptr);
 	free(*args->xgandalf_opts_ptr);
@@ -1062,6 +1141,7 @@ void cleanup_indexamajig_args(struct indexamajig_arguments *args)
 	free(args->worker_tmpdir);
 	free(args->queue_sem);
 	free(args->shm_name);
+	free(args->ring_name);
 	for ( i=0; i<args->n_copy_headers; i++ ) {
 		free(args->copy_headers[i]);
 	}
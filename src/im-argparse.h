@@ -57,12 +57,17 @@ struct indexamajig_arguments
 	int if_multi;
 	int if_retry;
 	int profile;  /* Whether to do wall-clock time profiling */
+	int profile_trace;  /* Whether to record every profiling block */
+	char *metrics_file;
+	double metrics_interval;
+	int stream_buffer;  /* MiB per worker, or zero to use pipes */
 	int no_data_timeout;
 	char **copy_headers;
 	int n_copy_headers;
 	char *harvest_file;
 	char *milledir;
 	char *millefile;
+	int mille_compress;
 	int cpu_pin;
 	int worker;
 	int worker_id;
@@ -71,6 +76,7 @@ struct indexamajig_arguments
 	int fd_mille;
 	char *queue_sem;
 	char *shm_name;
+	char *ring_name;
 
 	struct taketwo_options **taketwo_opts_ptr;
 	struct felix_options **felix_opts_ptr;
@@ -0,0 +1,576 @@
+/*
+ * im-ring.c
+ *
+ * Shared memory ring buffers for stream output from workers
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <stream.h>
+#include <utils.h>
+
+#include "im-ring.h"
+
+
+/* Each worker has a ring of chunk records.  The worker is the only one to
+ * move 'head', and the sandbox is the only one to move 'tail', so no locking
+ * is needed.  A record is a 32-bit length followed by the data, and may wrap
+ * around the end of the ring.  A chunk which is too big for the ring is split
+ * into several records, all but the last of which have RECORD_MORE set. */
+
+#define RECORD_MORE (0x80000000u)
+#define RECORD_LEN_MASK (0x7fffffffu)
+#define RECORD_HDR (sizeof(uint32_t))
+
+struct ring_header
+{
+	uint64_t head;
+	char pad1[56];
+	uint64_t tail;
+	char pad2[56];
+};
+
+struct rings_shm
+{
+	uint64_t n_rings;
+	uint64_t ring_size;
+	char pad[48];
+	/* Followed by n_rings * (struct ring_header + ring_size bytes) */
+};
+
+
+static size_t shm_size(int n_rings, size_t ring_size)
+{
+	return sizeof(struct rings_shm)
+	         + n_rings*(sizeof(struct ring_header)+ring_size);
+}
+
+
+static struct ring_header *get_ring(struct rings_shm *shm, int slot)
+{
+	char *base = (char *)shm + sizeof(struct rings_shm);
+	return (struct ring_header *)(base + slot*(sizeof(struct ring_header)
+	                                           + shm->ring_size));
+}
+
+
+static char *ring_data(struct ring_header *r)
+{
+	return (char *)r + sizeof(struct ring_header);
+}
+
+
+static void ring_read(struct ring_header *r, size_t size, uint64_t pos,
+                      void *vdest, size_t len)
+{
+	char *dest = vdest;
+	size_t offs = pos % size;
+	size_t first = (len < size-offs) ? len : size-offs;
+	memcpy(dest, ring_data(r)+offs, first);
+	memcpy(dest+first, ring_data(r), len-first);
+}
+
+
+static void ring_write(struct ring_header *r, size_t size, uint64_t pos,
+                       const void *vsrc, size_t len)
+{
+	const char *src = vsrc;
+	size_t offs = pos % size;
+	size_t first = (len < size-offs) ? len : size-offs;
+	memcpy(ring_data(r)+offs, src, first);
+	memcpy(ring_data(r), src+first, len-first);
+}
+
+
+/* ------------------------------ Sandbox side ------------------------------ */
+
+struct im_rings
+{
+	char *name;
+	struct rings_shm *shm;
+	size_t size;
+
+	/* Chunks which arrived in several records, one per ring */
+	char **partial;
+	size_t *partial_len;
+	size_t *partial_max;
+
+	/* Everything from one call to im_rings_drain() */
+	char *batch;
+	size_t batch_len;
+	size_t batch_max;
+};
+
+
+static int append(char **buf, size_t *len, size_t *max, size_t add)
+{
+	if ( *len + add > *max ) {
+		size_t nmax = 2*(*len + add);
+		char *nbuf = realloc(*buf, nmax);
+		if ( nbuf == NULL ) return 1;
+		*buf = nbuf;
+		*max = nmax;
+	}
+	return 0;
+}
+
+
+struct im_rings *im_rings_create(int n_rings, size_t ring_size)
+{
+	struct im_rings *r;
+	char tmp[128];
+	int fd;
+
+	r = calloc(1, sizeof(struct im_rings));
+	if ( r == NULL ) return NULL;
+
+	/* Keep the records aligned with the cache lines */
+	ring_size = (ring_size + 63) & ~(size_t)63;
+	r->size = shm_size(n_rings, ring_size);
+
+	snprintf(tmp, 127, "/indexamajig.ring.%i", getpid());
+	fd = shm_open(tmp, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if ( fd == -1 ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		free(r);
+		return NULL;
+	}
+	r->name = strdup(tmp);
+
+	if ( ftruncate(fd, r->size) == -1 ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		close(fd);
+		shm_unlink(r->name);
+		free(r->name);
+		free(r);
+		return NULL;
+	}
+
+	r->shm = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( r->shm == MAP_FAILED ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		shm_unlink(r->name);
+		free(r->name);
+		free(r);
+		return NULL;
+	}
+
+	/* New SHM is zero-filled, so all the rings are empty */
+	r->shm->n_rings = n_rings;
+	r->shm->ring_size = ring_size;
+
+	r->partial = calloc(n_rings, sizeof(char *));
+	r->partial_len = calloc(n_rings, sizeof(size_t));
+	r->partial_max = calloc(n_rings, sizeof(size_t));
+	if ( (r->partial == NULL) || (r->partial_len == NULL)
+	  || (r->partial_max == NULL) )
+	{
+		im_rings_destroy(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+
+const char *im_rings_name(struct im_rings *r)
+{
+	return r->name;
+}
+
+
+static int drain_ring(struct im_rings *r, int slot)
+{
+	struct ring_header *ring = get_ring(r->shm, slot);
+	size_t size = r->shm->ring_size;
+	uint64_t head, tail;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	if ( head == tail ) return 0;
+
+	do {
+
+		while ( tail != head ) {
+
+			uint32_t hdr;
+			size_t len;
+
+			ring_read(ring, size, tail, &hdr, RECORD_HDR);
+			len = hdr & RECORD_LEN_MASK;
+
+			if ( (hdr & RECORD_MORE) || (r->partial_len[slot] > 0) ) {
+
+				if ( append(&r->partial[slot], &r->partial_len[slot],
+				            &r->partial_max[slot], len) ) return 1;
+				ring_read(ring, size, tail+RECORD_HDR,
+				          r->partial[slot]+r->partial_len[slot], len);
+				r->partial_len[slot] += len;
+
+				if ( !(hdr & RECORD_MORE) ) {
+					size_t plen = r->partial_len[slot];
+					if ( append(&r->batch, &r->batch_len,
+					            &r->batch_max, plen) ) return 1;
+					memcpy(r->batch+r->batch_len,
+					       r->partial[slot], plen);
+					r->batch_len += plen;
+					r->partial_len[slot] = 0;
+				}
+
+			} else {
+
+				if ( append(&r->batch, &r->batch_len,
+				            &r->batch_max, len) ) return 1;
+				ring_read(ring, size, tail+RECORD_HDR,
+				          r->batch+r->batch_len, len);
+				r->batch_len += len;
+
+			}
+
+			tail += RECORD_HDR + len;
+
+		}
+
+		/* Hand the space back.  If the worker added something in the
+		 * meantime, it will see this and not ring the doorbell, so
+		 * look again. */
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+	} while ( head != tail );
+
+	return 0;
+}
+
+
+/* Writes all the complete chunks from all the rings to fh, in one go.
+ * Returns the number of bytes written. */
+size_t im_rings_drain(struct im_rings *r, FILE *fh)
+{
+	int i;
+	size_t len;
+
+	r->batch_len = 0;
+	for ( i=0; i<r->shm->n_rings; i++ ) {
+		if ( drain_ring(r, i) ) {
+			ERROR("Failed to allocate memory for stream data\n");
+			break;
+		}
+	}
+
+	if ( r->batch_len == 0 ) return 0;
+
+	len = fwrite(r->batch, 1, r->batch_len, fh);
+	fflush(fh);
+	return len;
+}
+
+
+/* Call when the worker using this ring has died, after draining it */
+void im_rings_reset(struct im_rings *r, int slot)
+{
+	if ( r->partial_len[slot] > 0 ) {
+		ERROR("WARNING: Discarding %lli bytes of incomplete chunk.\n",
+		      (long long)r->partial_len[slot]);
+	}
+	r->partial_len[slot] = 0;
+}
+
+
+/* Bytes in the rings, plus incomplete chunks which have been taken out */
+long long im_rings_backlog(struct im_rings *r)
+{
+	int i;
+	long long total = 0;
+
+	for ( i=0; i<r->shm->n_rings; i++ ) {
+		struct ring_header *ring = get_ring(r->shm, i);
+		total += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+		total += r->partial_len[i];
+	}
+
+	return total;
+}
+
+
+void im_rings_destroy(struct im_rings *r)
+{
+	int i;
+
+	if ( r == NULL ) return;
+
+	if ( r->partial != NULL ) {
+		for ( i=0; i<r->shm->n_rings; i++ ) free(r->partial[i]);
+	}
+	free(r->partial);
+	free(r->partial_len);
+	free(r->partial_max);
+	free(r->batch);
+	munmap(r->shm, r->size);
+	shm_unlink(r->name);
+	free(r->name);
+	free(r);
+}
+
+
+/* ------------------------------ Worker side ------------------------------- */
+
+struct im_ring_writer
+{
+	struct rings_shm *shm;
+	size_t map_size;
+	struct ring_header *ring;
+	uint64_t head;
+	int doorbell_fd;
+	FILE *fh;
+
+	/* Data written to fh, not yet in the ring */
+	char *pending;
+	size_t pending_len;
+	size_t pending_max;
+	size_t pending_pos;      /* Start of what's left to send */
+	size_t complete;         /* End of the last complete chunk */
+	size_t split_end;        /* End of the chunk being sent in pieces */
+};
+
+
+/* Stream data arrives here, usually one chunk at a time thanks to the
+ * fflush() at the end of stream_write_chunk(), but possibly in pieces. */
+static ssize_t writer_write(void *vp, const char *buf, size_t size)
+{
+	struct im_ring_writer *w = vp;
+	const char *marker = STREAM_CHUNK_END_MARKER"\n";
+	size_t mlen = strlen(marker);
+	size_t search;
+	char *end;
+
+	if ( append(&w->pending, &w->pending_len, &w->pending_max, size) ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(w->pending+w->pending_len, buf, size);
+
+	/* The marker might straddle the previous write */
+	search = (w->pending_len > mlen) ? w->pending_len - mlen : 0;
+	if ( search < w->complete ) search = w->complete;
+	w->pending_len += size;
+
+	while ( (end = memmem(w->pending+search, w->pending_len-search,
+	                      marker, mlen)) != NULL )
+	{
+		w->complete = end - w->pending + mlen;
+		search = w->complete;
+	}
+
+	return size;
+}
+
+
+struct im_ring_writer *im_ring_writer_open(const char *name, int slot,
+                                           int doorbell_fd)
+{
+	struct im_ring_writer *w;
+	struct rings_shm *hdr;
+	cookie_io_functions_t funcs = { NULL, writer_write, NULL, NULL };
+	int fd;
+
+	w = calloc(1, sizeof(struct im_ring_writer));
+	if ( w == NULL ) return NULL;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if ( fd == -1 ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	/* Find the size first */
+	hdr = mmap(NULL, sizeof(struct rings_shm), PROT_READ, MAP_SHARED, fd, 0);
+	if ( hdr == MAP_FAILED ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		close(fd);
+		free(w);
+		return NULL;
+	}
+	w->map_size = shm_size(hdr->n_rings, hdr->ring_size);
+	if ( slot >= hdr->n_rings ) {
+		ERROR("No ring buffer for worker %i\n", slot);
+		munmap(hdr, sizeof(struct rings_shm));
+		close(fd);
+		free(w);
+		return NULL;
+	}
+	munmap(hdr, sizeof(struct rings_shm));
+
+	w->shm = mmap(NULL, w->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	              fd, 0);
+	close(fd);
+	if ( w->shm == MAP_FAILED ) {
+		ERROR("Ring buffer setup failed: %s\n", strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	/* A previous worker in this slot might have left some chunks */
+	w->ring = get_ring(w->shm, slot);
+	w->head = w->ring->head;
+	w->doorbell_fd = doorbell_fd;
+
+	/* Never wait for the doorbell */
+	fcntl(doorbell_fd, F_SETFL, fcntl(doorbell_fd, F_GETFL) | O_NONBLOCK);
+
+	w->fh = fopencookie(w, "w", funcs);
+	if ( w->fh == NULL ) {
+		munmap(w->shm, w->map_size);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+
+/* The file handle to give to stream_open_fh_for_write().  It is closed by
+ * stream_close(), which must happen before im_ring_writer_close(). */
+FILE *im_ring_writer_fh(struct im_ring_writer *w)
+{
+	return w->fh;
+}
+
+
+static void push_record(struct im_ring_writer *w, size_t len, int more)
+{
+	uint32_t hdr = len | (more ? RECORD_MORE : 0);
+	size_t size = w->shm->ring_size;
+	uint64_t old_head = w->head;
+
+	ring_write(w->ring, size, w->head, &hdr, RECORD_HDR);
+	ring_write(w->ring, size, w->head+RECORD_HDR,
+	           w->pending+w->pending_pos, len);
+	w->head += RECORD_HDR + len;
+	w->pending_pos += len;
+
+	/* Publish, then wake the sandbox if it had already caught up */
+	__atomic_store_n(&w->ring->head, w->head, __ATOMIC_SEQ_CST);
+	if ( __atomic_load_n(&w->ring->tail, __ATOMIC_SEQ_CST) == old_head ) {
+		char c = 0;
+		if ( write(w->doorbell_fd, &c, 1) == -1 ) {
+			/* Doesn't matter - the sandbox will look anyway */
+		}
+	}
+}
+
+
+/* Moves as many complete chunks as possible into the ring.  Never waits.
+ * Returns non-zero if something is still waiting for space. */
+int im_ring_writer_flush(struct im_ring_writer *w)
+{
+	size_t size = w->shm->ring_size;
+
+	while ( w->pending_pos < w->complete ) {
+
+		uint64_t tail = __atomic_load_n(&w->ring->tail, __ATOMIC_ACQUIRE);
+		size_t space = size - (w->head - tail);
+		char *end;
+		size_t chunk_len;
+
+		/* A piece can end in the middle of the end marker, so the
+		 * rest of a split chunk can't be found by looking for it */
+		if ( w->split_end > w->pending_pos ) {
+			chunk_len = w->split_end - w->pending_pos;
+		} else {
+			end = memmem(w->pending+w->pending_pos,
+			             w->complete-w->pending_pos,
+			             STREAM_CHUNK_END_MARKER"\n",
+			             strlen(STREAM_CHUNK_END_MARKER"\n"));
+			chunk_len = end - (w->pending+w->pending_pos)
+			              + strlen(STREAM_CHUNK_END_MARKER"\n");
+		}
+
+		if ( chunk_len + RECORD_HDR <= space ) {
+			push_record(w, chunk_len, 0);
+		} else if ( chunk_len + RECORD_HDR <= size ) {
+			/* Will fit when the sandbox catches up */
+			break;
+		} else if ( space > RECORD_HDR ) {
+			/* Will never fit, so send it in pieces */
+			w->split_end = w->pending_pos + chunk_len;
+			push_record(w, space - RECORD_HDR, 1);
+		} else {
+			break;
+		}
+
+	}
+
+	if ( w->pending_pos == w->pending_len ) {
+		w->pending_pos = 0;
+		w->pending_len = 0;
+		w->complete = 0;
+		w->split_end = 0;
+	} else if ( w->pending_pos > w->pending_max/2 ) {
+		memmove(w->pending, w->pending+w->pending_pos,
+		        w->pending_len-w->pending_pos);
+		w->pending_len -= w->pending_pos;
+		w->complete -= w->pending_pos;
+		if ( w->split_end > w->pending_pos ) {
+			w->split_end -= w->pending_pos;
+		} else {
+			w->split_end = 0;
+		}
+		w->pending_pos = 0;
+	}
+
+	return w->pending_pos < w->complete;
+}
+
+
+void im_ring_writer_close(struct im_ring_writer *w)
+{
+	if ( w == NULL ) return;
+
+	while ( im_ring_writer_flush(w) ) {
+		notify_alive();
+		usleep(1000);
+	}
+
+	if ( w->pending_len > 0 ) {
+		ERROR("WARNING: %lli bytes of incomplete chunk not sent.\n",
+		      (long long)w->pending_len);
+	}
+
+	munmap(w->shm, w->map_size);
+	free(w->pending);
+	free(w);
+}
@@ -0,0 +1,46 @@
+/*
+ * im-ring.h
+ *
+ * Shared memory ring buffers for stream output from workers
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_RING_H
+#define IM_RING_H
+
+#include <stdio.h>
+
+/* Sandbox side */
+extern struct im_rings *im_rings_create(int n_rings, size_t ring_size);
+extern const char *im_rings_name(struct im_rings *r);
+extern size_t im_rings_drain(struct im_rings *r, FILE *fh);
+extern void im_rings_reset(struct im_rings *r, int slot);
+extern long long im_rings_backlog(struct im_rings *r);
+extern void im_rings_destroy(struct im_rings *r);
+
+/* Worker side */
+extern struct im_ring_writer *im_ring_writer_open(const char *name, int slot,
+                                                  int doorbell_fd);
+extern FILE *im_ring_writer_fh(struct im_ring_writer *w);
+extern int im_ring_writer_flush(struct im_ring_writer *w);
+extern void im_ring_writer_close(struct im_ring_writer *w);
+
+#endif /* IM_RING_H */
@@ -54,6 +54,8 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <semaphore.h>
@@ -71,7 +73,9 @@
 #include "im-zmq.h"
 #include "profile.h"
 #include "im-asapo.h"
+#include "im-ring.h"
 #include "predict-refine.h"
+#include "crystfel-mille.h"
 
 
 typedef struct
@@ -109,11 +113,23 @@ struct sandbox
 	int warned_long_running[MAX_NUM_WORKERS];
 	int profile;  /* Whether to do wall-clock time profiling */
 	int cpu_pin;
+	int n_restarts;
+
+	/* Metrics file, if any */
+	const char *metrics_file;
+	double metrics_interval;
+	double t_start;
+	double t_last_metrics;
+	int n_processed_last_metrics;
 
 	/* Streams to read from (NB not the same indices as the above) */
 	PipeList *st_from_workers;
 	PipeList *mille_from_workers;
 
+	/* If non-NULL, stream data comes through these instead, and the stream
+	 * pipes are only used to wake us up */
+	struct im_rings *rings;
+
 	int serial;
 
 	struct sb_shm *shared;
@@ -149,11 +165,11 @@ struct get_pattern_ctx
 
 #ifdef HAVE_CLOCK_GETTIME
 
-time_t get_monotonic_seconds()
+static double get_monotonic_time()
 {
 	struct timespec tp;
 	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec;
+	return tp.tv_sec + tp.tv_nsec*1e-9;
 }
 
 #else
@@ -161,16 +177,22 @@ time_t get_monotonic_seconds()
 /* Fallback version of the above.  The time according to gettimeofday() is not
  * monotonic, so measuring intervals based on it will screw up if there's a
  * timezone change (e.g. daylight savings) while the program is running. */
-time_t get_monotonic_seconds()
+static double get_monotonic_time()
 {
 	struct timeval tp;
 	gettimeofday(&tp, NULL);
-	return tp.tv_sec;
+	return tp.tv_sec + tp.tv_usec*1e-6;
 }
 
 #endif
 
 
+time_t get_monotonic_seconds()
+{
+	return (time_t)get_monotonic_time();
+}
+
+
 static void stamp_response(struct sandbox *sb, int n)
 {
 	sb->last_response[n] = get_monotonic_seconds();
@@ -383,23 +405,15 @@ static size_t pump_chunk(void *buf, size_t len, struct sandbox *sb)
 }
 
 
-static size_t pump_mille(void *buf, size_t len, struct sandbox *sb)
+static size_t pump_doorbell(void *buf, size_t len, struct sandbox *sb)
 {
-	int n;
-	int ni;
-	size_t reclen;
-
-	if ( len < sizeof(int) ) return 0;
-	ni = *(int *)buf;
-	n = (ni-2)/2;
-
-	reclen = (2+n)*sizeof(int) + (1+n)*sizeof(float);
-	if ( len < reclen ) return 0;
+	return len;
+}
 
-	fwrite(buf, 1, reclen, sb->mille_fh);
-	fflush(sb->mille_fh);
 
-	return reclen;
+static size_t pump_mille(void *buf, size_t len, struct sandbox *sb)
+{
+	return crystfel_mille_pump(buf, len, sb->mille_fh);
 }
 
 
@@ -590,7 +604,12 @@ static void check_pipes(PipeList *pd, size_t(*pump)(void *, size_t len, struct s
 
 static void try_read(struct sandbox *sb)
 {
-	check_pipes(sb->st_from_workers, pump_chunk, sb);
+	if ( sb->rings != NULL ) {
+		check_pipes(sb->st_from_workers, pump_doorbell, sb);
+		im_rings_drain(sb->rings, stream_get_fh(sb->stream));
+	} else {
+		check_pipes(sb->st_from_workers, pump_chunk, sb);
+	}
 	check_pipes(sb->mille_from_workers, pump_mille, sb);
 }
 
@@ -631,13 +650,14 @@ static void start_worker_process(struct sandbox *sb, int slot)
 	sb->shared->pings[slot] = 0;
 	sb->last_ping[slot] = 0;
 	sb->shared->time_last_start[slot] = get_monotonic_seconds();
+	sb->shared->time_task_start[slot] = sb->shared->time_last_start[slot];
 	pthread_mutex_unlock(&sb->shared->debug_lock);
 
 	sb->warned_long_running[slot] = 0;
 
 	/* Set up nargv including "new" args */
 	nargc = 0;
-	nargv = malloc((sb->argc+16)*sizeof(char *));
+	nargv = malloc((sb->argc+20)*sizeof(char *));
 	if ( nargv == NULL ) return;
 	for ( i=0; i<sb->argc; i++ ) {
 		nargv[nargc++] = sb->argv[i];
@@ -649,6 +669,11 @@ static void start_worker_process(struct sandbox *sb, int slot)
 	nargv[nargc++] = "--queue-sem";
 	nargv[nargc++] = sb->sem_name;
 
+	if ( sb->rings != NULL ) {
+		nargv[nargc++] = "--ring-shm";
+		nargv[nargc++] = (char *)im_rings_name(sb->rings);
+	}
+
 	nargv[nargc++] = "--worker-tmpdir";
 	len = 64 + strlen(sb->tmpdir);
 	tmpdir = malloc(len);
@@ -807,7 +832,16 @@ static void handle_zombie(struct sandbox *sb, int respawn)
 				       sb->shared->last_ev[i]);
 				STATUS("Task ID was: %s\n",
 				       sb->shared->last_task[i]);
-				if ( respawn ) start_worker_process(sb, i);
+				if ( sb->rings != NULL ) {
+					/* Keep the chunks it finished */
+					im_rings_drain(sb->rings,
+					               stream_get_fh(sb->stream));
+					im_rings_reset(sb->rings, i);
+				}
+				if ( respawn ) {
+					start_worker_process(sb, i);
+					sb->n_restarts++;
+				}
 			}
 
 		}
@@ -965,6 +999,7 @@ static void check_signals(struct sandbox *sb, int respawn)
 	if ( at_interrupt ) {
 		sem_unlink(sb->sem_name);
 		shm_unlink(sb->shm_name);
+		if ( sb->rings != NULL ) shm_unlink(im_rings_name(sb->rings));
 		exit(0);
 	}
 
@@ -1024,6 +1059,333 @@ static void try_status(struct sandbox *sb, int final)
 }
 
 
+/* Bytes waiting in the pipes from the workers, including incomplete chunks
+ * already read into our buffers */
+static long long pipe_backlog(PipeList *pd)
+{
+	int i;
+	long long total = 0;
+
+	for ( i=0; i<pd->n_read; i++ ) {
+		int n;
+		if ( ioctl(pd->fds[i], FIONREAD, &n) == 0 ) total += n;
+		total += pd->buffer_pos[i];
+	}
+
+	return total;
+}
+
+
+struct metrics
+{
+	double uptime;
+	double rate;
+	double rate_overall;
+	int n_processed;
+	int n_hits;
+	int n_hadcrystals;
+	int n_crystals;
+	int queue_depth;
+	int n_running;
+	long long stream_backlog;
+	long long mille_backlog;
+	char task[MAX_NUM_WORKERS][MAX_TASK_LEN];
+	time_t time_in_task[MAX_NUM_WORKERS];
+	time_t time_on_frame[MAX_NUM_WORKERS];
+};
+
+
+static void write_prom(FILE *fh, const char *name, const char *type,
+                       const char *help, double val)
+{
+	fprintf(fh, "# HELP indexamajig_%s %s\n", name, help);
+	fprintf(fh, "# TYPE indexamajig_%s %s\n", name, type);
+	fprintf(fh, "indexamajig_%s %.10g\n", name, val);
+}
+
+
+/* Writes a task label as the inside of a quoted string.  Backslash, double
+ * quote and newline need escaping in both formats, and JSON doesn't allow any
+ * other control characters either. */
+static void write_label(FILE *fh, const char *label, int json)
+{
+	const char *p;
+
+	for ( p=label; *p!='\0'; p++ ) {
+		unsigned char c = *p;
+		if ( (c == '"') || (c == '\\') ) {
+			fputc('\\', fh);
+			fputc(c, fh);
+		} else if ( c == '\n' ) {
+			fputs("\\n", fh);
+		} else if ( json && (c < 0x20) ) {
+			fprintf(fh, "\\u%04x", c);
+		} else {
+			fputc(c, fh);
+		}
+	}
+}
+
+
+/* Prometheus text format, suitable for node_exporter's textfile collector */
+static void write_metrics_prometheus(FILE *fh, struct sandbox *sb,
+                                     struct metrics *m)
+{
+	int i;
+
+	write_prom(fh, "uptime_seconds", "gauge",
+	           "Time since processing started", m->uptime);
+	write_prom(fh, "frames_processed_total", "counter",
+	           "Frames processed", m->n_processed);
+	write_prom(fh, "hits_total", "counter",
+	           "Frames which were hits", m->n_hits);
+	write_prom(fh, "indexed_frames_total", "counter",
+	           "Frames with at least one crystal", m->n_hadcrystals);
+	write_prom(fh, "crystals_total", "counter",
+	           "Crystals found", m->n_crystals);
+	write_prom(fh, "frames_per_second", "gauge",
+	           "Processing rate since the last update", m->rate);
+	write_prom(fh, "frames_per_second_overall", "gauge",
+	           "Processing rate since the start", m->rate_overall);
+	write_prom(fh, "hit_ratio", "gauge", "Fraction of frames which "
+	           "were hits", m->n_processed ? (double)m->n_hits/m->n_processed : 0.0);
+	write_prom(fh, "indexing_ratio", "gauge", "Fraction of hits which "
+	           "were indexed", m->n_hits ? (double)m->n_hadcrystals/m->n_hits : 0.0);
+	write_prom(fh, "queue_depth", "gauge",
+	           "Events waiting in the queue", m->queue_depth);
+	write_prom(fh, "stream_backlog_bytes", "gauge",
+	           "Stream data from workers not yet written", m->stream_backlog);
+	write_prom(fh, "mille_backlog_bytes", "gauge",
+	           "Millepede data from workers not yet written", m->mille_backlog);
+	write_prom(fh, "workers_running", "gauge",
+	           "Worker processes running", m->n_running);
+	write_prom(fh, "worker_restarts_total", "counter",
+	           "Worker processes restarted after crashing", sb->n_restarts);
+
+	fprintf(fh, "# HELP indexamajig_worker_task_seconds Time spent in "
+	            "the current task, labelled with the task\n");
+	fprintf(fh, "# TYPE indexamajig_worker_task_seconds gauge\n");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		fprintf(fh, "indexamajig_worker_task_seconds{worker=\"%i\","
+		        "task=\"", i);
+		write_label(fh, m->task[i], 0);
+		fprintf(fh, "\"} %lli\n", (long long)m->time_in_task[i]);
+	}
+
+	fprintf(fh, "# HELP indexamajig_worker_frame_seconds Time spent on "
+	            "the current frame\n");
+	fprintf(fh, "# TYPE indexamajig_worker_frame_seconds gauge\n");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		fprintf(fh, "indexamajig_worker_frame_seconds{worker=\"%i\"} "
+		        "%lli\n", i, (long long)m->time_on_frame[i]);
+	}
+}
+
+
+static void write_metrics_json(FILE *fh, struct sandbox *sb,
+                               struct metrics *m, int final)
+{
+	int i;
+	int first = 1;
+
+	fprintf(fh, "{\"final\": %s,\n", final ? "true" : "false");
+	fprintf(fh, " \"uptime_seconds\": %.1f,\n", m->uptime);
+	fprintf(fh, " \"frames_processed\": %i,\n", m->n_processed);
+	fprintf(fh, " \"hits\": %i,\n", m->n_hits);
+	fprintf(fh, " \"indexed_frames\": %i,\n", m->n_hadcrystals);
+	fprintf(fh, " \"crystals\": %i,\n", m->n_crystals);
+	fprintf(fh, " \"frames_per_second\": %.2f,\n", m->rate);
+	fprintf(fh, " \"frames_per_second_overall\": %.2f,\n",
+	        m->rate_overall);
+	fprintf(fh, " \"queue_depth\": %i,\n", m->queue_depth);
+	fprintf(fh, " \"stream_backlog_bytes\": %lli,\n", m->stream_backlog);
+	fprintf(fh, " \"mille_backlog_bytes\": %lli,\n", m->mille_backlog);
+	fprintf(fh, " \"workers_running\": %i,\n", m->n_running);
+	fprintf(fh, " \"worker_restarts\": %i,\n", sb->n_restarts);
+	fprintf(fh, " \"workers\": [");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		fprintf(fh, "%s\n  {\"worker\": %i, \"task\": \"",
+		        first ? "" : ",", i);
+		write_label(fh, m->task[i], 1);
+		fprintf(fh, "\", \"task_seconds\": %lli, "
+		        "\"frame_seconds\": %lli}",
+		        (long long)m->time_in_task[i],
+		        (long long)m->time_on_frame[i]);
+		first = 0;
+	}
+	fprintf(fh, "]}\n");
+}
+
+
+static void try_metrics(struct sandbox *sb, int final)
+{
+	struct metrics m;
+	double tnow;
+	time_t tnow_s;
+	char *tmp;
+	size_t len;
+	FILE *fh;
+	int i;
+
+	if ( sb->metrics_file == NULL ) return;
+
+	tnow = get_monotonic_time();
+	if ( !final && (tnow - sb->t_last_metrics < sb->metrics_interval) ) {
+		return;
+	}
+
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	m.n_processed = sb->shared->n_processed;
+	m.n_hits = sb->shared->n_hits;
+	m.n_hadcrystals = sb->shared->n_hadcrystals;
+	m.n_crystals = sb->shared->n_crystals;
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	pthread_mutex_lock(&sb->shared->queue_lock);
+	m.queue_depth = sb->shared->n_events;
+	pthread_mutex_unlock(&sb->shared->queue_lock);
+
+	tnow_s = tnow;
+	m.n_running = 0;
+	pthread_mutex_lock(&sb->shared->debug_lock);
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		m.n_running++;
+		memcpy(m.task[i], sb->shared->last_task[i], MAX_TASK_LEN);
+		m.task[i][MAX_TASK_LEN-1] = '\0';
+		m.time_in_task[i] = tnow_s - sb->shared->time_task_start[i];
+		m.time_on_frame[i] = tnow_s - sb->shared->time_last_start[i];
+	}
+	pthread_mutex_unlock(&sb->shared->debug_lock);
+
+	m.uptime = tnow - sb->t_start;
+	m.rate = 0.0;
+	if ( tnow > sb->t_last_metrics ) {
+		m.rate = (m.n_processed - sb->n_processed_last_metrics)
+		             / (tnow - sb->t_last_metrics);
+	}
+	m.rate_overall = 0.0;
+	if ( m.uptime > 0.0 ) m.rate_overall = m.n_processed / m.uptime;
+	if ( sb->rings != NULL ) {
+		m.stream_backlog = im_rings_backlog(sb->rings);
+	} else {
+		m.stream_backlog = pipe_backlog(sb->st_from_workers);
+	}
+	m.mille_backlog = pipe_backlog(sb->mille_from_workers);
+
+	sb->t_last_metrics = tnow;
+	sb->n_processed_last_metrics = m.n_processed;
+
+	/* Written to a new file and renamed, so that the file is never seen
+	 * half-written */
+	len = strlen(sb->metrics_file)+16;
+	tmp = malloc(len);
+	if ( tmp == NULL ) return;
+	snprintf(tmp, len, "%s.%i.tmp", sb->metrics_file, getpid());
+
+	fh = fopen(tmp, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to write metrics file %s: %s\n",
+		      tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	len = strlen(sb->metrics_file);
+	if ( (len > 5) && (strcmp(sb->metrics_file+len-5, ".json") == 0) ) {
+		write_metrics_json(fh, sb, &m, final);
+	} else {
+		write_metrics_prometheus(fh, sb, &m);
+	}
+
+	fclose(fh);
+	if ( rename(tmp, sb->metrics_file) ) {
+		ERROR("Failed to update metrics file %s: %s\n",
+		      sb->metrics_file, strerror(errno));
+	}
+	free(tmp);
+}
+
+
+/* Collect the profiling results from all the worker processes, including
+ * any which were replaced after crashing */
+static void merge_profiles(const char *tmpdir, int n_proc)
+{
+	ProfileSummary *ps;
+	char **traces = NULL;
+	int n_traces = 0;
+	int slot;
+	int i;
+
+	ps = profile_summary_new();
+	if ( ps == NULL ) return;
+
+	for ( slot=0; slot<n_proc; slot++ ) {
+
+		char workerdir[4096];
+		char path[4352];
+		DIR *d;
+		struct dirent *ent;
+
+		snprintf(workerdir, 4096, "%s/worker.%i", tmpdir, slot);
+		d = opendir(workerdir);
+		if ( d == NULL ) continue;
+
+		while ( (ent = readdir(d)) != NULL ) {
+
+			size_t len = strlen(ent->d_name);
+
+			snprintf(path, 4352, "%s/%s", workerdir, ent->d_name);
+
+			if ( (strncmp(ent->d_name, "profile.", 8) == 0)
+			  && (len > 4)
+			  && (strcmp(ent->d_name+len-4, ".dat") == 0) )
+			{
+				profile_summary_add_file(ps, path);
+				unlink(path);
+			}
+
+			if ( (strncmp(ent->d_name, "trace.", 6) == 0)
+			  && (len > 5)
+			  && (strcmp(ent->d_name+len-5, ".json") == 0) )
+			{
+				char **nt;
+				nt = realloc(traces, (n_traces+1)*sizeof(char *));
+				if ( nt == NULL ) continue;
+				traces = nt;
+				traces[n_traces++] = strdup(path);
+			}
+
+		}
+
+		closedir(d);
+
+	}
+
+	if ( profile_summary_write_json(ps, "indexamajig-profile.json") == 0 ) {
+		STATUS("Profiling results written to indexamajig-profile.json\n");
+	}
+	profile_summary_free(ps);
+
+	if ( n_traces > 0 ) {
+		if ( profile_merge_traces("indexamajig-trace.json",
+		                          traces, n_traces) == 0 )
+		{
+			STATUS("Profiling trace written to "
+			       "indexamajig-trace.json\n");
+		}
+		for ( i=0; i<n_traces; i++ ) {
+			unlink(traces[i]);
+			free(traces[i]);
+		}
+		free(traces);
+	}
+}
+
+
 static void delete_temporary_folder(const char *tmpdir, int n_proc)
 {
 	int slot;
@@ -1150,7 +1512,9 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
                    struct im_asapo_params *asapo_params,
                    int timeout, int profile, int cpu_pin,
                    int no_data_timeout, int argc, char *argv[],
-                   const char *probed_methods, FILE *mille_fh)
+                   const char *probed_methods, FILE *mille_fh,
+                   const char *metrics_file, double metrics_interval,
+                   int stream_buffer)
 {
 	int i;
 	struct sandbox *sb;
@@ -1203,6 +1567,10 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->argv = argv;
 	sb->probed_methods = probed_methods;
 	sb->mille_fh = mille_fh;
+	sb->metrics_file = metrics_file;
+	sb->metrics_interval = metrics_interval;
+	sb->t_start = get_monotonic_time();
+	sb->t_last_metrics = sb->t_start;
 
 	if ( zmq_params->addr != NULL ) {
 		sb->zmq_params = zmq_params;
@@ -1226,6 +1594,13 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->mille_from_workers = pipe_list_new();
 	sb->stream = stream;
 
+	if ( stream_buffer > 0 ) {
+		sb->rings = im_rings_create(n_proc, (size_t)stream_buffer*1024*1024);
+		if ( sb->rings == NULL ) {
+			ERROR("Falling back on pipes for stream data.\n");
+		}
+	}
+
 	gpctx.fh = fh;
 	gpctx.use_basename = config_basename;
 	gpctx.dtempl = iargs->dtempl;
@@ -1333,6 +1708,7 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 		/* Update progress */
 		try_status(sb, 0);
+		try_metrics(sb, 0);
 
 		/* Begin exit criterion checking */
 		pthread_mutex_lock(&sb->shared->queue_lock);
@@ -1382,6 +1758,7 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 			check_signals(sb, 0);
 			check_hung_workers(sb);
 			try_status(sb, 0);
+			try_metrics(sb, 0);
 		}
 		/* If this worker died and got waited by the zombie handler,
 		 * waitpid() returns -1 and the loop still exits. */
@@ -1394,11 +1771,20 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		} while ( any_open(sb) );
 	}
 
+	if ( sb->rings != NULL ) {
+		/* The workers fill the buffers before closing their pipes */
+		im_rings_drain(sb->rings, stream_get_fh(sb->stream));
+		for ( i=0; i<n_proc; i++ ) im_rings_reset(sb->rings, i);
+	}
+
+	try_metrics(sb, 1);
+
 	sem_unlink(semname_q);
 	sem_close(sb->queue_sem);
 
 	pipe_list_destroy(sb->st_from_workers);
 	pipe_list_destroy(sb->mille_from_workers);
+	im_rings_destroy(sb->rings);
 	free(sb->running);
 	free(sb->last_response);
 	free(sb->pids);
@@ -1407,6 +1793,7 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	if ( sb->shared->n_processed == 0 ) r = 5;
 	if ( sb->shared->should_shutdown ) r = 1;
 
+	if ( sb->profile ) merge_profiles(sb->tmpdir, n_proc);
 	delete_temporary_folder(sb->tmpdir, n_proc);
 
 	shm_unlink(sb->shm_name);
@@ -72,6 +72,7 @@ struct sb_shm
 	char last_task[MAX_NUM_WORKERS][MAX_TASK_LEN];
 	int pings[MAX_NUM_WORKERS];
 	time_t time_last_start[MAX_NUM_WORKERS];
+	time_t time_task_start[MAX_NUM_WORKERS];
 
 	pthread_mutex_t totals_lock;
 	int n_processed;
@@ -92,6 +93,8 @@ extern int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
                           struct im_asapo_params *asapo_params,
                           int timeout, int profile, int cpu_pin,
                           int no_data_timeout, int argc, char *argv[],
-                          const char *probed_methods, FILE *mille_fh);
+                          const char *probed_methods, FILE *mille_fh,
+                          const char *metrics_file, double metrics_interval,
+                          int stream_buffer);
 
 #endif /* IM_SANDBOX_H */
@@ -81,6 +81,7 @@
 #include "im-argparse.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-ring.h"
 #include "version.h"
 #include "profile.h"
 
@@ -296,6 +297,7 @@ static void set_last_task_sandbox(const char *task, void *vp)
 	assert(strlen(task) < MAX_TASK_LEN-1);
 	pthread_mutex_lock(&db->shared->debug_lock);
 	strcpy(db->shared->last_task[db->worker], task);
+	db->shared->time_task_start[db->worker] = get_monotonic_seconds();
 	pthread_mutex_unlock(&db->shared->debug_lock);
 }
 
@@ -324,13 +326,32 @@ static int run_work(struct indexamajig_arguments *args)
 	struct pf8_private_data *pf8_data = NULL;
 	struct indexamajig_debug_data debugdata;
 	struct sb_shm *shared;
+	struct im_ring_writer *ring = NULL;
 
 	if ( args->cpu_pin ) pin_to_cpu(args->worker_id);
 
-	st = stream_open_fd_for_write(args->fd_stream, args->iargs.dtempl);
+	if ( args->ring_name != NULL ) {
+		/* The stream pipe just becomes a doorbell */
+		ring = im_ring_writer_open(args->ring_name, args->worker_id,
+		                           args->fd_stream);
+		if ( ring == NULL ) return 1;
+		st = stream_open_fh_for_write(im_ring_writer_fh(ring),
+		                              args->iargs.dtempl);
+	} else {
+		st = stream_open_fd_for_write(args->fd_stream, args->iargs.dtempl);
+	}
 
 	if ( args->profile ) {
-		profile_init();
+		char stats_fn[1024];
+		char trace_fn[1024];
+		/* Named by PID, so that a replacement worker doesn't overwrite
+		 * the results.  The sandbox merges them all at the end. */
+		snprintf(stats_fn, 1024, "%s/profile.%i.dat",
+		         args->worker_tmpdir, getpid());
+		snprintf(trace_fn, 1024, "%s/trace.%i.json",
+		         args->worker_tmpdir, getpid());
+		profile_init(stats_fn, args->profile_trace ? trace_fn : NULL,
+		             args->worker_id);
 	}
 
 	/* Load unit cell (if given) */
@@ -381,6 +402,9 @@ static int run_work(struct indexamajig_arguments *args)
 		return 1;
 	}
 
+	indexing_set_race(args->iargs.ipriv, args->iargs.race_threads,
+	                  args->iargs.race_deadline);
+
 	if ( args->worker_id == 0 ) {
 
 		print_indexing_info(args->iargs.ipriv);
@@ -448,7 +472,15 @@ static int run_work(struct indexamajig_arguments *args)
 	debugdata.worker = args->worker_id;
 	set_debug_funcs(set_last_task_sandbox, notify_alive_sandbox, &debugdata);
 
-	mille = crystfel_mille_new_fd(args->fd_mille);
+	if ( args->iargs.mille ) {
+		mille = crystfel_mille_new_fd(args->fd_mille);
+		if ( (mille != NULL) && args->mille_compress ) {
+			/* Carries on uncompressed if this fails */
+			crystfel_mille_set_compression(mille, 1);
+		}
+	} else {
+		mille = NULL;
+	}
 
 	ida = image_data_arrays_new();
 
@@ -464,6 +496,16 @@ static int run_work(struct indexamajig_arguments *args)
 		int ok = 1;
 		int should_shutdown;
 
+		/* Don't take on more work until the sandbox has taken the
+		 * output from the last frame */
+		if ( ring != NULL ) {
+			set_last_task("wait_stream_buffer");
+			while ( im_ring_writer_flush(ring) ) {
+				notify_alive();
+				usleep(1000);
+			}
+		}
+
 		/* Wait until an event is ready */
 		notify_alive();
 		set_last_task("wait_event");
@@ -625,6 +667,9 @@ static int run_work(struct indexamajig_arguments *args)
 			              shared, asapostuff, mille, ida);
 			profile_end("process-image");
 
+			if ( ring != NULL ) im_ring_writer_flush(ring);
+			crystfel_mille_end_frame(mille);
+
 			if ( asapostuff != NULL ) {
 				im_asapo_finalise(asapostuff, ser);
 			}
@@ -636,15 +681,19 @@ static int run_work(struct indexamajig_arguments *args)
 		 * that it can be queried for "header" values etc.  They will
 		 * eventually be freed by image_free() under process_image(). */
 
-		if ( args->profile ) {
-			profile_print_and_reset(args->worker_id);
-		}
+		profile_flush();
 
 		free(pargs.filename);
 		free(pargs.event);
 	}
 
+	profile_finish();
+
 	stream_close(st);
+	if ( ring != NULL ) {
+		im_ring_writer_close(ring);
+		close(args->fd_stream);
+	}
 	munmap(shared, sizeof(struct sb_shm));
 	sem_close(queue_sem);
 
@@ -942,7 +991,9 @@ int main(int argc, char *argv[])
 	                   &args->zmq_params, &args->asapo_params,
 	                   timeout, args->profile, args->cpu_pin,
 	                   args->no_data_timeout, argc, argv,
-			   probed_methods, mille_fh);
+			   probed_methods, mille_fh,
+	                   args->metrics_file, args->metrics_interval,
+	                   args->stream_buffer);
 
 	fclose(mille_fh);
 	free(tmpdir);
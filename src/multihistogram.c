@@ -93,9 +93,9 @@ void multihistogram_free(MultiHistogram *hi)
 }
 
 
-void multihistogram_add_value(MultiHistogram *hi, double val, unsigned int cat)
+int multihistogram_get_bin(MultiHistogram *hi, double val)
 {
-	int i, j;
+	int j;
 
 	j = (val - hi->min) / hi->bin_width;
 
@@ -103,12 +103,30 @@ void multihistogram_add_value(MultiHistogram *hi, double val, unsigned int cat)
 	if ( j < 0 ) j = 0;
 	if ( j >= hi->n_bins ) j = hi->n_bins - 1;
 
+	return j;
+}
+
+
+/* Add n (which may be negative) to the given bin of each category in cat.
+ * Values can be moved between categories this way, without having to
+ * rebuild the whole histogram */
+void multihistogram_add_to_bin(MultiHistogram *hi, int bin, unsigned int cat,
+                               int n)
+{
+	int i;
+
 	for ( i=0; i<32; i++ ) {
-		if ( cat & (unsigned)1<<i ) hi->bins[i][j]++;
+		if ( cat & (unsigned)1<<i ) hi->bins[i][bin] += n;
 	}
 }
 
 
+void multihistogram_add_value(MultiHistogram *hi, double val, unsigned int cat)
+{
+	multihistogram_add_to_bin(hi, multihistogram_get_bin(hi, val), cat, 1);
+}
+
+
 int *multihistogram_get_data(MultiHistogram *hi, int cat)
 {
 	if ( cat < 0 ) return NULL;
@@ -42,6 +42,9 @@ extern void multihistogram_free(MultiHistogram *hi);
 extern void multihistogram_delete_all_values(MultiHistogram *hi);
 extern void multihistogram_add_value(MultiHistogram *hi, double val,
                                      unsigned int cat);
+extern int multihistogram_get_bin(MultiHistogram *hi, double val);
+extern void multihistogram_add_to_bin(MultiHistogram *hi, int bin,
+                                      unsigned int cat, int n);
 
 extern void multihistogram_set_min(MultiHistogram *hi, double min);
 extern void multihistogram_set_max(MultiHistogram *hi, double max);
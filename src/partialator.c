@@ -343,6 +343,7 @@ static void show_help(const char *s)
 "      --no-scale             Disable scale factor (G, B) refinement.\n"
 "      --no-Bscale            Disable B factor scaling.\n"
 "      --no-pr                Disable orientation/physics refinement.\n"
+"      --pr-optimiser=<opt>   Post-refinement optimiser: step (default) or bfgs.\n"
 "      --no-deltacchalf       Disable rejection based on deltaCChalf.\n"
 "  -m, --model=<model>        Specify partiality model.\n"
 "      --min-measurements=<n> Minimum number of measurements to require.\n"
@@ -1143,6 +1144,8 @@ int main(int argc, char *argv[])
 	int no_deltacchalf = 0;
 	char *harvest_file = NULL;
 	char *log_folder = "pr-logs";
+	char *pr_optimiser_str = NULL;
+	enum pr_optimiser pr_optimiser = PR_OPTIMISER_STEP;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -1178,6 +1181,7 @@ int main(int argc, char *argv[])
 		{"harvest-file",       1, NULL,               16},
 		{"log-folder",         1, NULL,               17},
 		{"unmerged-output",    1, NULL,               18},
+		{"pr-optimiser",       1, NULL,               19},
 
 		{"no-scale",           0, &no_scale,           1},
 		{"no-Bscale",          0, &no_Bscale,          1},
@@ -1375,6 +1379,10 @@ int main(int argc, char *argv[])
 			unmerged_filename = strdup(optarg);
 			break;
 
+			case 19 :
+			pr_optimiser_str = strdup(optarg);
+			break;
+
 			case 0 :
 			break;
 
@@ -1468,6 +1476,20 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if ( pr_optimiser_str != NULL ) {
+		if ( strcmp(pr_optimiser_str, "step") == 0 ) {
+			pr_optimiser = PR_OPTIMISER_STEP;
+		} else if ( strcmp(pr_optimiser_str, "bfgs") == 0 ) {
+			pr_optimiser = PR_OPTIMISER_BFGS;
+		} else {
+			ERROR("Unknown post-refinement optimiser '%s'.\n",
+			      pr_optimiser_str);
+			free(pr_optimiser_str);
+			return 1;
+		}
+		free(pr_optimiser_str);
+	}
+
 	if ( (pmodel == PMODEL_UNITY) && !no_pr ) {
 		no_pr = 1;
 		STATUS("Setting --no-pr because we are not modelling "
@@ -1764,7 +1786,7 @@ int main(int argc, char *argv[])
 		if ( !no_pr ) {
 			refine_all(crystals, images, n_crystals, full, nthreads, pmodel,
 			           itn+1, no_logs, sym, amb, scaleflags,
-			           log_folder);
+			           log_folder, pr_optimiser);
 		}
 
 		/* Create new reference if needed */
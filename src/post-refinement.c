@@ -66,6 +66,16 @@ struct rf_priv
 	Crystal *cr_tgt;         /**< Crystal to use for testing modifications */
 	struct image image_tgt;  /**< Image structure to go with cr_tgt */
 	RefList *refls;          /**< The reflections to use */
+
+	/* Prepared view of 'refls', in list order.  Only reflections which
+	 * can contribute to the residual are included, and everything which
+	 * does not change during the refinement is looked up only once. */
+	int n_refls;
+	Reflection **refl_ptrs;  /**< Reflections in 'refls' */
+	double *I_full;          /**< Merged intensities from 'full' */
+	double *res;             /**< Resolutions (1/2d) */
+	int *free_flag;          /**< Free flags */
+	double *I_obs;           /**< Observed (partial) intensities */
 };
 
 
@@ -173,6 +183,126 @@ static void apply_parameters(Crystal *cr_orig, Crystal *cr_tgt,
 }
 
 
+/* Builds the reflection list and the prepared view for 'pv', from 'list_in'.
+ * Reflections without a merged counterpart (or with redundancy less than 2)
+ * cannot contribute to the residual, so they are left out and will not have
+ * their predictions or partialities recalculated. */
+static int prepare_refls(struct rf_priv *pv, RefList *list_in)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	UnitCell *cell = crystal_get_cell(pv->cr);
+	int n = 0;
+
+	pv->n_refls = 0;
+	pv->refl_ptrs = NULL;
+	pv->I_full = NULL;
+	pv->res = NULL;
+	pv->free_flag = NULL;
+	pv->I_obs = NULL;
+
+	pv->refls = reflist_new();
+	if ( pv->refls == NULL ) return 1;
+
+	for ( refl = first_refl(list_in, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *match;
+		Reflection *rn;
+
+		get_indices(refl, &h, &k, &l);
+		match = find_refl(pv->full, h, k, l);
+		if ( match == NULL ) continue;
+		if ( get_redundancy(match) < 2 ) continue;
+
+		rn = add_refl(pv->refls, h, k, l);
+		copy_data(rn, refl);
+		n++;
+	}
+
+	pv->n_refls = n;
+	if ( n == 0 ) return 0;
+	pv->refl_ptrs = malloc(n*sizeof(Reflection *));
+	pv->I_full = malloc(n*sizeof(double));
+	pv->res = malloc(n*sizeof(double));
+	pv->free_flag = malloc(n*sizeof(int));
+	pv->I_obs = malloc(n*sizeof(double));
+	if ( (pv->refl_ptrs == NULL) || (pv->I_full == NULL)
+	  || (pv->res == NULL) || (pv->free_flag == NULL)
+	  || (pv->I_obs == NULL) ) return 1;
+
+	n = 0;
+	for ( refl = first_refl(pv->refls, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+
+		get_indices(refl, &h, &k, &l);
+		pv->refl_ptrs[n] = refl;
+		pv->I_full[n] = get_intensity(find_refl(pv->full, h, k, l));
+		pv->res[n] = resolution(cell, h, k, l);
+		pv->free_flag[n] = get_flag(refl);
+		pv->I_obs[n] = get_intensity(refl);
+		n++;
+	}
+
+	return 0;
+}
+
+
+static void free_prepared_refls(struct rf_priv *pv)
+{
+	reflist_free(pv->refls);
+	free(pv->refl_ptrs);
+	free(pv->I_full);
+	free(pv->res);
+	free(pv->free_flag);
+	free(pv->I_obs);
+}
+
+
+/* Same as residual() in merge.c, but using the prepared view */
+static double prepared_residual(struct rf_priv *pv, int free)
+{
+	int i;
+	double num = 0.0;
+	double den = 0.0;
+	double G = crystal_get_osf(pv->cr_tgt);
+	double B = crystal_get_Bfac(pv->cr_tgt);
+
+	for ( i=0; i<pv->n_refls; i++ ) {
+
+		double w, int1, pobs, pcalc;
+		Reflection *refl = pv->refl_ptrs[i];
+
+		if ( free != pv->free_flag[i] ) continue;
+
+		int1 = correct_reflection_nopart(pv->I_obs[i], refl, G, B,
+		                                 pv->res[i]);
+		pobs = int1 / pv->I_full[i];
+		if ( pobs > 1.0 ) pobs = 1.0;
+		if ( pobs < 0.0 ) pobs = 0.0;
+
+		pcalc = get_partiality(refl);
+
+		w = 1.0 / correct_reflection_nopart(1.0, refl, G, B,
+		                                    pv->res[i]);
+		if ( isnan(w) ) {
+			w = 0.0;
+		}
+
+		num += w*fabs(pobs-pcalc);
+		den += w;
+
+	}
+
+	return num/den;
+}
+
+
 static double calc_residual(struct rf_priv *pv, struct rf_alteration alter,
                             int free)
 {
@@ -197,8 +327,7 @@ static double calc_residual(struct rf_priv *pv, struct rf_alteration alter,
 	update_predictions(pv->refls, pv->cr_tgt, &pv->image_tgt);
 	calculate_partialities(pv->refls, pv->cr_tgt, &pv->image_tgt, pv->pmodel);
 
-
-	return residual(pv->refls, pv->cr_tgt, pv->full, free, NULL, NULL);
+	return prepared_residual(pv, free);
 }
 
 
@@ -460,7 +589,13 @@ static void write_angle_grid(RefList *list_in, Crystal *cr, struct image *image,
 	priv.image_tgt = *image;
 	spectrum = spectrum_new();
 	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(list_in);
+	if ( prepare_refls(&priv, list_in) ) {
+		ERROR("Failed to prepare reflections for crystal %i\n", serial);
+		free_prepared_refls(&priv);
+		crystal_free(priv.cr_tgt);
+		spectrum_free(spectrum);
+		return;
+	}
 	cell = cell_new_from_cell(crystal_get_cell(cr));
 	crystal_set_cell(priv.cr_tgt, cell);
 
@@ -497,7 +632,7 @@ static void write_angle_grid(RefList *list_in, Crystal *cr, struct image *image,
 		fclose(fh);
 	}
 
-	reflist_free(priv.refls);
+	free_prepared_refls(&priv);
 	crystal_free(priv.cr_tgt);
 	spectrum_free(spectrum);
 }
@@ -526,7 +661,13 @@ static void write_radius_grid(RefList *list_in, Crystal *cr, struct image *image
 	priv.image_tgt = *image;
 	spectrum = spectrum_new();
 	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(list_in);
+	if ( prepare_refls(&priv, list_in) ) {
+		ERROR("Failed to prepare reflections for crystal %i\n", serial);
+		free_prepared_refls(&priv);
+		crystal_free(priv.cr_tgt);
+		spectrum_free(spectrum);
+		return;
+	}
 	cell = cell_new_from_cell(crystal_get_cell(cr));
 	crystal_set_cell(priv.cr_tgt, cell);
 
@@ -563,7 +704,7 @@ static void write_radius_grid(RefList *list_in, Crystal *cr, struct image *image
 		fclose(fh);
 	}
 
-	reflist_free(priv.refls);
+	free_prepared_refls(&priv);
 	crystal_free(priv.cr_tgt);
 	spectrum_free(spectrum);
 }
@@ -642,12 +783,206 @@ static void zero_alter(struct rf_alteration *alter)
 }
 
 
+/* Parameter vector for the gradient-based optimiser, in units of the step
+ * sizes used by the coordinate search (see do_pr_refine) */
+#define PR_NPARAMS 4
+
+static struct rf_alteration params_to_alter(const double *u,
+                                            const double *scale)
+{
+	struct rf_alteration alter;
+	alter.rot_x = u[0]*scale[0];
+	alter.rot_y = u[1]*scale[1];
+	alter.delta_R = u[2]*scale[2];
+	alter.delta_wave = u[3]*scale[3];
+	return alter;
+}
+
+
+/* Central-difference gradient of the residual in scaled coordinates.  The
+ * step is half of the coordinate search step, which is small enough to be
+ * accurate but large enough to smooth over the graininess of the residual.
+ * Next to the edge of the allowed parameter space (where the residual is NaN),
+ * a one-sided difference is used instead. */
+static int residual_gradient(struct rf_priv *priv, const double *u,
+                             double fom, const double *scale, double *grad)
+{
+	const double h = 0.5;
+	int i;
+
+	for ( i=0; i<PR_NPARAMS; i++ ) {
+
+		double ut[PR_NPARAMS];
+		double fp, fm;
+		int j;
+
+		for ( j=0; j<PR_NPARAMS; j++ ) ut[j] = u[j];
+
+		ut[i] = u[i] + h;
+		fp = calc_residual(priv, params_to_alter(ut, scale), 0);
+		ut[i] = u[i] - h;
+		fm = calc_residual(priv, params_to_alter(ut, scale), 0);
+
+		if ( !isnan(fp) && !isnan(fm) ) {
+			grad[i] = (fp - fm) / (2.0*h);
+		} else if ( !isnan(fp) ) {
+			grad[i] = (fp - fom) / h;
+		} else if ( !isnan(fm) ) {
+			grad[i] = (fom - fm) / h;
+		} else {
+			return 1;
+		}
+
+	}
+
+	return 0;
+}
+
+
+/* Quasi-Newton (BFGS) minimisation of the residual with respect to all four
+ * parameters at once.  Each iteration costs 2*PR_NPARAMS residual evaluations
+ * for the gradient, plus usually only one for the line search. */
+static int refine_bfgs(struct rf_alteration *cur, const double *scale,
+                       struct rf_priv *priv, int *total_iter, FILE *fh)
+{
+	double u[PR_NPARAMS];
+	double g[PR_NPARAMS];
+	double H[PR_NPARAMS][PR_NPARAMS];  /* Inverse Hessian estimate */
+	double fom;
+	int n_iter = 0;
+	int i, j;
+
+	u[0] = cur->rot_x / scale[0];
+	u[1] = cur->rot_y / scale[1];
+	u[2] = cur->delta_R / scale[2];
+	u[3] = cur->delta_wave / scale[3];
+
+	for ( i=0; i<PR_NPARAMS; i++ ) {
+		for ( j=0; j<PR_NPARAMS; j++ ) {
+			H[i][j] = (i==j) ? 1.0 : 0.0;
+		}
+	}
+
+	fom = calc_residual(priv, params_to_alter(u, scale), 0);
+	if ( isnan(fom) ) return 1;
+	if ( residual_gradient(priv, u, fom, scale, g) ) return 1;
+
+	while ( n_iter < 20 ) {
+
+		double p[PR_NPARAMS];
+		double un[PR_NPARAMS];
+		double gn[PR_NPARAMS];
+		double s[PR_NPARAMS], y[PR_NPARAMS];
+		double pmax = 0.0;
+		double slope = 0.0;
+		double alpha = 1.0;
+		double nfom = NAN;
+		double freefom;
+		double sy;
+		int n_ls = 0;
+
+		/* Search direction */
+		for ( i=0; i<PR_NPARAMS; i++ ) {
+			p[i] = 0.0;
+			for ( j=0; j<PR_NPARAMS; j++ ) p[i] -= H[i][j]*g[j];
+			slope += p[i]*g[i];
+			if ( fabs(p[i]) > pmax ) pmax = fabs(p[i]);
+		}
+
+		/* Not a descent direction: restart from steepest descent */
+		if ( slope >= 0.0 ) {
+			pmax = 0.0;
+			slope = 0.0;
+			for ( i=0; i<PR_NPARAMS; i++ ) {
+				for ( j=0; j<PR_NPARAMS; j++ ) {
+					H[i][j] = (i==j) ? 1.0 : 0.0;
+				}
+				p[i] = -g[i];
+				slope -= g[i]*g[i];
+				if ( fabs(p[i]) > pmax ) pmax = fabs(p[i]);
+			}
+		}
+		if ( pmax == 0.0 ) break;
+
+		/* Don't move further than ten coordinate search steps at once */
+		if ( pmax > 10.0 ) alpha = 10.0/pmax;
+
+		/* Backtracking line search (Armijo condition) */
+		do {
+			for ( i=0; i<PR_NPARAMS; i++ ) un[i] = u[i] + alpha*p[i];
+			nfom = calc_residual(priv, params_to_alter(un, scale), 0);
+			if ( !isnan(nfom) && (nfom <= fom + 1e-4*alpha*slope) ) {
+				break;
+			}
+			alpha /= 4.0;
+			n_ls++;
+		} while ( n_ls < 5 );
+
+		/* Line search failed or step became negligible */
+		if ( (n_ls == 5) || (alpha*pmax < 0.01) ) break;
+
+		if ( residual_gradient(priv, un, nfom, scale, gn) ) break;
+
+		/* BFGS update of the inverse Hessian */
+		sy = 0.0;
+		for ( i=0; i<PR_NPARAMS; i++ ) {
+			s[i] = un[i] - u[i];
+			y[i] = gn[i] - g[i];
+			sy += s[i]*y[i];
+		}
+		if ( sy > 1e-12 ) {
+
+			double Hy[PR_NPARAMS];
+			double yHy = 0.0;
+
+			for ( i=0; i<PR_NPARAMS; i++ ) {
+				Hy[i] = 0.0;
+				for ( j=0; j<PR_NPARAMS; j++ ) Hy[i] += H[i][j]*y[j];
+				yHy += y[i]*Hy[i];
+			}
+			for ( i=0; i<PR_NPARAMS; i++ ) {
+				for ( j=0; j<PR_NPARAMS; j++ ) {
+					H[i][j] += (sy+yHy)*s[i]*s[j]/(sy*sy)
+					         - (Hy[i]*s[j] + s[i]*Hy[j])/sy;
+				}
+			}
+		}
+
+		for ( i=0; i<PR_NPARAMS; i++ ) {
+			u[i] = un[i];
+			g[i] = gn[i];
+		}
+
+		n_iter++;
+		(*total_iter)++;
+
+		*cur = params_to_alter(u, scale);
+		if ( fh != NULL ) {
+			freefom = calc_residual(priv, *cur, 1);
+			fprintf(fh, "%5i %10.8f  %10.8f %10.8f %10.8f  %e  %e\n",
+			        *total_iter, nfom, freefom,
+			        cur->rot_x, cur->rot_y,
+			        crystal_get_profile_radius(priv->cr)+cur->delta_R,
+			        priv->image->lambda+cur->delta_wave);
+		}
+
+		/* Converged? */
+		if ( fom - nfom < 1e-6*fom ) break;
+		fom = nfom;
+
+	}
+
+	*cur = params_to_alter(u, scale);
+	return 0;
+}
+
+
 static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
                          const RefList *full,
                          PartialityModel pmodel, int serial,
                          int cycle, int write_logs,
                          SymOpList *sym, SymOpList *amb, int scaleflags,
-                         const char *log_folder)
+                         const char *log_folder, enum pr_optimiser optimiser)
 {
 	struct rf_priv priv;
 	struct rf_alteration alter;
@@ -671,7 +1006,13 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 	priv.image_tgt = *image;
 	spectrum = spectrum_new();
 	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(*plist_in);
+	if ( prepare_refls(&priv, *plist_in) ) {
+		ERROR("Failed to prepare reflections for crystal %i\n", serial);
+		free_prepared_refls(&priv);
+		crystal_free(priv.cr_tgt);
+		spectrum_free(spectrum);
+		return;
+	}
 	cell = cell_new_from_cell(crystal_get_cell(cr));
 	crystal_set_cell(priv.cr_tgt, cell);
 
@@ -697,23 +1038,40 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 
 	}
 
-	/* Refine orientation */
-	struct rf_alteration dirns[4];
-	zero_alter(&dirns[0]);  dirns[0].rot_x += 0.1e-3;
-	zero_alter(&dirns[1]);  dirns[1].rot_x -= 0.1e-3;
-	zero_alter(&dirns[2]);  dirns[2].rot_y += 0.1e-3;
-	zero_alter(&dirns[3]);  dirns[3].rot_y -= 0.1e-3;
-	refine_loop(&alter, dirns, 4, &priv, &n_iter, fh);
+	if ( optimiser == PR_OPTIMISER_BFGS ) {
+
+		double scale[PR_NPARAMS];
 
-	/* Refine profile radius */
-	zero_alter(&dirns[0]);  dirns[0].delta_R += 1e5;
-	zero_alter(&dirns[1]);  dirns[1].delta_R -= 1e5;
-	refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+		scale[0] = 0.1e-3;
+		scale[1] = 0.1e-3;
+		scale[2] = 1e5;
+		scale[3] = image->lambda/1000.0;
 
-	/* Refine wavelength */
-	zero_alter(&dirns[0]);  dirns[0].delta_wave += image->lambda/1000.0;
-	zero_alter(&dirns[1]);  dirns[1].delta_wave -= image->lambda/1000.0;
-	refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+		if ( refine_bfgs(&alter, scale, &priv, &n_iter, fh) ) {
+			zero_alter(&alter);
+		}
+
+	} else {
+
+		/* Refine orientation */
+		struct rf_alteration dirns[4];
+		zero_alter(&dirns[0]);  dirns[0].rot_x += 0.1e-3;
+		zero_alter(&dirns[1]);  dirns[1].rot_x -= 0.1e-3;
+		zero_alter(&dirns[2]);  dirns[2].rot_y += 0.1e-3;
+		zero_alter(&dirns[3]);  dirns[3].rot_y -= 0.1e-3;
+		refine_loop(&alter, dirns, 4, &priv, &n_iter, fh);
+
+		/* Refine profile radius */
+		zero_alter(&dirns[0]);  dirns[0].delta_R += 1e5;
+		zero_alter(&dirns[1]);  dirns[1].delta_R -= 1e5;
+		refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+
+		/* Refine wavelength */
+		zero_alter(&dirns[0]);  dirns[0].delta_wave += image->lambda/1000.0;
+		zero_alter(&dirns[1]);  dirns[1].delta_wave -= image->lambda/1000.0;
+		refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+
+	}
 
 	/* Apply the final shifts */
 	apply_parameters(cr, cr, image, image, alter);
@@ -735,7 +1093,7 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 		fclose(fh);
 	}
 
-	reflist_free(priv.refls);
+	free_prepared_refls(&priv);
 	crystal_free(priv.cr_tgt);
 	spectrum_free(spectrum);
 }
@@ -755,6 +1113,7 @@ struct refine_args
 	SymOpList *amb;
 	int scaleflags;
 	const char *log_folder;
+	enum pr_optimiser optimiser;
 };
 
 
@@ -780,7 +1139,7 @@ static void refine_image(void *task, int id)
 	             pargs->full, pargs->pmodel,
 	             pargs->serial, pargs->cycle, write_logs,
 	             pargs->sym, pargs->amb, pargs->scaleflags,
-	             pargs->log_folder);
+	             pargs->log_folder, pargs->optimiser);
 }
 
 
@@ -818,7 +1177,7 @@ void refine_all(struct crystal_refls *crystals, struct image **images, int n_cry
                 RefList *full, int nthreads, PartialityModel pmodel,
                 int cycle, int no_logs,
                 SymOpList *sym, SymOpList *amb, int scaleflags,
-                const char *log_folder)
+                const char *log_folder, enum pr_optimiser optimiser)
 {
 	struct refine_args task_defaults;
 	struct pr_queue_args qargs;
@@ -835,6 +1194,7 @@ void refine_all(struct crystal_refls *crystals, struct image **images, int n_cry
 	task_defaults.scaleflags = scaleflags;
 	task_defaults.serial = 0;
 	task_defaults.log_folder = log_folder;
+	task_defaults.optimiser = optimiser;
 
 	qargs.task_defaults = task_defaults;
 	qargs.n_started = 0;
@@ -56,6 +56,14 @@ enum prflag
 };
 
 
+/* Optimisation algorithm for post-refinement */
+enum pr_optimiser
+{
+	PR_OPTIMISER_STEP,  /* Fixed-step coordinate search (default) */
+	PR_OPTIMISER_BFGS,  /* Quasi-Newton with finite-difference gradients */
+};
+
+
 extern const char *str_prflag(enum prflag flag);
 
 extern void refine_all(struct crystal_refls *crystals, struct image **images,
@@ -63,7 +71,7 @@ extern void refine_all(struct crystal_refls *crystals, struct image **images,
                        RefList *full, int nthreads, PartialityModel pmodel,
                        int cycle, int no_logs,
                        SymOpList *sym, SymOpList *amb, int scaleflags,
-                       const char *log_folder);
+                       const char *log_folder, enum pr_optimiser optimiser);
 
 extern void write_gridscan(RefList *list, Crystal *cr, struct image *image,
                            const RefList *full,
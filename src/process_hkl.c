@@ -42,6 +42,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include <utils.h>
 #include <reflist-utils.h>
@@ -70,6 +71,7 @@ static void show_help(const char *s)
 "                             Default: processed.hkl).\n"
 "      --stat=<filename>     Specify output filename for merging statistics.\n"
 "  -y, --symmetry=<sym>      Merge according to point group <sym>.\n"
+"  -j <n>                    Use <n> threads for reading and merging.\n"
 "\n"
 "      --start-after=<n>     Skip <n> crystals at the start of the stream.\n"
 "      --stop-after=<n>      Stop after merging <n> crystals.\n"
@@ -145,57 +147,154 @@ static void plot_histogram(double *vals, int n, float hist_min, float hist_max,
 }
 
 
-static double scale_intensities(RefList *reference, RefList *new,
-                              const SymOpList *sym)
+/* Largest number of entries in a reference table (512 MB) */
+#define MAX_REFERENCE_TABLE (64*1024*1024)
+
+
+/* The reference intensities, in a box of indices big enough for all the
+ * symmetry equivalents of every reflection.  A reflection from a crystal can
+ * then be looked up directly, without putting it into the asymmetric unit or
+ * searching the list.  If the box would be too big, the reference list is
+ * searched instead. */
+struct reference_table
 {
-	double s;
-	double top = 0.0;
-	double bot = 0.0;
+	RefList *list;
+	const SymOpList *sym;
+
+	signed int h_min;
+	signed int k_min;
+	signed int l_min;
+	int nh;
+	int nk;
+	int nl;
+	double *vals;  /* NAN where there is no reference intensity */
+};
+
+
+static struct reference_table *reference_table_new(RefList *list,
+                                                   const SymOpList *sym)
+{
+	struct reference_table *t;
 	Reflection *refl;
 	RefListIterator *iter;
+	signed int h_max = INT_MIN;
+	signed int k_max = INT_MIN;
+	signed int l_max = INT_MIN;
+	long long int n;
+	int n_equivs = num_equivs(sym, NULL);
+	long long int i;
+
+	t = malloc(sizeof(struct reference_table));
+	if ( t == NULL ) return NULL;
+
+	t->list = list;
+	t->sym = sym;
+	t->vals = NULL;
+	t->h_min = INT_MAX;
+	t->k_min = INT_MAX;
+	t->l_min = INT_MAX;
 
-	for ( refl = first_refl(new, &iter);
+	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-
-		double i1, i2;
-		signed int hu, ku, lu;
 		signed int h, k, l;
-		Reflection *reference_version;
+		int j;
 
 		get_indices(refl, &h, &k, &l);
-		get_asymm(sym, h, k, l, &hu, &ku, &lu);
+		for ( j=0; j<n_equivs; j++ ) {
+			signed int he, ke, le;
+			get_equiv(sym, NULL, j, h, k, l, &he, &ke, &le);
+			if ( he < t->h_min ) t->h_min = he;
+			if ( ke < t->k_min ) t->k_min = ke;
+			if ( le < t->l_min ) t->l_min = le;
+			if ( he > h_max ) h_max = he;
+			if ( ke > k_max ) k_max = ke;
+			if ( le > l_max ) l_max = le;
+		}
+	}
 
-		reference_version = find_refl(reference, hu, ku, lu);
-		if ( reference_version == NULL ) continue;
+	if ( h_max < t->h_min ) return t;  /* Empty reference */
 
-		i1 = get_intensity(reference_version);
-		i2 = get_intensity(refl);
+	t->nh = h_max - t->h_min + 1;
+	t->nk = k_max - t->k_min + 1;
+	t->nl = l_max - t->l_min + 1;
+	n = (long long int)t->nh * t->nk * t->nl;
+	if ( n > MAX_REFERENCE_TABLE ) {
+		STATUS("Reference is too big for a table, "
+		       "it will be slower to use.\n");
+		return t;
+	}
 
-		/* Calculate LSQ estimate of scaling factor */
-		top += i1 * i2;
-		bot += i2 * i2;
+	t->vals = malloc(n*sizeof(double));
+	if ( t->vals == NULL ) return t;
+	for ( i=0; i<n; i++ ) t->vals[i] = NAN;
 
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		double intensity = get_intensity(refl);
+		int j;
+
+		get_indices(refl, &h, &k, &l);
+		for ( j=0; j<n_equivs; j++ ) {
+			signed int he, ke, le;
+			get_equiv(sym, NULL, j, h, k, l, &he, &ke, &le);
+			t->vals[((long long int)(he - t->h_min)*t->nk
+			          + (ke - t->k_min))*t->nl + (le - t->l_min)] = intensity;
+		}
 	}
 
-	s = top / bot;
+	return t;
+}
+
 
-	return s;
+static void reference_table_free(struct reference_table *t)
+{
+	if ( t == NULL ) return;
+	free(t->vals);
+	free(t);
 }
 
 
-static double cc_intensities(RefList *reference, RefList *new,
-                             const SymOpList *sym)
+/* Returns NAN if the reflection is not in the reference */
+static double reference_intensity(const struct reference_table *t,
+                                  signed int h, signed int k, signed int l)
+{
+	Reflection *refl;
+
+	if ( t->vals != NULL ) {
+		int ih = h - t->h_min;
+		int ik = k - t->k_min;
+		int il = l - t->l_min;
+		if ( (ih < 0) || (ih >= t->nh) ) return NAN;
+		if ( (ik < 0) || (ik >= t->nk) ) return NAN;
+		if ( (il < 0) || (il >= t->nl) ) return NAN;
+		return t->vals[((long long int)ih*t->nk + ik)*t->nl + il];
+	}
+
+	get_asymm(t->sym, h, k, l, &h, &k, &l);
+	refl = find_refl(t->list, h, k, l);
+	if ( refl == NULL ) return NAN;
+	return get_intensity(refl);
+}
+
+
+/* Least-squares scale factor and correlation coefficient between a crystal's
+ * intensities and the reference, in one pass */
+static void compare_with_reference(const struct reference_table *reference,
+                                   RefList *new, double *pscale, double *pcc)
 {
 	/* "x" is "reference" */
-	float s_xy = 0.0;
-	float s_x = 0.0;
-	float s_y = 0.0;
-	float s_x2 = 0.0;
-	float s_y2 = 0.0;
+	double s_xy = 0.0;
+	double s_x = 0.0;
+	double s_y = 0.0;
+	double s_x2 = 0.0;
+	double s_y2 = 0.0;
 	int n = 0;
-	float t1, t2;
+	double t1, t2;
 
 	Reflection *refl;
 	RefListIterator *iter;
@@ -204,37 +303,34 @@ static double cc_intensities(RefList *reference, RefList *new,
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-
 		double i1, i2;
-		signed int hu, ku, lu;
 		signed int h, k, l;
-		Reflection *reference_version;
 
 		get_indices(refl, &h, &k, &l);
-		get_asymm(sym, h, k, l, &hu, &ku, &lu);
-
-		reference_version = find_refl(reference, hu, ku, lu);
-		if ( reference_version == NULL ) continue;
+		i1 = reference_intensity(reference, h, k, l);
+		if ( isnan(i1) ) continue;
 
-		i1 = get_intensity(reference_version);
 		i2 = get_intensity(refl);
 
-
 		s_xy += i1 * i2;
 		s_x += i1;
 		s_y += i2;
 		s_x2 += i1 * i1;
 		s_y2 += i2 * i2;
 		n++;
-
 	}
 
+	/* Calculate LSQ estimate of scaling factor */
+	*pscale = s_xy / s_y2;
+
 	t1 = s_x2 - s_x*s_x / n;
 	t2 = s_y2 - s_y*s_y / n;
 
-	if ( (t1 <= 0.0) || (t2 <= 0.0) ) return 0.0;
-
-	return (s_xy - s_x*s_y/n) / sqrt(t1*t2);
+	if ( (t1 <= 0.0) || (t2 <= 0.0) ) {
+		*pcc = 0.0;
+	} else {
+		*pcc = (s_xy - s_x*s_y/n) / sqrt(t1*t2);
+	}
 }
 
 
@@ -270,42 +366,45 @@ static void apply_kpred(double k, RefList *list)
 }
 
 
-static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
-                         RefList *new_refl, RefList *reference, const SymOpList *sym,
-                         double **hist_vals, signed int hist_h,
-                         signed int hist_k, signed int hist_l, int *hist_n,
-                         struct polarisation p, double min_snr, double max_adu,
-                         double push_res, double min_cc, int do_scale,
-                         FILE *stat)
+/* Everything which needs to be done to a crystal before it can be merged,
+ * apart from checks which depend on the other crystals */
+static int check_crystal(struct image *image, Crystal *cr, RefList *new_refl,
+                         const struct reference_table *reference,
+                         struct polarisation p, double min_cc, int do_scale,
+                         double *pscale, double *pcc)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	double scale;
+	double scale, cc;
 
 	/* First, correct for polarisation */
 	apply_kpred(1.0/image->lambda, new_refl);
 	polarisation_correction(new_refl, crystal_get_cell(cr), p);
 
 	if ( reference != NULL ) {
-		double cc;
-		if ( do_scale ) {
-			scale = scale_intensities(reference, new_refl, sym);
-		} else {
-			scale = 1.0;
-		}
-		cc = cc_intensities(reference, new_refl, sym);
+		compare_with_reference(reference, new_refl, &scale, &cc);
+		if ( !do_scale ) scale = 1.0;
 		if ( cc < min_cc ) return 1;
 		if ( isnan(scale) ) return 1;
 		if ( scale <= 0.0 ) return 1;
-		if ( stat != NULL ) {
-			fprintf(stat, "%s %s %f %f\n", image->filename,
-			        image->ev, scale, cc);
-		}
-
 	} else {
 		scale = 1.0;
+		cc = NAN;
 	}
 
+	*pscale = scale;
+	*pcc = cc;
+	return 0;
+}
+
+
+static void add_crystal(RefList *model, Crystal *cr, RefList *new_refl,
+                        const SymOpList *sym, double scale,
+                        double **hist_vals, signed int hist_h,
+                        signed int hist_k, signed int hist_l, int *hist_n,
+                        double min_snr, double max_adu, double push_res)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
 	for ( refl = first_refl(new_refl, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
@@ -375,6 +474,32 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
 		}
 
 	}
+}
+
+
+static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
+                         RefList *new_refl,
+                         const struct reference_table *reference,
+                         const SymOpList *sym,
+                         double **hist_vals, signed int hist_h,
+                         signed int hist_k, signed int hist_l, int *hist_n,
+                         struct polarisation p, double min_snr, double max_adu,
+                         double push_res, double min_cc, int do_scale,
+                         FILE *stat)
+{
+	double scale, cc;
+
+	if ( check_crystal(image, cr, new_refl, reference, p, min_cc,
+	                   do_scale, &scale, &cc) ) return 1;
+
+	if ( (reference != NULL) && (stat != NULL) ) {
+		fprintf(stat, "%s %s %f %f\n", image->filename,
+		        image->ev, scale, cc);
+	}
+
+	add_crystal(model, cr, new_refl, sym, scale, hist_vals,
+	            hist_h, hist_k, hist_l, hist_n, min_snr, max_adu,
+	            push_res);
 
 	return 0;
 }
@@ -394,8 +519,8 @@ static void display_progress(int n_images, int n_crystals, int n_crystals_used)
 }
 
 
-static int merge_stream(Stream *st,
-                        RefList *model, RefList *reference,
+static int merge_stream(Stream *st, RefList *model,
+                        const struct reference_table *reference,
                         const SymOpList *sym,
                         double **hist_vals, signed int hist_h,
                         signed int hist_k, signed int hist_l,
@@ -419,6 +544,9 @@ static int merge_stream(Stream *st,
 		struct image *image;
 		int i;
 
+		/* Already stopped in a previous stream? */
+		if ( (stop_after>0) && (n_crystals_used == stop_after) ) break;
+
 		/* Get data from next chunk */
 		image = stream_read_chunk(st, STREAM_REFLECTIONS);
 		if ( image == NULL ) break;
@@ -475,6 +603,412 @@ struct stream_list
 };
 
 
+/* Number of chunks handed to a thread at once */
+#define MERGE_BATCH (32)
+
+
+/* One share of the merged model.  Batch number i always goes into share
+ * number i modulo the number of shares, and the batches go into each share in
+ * order, so that the result does not depend on the timing of the threads. */
+struct partial_merge
+{
+	RefList *model;
+	double *hist_vals;
+	int hist_n;
+
+	int next_batch;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+struct merge_queue_args
+{
+	struct stream_list *streams;
+	int cur_stream;
+	int n_batches;
+
+	const struct reference_table *reference;
+	const SymOpList *sym;
+	signed int hist_h;
+	signed int hist_k;
+	signed int hist_l;
+	struct polarisation p;
+	double min_snr;
+	double max_adu;
+	int start_after;
+	int stop_after;
+	double min_res;
+	double push_res;
+	double min_cc;
+	int do_scale;
+	int flag_even_odd;
+	FILE *stat;
+
+	struct partial_merge *partials;
+	int n_partials;
+
+	/* The crystals are counted and selected in the same order as they
+	 * would be with only one thread, one batch at a time */
+	pthread_mutex_t commit_lock;
+	pthread_cond_t commit_cond;
+	int next_commit;
+	int stopped;
+	int n_images;
+	int n_crystals;
+	int n_crystals_used;
+	int n_crystals_seen;
+};
+
+
+struct merge_batch
+{
+	struct merge_queue_args *qargs;
+	int serial;
+	int n_chunks;
+	Stream *streams[MERGE_BATCH];
+	char *text[MERGE_BATCH];
+	size_t len[MERGE_BATCH];
+};
+
+
+struct crystal_result
+{
+	int res_ok;
+	int check_ok;
+	int selected;
+	double scale;
+	double cc;
+};
+
+
+static void *merge_get_task(void *vp)
+{
+	struct merge_queue_args *qargs = vp;
+	struct merge_batch *batch;
+	int stopped;
+
+	pthread_mutex_lock(&qargs->commit_lock);
+	stopped = qargs->stopped;
+	pthread_mutex_unlock(&qargs->commit_lock);
+	if ( stopped ) return NULL;
+
+	batch = malloc(sizeof(struct merge_batch));
+	if ( batch == NULL ) return NULL;
+	batch->n_chunks = 0;
+
+	while ( (batch->n_chunks < MERGE_BATCH)
+	     && (qargs->cur_stream < qargs->streams->n) )
+	{
+		Stream *st = qargs->streams->streams[qargs->cur_stream];
+		size_t len;
+		char *text;
+
+		text = stream_read_chunk_text(st, &len);
+		if ( text == NULL ) {
+			qargs->cur_stream++;
+			continue;
+		}
+
+		batch->streams[batch->n_chunks] = st;
+		batch->text[batch->n_chunks] = text;
+		batch->len[batch->n_chunks] = len;
+		batch->n_chunks++;
+	}
+
+	if ( batch->n_chunks == 0 ) {
+		free(batch);
+		return NULL;
+	}
+
+	batch->qargs = qargs;
+	batch->serial = qargs->n_batches++;
+	return batch;
+}
+
+
+/* Called in order of batch number */
+static void select_crystals(struct merge_queue_args *qargs,
+                            struct image **images, int n_images,
+                            struct crystal_result **results)
+{
+	int i, j;
+
+	for ( i=0; i<n_images; i++ ) {
+
+		if ( images[i] == NULL ) continue;
+		if ( qargs->stopped ) break;
+
+		qargs->n_images++;
+
+		for ( j=0; j<images[i]->n_crystals; j++ ) {
+
+			struct crystal_result *res = &results[i][j];
+
+			qargs->n_crystals_seen++;
+			if ( (qargs->n_crystals_seen > qargs->start_after)
+			  && res->res_ok
+			  && ((qargs->flag_even_odd == 2)
+			   || (qargs->n_crystals_seen%2 == qargs->flag_even_odd)) )
+			{
+				qargs->n_crystals++;
+				if ( res->check_ok ) {
+					res->selected = 1;
+					qargs->n_crystals_used++;
+					if ( (qargs->reference != NULL)
+					  && (qargs->stat != NULL) )
+					{
+						fprintf(qargs->stat,
+						        "%s %s %f %f\n",
+						        images[i]->filename,
+						        images[i]->ev,
+						        res->scale, res->cc);
+					}
+				}
+			}
+
+			if ( (qargs->stop_after > 0)
+			  && (qargs->n_crystals_used == qargs->stop_after) )
+			{
+				qargs->stopped = 1;
+				break;
+			}
+
+		}
+
+	}
+
+	display_progress(qargs->n_images, qargs->n_crystals_seen,
+	                 qargs->n_crystals_used);
+}
+
+
+static void merge_work(void *vp, int cookie)
+{
+	struct merge_batch *batch = vp;
+	struct merge_queue_args *qargs = batch->qargs;
+	struct partial_merge *part;
+	struct image *images[MERGE_BATCH];
+	struct crystal_result *results[MERGE_BATCH];
+	int i, j;
+
+	/* Interpret the chunks, and do everything which doesn't depend on the
+	 * other crystals */
+	for ( i=0; i<batch->n_chunks; i++ ) {
+
+		images[i] = stream_parse_chunk(batch->streams[i],
+		                               batch->text[i], batch->len[i],
+		                               STREAM_REFLECTIONS);
+		cffree(batch->text[i]);
+		results[i] = NULL;
+
+		if ( images[i] == NULL ) {
+			ERROR("Failed to read chunk (skipping)\n");
+			continue;
+		}
+
+		results[i] = calloc(images[i]->n_crystals+1,
+		                    sizeof(struct crystal_result));
+		if ( results[i] == NULL ) {
+			ERROR("Failed to allocate crystal results\n");
+			image_free(images[i]);
+			images[i] = NULL;
+			continue;
+		}
+
+		for ( j=0; j<images[i]->n_crystals; j++ ) {
+
+			Crystal *cr = images[i]->crystals[j].cr;
+			struct crystal_result *res = &results[i][j];
+
+			res->res_ok = crystal_get_resolution_limit(cr)
+			                                     >= qargs->min_res;
+			if ( !res->res_ok ) continue;
+
+			res->check_ok = !check_crystal(images[i], cr,
+			                               images[i]->crystals[j].refls,
+			                               qargs->reference, qargs->p,
+			                               qargs->min_cc,
+			                               qargs->do_scale,
+			                               &res->scale, &res->cc);
+		}
+	}
+
+	pthread_mutex_lock(&qargs->commit_lock);
+	while ( qargs->next_commit != batch->serial ) {
+		pthread_cond_wait(&qargs->commit_cond, &qargs->commit_lock);
+	}
+	select_crystals(qargs, images, batch->n_chunks, results);
+	qargs->next_commit++;
+	pthread_cond_broadcast(&qargs->commit_cond);
+	pthread_mutex_unlock(&qargs->commit_lock);
+
+	part = &qargs->partials[batch->serial % qargs->n_partials];
+	pthread_mutex_lock(&part->lock);
+	while ( part->next_batch != batch->serial ) {
+		pthread_cond_wait(&part->cond, &part->lock);
+	}
+
+	for ( i=0; i<batch->n_chunks; i++ ) {
+		if ( images[i] == NULL ) continue;
+		for ( j=0; j<images[i]->n_crystals; j++ ) {
+			if ( !results[i][j].selected ) continue;
+			add_crystal(part->model, images[i]->crystals[j].cr,
+			            images[i]->crystals[j].refls, qargs->sym,
+			            results[i][j].scale, &part->hist_vals,
+			            qargs->hist_h, qargs->hist_k, qargs->hist_l,
+			            &part->hist_n, qargs->min_snr,
+			            qargs->max_adu, qargs->push_res);
+		}
+		image_free(images[i]);
+		free(results[i]);
+	}
+
+	part->next_batch += qargs->n_partials;
+	pthread_cond_broadcast(&part->cond);
+	pthread_mutex_unlock(&part->lock);
+}
+
+
+static void merge_final(void *qargs, void *vp)
+{
+	free(vp);
+}
+
+
+/* Combine a partial merge into the model, using the formulae of Chan et al.
+ * for the mean and sum of squared deviations */
+static void add_partial_merge(RefList *model, RefList *partial)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(partial, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *model_version;
+		double na, nb, n, delta;
+
+		get_indices(refl, &h, &k, &l);
+		model_version = find_refl(model, h, k, l);
+		if ( model_version == NULL ) {
+			model_version = add_refl(model, h, k, l);
+			copy_data(model_version, refl);
+			continue;
+		}
+
+		na = get_temp1(model_version);
+		nb = get_temp1(refl);
+		n = na + nb;
+		delta = get_intensity(refl) - get_intensity(model_version);
+
+		set_intensity(model_version,
+		              get_intensity(model_version) + delta*nb/n);
+		set_temp2(model_version, get_temp2(model_version)
+		                         + get_temp2(refl) + delta*delta*na*nb/n);
+		set_temp1(model_version, n);
+		set_redundancy(model_version, get_redundancy(model_version)
+		                              + get_redundancy(refl));
+	}
+}
+
+
+static int merge_streams_threaded(struct stream_list *streams,
+                                  RefList *model,
+                                  const struct reference_table *reference,
+                                  const SymOpList *sym,
+                                  double **hist_vals, signed int hist_h,
+                                  signed int hist_k, signed int hist_l,
+                                  int *hist_i, struct polarisation p,
+                                  double min_snr, double max_adu,
+                                  int start_after, int stop_after,
+                                  double min_res, double push_res,
+                                  double min_cc, int do_scale,
+                                  int flag_even_odd, FILE *stat,
+                                  int n_threads)
+{
+	struct merge_queue_args qargs;
+	int i;
+
+	qargs.streams = streams;
+	qargs.cur_stream = 0;
+	qargs.n_batches = 0;
+	qargs.reference = reference;
+	qargs.sym = sym;
+	qargs.hist_h = hist_h;
+	qargs.hist_k = hist_k;
+	qargs.hist_l = hist_l;
+	qargs.p = p;
+	qargs.min_snr = min_snr;
+	qargs.max_adu = max_adu;
+	qargs.start_after = start_after;
+	qargs.stop_after = stop_after;
+	qargs.min_res = min_res;
+	qargs.push_res = push_res;
+	qargs.min_cc = min_cc;
+	qargs.do_scale = do_scale;
+	qargs.flag_even_odd = flag_even_odd;
+	qargs.stat = stat;
+	qargs.next_commit = 0;
+	qargs.stopped = 0;
+	qargs.n_images = 0;
+	qargs.n_crystals = 0;
+	qargs.n_crystals_used = 0;
+	qargs.n_crystals_seen = 0;
+	pthread_mutex_init(&qargs.commit_lock, NULL);
+	pthread_cond_init(&qargs.commit_cond, NULL);
+
+	qargs.n_partials = n_threads;
+	qargs.partials = malloc(n_threads*sizeof(struct partial_merge));
+	if ( qargs.partials == NULL ) return 1;
+	for ( i=0; i<n_threads; i++ ) {
+		struct partial_merge *part = &qargs.partials[i];
+		part->model = reflist_new();
+		if ( part->model == NULL ) return 1;
+		part->hist_vals = NULL;
+		if ( *hist_vals != NULL ) {
+			part->hist_vals = malloc(1*sizeof(double));
+		}
+		part->hist_n = 0;
+		part->next_batch = i;
+		pthread_mutex_init(&part->lock, NULL);
+		pthread_cond_init(&part->cond, NULL);
+	}
+
+	run_threads(n_threads, merge_work, merge_get_task, merge_final,
+	            &qargs, 0, 0, 0, 0);
+
+	for ( i=0; i<n_threads; i++ ) {
+
+		struct partial_merge *part = &qargs.partials[i];
+		int j;
+
+		add_partial_merge(model, part->model);
+		reflist_free(part->model);
+
+		if ( part->hist_vals != NULL ) {
+			for ( j=0; j<part->hist_n; j++ ) {
+				*hist_vals = check_hist_size(*hist_i,
+				                             *hist_vals);
+				if ( *hist_vals == NULL ) break;
+				(*hist_vals)[(*hist_i)++] = part->hist_vals[j];
+			}
+			free(part->hist_vals);
+		}
+
+		pthread_mutex_destroy(&part->lock);
+		pthread_cond_destroy(&part->cond);
+	}
+
+	free(qargs.partials);
+	pthread_mutex_destroy(&qargs.commit_lock);
+	pthread_cond_destroy(&qargs.commit_cond);
+	return 0;
+}
+
+
 static int merge_all(struct stream_list *streams,
                      RefList *model, RefList *reference,
                      const SymOpList *sym,
@@ -485,7 +1019,7 @@ static int merge_all(struct stream_list *streams,
                      double min_snr, double max_adu,
                      int start_after, int stop_after, double min_res,
                      double push_res, double min_cc, int do_scale,
-                     int flag_even_odd, char *stat_output)
+                     int flag_even_odd, char *stat_output, int n_threads)
 {
 	Reflection *refl;
 	RefListIterator *iter;
@@ -495,6 +1029,8 @@ static int merge_all(struct stream_list *streams,
 	int n_crystals_used = 0;
 	int n_crystals_seen = 0;
 	FILE *stat = NULL;
+	struct reference_table *table = NULL;
+	int fail = 0;
 
 	if ( stat_output != NULL ) {
 		stat = fopen(stat_output, "w");
@@ -504,18 +1040,42 @@ static int merge_all(struct stream_list *streams,
 		}
 	}
 
-	for ( i=0; i<streams->n; i++ ) {
-		if ( merge_stream(streams->streams[i],
-		                  model, reference, sym,
-		                  hist_vals, hist_h, hist_k, hist_l, hist_i,
-		                  p, min_measurements, min_snr, max_adu,
-		                  start_after, stop_after, min_res,
-		                  push_res, min_cc, do_scale,
-		                  flag_even_odd, stat_output,
-		                  &n_images, &n_crystals, &n_crystals_used,
-		                  &n_crystals_seen, stat) ) return 1;
+	if ( reference != NULL ) {
+		table = reference_table_new(reference, sym);
+		if ( table == NULL ) {
+			if ( stat != NULL ) fclose(stat);
+			return 1;
+		}
 	}
 
+	if ( n_threads > 1 ) {
+		fail = merge_streams_threaded(streams, model, table, sym,
+		                              hist_vals, hist_h, hist_k, hist_l,
+		                              hist_i, p, min_snr, max_adu,
+		                              start_after, stop_after, min_res,
+		                              push_res, min_cc, do_scale,
+		                              flag_even_odd, stat, n_threads);
+	} else {
+		for ( i=0; i<streams->n; i++ ) {
+			fail = merge_stream(streams->streams[i],
+			                    model, table, sym,
+			                    hist_vals, hist_h, hist_k, hist_l,
+			                    hist_i, p, min_measurements, min_snr,
+			                    max_adu, start_after, stop_after,
+			                    min_res, push_res, min_cc, do_scale,
+			                    flag_even_odd, stat_output,
+			                    &n_images, &n_crystals,
+			                    &n_crystals_used, &n_crystals_seen,
+			                    stat);
+			if ( fail ) break;
+		}
+	}
+
+	if ( fail ) {
+		if ( stat != NULL ) fclose(stat);
+		reference_table_free(table);
+		return 1;
+	}
 
 	for ( refl = first_refl(model, &iter);
 	      refl != NULL;
@@ -538,6 +1098,8 @@ static int merge_all(struct stream_list *streams,
 		fclose(stat);
 	}
 
+	reference_table_free(table);
+
 	return 0;
 }
 
@@ -610,6 +1172,7 @@ int main(int argc, char *argv[])
 	double push_res = +INFINITY;
 	double min_cc = -INFINITY;
 	int twopass = 0;
+	int n_threads = 1;
 	char *audit_info;
 	struct stream_list stream_list = {.n = 0,
 	                                  .max_n = 0,
@@ -646,7 +1209,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:",
+	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -663,6 +1226,17 @@ int main(int argc, char *argv[])
 			output = strdup(optarg);
 			break;
 
+			case 'j' :
+			if ( sscanf(optarg, "%i", &n_threads) != 1 ) {
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			if ( n_threads < 1 ) {
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case 's' :
 			errno = 0;
 			start_after = strtod(optarg, &rval);
@@ -877,7 +1451,8 @@ int main(int argc, char *argv[])
 	                    &hist_vals, hist_h, hist_k, hist_l,
 	                    &hist_i, polarisation, min_measurements, min_snr,
 	                    max_adu, start_after, stop_after, min_res, push_res,
-	                    min_cc, config_scale, flag_even_odd, stat_output);
+	                    min_cc, config_scale, flag_even_odd, stat_output,
+	                    n_threads);
 	fprintf(stderr, "\n");
 	if ( merge_r ) {
 		ERROR("Error while reading stream.\n");
@@ -912,7 +1487,7 @@ int main(int argc, char *argv[])
 				      polarisation, min_measurements, min_snr,
 				      max_adu, start_after, stop_after, min_res,
 				      push_res, min_cc, config_scale,
-				      flag_even_odd, stat_output);
+				      flag_even_odd, stat_output, n_threads);
 			fprintf(stderr, "\n");
 			if ( r ) {
 				ERROR("Error while reading stream.\n");
@@ -279,7 +279,7 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	}
 
 	if ( iargs->peak_search.noisefilter ) {
-		profile_start("median-filter");
+		profile_start("noise-filter");
 		filter_noise(image);
 		profile_end("noise-filter");
 	}
@@ -75,6 +75,8 @@ struct index_args
 	int n_threads;
 	int mille;
 	int max_mille_level;
+	int race_threads;
+	double race_deadline;
 
 	/* Integration */
 	IntegrationMethod int_meth;
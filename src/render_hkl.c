@@ -116,75 +116,57 @@ static void show_help(const char *s)
 #ifdef HAVE_CAIRO
 
 
-static double max_value(RefList *list, int wght, const SymOpList *sym)
+static double refl_value(Reflection *refl, int wght, int n)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	double max = -INFINITY;
-	SymOpMask *m;
-
-	m = new_symopmask(sym);
-
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		double val;
-		int n;
-		signed int h, k, l;
-
-		get_indices(refl, &h, &k, &l);
+	double val;
 
-		special_position(sym, m, h, k, l);
-		n = num_equivs(sym, m);
+	switch ( wght ) {
 
-		switch ( wght ) {
+		case WGHT_I :
+		val = get_intensity(refl);
+		break;
 
-			case WGHT_I :
-			val = get_intensity(refl);
-			break;
+		case WGHT_SQRTI :
+		val = get_intensity(refl);
+		val = (val>0.0) ? sqrt(val) : 0.0;
+		break;
 
-			case WGHT_SQRTI :
-			val = get_intensity(refl);
-			val = (val>0.0) ? sqrt(val) : 0.0;
-			break;
+		case WGHT_COUNTS :
+		val = get_redundancy(refl);
+		val /= (double)n;
+		break;
 
-			case WGHT_COUNTS :
-			val = get_redundancy(refl);
-			val /= (double)n;
-			break;
+		case WGHT_RAWCOUNTS :
+		val = get_redundancy(refl);
+		break;
 
-			case WGHT_RAWCOUNTS :
-			val = get_redundancy(refl);
-			break;
-
-			default :
-			ERROR("Invalid weighting.\n");
-			abort();
-
-		}
+		default :
+		ERROR("Invalid weighting.\n");
+		abort();
 
-		if ( val > max ) max = val;
 	}
 
-	return max;
+	return val;
 }
 
 
-static void draw_circles(double xh, double xk, double xl,
-                         double yh, double yk, double yl,
-                         signed int zh, signed int zk, signed int zl,
-                         RefList *list, const SymOpList *sym,
-                         cairo_t *dctx, int wght, double boost, int colscale,
-                         UnitCell *cell, double radius, double theta,
-                         double as, double bs, double cx, double cy,
-                         double scale, double max_val, signed int zone)
+/* A reflection in the zone, in terms of the 2D basis of the plot */
+struct zone_spot
+{
+	double xi;
+	double yi;
+	double val;
+};
+
+
+/* Calculates the matrix which takes indices to coordinates in the basis
+ * (x, y, z), where z is along the zone axis */
+static int zone_basis_inverse(double xh, double xk, double xl,
+                              double yh, double yk, double yl,
+                              signed int zh, signed int zk, signed int zl,
+                              UnitCell *cell, gsl_matrix *binv)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	SymOpMask *m;
 	gsl_matrix *basis;
-	gsl_vector *ind;
 	gsl_permutation *p;
 	int signum;
 	double adx, ady, adz;
@@ -197,19 +179,17 @@ static void draw_circles(double xh, double xk, double xl,
 	gsl_matrix *A;
 	double za_len;
 
-	m = new_symopmask(sym);
-
 	/* Get the zone axis direction in cartesian coordinates */
 	za = gsl_vector_alloc(3);
 	if ( za == NULL ) {
 		ERROR("Couldn't allocate za\n");
-		return;
+		return 1;
 	}
 	if ( cell_get_cartesian(cell, &adx, &ady, &adz,
 	                              &bdx, &bdy, &bdz,
 	                              &cdx, &cdy, &cdz) ) {
 		ERROR("Couldn't get cartesian parameters\n");
-		return;
+		return 1;
 	}
 	gsl_vector_set(za, 0, adx*zh + bdx*zk + cdx*zl);
 	gsl_vector_set(za, 1, ady*zh + bdy*zk + cdy*zl);
@@ -227,13 +207,13 @@ static void draw_circles(double xh, double xk, double xl,
 	                               &bsx, &bsy, &bsz,
 	                               &csx, &csy, &csz) ) {
 		ERROR("Couldn't get reciprocal parameters\n");
-		return;
+		return 1;
 	}
 
 	A = gsl_matrix_alloc(3, 3);
 	if ( A == NULL ) {
 		ERROR("Couldn't allocate A\n");
-		return;
+		return 1;
 	}
 	gsl_matrix_set(A, 0, 0, asx);
 	gsl_matrix_set(A, 1, 0, asy);
@@ -257,7 +237,7 @@ static void draw_circles(double xh, double xk, double xl,
 	gsl_matrix_free(A);
 
 	basis = gsl_matrix_alloc(3, 3);
-	if ( basis == NULL ) return;
+	if ( basis == NULL ) return 1;
 
 	gsl_matrix_set(basis, 0, 0, xh);
 	gsl_matrix_set(basis, 1, 0, xk);
@@ -269,92 +249,129 @@ static void draw_circles(double xh, double xk, double xl,
 	gsl_matrix_set(basis, 1, 2, gsl_vector_get(za, 1));
 	gsl_matrix_set(basis, 2, 2, gsl_vector_get(za, 2));
 	gsl_linalg_LU_decomp(basis, p, &signum);
+	gsl_linalg_LU_invert(basis, p, binv);
 
 	gsl_vector_free(za);
+	gsl_matrix_free(basis);
+	gsl_permutation_free(p);
 
-	ind = gsl_vector_alloc(3);
-	if ( ind == NULL ) return;
+	return 0;
+}
+
+
+/* Finds the reflections in the zone, including symmetry equivalents, in a
+ * single pass through the list.  Also finds the maximum value over the whole
+ * list, for the colour scale. */
+static struct zone_spot *find_zone_spots(RefList *list, const SymOpList *sym,
+                                         int wght, gsl_matrix *binv,
+                                         signed int zh, signed int zk,
+                                         signed int zl, signed int zone,
+                                         int *pn, double *pmax)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	SymOpMask *m;
+	struct zone_spot *spots;
+	int n_spots = 0;
+	int max_spots = 1024;
+	double max = -INFINITY;
+	double b00, b01, b02, b10, b11, b12;
+
+	b00 = gsl_matrix_get(binv, 0, 0);
+	b01 = gsl_matrix_get(binv, 0, 1);
+	b02 = gsl_matrix_get(binv, 0, 2);
+	b10 = gsl_matrix_get(binv, 1, 0);
+	b11 = gsl_matrix_get(binv, 1, 1);
+	b12 = gsl_matrix_get(binv, 1, 2);
+
+	spots = malloc(max_spots*sizeof(struct zone_spot));
+	if ( spots == NULL ) return NULL;
+
+	m = new_symopmask(sym);
 
-	/* Iterate over all reflections */
 	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		double u, v, val;
+		double val;
 		signed int ha, ka, la;
 		int i, n;
-		double r, g, b;
 
 		get_indices(refl, &ha, &ka, &la);
 
 		special_position(sym, m, ha, ka, la);
 		n = num_equivs(sym, m);
 
+		val = refl_value(refl, wght, n);
+		if ( val > max ) max = val;
+
 		for ( i=0; i<n; i++ ) {
 
 			signed int h, k, l;
-			double xi, yi;
 
 			get_equiv(sym, m, i, ha, ka, la, &h, &k, &l);
 
 			/* Is the reflection in the zone? */
-			if ( h*zh + k*zk + l*zl != zone) continue;
+			if ( h*zh + k*zk + l*zl != zone ) continue;
+
+			if ( n_spots == max_spots ) {
+				struct zone_spot *spots_new;
+				max_spots *= 2;
+				spots_new = realloc(spots, max_spots*sizeof(struct zone_spot));
+				if ( spots_new == NULL ) {
+					ERROR("Failed to allocate spot list\n");
+					free(spots);
+					free_symopmask(m);
+					return NULL;
+				}
+				spots = spots_new;
+			}
 
-			gsl_vector_set(ind, 0, h);
-			gsl_vector_set(ind, 1, k);
-			gsl_vector_set(ind, 2, l);
-			gsl_linalg_LU_svx(basis, p, ind);
-			xi = gsl_vector_get(ind, 0);
-			yi = gsl_vector_get(ind, 1);
+			spots[n_spots].xi = b00*h + b01*k + b02*l;
+			spots[n_spots].yi = b10*h + b11*k + b12*l;
+			spots[n_spots].val = val;
+			n_spots++;
 
-			switch ( wght) {
+		}
 
-				case WGHT_I :
-				val = get_intensity(refl);
-				break;
+	}
 
-				case WGHT_SQRTI :
-				val = get_intensity(refl);
-				val = (val>0.0) ? sqrt(val) : 0.0;
-				break;
+	free_symopmask(m);
 
-				case WGHT_COUNTS :
-				val = get_redundancy(refl);
-				val /= (double)n;
-				break;
+	*pn = n_spots;
+	*pmax = max;
+	return spots;
+}
 
-				case WGHT_RAWCOUNTS :
-				val = get_redundancy(refl);
-				break;
 
-				default :
-				ERROR("Invalid weighting.\n");
-				abort();
+static void draw_circles(struct zone_spot *spots, int n_spots,
+                         cairo_t *dctx, double boost, int colscale,
+                         double radius, double theta,
+                         double as, double bs, double cx, double cy,
+                         double scale, double max_val)
+{
+	int i;
+	const double sin_theta = sin(theta);
+	const double cos_theta = cos(theta);
 
-			}
+	for ( i=0; i<n_spots; i++ ) {
 
-			/* Absolute location in image based on 2D basis */
-			u = (double)xi*as*sin(theta);
-			v = (double)xi*as*cos(theta) + (double)yi*bs;
+		double u, v;
+		double r, g, b;
 
-			cairo_arc(dctx, ((double)cx)+u*scale,
-				        ((double)cy)+v*scale,
-				        radius, 0.0, 2.0*M_PI);
+		/* Absolute location in image based on 2D basis */
+		u = spots[i].xi*as*sin_theta;
+		v = spots[i].xi*as*cos_theta + spots[i].yi*bs;
 
-			colscale_lookup(val, max_val/boost, colscale,
-			                &r, &g, &b);
-			cairo_set_source_rgb(dctx, r, g, b);
-			cairo_fill(dctx);
+		cairo_arc(dctx, cx+u*scale, cy+v*scale,
+		          radius, 0.0, 2.0*M_PI);
 
-		}
+		colscale_lookup(spots[i].val, max_val/boost, colscale,
+		                &r, &g, &b);
+		cairo_set_source_rgb(dctx, r, g, b);
+		cairo_fill(dctx);
 
 	}
-
-	gsl_matrix_free(basis);
-	gsl_vector_free(ind);
-	gsl_permutation_free(p);
-
-	free_symopmask(m);
 }
 
 
@@ -436,6 +453,9 @@ static void render_za(UnitCell *cell, RefList *list,
 	int png;
 	double rmin, rmax;
 	int i;
+	gsl_matrix *binv;
+	struct zone_spot *spots;
+	int n_spots;
 
 	/* Vector product to determine the zone axis. */
 	zh = yk*xl - yl*xk;
@@ -469,9 +489,25 @@ static void render_za(UnitCell *cell, RefList *list,
 	       " (d = %.2f - %.2f A)\n",
 	       rmin/1e9, rmax/1e9, (1.0/rmin)/1e-10, (1.0/rmax)/1e-10);
 
-	max_val = max_value(list, wght, sym);
+	binv = gsl_matrix_alloc(3, 3);
+	if ( binv == NULL ) return;
+	if ( zone_basis_inverse(xh, xk, xl, yh, yk, yl, zh, zk, zl,
+	                        cell, binv) )
+	{
+		gsl_matrix_free(binv);
+		return;
+	}
+
+	spots = find_zone_spots(list, sym, wght, binv, zh, zk, zl, zone,
+	                        &n_spots, &max_val);
+	gsl_matrix_free(binv);
+	if ( spots == NULL ) {
+		ERROR("Couldn't find reflections in the zone.\n");
+		return;
+	}
 	if ( max_val <= 0.0 ) {
 		STATUS("Couldn't find max value.\n");
+		free(spots);
 		return;
 	}
 
@@ -508,6 +544,7 @@ static void render_za(UnitCell *cell, RefList *list,
 	if ( cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ) {
 		ERROR("Couldn't create Cairo surface\n");
 		cairo_surface_destroy(surface);
+		free(spots);
 		return;
 	}
 
@@ -515,6 +552,7 @@ static void render_za(UnitCell *cell, RefList *list,
 	if ( cairo_status(dctx) != CAIRO_STATUS_SUCCESS ) {
 		ERROR("Couldn't create Cairo context\n");
 		cairo_surface_destroy(surface);
+		free(spots);
 		return;
 	}
 
@@ -531,10 +569,9 @@ static void render_za(UnitCell *cell, RefList *list,
 	cx = 532.0 - size.width;
 	cy = 512.0 - 20.0;
 
-	draw_circles(xh, xk, xl, yh, yk, yl, zh, zk, zl,
-	             list, sym, dctx, wght, boost, colscale, cell,
-	             max_r, theta, as, bs, cx, cy, scale,
-	             max_val, zone);
+	draw_circles(spots, n_spots, dctx, boost, colscale,
+	             max_r, theta, as, bs, cx, cy, scale, max_val);
+	free(spots);
 
 	/* Resolution rings */
 	for ( i=0; i<rings->n_rings; i++ ) {
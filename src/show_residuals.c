@@ -120,17 +120,6 @@ struct gm_ave
 };
 
 
-static int readint(FILE *fh)
-{
-	int r;
-	if ( fread(&r, 4, 1, fh) != 1 ) {
-		ERROR("Failed to read.\n");
-		exit(1);
-	}
-	return r;
-}
-
-
 static void find_markers(int *arri, int start, int len, int *mid, int *next)
 {
 	int i;
@@ -203,48 +192,26 @@ static int read_file(const char *filename,
                      int n_groups,
                      struct detgeom *detgeom)
 {
-	FILE *fh;
+	MilleReader *r;
 	int n_records = 0;
 
-	fh = fopen(filename, "rb");
-	if ( fh == NULL ) {
+	r = crystfel_mille_reader_open(filename);
+	if ( r == NULL ) {
 		ERROR("Couldn't open '%s'\n", filename);
 		return 0;
 	}
 
 	do {
 
-		int nw, arrlen;
+		int arrlen;
 		float *arrf;
 		int *arri;
+		int rval;
 
-		if ( fread(&nw, sizeof(int), 1, fh) != 1 ) {
-			if ( feof(fh) ) {
-				break;
-			} else {
-				ERROR("Failed to read record header\n");
-				return 0;
-			}
-		}
-
-		arrlen = (nw-2)/2;
-
-		arrf = malloc(arrlen*sizeof(float));
-		arri = malloc(arrlen*sizeof(int));
-		if ( (arri == NULL) || (arrf == NULL) ) {
-			ERROR("Failed to allocate memory\n");
-			return 0;
-		}
-
-		readint(fh);  /* And ignore it */
-		if ( fread(arrf, 4, arrlen, fh) != arrlen ) {
-			ERROR("Failed to read float array\n");
-			return 0;
-		}
-
-		readint(fh);  /* And ignore it */
-		if ( fread(arri, 4, arrlen, fh) != arrlen ) {
-			ERROR("Failed to read integer array\n");
+		rval = crystfel_mille_reader_next(r, &arrlen, &arrf, &arri);
+		if ( rval == 0 ) break;
+		if ( rval < 0 ) {
+			crystfel_mille_reader_close(r);
 			return 0;
 		}
 
@@ -292,11 +259,9 @@ static int read_file(const char *filename,
 
 		}
 
-		free(arrf);
-		free(arri);
-
-	} while ( !feof(fh) );
+	} while ( 1 );
 
+	crystfel_mille_reader_close(r);
 	STATUS("Read %i records from %s\n", n_records, filename);
 	return n_records;
 }
@@ -53,9 +53,22 @@
 /* Maximum number of series which can overlap at once */
 #define MAX_SER 8
 
+/* Lattice vectors of one crystal: all sums of -1, 0 or +1 times each of the
+ * real-space axes, which are the candidates for each axis after permutation */
+struct lattice_vecs
+{
+	char    cen;
+	double  len[27];
+	double  dir[27][3];  /* Unit vectors */
+};
+
+/* Index of the plain a, b and c axes in lattice_vecs */
+static const int axis_vec[3] = {22, 16, 14};
+
 struct window
 {
 	struct image   *img;
+	struct lattice_vecs **lv;  /* For each crystal of each frame */
 	int             ws;
 	int             add_ptr;   /* First empty slot (for adding frames) */
 	int             join_ptr;  /* First unjoined slot */
@@ -294,6 +307,105 @@ static int crystal_used(struct window *win, int pos, int cn)
 }
 
 
+static void set_lattice_vecs(struct lattice_vecs *lv, UnitCell *cell)
+{
+	double cv[3][3];
+	int c;
+
+	cell_get_cartesian(cell, &cv[0][0], &cv[0][1], &cv[0][2],
+	                         &cv[1][0], &cv[1][1], &cv[1][2],
+	                         &cv[2][0], &cv[2][1], &cv[2][2]);
+
+	lv->cen = cell_get_centering(cell);
+
+	for ( c=0; c<27; c++ ) {
+
+		const int c0 = c/9 - 1;
+		const int c1 = (c/3)%3 - 1;
+		const int c2 = c%3 - 1;
+		double v[3];
+		int j;
+
+		for ( j=0; j<3; j++ ) {
+			v[j] = c0*cv[0][j] + c1*cv[1][j] + c2*cv[2][j];
+		}
+
+		lv->len[c] = modulus(v[0], v[1], v[2]);
+		for ( j=0; j<3; j++ ) {
+			lv->dir[c][j] = (c == 13) ? 0.0 : v[j]/lv->len[c];
+		}
+
+	}
+}
+
+
+/* Lattice vectors for all the crystals in a frame, calculated once when the
+ * frame enters the window */
+static struct lattice_vecs *make_lattice_vecs(struct image *image)
+{
+	struct lattice_vecs *lv;
+	int i;
+
+	if ( image->n_crystals == 0 ) return NULL;
+
+	lv = malloc(image->n_crystals*sizeof(struct lattice_vecs));
+	if ( lv == NULL ) {
+		ERROR("Failed to allocate lattice vectors\n");
+		exit(1);
+	}
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+		set_lattice_vecs(&lv[i],
+		                 crystal_get_cell(image->crystals[i].cr));
+	}
+
+	return lv;
+}
+
+
+/* Returns zero if there is no way that compare_permuted_cell_parameters_and_
+ * orientation() could match 'cell' to 'ref'.  This is much cheaper than the
+ * full comparison, and rules out nearly all pairs of unrelated crystals.  The
+ * tolerances are widened very slightly, so that rounding can never make this
+ * reject a pair which the full comparison would accept. */
+static int could_match(const struct lattice_vecs *cell,
+                       const struct lattice_vecs *ref, const double *tols)
+{
+	const double slack = 1e-6;
+	int k;
+
+	if ( cell->cen != ref->cen ) return 0;
+
+	for ( k=0; k<3; k++ ) {
+
+		const int r = axis_vec[k];
+		const double mincos = cos(tols[3+k] + slack);
+		int c;
+
+		for ( c=0; c<27; c++ ) {
+
+			double cosine;
+
+			if ( c == 13 ) continue;
+
+			if ( fabs(cell->len[c] - ref->len[r])
+			     > (tols[k]+slack)*cell->len[c] ) continue;
+
+			cosine = cell->dir[c][0]*ref->dir[r][0]
+			       + cell->dir[c][1]*ref->dir[r][1]
+			       + cell->dir[c][2]*ref->dir[r][2];
+			if ( cosine >= mincos ) break;
+
+		}
+
+		if ( c == 27 ) return 0;
+
+	}
+
+	return 1;
+}
+
+
 static IntegerMatrix *try_all(struct window *win, int n1, int n2,
                               int *c1, int *c2)
 {
@@ -313,22 +425,26 @@ static IntegerMatrix *try_all(struct window *win, int n1, int n2,
 	i2 = &win->img[n2];
 
 	for ( i=0; i<i1->n_crystals; i++ ) {
-	for ( j=0; j<i2->n_crystals; j++ ) {
 
-		if ( compare_permuted_cell_parameters_and_orientation(crystal_get_cell(i1->crystals[i].cr),
-		                                                      crystal_get_cell(i2->crystals[j].cr),
-		                                                      tols, &m) )
-		{
-			if ( !crystal_used(win, n1, i)
-			  && !crystal_used(win, n2, j) )
+		if ( crystal_used(win, n1, i) ) continue;
+
+		for ( j=0; j<i2->n_crystals; j++ ) {
+
+			if ( crystal_used(win, n2, j) ) continue;
+
+			if ( !could_match(&win->lv[n1][i], &win->lv[n2][j],
+			                  tols) ) continue;
+
+			if ( compare_permuted_cell_parameters_and_orientation(crystal_get_cell(i1->crystals[i].cr),
+			                                                      crystal_get_cell(i2->crystals[j].cr),
+			                                                      tols, &m) )
 			{
 				*c1 = i;
 				*c2 = j;
 				return m;
 			}
-		}
 
-	}
+		}
 	}
 
 	return NULL;
@@ -370,6 +486,7 @@ static int try_join(struct window *win, int sn)
 	int j;
 	Crystal *cr;
 	UnitCell *ref;
+	struct lattice_vecs ref_lv;
 	const int sp = win->join_ptr - 1;
 	const double tols[] = {0.1, 0.1, 0.1,
 	                       deg2rad(5.0), deg2rad(5.0), deg2rad(5.0)};
@@ -378,9 +495,12 @@ static int try_join(struct window *win, int sn)
 	 * series */
 	cr = win->img[sp].crystals[win->ser[sn][sp]].cr;
 	ref = cell_transform_intmat(crystal_get_cell(cr), win->mat[sn][sp]);
+	set_lattice_vecs(&ref_lv, ref);
 
 	for ( j=0; j<win->img[win->join_ptr].n_crystals; j++ ) {
 		Crystal *cr2;
+		if ( !could_match(&ref_lv, &win->lv[win->join_ptr][j],
+		                  tols) ) continue;
 		cr2 = win->img[win->join_ptr].crystals[j].cr;
 		if ( compare_permuted_cell_parameters_and_orientation(ref, crystal_get_cell(cr2),
 		                                                      tols,
@@ -495,7 +615,9 @@ static void add_to_window(struct image *cur, struct window *win,
 			win->ws += sf;
 			win->img = realloc(win->img,
 			                   win->ws*sizeof(struct image));
-			if ( win->img == NULL ) {
+			win->lv = realloc(win->lv,
+			                  win->ws*sizeof(struct lattice_vecs *));
+			if ( (win->img == NULL) || (win->lv == NULL) ) {
 				ERROR("Failed to expand series buffers\n");
 				exit(1);
 			}
@@ -541,10 +663,13 @@ static void add_to_window(struct image *cur, struct window *win,
 				if ( win->img[iser].serial != 0 ) {
 					free_all_crystals(&win->img[iser]);
 				}
+				free(win->lv[iser]);
 			}
 
 			memmove(win->img, win->img+sf,
 			        (win->ws-sf)*sizeof(struct image));
+			memmove(win->lv, win->lv+sf,
+			        (win->ws-sf)*sizeof(struct lattice_vecs *));
 
 			for ( iser=0; iser<MAX_SER; iser++ ) {
 				memmove(win->ser[iser], win->ser[iser]+sf,
@@ -557,6 +682,7 @@ static void add_to_window(struct image *cur, struct window *win,
 		for ( iwin=0; iwin<sf; iwin++ ) {
 			int j;
 			win->img[win->ws-sf+iwin].serial = 0;
+			win->lv[win->ws-sf+iwin] = NULL;
 			for ( j=0; j<MAX_SER; j++ ) {
 				win->ser[j][win->ws-sf+iwin] = -1;
 				win->mat[j][win->ws-sf+iwin] = NULL;
@@ -566,6 +692,8 @@ static void add_to_window(struct image *cur, struct window *win,
 	}
 
 	win->img[pos] = *cur;
+	free(win->lv[pos]);
+	win->lv[pos] = make_lattice_vecs(cur);
 	if ( pos >= win->add_ptr ) win->add_ptr = pos+1;
 }
 
@@ -688,7 +816,8 @@ int main(int argc, char *argv[])
 	/* Allocate initial window */
 	win.ws = default_window_size;
 	win.img = calloc(win.ws, sizeof(struct image));
-	if ( win.img == NULL ) {
+	win.lv = calloc(win.ws, sizeof(struct lattice_vecs *));
+	if ( (win.img == NULL) || (win.lv == NULL) ) {
 		ERROR("Failed to allocate series buffers\n");
 		return 1;
 	}
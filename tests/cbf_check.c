@@ -0,0 +1,282 @@
+/*
+ * cbf_check.c
+ *
+ * Check and benchmark CBF byte offset decoding, using synthetic frames
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+#include <libcrystfel-config.h>
+
+/* Same condition as in image-cbf.c, which only reads gzipped CBFs if this
+ * is set */
+#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
+#define CBF_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <image.h>
+#include <datatemplate.h>
+#include <utils.h>
+
+/* Pilatus 6M-sized frame */
+#define W (2463)
+#define H (2527)
+
+/* Number of times to read each file for the timing */
+#define N_REPEATS (5)
+
+
+static const char *geom =
+	"photon_energy = 12000 eV\n"
+	"clen = 0.2\n"
+	"res = 5814\n"
+	"adu_per_photon = 1\n"
+	"p0/min_fs = 0\n"
+	"p0/max_fs = 2462\n"
+	"p0/min_ss = 0\n"
+	"p0/max_ss = 2526\n"
+	"p0/fs = x\n"
+	"p0/ss = y\n"
+	"p0/corner_x = -1231\n"
+	"p0/corner_y = -1263\n";
+
+
+/* Mostly low counts, as for a real diffraction pattern, plus some Bragg
+ * peaks, masked pixels and a few extreme values, so that all the escape
+ * sequences get used */
+static void make_frame(int32_t *frame, gsl_rng *rng)
+{
+	int i;
+
+	for ( i=0; i<W*H; i++ ) {
+		frame[i] = gsl_ran_poisson(rng, 3.0);
+	}
+
+	for ( i=0; i<500; i++ ) {
+		int idx = gsl_rng_uniform_int(rng, W*H);
+		frame[idx] = gsl_rng_uniform_int(rng, 1000000);
+	}
+
+	/* Module gaps */
+	for ( i=0; i<W*H; i++ ) {
+		if ( (i % W) % 495 > 486 ) frame[i] = -1;
+	}
+
+	frame[1000] = INT32_MAX;
+	frame[1001] = INT32_MIN+1;
+	frame[1002] = INT32_MAX;
+	frame[W*H-1] = 1;
+}
+
+
+static void put_le(unsigned char *out, size_t *pos, int64_t val, int nbytes)
+{
+	int i;
+	for ( i=0; i<nbytes; i++ ) {
+		out[(*pos)++] = (val >> (8*i)) & 0xff;
+	}
+}
+
+
+static size_t encode_byte_offset(const int32_t *frame, unsigned char *out)
+{
+	size_t pos = 0;
+	int64_t last = 0;
+	int i;
+
+	for ( i=0; i<W*H; i++ ) {
+
+		int64_t delta = (int64_t)frame[i] - last;
+		last = frame[i];
+
+		if ( (delta > -128) && (delta < 128) ) {
+			put_le(out, &pos, delta, 1);
+			continue;
+		}
+		put_le(out, &pos, -128, 1);
+
+		if ( (delta > INT16_MIN) && (delta <= INT16_MAX) ) {
+			put_le(out, &pos, delta, 2);
+			continue;
+		}
+		put_le(out, &pos, INT16_MIN, 2);
+
+		if ( (delta > INT32_MIN) && (delta <= INT32_MAX) ) {
+			put_le(out, &pos, delta, 4);
+			continue;
+		}
+		put_le(out, &pos, INT32_MIN, 4);
+		put_le(out, &pos, delta, 8);
+
+	}
+
+	return pos;
+}
+
+
+static size_t make_cbf(const int32_t *frame, unsigned char *out)
+{
+	size_t len;
+	int hdr_len;
+	unsigned char *data;
+	char hdr[4096];
+
+	data = malloc(15*W*H);
+	len = encode_byte_offset(frame, data);
+
+	hdr_len = snprintf(hdr, 4096,
+	                   "###CBF: VERSION 1.5, synthetic\r\n"
+	                   "\r\n"
+	                   "data_synthetic\r\n"
+	                   "\r\n"
+	                   "_array_data.data\r\n"
+	                   ";\r\n"
+	                   "--CIF-BINARY-FORMAT-SECTION--\r\n"
+	                   "Content-Type: application/octet-stream;\r\n"
+	                   "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+	                   "Content-Transfer-Encoding: BINARY\r\n"
+	                   "X-Binary-Size: %zu\r\n"
+	                   "X-Binary-ID: 1\r\n"
+	                   "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+	                   "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n"
+	                   "X-Binary-Number-of-Elements: %i\r\n"
+	                   "X-Binary-Size-Fastest-Dimension: %i\r\n"
+	                   "X-Binary-Size-Second-Dimension: %i\r\n"
+	                   "X-Binary-Size-Padding: 4095\r\n"
+	                   "\r\n"
+	                   "\x0c\x1a\x04\xd5",
+	                   len, W*H, W, H);
+
+	memcpy(out, hdr, hdr_len);
+	memcpy(out+hdr_len, data, len);
+	memset(out+hdr_len+len, 0, 4095);
+	free(data);
+
+	return hdr_len+len+4095;
+}
+
+
+static double now()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static int check_file(DataTemplate *dtempl, const char *filename,
+                      const int32_t *frame, size_t file_size)
+{
+	int i;
+	double t_start, t;
+	int fail = 0;
+
+	t_start = now();
+	for ( i=0; i<N_REPEATS; i++ ) {
+
+		struct image *image;
+		int j;
+		int nbad = 0;
+
+		image = image_read(dtempl, filename, NULL, 0, 1, NULL);
+		if ( image == NULL ) {
+			ERROR("Failed to read %s\n", filename);
+			return 1;
+		}
+
+		for ( j=0; j<W*H; j++ ) {
+			if ( image->dp[0][j] != (float)frame[j] ) nbad++;
+		}
+		if ( nbad > 0 ) {
+			ERROR("%s: %i pixels wrong\n", filename, nbad);
+			fail = 1;
+		}
+
+		image_free(image);
+
+	}
+	t = (now() - t_start)/N_REPEATS;
+
+	STATUS("%s: %.1f ms per frame, %.0f MB/s\n", filename, t*1e3,
+	       file_size/t/1e6);
+
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int32_t *frame;
+	unsigned char *cbf;
+	size_t cbf_len;
+	gsl_rng *rng;
+	DataTemplate *dtempl;
+	FILE *fh;
+	int fail = 0;
+
+	frame = malloc(W*H*sizeof(int32_t));
+	cbf = malloc(15*W*H+8192);
+	if ( (frame == NULL) || (cbf == NULL) ) return 1;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	make_frame(frame, rng);
+	gsl_rng_free(rng);
+
+	cbf_len = make_cbf(frame, cbf);
+
+	dtempl = data_template_new_from_string(geom);
+	if ( dtempl == NULL ) {
+		ERROR("Failed to create data template\n");
+		return 1;
+	}
+
+	fh = fopen("cbf_check.cbf", "wb");
+	if ( fh == NULL ) return 1;
+	fwrite(cbf, 1, cbf_len, fh);
+	fclose(fh);
+	fail += check_file(dtempl, "cbf_check.cbf", frame, cbf_len);
+	unlink("cbf_check.cbf");
+
+	#ifdef CBF_USE_ZLIB
+	gzFile gzfh;
+	gzfh = gzopen("cbf_check.cbf.gz", "wb");
+	if ( gzfh == NULL ) return 1;
+	gzwrite(gzfh, cbf, cbf_len);
+	gzclose(gzfh);
+	fail += check_file(dtempl, "cbf_check.cbf.gz", frame, cbf_len);
+	unlink("cbf_check.cbf.gz");
+	#endif
+
+	data_template_free(dtempl);
+	free(frame);
+	free(cbf);
+
+	return fail;
+}
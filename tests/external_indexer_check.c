@@ -0,0 +1,265 @@
+/*
+ * external_indexer_check.c
+ *
+ * Check that a long-lived external indexer gets reused and restarted
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <image.h>
+#include <utils.h>
+#include <indexers/dirax.h>
+
+
+/* Stand-in for DirAx, which finds the cell whose a axis length was in the
+ * file "cell" when the frame was read.  It counts how many times it has been
+ * started, and can be told to crash.  It can also be told to offer no cells,
+ * in which case it picks one by itself after being told to, and prints it
+ * late. */
+static const char *stub =
+	"#!/bin/sh\n"
+	"print_cell() {\n"
+	"  echo \"R D\"\n"
+	"  echo \"0.0 0.0 0.0 $a 0.0 0.0\"\n"
+	"  echo \"0.0 0.0 0.0 0.0 20.0 0.0\"\n"
+	"  echo \"0.0 0.0 0.0 0.0 0.0 30.0\"\n"
+	"}\n"
+	"echo start >> \"$STUB_DIR/starts\"\n"
+	"echo \"dirax (stub)\"\n"
+	"while true; do\n"
+	"  printf 'Dirax> '\n"
+	"  read cmd arg || exit 0\n"
+	"  case \"$cmd\" in\n"
+	"  read)\n"
+	"    a=$(cat \"$STUB_DIR/cell\")\n"
+	"    if [ -e \"$STUB_DIR/die\" ]; then rm -f \"$STUB_DIR/die\"; exit 1; fi\n"
+	"    ;;\n"
+	"  go)\n"
+	"    if [ -e \"$STUB_DIR/crash\" ]; then rm -f \"$STUB_DIR/crash\"; exit 1; fi\n"
+	"    ;;\n"
+	"  acl)\n"
+	"    if [ -e \"$STUB_DIR/giveup\" ]; then\n"
+	"      rm -f \"$STUB_DIR/giveup\"\n"
+	"      printf 'acl/auto [1]: '\n"
+	"      read n || exit 0\n"
+	"      echo \"   1   20   $a 20.0 30.0 90.0 90.0 90.0   1\"\n"
+	"      print_cell\n"
+	"    else\n"
+	"      echo \"   1   20   $a 20.0 30.0 90.0 90.0 90.0   1\"\n"
+	"      printf 'acl/auto [1]: '\n"
+	"      read n || exit 0\n"
+	"    fi\n"
+	"    ;;\n"
+	"  cell)\n"
+	"    print_cell\n"
+	"    ;;\n"
+	"  exit)\n"
+	"    exit 0\n"
+	"    ;;\n"
+	"  esac\n"
+	"done\n";
+
+
+static char stub_dir[] = "external_indexer_check.XXXXXX";
+
+
+static int count_starts()
+{
+	FILE *fh;
+	char filename[1024];
+	char line[64];
+	int n = 0;
+
+	snprintf(filename, 1023, "%s/starts", stub_dir);
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return 0;
+	while ( fgets(line, 64, fh) != NULL ) n++;
+	fclose(fh);
+	return n;
+}
+
+
+static void make_flag(const char *name)
+{
+	FILE *fh;
+	char filename[1024];
+
+	snprintf(filename, 1023, "%s/%s", stub_dir, name);
+	fh = fopen(filename, "w");
+	if ( fh != NULL ) fclose(fh);
+}
+
+
+/* Each frame gets a different cell, with axis length "a" in Angstroms */
+static int index_frame(struct image *image, void *priv, double a_exp)
+{
+	int r;
+	FILE *fh;
+	char filename[1024];
+
+	snprintf(filename, 1023, "%s/cell", stub_dir);
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) return 0;
+	fprintf(fh, "%.1f\n", a_exp);
+	fclose(fh);
+
+	free_all_crystals(image);
+	r = run_dirax(image, priv);
+
+	if ( image->n_crystals > 0 ) {
+		double a, b, c, al, be, ga;
+		cell_get_parameters(crystal_get_cell(image->crystals[0].cr),
+		                    &a, &b, &c, &al, &be, &ga);
+		if ( (fabs(a-a_exp*1e-10) > 1e-12) || (fabs(b-20e-10) > 1e-12)
+		  || (fabs(c-30e-10) > 1e-12) )
+		{
+			ERROR("Wrong cell: a = %f A (expected %f A)\n",
+			      a*1e10, a_exp);
+			return 0;
+		}
+	}
+
+	return r && (image->n_crystals == 1);
+}
+
+
+static int check(int ok, int starts, const char *what)
+{
+	int n = count_starts();
+
+	if ( !ok ) {
+		ERROR("%s: indexing failed\n", what);
+		return 1;
+	}
+	if ( n != starts ) {
+		ERROR("%s: stub started %i times (expected %i)\n",
+		      what, n, starts);
+		return 1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct image *image;
+	IndexingMethod indm = INDEXING_DIRAX;
+	void *priv;
+	char filename[1024];
+	char *path;
+	FILE *fh;
+	int i;
+	int fail = 0;
+
+	if ( mkdtemp(stub_dir) == NULL ) return 1;
+	snprintf(filename, 1023, "%s/dirax", stub_dir);
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) return 1;
+	fputs(stub, fh);
+	fclose(fh);
+	chmod(filename, S_IRWXU);
+
+	/* The indexer runs in its own scratch folder, so the stub needs
+	 * absolute paths */
+	path = malloc(strlen(getenv("PATH")) + 2048);
+	snprintf(path, 1024, "%s/%s", getcwd(filename, 1024), stub_dir);
+	setenv("STUB_DIR", path, 1);
+	strcat(path, ":");
+	strcat(path, getenv("PATH"));
+	setenv("PATH", path, 1);
+	free(path);
+
+	image = image_new();
+	image->lambda = 1e-10;
+	image->detgeom = calloc(1, sizeof(struct detgeom));
+	image->detgeom->n_panels = 1;
+	image->detgeom->panels = calloc(1, sizeof(struct detgeom_panel));
+	image->detgeom->panels[0].w = 100;
+	image->detgeom->panels[0].h = 100;
+	image->detgeom->panels[0].fsx = 1.0;
+	image->detgeom->panels[0].ssy = 1.0;
+	image->detgeom->panels[0].cnx = -50.0;
+	image->detgeom->panels[0].cny = -50.0;
+	image->detgeom->panels[0].cnz = 1000.0;
+	image->detgeom->panels[0].pixel_pitch = 100e-6;
+	image->features = image_feature_list_new();
+	image->owns_peaklist = 1;
+	for ( i=0; i<30; i++ ) {
+		image_add_feature(image->features, 3*i, 2*i, 0, 100.0, NULL);
+	}
+
+	/* Probing runs the stub once */
+	priv = dirax_prepare(&indm, NULL);
+	if ( priv == NULL ) {
+		ERROR("Failed to prepare DirAx\n");
+		return 1;
+	}
+
+	/* Many frames, one process */
+	for ( i=0; i<5; i++ ) {
+		fail += check(index_frame(image, priv, 10.0+i), 2,
+		              "Normal frame");
+	}
+
+	/* When DirAx can't offer a good enough cell, the frame fails.  What
+	 * DirAx says afterwards must not end up in the next frame */
+	make_flag("giveup");
+	if ( index_frame(image, priv, 15.0) ) {
+		ERROR("Frame should have failed\n");
+		fail++;
+	}
+	fail += check(index_frame(image, priv, 16.0), 2, "After giving up");
+
+	/* A crash part way through loses that frame, and the next frame gets
+	 * a new process */
+	make_flag("crash");
+	if ( index_frame(image, priv, 17.0) ) {
+		ERROR("Frame should have failed\n");
+		fail++;
+	}
+	fail += check(index_frame(image, priv, 18.0), 3, "After crash");
+
+	/* If the process has gone away before the frame gets started, the
+	 * frame gets retried */
+	make_flag("die");
+	fail += check(index_frame(image, priv, 19.0), 4, "After early exit");
+	fail += check(index_frame(image, priv, 20.0), 4, "Normal frame");
+
+	dirax_cleanup(priv);
+	image_free(image);
+
+	snprintf(filename, 1023, "%s/starts", stub_dir);
+	unlink(filename);
+	snprintf(filename, 1023, "%s/cell", stub_dir);
+	unlink(filename);
+	snprintf(filename, 1023, "%s/dirax", stub_dir);
+	unlink(filename);
+	rmdir(stub_dir);
+
+	if ( fail ) return 1;
+	return 0;
+}
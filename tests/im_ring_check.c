@@ -0,0 +1,438 @@
+/*
+ * im_ring_check.c
+ *
+ * Check the shared memory ring buffers for stream output from workers
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stream.h>
+#include <utils.h>
+
+#include "../src/im-ring.h"
+
+
+/* Small enough that the records wrap around many times, and that some chunks
+ * have to be split */
+#define RING_SIZE (1024)
+#define N_CHUNKS (3000)
+#define N_WORKERS (2)
+
+/* Exit status of a worker which never found its ring full */
+#define NEVER_FULL (2)
+
+
+static double now()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+/* Chunk number 'idx' from 'worker', between about 50 bytes and three times
+ * the size of the ring */
+static char *make_chunk(int worker, int idx)
+{
+	char *chunk;
+	size_t fill, len;
+	size_t i;
+
+	fill = (idx*7919 + worker*104729) % (3*RING_SIZE);
+	if ( idx % 3 ) fill %= 100;
+
+	chunk = malloc(fill+256);
+	if ( chunk == NULL ) return NULL;
+
+	len = sprintf(chunk, STREAM_CHUNK_START_MARKER"\nworker=%i idx=%i\n",
+	              worker, idx);
+	for ( i=0; i<fill; i++ ) {
+		chunk[len++] = (i % 64 == 63) ? '\n' : 'a' + (idx+i) % 26;
+	}
+	len += sprintf(chunk+len, "\n"STREAM_CHUNK_END_MARKER"\n");
+
+	return chunk;
+}
+
+
+/* The worker side, writing like indexamajig: the stream is flushed after each
+ * chunk, and the worker waits for space before starting the next one.  The
+ * last chunk is left for im_ring_writer_close().  Returns the exit status. */
+static int write_chunks(const char *name, int worker, int doorbell,
+                        int first, int last, double delay)
+{
+	struct im_ring_writer *w;
+	FILE *fh;
+	int i;
+	int n_full = 0;
+
+	w = im_ring_writer_open(name, worker, doorbell);
+	if ( w == NULL ) return 1;
+	fh = im_ring_writer_fh(w);
+
+	/* Let the sandbox side start waiting */
+	usleep(delay*1e6);
+
+	for ( i=first; i<last; i++ ) {
+
+		char *chunk = make_chunk(worker, i);
+		size_t len;
+		if ( chunk == NULL ) return 1;
+
+		while ( im_ring_writer_flush(w) ) {
+			n_full++;
+			usleep(100);
+		}
+
+		/* Sometimes split the end marker between two writes */
+		len = strlen(chunk);
+		if ( i % 5 == 0 ) {
+			fwrite(chunk, 1, len-6, fh);
+			fflush(fh);
+			fwrite(chunk+len-6, 1, 6, fh);
+		} else {
+			fputs(chunk, fh);
+		}
+		free(chunk);
+
+		if ( i < last-1 ) {
+			fflush(fh);
+			im_ring_writer_flush(w);
+		}
+
+	}
+
+	/* Something incomplete, which should not appear */
+	fprintf(fh, STREAM_CHUNK_START_MARKER"\nincomplete\n");
+
+	fclose(fh);
+	im_ring_writer_close(w);
+	close(doorbell);
+
+	return (n_full > 0) ? 0 : NEVER_FULL;
+}
+
+
+/* Write part of a chunk which is too big for the ring, then die */
+static int write_and_die(const char *name, int worker, int doorbell)
+{
+	struct im_ring_writer *w;
+	FILE *fh;
+	char *chunk;
+
+	w = im_ring_writer_open(name, worker, doorbell);
+	if ( w == NULL ) return 1;
+	fh = im_ring_writer_fh(w);
+
+	chunk = malloc(4*RING_SIZE+1);
+	if ( chunk == NULL ) return 1;
+	memset(chunk, 'x', 4*RING_SIZE);
+	chunk[4*RING_SIZE] = '\0';
+	fprintf(fh, STREAM_CHUNK_START_MARKER"\ndead\n%s\n"
+	            STREAM_CHUNK_END_MARKER"\n", chunk);
+	fflush(fh);
+
+	/* Nobody is draining the ring, so this fills it up */
+	if ( !im_ring_writer_flush(w) ) return 1;
+
+	return 0;
+}
+
+
+static pid_t start_worker(struct im_rings *r, int worker, int *pfd,
+                          int first, int last, double delay, int die)
+{
+	int fds[2];
+	pid_t pid;
+
+	if ( pipe(fds) == -1 ) return -1;
+
+	pid = fork();
+	if ( pid == -1 ) return -1;
+	if ( pid == 0 ) {
+		close(fds[0]);
+		if ( die ) {
+			_exit(write_and_die(im_rings_name(r), worker, fds[1]));
+		}
+		_exit(write_chunks(im_rings_name(r), worker, fds[1],
+		                   first, last, delay));
+	}
+
+	close(fds[1]);
+	*pfd = fds[0];
+	return pid;
+}
+
+
+/* The sandbox side.  Waits on the doorbells with a long timeout, so that a
+ * lost wakeup shows up as a failure rather than just a delay.  Carries on
+ * afterwards, so that the workers can finish. */
+static int drain_until_eof(struct im_rings *r, int *fds, int n, FILE *fh,
+                           double *first_wait)
+{
+	int n_open = n;
+	int timed_out = 0;
+	int i;
+
+	*first_wait = -1.0;
+
+	while ( n_open > 0 ) {
+
+		struct pollfd pf[N_WORKERS];
+		double t;
+		int np = 0;
+		int p;
+
+		for ( i=0; i<n; i++ ) {
+			if ( fds[i] == -1 ) continue;
+			pf[np].fd = fds[i];
+			pf[np].events = POLLIN;
+			pf[np].revents = 0;
+			np++;
+		}
+
+		t = now();
+		p = poll(pf, np, timed_out ? 10 : 5000);
+		if ( (p == 0) && !timed_out ) {
+			ERROR("Timed out waiting for the doorbell\n");
+			timed_out = 1;
+		}
+		if ( *first_wait < 0.0 ) *first_wait = now() - t;
+
+		for ( i=0; i<np; i++ ) {
+
+			char buf[256];
+			ssize_t rd;
+			int j;
+
+			if ( pf[i].revents == 0 ) continue;
+
+			rd = read(pf[i].fd, buf, sizeof(buf));
+			if ( rd > 0 ) continue;
+
+			/* EOF: the worker has closed its writer */
+			for ( j=0; j<n; j++ ) {
+				if ( fds[j] == pf[i].fd ) fds[j] = -1;
+			}
+			close(pf[i].fd);
+			n_open--;
+
+		}
+
+		im_rings_drain(r, fh);
+
+	}
+
+	im_rings_drain(r, fh);
+	return timed_out;
+}
+
+
+static int wait_worker(pid_t pid, int worker)
+{
+	int status;
+
+	waitpid(pid, &status, 0);
+	if ( !WIFEXITED(status) ) {
+		ERROR("Worker %i crashed\n", worker);
+		return 1;
+	}
+	if ( WEXITSTATUS(status) == NEVER_FULL ) {
+		ERROR("Ring for worker %i never became full\n", worker);
+		return 1;
+	}
+	if ( WEXITSTATUS(status) != 0 ) {
+		ERROR("Worker %i failed\n", worker);
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Checks that the output consists of exactly the expected chunks, complete
+ * and in order for each worker, and nothing else */
+static int check_output(char *out, size_t out_len, int *n_expected,
+                        int *first)
+{
+	int next[N_WORKERS];
+	const char *end_marker = STREAM_CHUNK_END_MARKER"\n";
+	char *pos = out;
+	int i;
+
+	for ( i=0; i<N_WORKERS; i++ ) next[i] = first[i];
+
+	while ( pos < out+out_len ) {
+
+		int worker, idx;
+		char *chunk;
+		char *end;
+		size_t len;
+
+		if ( sscanf(pos, STREAM_CHUNK_START_MARKER"\nworker=%i idx=%i\n",
+		            &worker, &idx) != 2 )
+		{
+			ERROR("Unexpected data at %lli\n",
+			      (long long)(pos-out));
+			return 1;
+		}
+
+		if ( (worker < 0) || (worker >= N_WORKERS)
+		  || (idx != next[worker]) )
+		{
+			ERROR("Got chunk %i from worker %i\n", idx, worker);
+			return 1;
+		}
+
+		chunk = make_chunk(worker, idx);
+		if ( chunk == NULL ) return 1;
+		len = strlen(chunk);
+		end = memmem(pos, out+out_len-pos, end_marker,
+		             strlen(end_marker));
+		if ( (end == NULL) || (end+strlen(end_marker)-pos != len)
+		  || (memcmp(pos, chunk, len) != 0) )
+		{
+			ERROR("Chunk %i from worker %i is wrong\n", idx, worker);
+			free(chunk);
+			return 1;
+		}
+		free(chunk);
+
+		next[worker]++;
+		pos += len;
+
+	}
+
+	for ( i=0; i<N_WORKERS; i++ ) {
+		if ( next[i] != first[i]+n_expected[i] ) {
+			ERROR("Got %i chunks from worker %i, should be %i\n",
+			      next[i]-first[i], i, n_expected[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct im_rings *r;
+	char *out;
+	size_t out_len;
+	FILE *fh;
+	int fds[N_WORKERS];
+	pid_t pids[N_WORKERS];
+	int first[N_WORKERS];
+	int n_expected[N_WORKERS];
+	double first_wait;
+	int fail = 0;
+	int i;
+	char *name;
+
+	r = im_rings_create(N_WORKERS, RING_SIZE);
+	if ( r == NULL ) return 1;
+	name = strdup(im_rings_name(r));
+
+	/* Nothing written yet */
+	fh = open_memstream(&out, &out_len);
+	if ( im_rings_drain(r, fh) != 0 ) {
+		ERROR("Data from empty rings\n");
+		fail = 1;
+	}
+
+	STATUS("Two workers writing at the same time\n");
+	for ( i=0; i<N_WORKERS; i++ ) {
+		first[i] = 0;
+		n_expected[i] = N_CHUNKS;
+		pids[i] = start_worker(r, i, &fds[i], 0, N_CHUNKS, 0.3, 0);
+		if ( pids[i] == -1 ) return 1;
+	}
+	fail += drain_until_eof(r, fds, N_WORKERS, fh, &first_wait);
+	for ( i=0; i<N_WORKERS; i++ ) fail += wait_worker(pids[i], i);
+	fclose(fh);
+
+	/* The doorbell should not have woken us before there was anything */
+	if ( first_wait < 0.2 ) {
+		ERROR("Didn't wait for the workers (%f s)\n", first_wait);
+		fail = 1;
+	}
+
+	fail += check_output(out, out_len, n_expected, first);
+	free(out);
+
+	if ( im_rings_backlog(r) != 0 ) {
+		ERROR("Backlog left over: %lli\n", im_rings_backlog(r));
+		fail = 1;
+	}
+
+	STATUS("A worker which dies part way through a chunk\n");
+	fh = open_memstream(&out, &out_len);
+	pids[0] = start_worker(r, 0, &fds[0], 0, 0, 0.0, 1);
+	if ( pids[0] == -1 ) return 1;
+	fail += wait_worker(pids[0], 0);
+
+	/* The doorbell has been rung and then closed */
+	fail += drain_until_eof(r, fds, 1, fh, &first_wait);
+	if ( im_rings_backlog(r) == 0 ) {
+		ERROR("Incomplete chunk not counted in backlog\n");
+		fail = 1;
+	}
+	im_rings_reset(r, 0);
+	if ( im_rings_backlog(r) != 0 ) {
+		ERROR("Backlog left over after reset: %lli\n",
+		      im_rings_backlog(r));
+		fail = 1;
+	}
+
+	/* The replacement carries on in the same ring */
+	first[0] = N_CHUNKS;
+	n_expected[0] = 200;
+	first[1] = 0;
+	n_expected[1] = 0;
+	pids[0] = start_worker(r, 0, &fds[0], N_CHUNKS, N_CHUNKS+200, 0.0, 0);
+	if ( pids[0] == -1 ) return 1;
+	fail += drain_until_eof(r, fds, 1, fh, &first_wait);
+	fail += wait_worker(pids[0], 0);
+	fclose(fh);
+
+	fail += check_output(out, out_len, n_expected, first);
+	free(out);
+
+	STATUS("Sandbox side closed\n");
+	im_rings_destroy(r);
+	if ( im_ring_writer_open(name, 0, -1) != NULL ) {
+		ERROR("Opened a ring after it was destroyed\n");
+		fail = 1;
+	}
+	free(name);
+
+	if ( fail ) return 1;
+	return 0;
+}
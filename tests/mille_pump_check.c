@@ -0,0 +1,309 @@
+/*
+ * mille_pump_check.c
+ *
+ * Check that Mille records survive the trip from a worker to the file
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <crystfel-mille.h>
+#include <utils.h>
+
+
+#define N_RECORDS (4000)
+#define MAX_MEAS (80)
+#define NLC (3)
+#define NGL (6)
+
+/* Entries per measurement: value, local gradients, sigma, global gradients */
+#define MEAS_LEN (NLC+NGL+2)
+
+
+static int n_meas(int i)
+{
+	return 1 + (i*37) % MAX_MEAS;
+}
+
+
+/* Arbitrary but repeatable non-zero values */
+static float value(int i, int j, int k)
+{
+	unsigned int x = i*7919u + j*104729u + k*1299709u + 12345u;
+	x ^= x >> 13;
+	x *= 0x5bd1e995u;
+	x ^= x >> 15;
+	return 1.0 + (x % 100000)/1000.0;
+}
+
+
+/* Fills in one measurement, and also what it should look like in the file */
+static void make_meas(int i, int j, float *derLc, float *derGl, int *labels,
+                      float *rMeas, float *sigma, float *ef, int *el)
+{
+	int k;
+	int p = 0;
+
+	*rMeas = value(i, j, 0);
+	*sigma = value(i, j, 1);
+	for ( k=0; k<NLC; k++ ) derLc[k] = value(i, j, 2+k);
+	for ( k=0; k<NGL; k++ ) {
+		derGl[k] = value(i, j, 2+NLC+k);
+		labels[k] = 100*(1+(i+j)%4) + k + 1;
+	}
+
+	ef[p] = *rMeas;  el[p++] = 0;
+	for ( k=0; k<NLC; k++ ) {
+		ef[p] = derLc[k];  el[p++] = k+1;
+	}
+	ef[p] = *sigma;  el[p++] = 0;
+	for ( k=0; k<NGL; k++ ) {
+		ef[p] = derGl[k];  el[p++] = labels[k];
+	}
+}
+
+
+/* The worker side */
+static void write_records(int fd, int compress)
+{
+	Mille *m;
+	int i;
+
+	m = crystfel_mille_new_fd(fd);
+	if ( m == NULL ) _exit(1);
+	if ( crystfel_mille_set_compression(m, compress) ) _exit(1);
+
+	for ( i=0; i<N_RECORDS; i++ ) {
+		int j;
+		for ( j=0; j<n_meas(i); j++ ) {
+			float derLc[NLC];
+			float derGl[NGL];
+			int labels[NGL];
+			float rMeas, sigma;
+			float ef[MEAS_LEN];
+			int el[MEAS_LEN];
+			make_meas(i, j, derLc, derGl, labels, &rMeas, &sigma,
+			          ef, el);
+			crystfel_mille_add_measurement(m, NLC, derLc,
+			                               NGL, derGl, labels,
+			                               rMeas, sigma);
+		}
+		crystfel_mille_write_record(m);
+
+		/* As if there were a few records per frame */
+		if ( i % 5 == 4 ) crystfel_mille_end_frame(m);
+	}
+
+	crystfel_mille_free(m);
+}
+
+
+/* The sandbox side, reading in awkward sizes so that records and compressed
+ * blocks get split between reads */
+static int pump_records(int fd, const char *filename, int *pn_blocks,
+                        int *pn_split)
+{
+	const size_t chunks[] = {1, 7, 4093, 65521, 3, 1000003};
+	const int n_chunks = sizeof(chunks)/sizeof(chunks[0]);
+	char *buf = NULL;
+	size_t buf_len = 0;
+	size_t pos = 0;
+	int c = 0;
+	FILE *fh;
+
+	fh = fopen(filename, "wb");
+	if ( fh == NULL ) return 1;
+
+	*pn_blocks = 0;
+	*pn_split = 0;
+
+	do {
+
+		size_t chunk = chunks[c++ % n_chunks];
+		ssize_t r;
+		size_t h;
+
+		if ( pos + chunk > buf_len ) {
+			buf_len = pos + chunk;
+			buf = realloc(buf, buf_len);
+			if ( buf == NULL ) return 1;
+		}
+
+		r = read(fd, buf+pos, chunk);
+		if ( r == -1 ) return 1;
+		if ( r == 0 ) break;
+		pos += r;
+
+		do {
+			int block = (pos >= sizeof(int))
+			         && (*(int *)buf == CRYSTFEL_MILLE_BLOCK_MARKER);
+			h = crystfel_mille_pump(buf, pos, fh);
+			if ( h > pos ) {
+				ERROR("Pump used more than it was given\n");
+				return 1;
+			}
+			if ( block && (h > 0) ) (*pn_blocks)++;
+			if ( block && (h == 0) && (pos > 2*sizeof(int)) ) {
+				(*pn_split)++;
+			}
+			memmove(buf, buf+h, pos-h);
+			pos -= h;
+		} while ( h > 0 );
+
+	} while ( 1 );
+
+	fclose(fh);
+	free(buf);
+
+	if ( pos != 0 ) {
+		ERROR("%zu bytes left over\n", pos);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int check_records(const char *filename)
+{
+	MilleReader *r;
+	int i;
+	int len;
+	float *floats;
+	int *labels;
+
+	r = crystfel_mille_reader_open(filename);
+	if ( r == NULL ) return 1;
+
+	for ( i=0; i<N_RECORDS; i++ ) {
+
+		int j;
+
+		if ( crystfel_mille_reader_next(r, &len, &floats, &labels) != 1 ) {
+			ERROR("Failed to read record %i\n", i);
+			crystfel_mille_reader_close(r);
+			return 1;
+		}
+
+		if ( len != n_meas(i)*MEAS_LEN ) {
+			ERROR("Record %i has %i entries (should be %i)\n",
+			      i, len, n_meas(i)*MEAS_LEN);
+			crystfel_mille_reader_close(r);
+			return 1;
+		}
+
+		for ( j=0; j<n_meas(i); j++ ) {
+
+			float derLc[NLC];
+			float derGl[NGL];
+			int lbl[NGL];
+			float rMeas, sigma;
+			float ef[MEAS_LEN];
+			int el[MEAS_LEN];
+
+			make_meas(i, j, derLc, derGl, lbl, &rMeas, &sigma,
+			          ef, el);
+			if ( memcmp(ef, floats+j*MEAS_LEN, sizeof(ef))
+			  || memcmp(el, labels+j*MEAS_LEN, sizeof(el)) )
+			{
+				ERROR("Record %i differs at measurement %i\n",
+				      i, j);
+				crystfel_mille_reader_close(r);
+				return 1;
+			}
+		}
+	}
+
+	if ( crystfel_mille_reader_next(r, &len, &floats, &labels) != 0 ) {
+		ERROR("Extra data at end of file\n");
+		crystfel_mille_reader_close(r);
+		return 1;
+	}
+
+	crystfel_mille_reader_close(r);
+	return 0;
+}
+
+
+static int run_check(int compress, const char *filename)
+{
+	int fds[2];
+	pid_t pid;
+	int status;
+	int n_blocks, n_split;
+	int fail;
+
+	if ( pipe(fds) == -1 ) return 1;
+
+	pid = fork();
+	if ( pid == -1 ) return 1;
+	if ( pid == 0 ) {
+		close(fds[0]);
+		write_records(fds[1], compress);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	fail = pump_records(fds[0], filename, &n_blocks, &n_split);
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	if ( !WIFEXITED(status) || (WEXITSTATUS(status) != 0) ) {
+		ERROR("Writer failed (compress=%i)\n", compress);
+		return 1;
+	}
+	if ( fail ) return 1;
+
+	STATUS("compress=%i: %i compressed blocks, split %i times\n",
+	       compress, n_blocks, n_split);
+
+	if ( compress ) {
+		/* The records should have been written in several batches,
+		 * and at least some of them arrived in pieces */
+		if ( (n_blocks < 2) || (n_split == 0) ) {
+			ERROR("Compressed blocks not as expected\n");
+			return 1;
+		}
+	} else if ( n_blocks != 0 ) {
+		ERROR("Compressed blocks in uncompressed data\n");
+		return 1;
+	}
+
+	fail = check_records(filename);
+	unlink(filename);
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+
+	fail += run_check(0, "mille_pump_check.bin");
+	fail += run_check(1, "mille_pump_check.bin.gz");
+
+	if ( fail ) return 1;
+	return 0;
+}
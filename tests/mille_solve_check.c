@@ -0,0 +1,266 @@
+/*
+ * mille_solve_check.c
+ *
+ * Check that the built-in Millepede solver finds known detector offsets
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <gsl/gsl_rng.h>
+#include <zlib.h>
+
+#include <crystfel-mille.h>
+#include <utils.h>
+
+
+#define N_PANELS (4)
+
+/* The offsets to be found.  Panel offsets are relative to the overall
+ * position, so they sum to zero. */
+static const double all_tx = 0.3;
+static const double all_ty = -0.1;
+static const double panel_tx[N_PANELS] = {0.1, -0.2, 0.15, -0.05};
+static const double panel_ty[N_PANELS] = {-0.3, 0.1, 0.05, 0.15};
+
+
+struct record
+{
+	int n;
+	float f[4096];
+	int l[4096];
+};
+
+
+static void add_entry(struct record *rec, float f, int l)
+{
+	rec->f[rec->n] = f;
+	rec->l[rec->n] = l;
+	rec->n++;
+}
+
+
+/* Same layout as crystfel_mille_write_record() */
+static void write_record(gzFile fh, struct record *rec)
+{
+	int nw = rec->n*2 + 2;
+	float nf = 0.0;
+	int ni = 0;
+
+	gzwrite(fh, &nw, sizeof(int));
+	gzwrite(fh, &nf, sizeof(float));
+	gzwrite(fh, rec->f, rec->n*sizeof(float));
+	gzwrite(fh, &ni, sizeof(int));
+	gzwrite(fh, rec->l, rec->n*sizeof(int));
+}
+
+
+/* One crystal, with two local parameters: a scale factor and an in-plane
+ * rotation.  Each spot gives an x and a y measurement, which depend on the
+ * overall detector position and the panel position, and an extra
+ * measurement of the scale factor only. */
+static void write_crystal(gzFile fh, gsl_rng *rng)
+{
+	struct record rec;
+	double scale = gsl_rng_uniform(rng) - 0.5;
+	double rot = gsl_rng_uniform(rng) - 0.5;
+	int i;
+
+	rec.n = 0;
+	for ( i=0; i<40; i++ ) {
+
+		int p = gsl_rng_uniform_int(rng, N_PANELS);
+		int serial = 100*(p+1);
+		double x = 2.0*gsl_rng_uniform(rng) - 1.0;
+		double y = 2.0*gsl_rng_uniform(rng) - 1.0;
+
+		add_entry(&rec, all_tx + panel_tx[p] + scale*x - rot*y, 0);
+		add_entry(&rec, x, 1);
+		add_entry(&rec, -y, 2);
+		add_entry(&rec, 0.3, 0);
+		add_entry(&rec, 1.0, mille_label(serial, GPARAM_DET_TX));
+		add_entry(&rec, 1.0, mille_label(0, GPARAM_DET_TX));
+		add_entry(&rec, y, mille_label(0, GPARAM_DET_RZ));  /* Fixed */
+
+		add_entry(&rec, all_ty + panel_ty[p] + scale*y + rot*x, 0);
+		add_entry(&rec, y, 1);
+		add_entry(&rec, x, 2);
+		add_entry(&rec, 0.3, 0);
+		add_entry(&rec, 1.0, mille_label(serial, GPARAM_DET_TY));
+		add_entry(&rec, 1.0, mille_label(0, GPARAM_DET_TY));
+		add_entry(&rec, -x, mille_label(0, GPARAM_DET_RZ));  /* Fixed */
+
+		add_entry(&rec, 0.5*scale, 0);
+		add_entry(&rec, 0.5, 1);
+		add_entry(&rec, 0.2, 0);
+
+	}
+
+	write_record(fh, &rec);
+}
+
+
+/* A record whose local parameters can't be determined, because their
+ * gradients are always in the same ratio */
+static void write_bad_crystal(gzFile fh)
+{
+	struct record rec;
+	int i;
+
+	rec.n = 0;
+	for ( i=0; i<3; i++ ) {
+		add_entry(&rec, 1.0, 0);
+		add_entry(&rec, 1.0+i, 1);
+		add_entry(&rec, 2.0+2.0*i, 2);
+		add_entry(&rec, 0.3, 0);
+		add_entry(&rec, 1.0, mille_label(100*(i+1), GPARAM_DET_TX));
+	}
+	write_record(fh, &rec);
+}
+
+
+static double expected(int label)
+{
+	int serial = label - (label % 100);
+	enum gparam p = mille_unlabel(label % 100);
+
+	if ( serial == 0 ) {
+		return (p == GPARAM_DET_TX) ? all_tx : all_ty;
+	}
+
+	if ( p == GPARAM_DET_TX ) return panel_tx[serial/100-1];
+	return panel_ty[serial/100-1];
+}
+
+
+static int solve(const char **files, int n_files, int n_threads)
+{
+	MilleSolver *s;
+	int con_x[N_PANELS];
+	int con_y[N_PANELS];
+	int i;
+	int n_used, n_rejected;
+	int last_label = -1;
+	int fail = 0;
+
+	s = mille_solver_new();
+	mille_solver_add_parameter(s, mille_label(0, GPARAM_DET_TX));
+	mille_solver_add_parameter(s, mille_label(0, GPARAM_DET_TY));
+	for ( i=0; i<N_PANELS; i++ ) {
+		/* Add in a funny order, to check the sorting */
+		int serial = 100*(N_PANELS-i);
+		mille_solver_add_parameter(s, mille_label(serial, GPARAM_DET_TY));
+		mille_solver_add_parameter(s, mille_label(serial, GPARAM_DET_TX));
+		con_x[i] = mille_label(serial, GPARAM_DET_TX);
+		con_y[i] = mille_label(serial, GPARAM_DET_TY);
+	}
+	mille_solver_add_constraint(s, con_x, N_PANELS);
+	mille_solver_add_constraint(s, con_y, N_PANELS);
+
+	for ( i=0; i<n_files; i++ ) {
+		mille_solver_add_file(s, files[i]);
+	}
+
+	if ( mille_solver_solve(s, n_threads) ) {
+		ERROR("Solver failed with %i threads\n", n_threads);
+		mille_solver_free(s);
+		return 1;
+	}
+
+	mille_solver_num_records(s, &n_used, &n_rejected);
+	if ( (n_used != 200) || (n_rejected != 1) ) {
+		ERROR("%i threads: %i records used, %i rejected\n",
+		      n_threads, n_used, n_rejected);
+		fail = 1;
+	}
+
+	if ( mille_solver_num_parameters(s) != 2+2*N_PANELS ) {
+		ERROR("Wrong number of parameters\n");
+		fail = 1;
+	}
+
+	for ( i=0; i<mille_solver_num_parameters(s); i++ ) {
+
+		int label;
+		double shift;
+
+		if ( !mille_solver_get_result(s, i, &label, &shift) ) {
+			ERROR("Parameter %i not determined\n", label);
+			fail = 1;
+		}
+
+		if ( label <= last_label ) {
+			ERROR("Parameters are not in order\n");
+			fail = 1;
+		}
+		last_label = label;
+
+		STATUS("%i threads: parameter %3i = %+f (should be %+f)\n",
+		       n_threads, label, shift, expected(label));
+		if ( fabs(shift - expected(label)) > 1e-4 ) fail = 1;
+
+	}
+
+	mille_solver_free(s);
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *files[] = {"mille_solve_check-0.bin",
+	                       "mille_solve_check-1.bin.gz"};
+	gsl_rng *rng;
+	gzFile fh;
+	int i;
+	int fail = 0;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	/* Uncompressed */
+	fh = gzopen(files[0], "wbT");
+	if ( fh == NULL ) return 1;
+	for ( i=0; i<100; i++ ) write_crystal(fh, rng);
+	write_bad_crystal(fh);
+	gzclose(fh);
+
+	/* Compressed, in two blocks like the output of indexamajig */
+	fh = gzopen(files[1], "wb");
+	if ( fh == NULL ) return 1;
+	for ( i=0; i<50; i++ ) write_crystal(fh, rng);
+	gzclose(fh);
+	fh = gzopen(files[1], "ab");
+	if ( fh == NULL ) return 1;
+	for ( i=0; i<50; i++ ) write_crystal(fh, rng);
+	gzclose(fh);
+
+	gsl_rng_free(rng);
+
+	fail += solve(files, 2, 1);
+	fail += solve(files, 2, 3);
+
+	for ( i=0; i<2; i++ ) unlink(files[i]);
+
+	if ( fail ) return 1;
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * thread_pool_check.c
+ *
+ * Check the thread pool
+ *
+ * Copyright © 2024 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <thread-pool.h>
+#include <utils.h>
+
+
+#define MAX_THREADS (32)
+
+
+struct check_queue;
+
+struct check_task
+{
+	struct check_queue *q;
+	int idx;
+	int n_run;
+	int n_final;
+	int bad_cookie;
+	int nested_fail;
+};
+
+
+struct check_queue
+{
+	struct check_task *tasks;
+	int n_tasks;      /* Number of tasks which get_task() will hand out */
+	int next;
+	int n_threads;
+	int nested;       /* Each task runs a smaller run_threads() of its own */
+
+	/* Which cookies are in use right now */
+	int busy[MAX_THREADS];
+
+	/* For checking that get_task() and final() are not called at the
+	 * same time as each other, or themselves */
+	int in_serial;
+	int serial_fail;
+};
+
+
+static int run_check(int n_threads, int n_tasks, int max, int nested);
+
+
+static void enter_serial(struct check_queue *q)
+{
+	if ( __sync_fetch_and_add(&q->in_serial, 1) != 0 ) q->serial_fail = 1;
+}
+
+
+static void leave_serial(struct check_queue *q)
+{
+	__sync_fetch_and_sub(&q->in_serial, 1);
+}
+
+
+static void *get_task(void *vp)
+{
+	struct check_queue *q = vp;
+	struct check_task *task = NULL;
+
+	enter_serial(q);
+	if ( q->next < q->n_tasks ) task = &q->tasks[q->next++];
+	leave_serial(q);
+
+	return task;
+}
+
+
+static void final(void *qp, void *vp)
+{
+	struct check_queue *q = qp;
+	struct check_task *task = vp;
+
+	enter_serial(q);
+	task->n_final++;
+	leave_serial(q);
+}
+
+
+static void work(void *vp, int cookie)
+{
+	struct check_task *task = vp;
+	struct check_queue *q = task->q;
+	volatile double x = 0.0;
+	int i;
+
+	__sync_fetch_and_add(&task->n_run, 1);
+
+	if ( (cookie < 0) || (cookie >= q->n_threads) ) {
+		task->bad_cookie = 1;
+		return;
+	}
+
+	/* No other thread should be using the same cookie right now */
+	if ( __sync_fetch_and_add(&q->busy[cookie], 1) != 0 ) {
+		task->bad_cookie = 1;
+	}
+
+	/* Give the other threads a chance to steal something */
+	for ( i=0; i<(task->idx % 7)*100; i++ ) x += i;
+
+	if ( q->nested ) {
+		task->nested_fail = run_check(3, 50+task->idx, 0, 0);
+	}
+
+	__sync_fetch_and_sub(&q->busy[cookie], 1);
+}
+
+
+/* Runs one lot of tasks, and returns non-zero if anything went wrong */
+static int run_check(int n_threads, int n_tasks, int max, int nested)
+{
+	struct check_queue *q;
+	int i;
+	int n_done;
+	int n_expected;
+	int fail = 0;
+
+	q = calloc(1, sizeof(struct check_queue));
+	if ( q == NULL ) return 1;
+	q->tasks = calloc(n_tasks+1, sizeof(struct check_task));
+	if ( q->tasks == NULL ) {
+		free(q);
+		return 1;
+	}
+	q->n_tasks = n_tasks;
+	q->n_threads = n_threads;
+	q->nested = nested;
+	for ( i=0; i<n_tasks; i++ ) {
+		q->tasks[i].q = q;
+		q->tasks[i].idx = i;
+	}
+
+	n_done = run_threads(n_threads, work, get_task, final, q, max, 0, 0, 0);
+
+	n_expected = n_tasks;
+	if ( (max > 0) && (max < n_tasks) ) n_expected = max;
+
+	if ( n_done != n_expected ) {
+		ERROR("%i tasks done, should be %i\n", n_done, n_expected);
+		fail = 1;
+	}
+
+	if ( q->next != n_expected ) {
+		ERROR("%i tasks handed out, should be %i\n", q->next, n_expected);
+		fail = 1;
+	}
+
+	if ( q->serial_fail ) {
+		ERROR("get_task or final were called concurrently\n");
+		fail = 1;
+	}
+
+	for ( i=0; i<n_tasks; i++ ) {
+		struct check_task *task = &q->tasks[i];
+		int should = (i < n_expected) ? 1 : 0;
+		if ( (task->n_run != should) || (task->n_final != should) ) {
+			ERROR("Task %i ran %i times and was finalised %i times\n",
+			      i, task->n_run, task->n_final);
+			fail = 1;
+			break;
+		}
+		if ( task->bad_cookie ) {
+			ERROR("Task %i got a bad cookie\n", i);
+			fail = 1;
+			break;
+		}
+		if ( task->nested_fail ) {
+			ERROR("Nested run_threads failed in task %i\n", i);
+			fail = 1;
+			break;
+		}
+	}
+
+	free(q->tasks);
+	free(q);
+	return fail;
+}
+
+
+static void *concurrent_thread(void *vp)
+{
+	int *fail = vp;
+	int i;
+
+	for ( i=0; i<50; i++ ) {
+		*fail += run_check(1+i%5, 2000, 0, 0);
+	}
+
+	return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+	int i;
+	pthread_t threads[4];
+	int thread_fail[4];
+
+	STATUS("Different numbers of threads and tasks\n");
+	fail += run_check(1, 1000, 0, 0);
+	fail += run_check(4, 0, 0, 0);
+	fail += run_check(4, 1, 0, 0);
+	fail += run_check(4, 3, 0, 0);
+	fail += run_check(8, 100000, 0, 0);
+	fail += run_check(2, 100000, 0, 0);
+	fail += run_check(MAX_THREADS, 100000, 0, 0);
+	fail += run_check(3, 10000, 0, 0);
+
+	STATUS("Limited number of tasks\n");
+	fail += run_check(4, 10000, 1, 0);
+	fail += run_check(4, 10000, 77, 0);
+	fail += run_check(4, 10000, 10000, 0);
+	fail += run_check(4, 10000, 20000, 0);
+
+	STATUS("Nested calls\n");
+	fail += run_check(4, 200, 0, 1);
+	fail += run_check(1, 20, 0, 1);
+
+	STATUS("Concurrent calls\n");
+	for ( i=0; i<4; i++ ) {
+		thread_fail[i] = 0;
+		if ( pthread_create(&threads[i], NULL, concurrent_thread,
+		                    &thread_fail[i]) )
+		{
+			ERROR("Couldn't start thread\n");
+			return 1;
+		}
+	}
+	for ( i=0; i<4; i++ ) {
+		pthread_join(threads[i], NULL);
+		fail += thread_fail[i];
+	}
+
+	STATUS("Back to normal\n");
+	fail += run_check(8, 100000, 0, 0);
+
+	if ( fail ) return 1;
+	return 0;
+}